@@ -0,0 +1,618 @@
+#!/bin/bash
+#Benchmarks for KVFS
+#
+#Mounts KVFS over a scratch root and runs bench/fsbench against it.
+#Run from the project directory after building kvfs and bench/fsbench:
+#
+#  gcc -O2 -Wall -o bench/fsbench bench/fsbench.c -lpthread
+#  bench/bench.sh keys
+#
+#Workloads:
+#  keys     create/stat throughput at KEYS key counts, flat vs sharded layout
+#  attr     repeated stat of ATTR_FILES files with the attribute cache off and on
+#  create   files/sec creating CREATE_FILES 4 KiB files, on KVFS and on the bare root
+#  splice   MiB/s writing and reading back a SEQ_MB file, with KVFS_SPLICE off and on
+#  readdir  entries/sec listing directories of READDIR_FILES entries, flat and sharded
+#  threads  smallfile and stat throughput at THREADS client threads, on a
+#           single-threaded (-s) mount and on the default multi-threaded one
+#  rename   time to rename a directory holding each of RENAME_FILES files
+#  writeback  100-byte appends/sec for APPEND_RECORDS records, with
+#           KVFS_WRITEBACK_BYTES off and at WRITEBACK_BYTES
+#  readahead  MiB/s reading back a SEQ_MB file on a fresh mount, with
+#           KVFS_READAHEAD off and at READAHEAD_BYTES
+#  pack     smallfile throughput and disk usage for CREATE_FILES 4 KiB files,
+#           with KVFS_PACK_BYTES off and at PACK_BYTES
+#  backend  create/stat/list/unlink throughput for META_FILES files, with the
+#           passthrough and the lsm index backend (KVFS_BACKEND)
+#  dedup    copy throughput and disk usage for DEDUP_COPIES copies of 4 distinct
+#           DEDUP_MB MiB files, with KVFS_DEDUP_BYTES off and at DEDUP_BYTES
+#  compress MiB/s writing and (after a remount) reading back COMPRESS_MB MiB
+#           each of text, binary and random data, and the disk usage of all
+#           three, with each of COMPRESS_CODECS as KVFS_COMPRESS
+#  sync     fsync'ed 100-byte appends/sec for SYNC_RECORDS records at THREADS
+#           client threads, with KVFS_SYNC=file and group
+#  io       random 4 KiB reads and writes/sec over an IO_MB MiB file at each
+#           of IO_THREADS client threads (the queue depth kvfs sees), with
+#           KVFS_IO=sync and uring, through a direct_io mount so every
+#           request reaches kvfs; the io.* counters show how many requests
+#           each io_uring_enter() carried.  kvfs must be built with
+#           -DHAVE_LINUX_IO_URING_H
+#  batch    BATCH_FILES files made, stat'ed, chmod'ed and removed by xargs
+#           touch/stat/chmod/rm, one FUSE request or more per file, and then
+#           through mountdir/.kvfs_batch, one batch per step, with
+#           KVFS_BATCH_THREADS at each of BATCH_THREADS; items/sec for each
+#  crash    kills kvfs with SIGKILL at a random point of a synclog run,
+#           CRASH_ROUNDS times for each of CRASH_CONFIGS (comma-separated
+#           environment settings), mounts the root again and checks that
+#           every record fsbench was told is synced came back; exits 1 if
+#           any didn't
+#  suite    the standard set, run at each of SUITE_THREADS client threads on
+#           KVFS and on the bare root: SUITE_FILES small files created,
+#           stat'ed and removed, then written with 4 KiB each; a
+#           SUITE_MB MiB file written and read sequentially, then in
+#           SUITE_RAND_OPS random 4 KiB writes and reads; SUITE_FILES files
+#           16 directories down made and stat'ed; and a SUITE_LIST_FILES
+#           entry directory listed.  Every result is one line of key=value
+#           pairs (target=, workload=, threads=, ops_per_sec=, ...), and a
+#           "summary" line per workload gives kvfs_ops_per_sec/bare_ops_per_sec.
+#           Builds bench/fsbench first if it isn't there.  Save the output to
+#           compare it with a later run.
+#  compare  bench.sh compare <old> <new>: each result of two saved suite runs
+#           side by side, marking those more than COMPARE_PCT percent slower;
+#           exits 1 if there are any
+
+ROOT=${ROOT:-"$HOME/kvfs_bench_root"}
+MOUNT=${MOUNT:-"/tmp/kvfs_bench_mnt"}
+KVFS=${KVFS:-"./kvfs"}
+FSBENCH=${FSBENCH:-"bench/fsbench"}
+KEYS=${KEYS:-"10000 1000000 10000000"}
+ATTR_FILES=${ATTR_FILES:-10000}
+CREATE_FILES=${CREATE_FILES:-20000}
+SEQ_MB=${SEQ_MB:-2048}
+THREADS=${THREADS:-"1 2 4 8 16"}
+READDIR_FILES=${READDIR_FILES:-"100000 1000000"}
+RENAME_FILES=${RENAME_FILES:-"10 10000 1000000"}
+APPEND_RECORDS=${APPEND_RECORDS:-200000}
+WRITEBACK_BYTES=${WRITEBACK_BYTES:-131072}
+READAHEAD_BYTES=${READAHEAD_BYTES:-1048576}
+PACK_BYTES=${PACK_BYTES:-65536}
+META_FILES=${META_FILES:-100000}
+DEDUP_COPIES=${DEDUP_COPIES:-16}
+DEDUP_MB=${DEDUP_MB:-16}
+DEDUP_BYTES=${DEDUP_BYTES:-65536}
+COMPRESS_MB=${COMPRESS_MB:-256}
+COMPRESS_CODECS=${COMPRESS_CODECS:-"off lz4 zlib"}
+SUITE_THREADS=${SUITE_THREADS:-"1 4"}
+SUITE_FILES=${SUITE_FILES:-20000}
+SUITE_MB=${SUITE_MB:-512}
+SUITE_RAND_OPS=${SUITE_RAND_OPS:-50000}
+SUITE_LIST_FILES=${SUITE_LIST_FILES:-100000}
+COMPARE_PCT=${COMPARE_PCT:-10}
+SYNC_RECORDS=${SYNC_RECORDS:-20000}
+IO_MB=${IO_MB:-1024}
+IO_THREADS=${IO_THREADS:-"1 8 32 64"}
+IO_OPS=${IO_OPS:-200000}
+BATCH_FILES=${BATCH_FILES:-100000}
+BATCH_THREADS=${BATCH_THREADS:-"1 4"}
+CRASH_ROUNDS=${CRASH_ROUNDS:-5}
+CRASH_RECORDS=${CRASH_RECORDS:-1000000}
+CRASH_CONFIGS=${CRASH_CONFIGS:-"KVFS_SYNC=file KVFS_SYNC=group KVFS_WRITEBACK_BYTES=131072 KVFS_PACK_BYTES=65536 KVFS_BACKEND=lsm,KVFS_SYNC=group"}
+
+#Extra arguments are passed to kvfs as FUSE options.
+mount_kvfs()
+{
+	mkdir -p "$ROOT" "$MOUNT"
+	rm -rf "${ROOT:?}"/*
+	remount_kvfs "$@"
+}
+
+#Mount without emptying the root first.
+remount_kvfs()
+{
+	"$KVFS" "$@" "$ROOT" "$MOUNT" || exit 1
+}
+
+unmount_kvfs()
+{
+	fusermount -u "$MOUNT"
+}
+
+bench_keys()
+{
+	for n in $KEYS; do
+		for layout in flat shard; do
+			KVFS_LAYOUT=$layout mount_kvfs
+			printf "keys=%s layout=%s " "$n" "$layout"
+			"$FSBENCH" create "$MOUNT" -n "$n"
+			printf "keys=%s layout=%s " "$n" "$layout"
+			"$FSBENCH" stat "$MOUNT" -n "$n"
+			unmount_kvfs
+		done
+	done
+}
+
+bench_attr()
+{
+	for timeout in 0 1; do
+		KVFS_ATTR_TIMEOUT=$timeout mount_kvfs
+		"$FSBENCH" create "$MOUNT" -n "$ATTR_FILES" > /dev/null
+		for round in 1 2 3; do
+			printf "attr_timeout=%s round=%s " "$timeout" "$round"
+			"$FSBENCH" stat "$MOUNT" -n "$ATTR_FILES"
+		done
+		getfattr --only-values -n user.kvfs.stats "$MOUNT" 2> /dev/null | grep attrcache
+		unmount_kvfs
+	done
+}
+
+bench_create()
+{
+	for threads in 1 4; do
+		mount_kvfs
+		printf "target=kvfs "
+		"$FSBENCH" smallfile "$MOUNT" -n "$CREATE_FILES" -t "$threads"
+		unmount_kvfs
+		rm -rf "${ROOT:?}"/*
+		printf "target=bare "
+		"$FSBENCH" smallfile "$ROOT" -n "$CREATE_FILES" -t "$threads"
+	done
+}
+
+#The read is done on a fresh mount, so it comes from the backing
+#file rather than the kernel's cache of the FUSE file.
+bench_splice()
+{
+	for splice in 0 1; do
+		opts=""
+		if [ "$splice" = 1 ]; then
+			opts="-o splice_read,splice_write,splice_move"
+		fi
+		KVFS_SPLICE=$splice mount_kvfs $opts
+		printf "splice=%s " "$splice"
+		"$FSBENCH" seqwrite "$MOUNT" -n "$SEQ_MB"
+		unmount_kvfs
+		KVFS_SPLICE=$splice remount_kvfs $opts
+		printf "splice=%s " "$splice"
+		"$FSBENCH" seqread "$MOUNT" -n "$SEQ_MB"
+		unmount_kvfs
+	done
+}
+
+bench_readdir()
+{
+	for n in $READDIR_FILES; do
+		for layout in flat shard; do
+			KVFS_LAYOUT=$layout mount_kvfs
+			"$FSBENCH" create "$MOUNT" -n "$n" -t 4 > /dev/null
+			for round in 1 2; do
+				printf "entries=%s layout=%s round=%s " "$n" "$layout" "$round"
+				"$FSBENCH" list "$MOUNT" -n "$n"
+			done
+			unmount_kvfs
+		done
+	done
+}
+
+bench_threads()
+{
+	for mode in single multi; do
+		opts=""
+		if [ "$mode" = single ]; then
+			opts="-s"
+		fi
+		for t in $THREADS; do
+			mount_kvfs $opts
+			printf "mode=%s " "$mode"
+			"$FSBENCH" smallfile "$MOUNT" -n "$CREATE_FILES" -t "$t"
+			printf "mode=%s " "$mode"
+			"$FSBENCH" stat "$MOUNT" -n "$CREATE_FILES" -t "$t"
+			unmount_kvfs
+		done
+	done
+}
+
+bench_rename()
+{
+	for n in $RENAME_FILES; do
+		mount_kvfs
+		mkdir "$MOUNT/a"
+		"$FSBENCH" create "$MOUNT/a" -n "$n" -t 4 > /dev/null
+		start=$(date +%s%N)
+		mv "$MOUNT/a" "$MOUNT/b" || exit 1
+		end=$(date +%s%N)
+		printf "files=%s rename_us=%s\n" "$n" $(( (end - start) / 1000 ))
+		unmount_kvfs
+	done
+}
+
+bench_writeback()
+{
+	for bytes in 0 "$WRITEBACK_BYTES"; do
+		for t in 1 4; do
+			KVFS_WRITEBACK_BYTES=$bytes mount_kvfs
+			printf "writeback=%s " "$bytes"
+			"$FSBENCH" append "$MOUNT" -n "$APPEND_RECORDS" -t "$t"
+			getfattr --only-values -n user.kvfs.stats "$MOUNT" 2> /dev/null | grep writeback
+			unmount_kvfs
+		done
+	done
+}
+
+#Like splice, the read is done on a fresh mount.
+bench_readahead()
+{
+	for bytes in 0 "$READAHEAD_BYTES"; do
+		KVFS_READAHEAD=$bytes mount_kvfs
+		"$FSBENCH" seqwrite "$MOUNT" -n "$SEQ_MB" > /dev/null
+		unmount_kvfs
+		KVFS_READAHEAD=$bytes remount_kvfs
+		printf "readahead=%s " "$bytes"
+		"$FSBENCH" seqread "$MOUNT" -n "$SEQ_MB"
+		getfattr --only-values -n user.kvfs.stats "$MOUNT" 2> /dev/null | grep readahead
+		unmount_kvfs
+	done
+}
+
+bench_pack()
+{
+	for bytes in 0 "$PACK_BYTES"; do
+		KVFS_PACK_BYTES=$bytes mount_kvfs
+		printf "pack=%s " "$bytes"
+		"$FSBENCH" smallfile "$MOUNT" -n "$CREATE_FILES"
+		unmount_kvfs
+		printf "pack=%s disk_kib=%s files=%s\n" "$bytes" \
+			"$(du -sk --exclude=.kvfs_index "$ROOT" | cut -f1)" \
+			"$(find "$ROOT" -path "$ROOT/.kvfs_index" -prune -o -type f -print | wc -l)"
+	done
+}
+
+#The kernel's caches would answer the stats and lookups, so they are
+#turned off to measure the index.
+bench_backend()
+{
+	for backend in passthrough lsm; do
+		KVFS_BACKEND=$backend mount_kvfs -o attr_timeout=0,entry_timeout=0
+		for workload in create stat list unlink; do
+			printf "backend=%s " "$backend"
+			"$FSBENCH" $workload "$MOUNT" -n "$META_FILES"
+		done
+		unmount_kvfs
+	done
+}
+
+bench_dedup()
+{
+	for bytes in 0 "$DEDUP_BYTES"; do
+		KVFS_DEDUP_BYTES=$bytes mount_kvfs
+		for f in 1 2 3 4; do
+			head -c "$((DEDUP_MB << 20))" /dev/urandom > "$MOUNT/src$f"
+		done
+		start=$(date +%s%N)
+		for c in $(seq "$DEDUP_COPIES"); do
+			for f in 1 2 3 4; do
+				cp "$MOUNT/src$f" "$MOUNT/copy$c.$f" || exit 1
+			done
+		done
+		end=$(date +%s%N)
+		printf "dedup=%s copy_mib_s=%s\n" "$bytes" \
+			$(( DEDUP_COPIES * 4 * DEDUP_MB * 1000000000 / (end - start) ))
+		getfattr --only-values -n user.kvfs.stats "$MOUNT" 2> /dev/null | grep dedup
+		unmount_kvfs
+		printf "dedup=%s disk_kib=%s\n" "$bytes" "$(du -sk "$ROOT" | cut -f1)"
+	done
+}
+
+#The data is made outside the mount first: the sources are repeated
+#out to COMPRESS_MB, text from the tree and binary from kvfs itself.
+bench_compress()
+{
+	data=$(mktemp -d)
+	for src in "text:*.c README.md" "binary:$KVFS" "random:/dev/urandom"; do
+		kind=${src%%:*}
+		while cat ${src#*:}; do :; done 2> /dev/null | head -c "$((COMPRESS_MB << 20))" > "$data/$kind"
+	done
+	for codec in $COMPRESS_CODECS; do
+		KVFS_COMPRESS=$codec mount_kvfs
+		for kind in text binary random; do
+			start=$(date +%s%N)
+			cp "$data/$kind" "$MOUNT/$kind" || exit 1
+			end=$(date +%s%N)
+			printf "compress=%s data=%s write_mib_s=%s\n" "$codec" "$kind" \
+				$(( COMPRESS_MB * 1000000000 / (end - start) ))
+		done
+		unmount_kvfs
+		KVFS_COMPRESS=$codec remount_kvfs
+		for kind in text binary random; do
+			start=$(date +%s%N)
+			cat "$MOUNT/$kind" > /dev/null
+			end=$(date +%s%N)
+			printf "compress=%s data=%s read_mib_s=%s\n" "$codec" "$kind" \
+				$(( COMPRESS_MB * 1000000000 / (end - start) ))
+		done
+		getfattr --only-values -n user.kvfs.stats "$MOUNT" 2> /dev/null | grep compress
+		unmount_kvfs
+		printf "compress=%s disk_kib=%s\n" "$codec" "$(du -sk --exclude=.kvfs_index "$ROOT" | cut -f1)"
+	done
+	rm -rf "$data"
+}
+
+bench_sync()
+{
+	for mode in file group; do
+		for t in $THREADS; do
+			KVFS_SYNC=$mode mount_kvfs
+			printf "sync=%s " "$mode"
+			"$FSBENCH" synclog "$MOUNT" -n "$SYNC_RECORDS" -t "$t"
+			getfattr --only-values -n user.kvfs.stats "$MOUNT" 2> /dev/null | grep sync
+			unmount_kvfs
+		done
+	done
+}
+
+bench_io()
+{
+	for engine in sync uring; do
+		KVFS_IO=$engine mount_kvfs -o direct_io
+		"$FSBENCH" seqwrite "$MOUNT" -n "$IO_MB" > /dev/null
+		for t in $IO_THREADS; do
+			for workload in randread randwrite; do
+				printf "io=%s " "$engine"
+				"$FSBENCH" $workload "$MOUNT" -n "$IO_OPS" -t "$t"
+			done
+		done
+		getfattr --only-values -n user.kvfs.stats "$MOUNT" 2> /dev/null | grep "^io\."
+		unmount_kvfs
+	done
+}
+
+#Items per second for $1 files since start, a date +%s.%N time.
+batch_rate()
+{
+	awk -v n="$1" -v start="$2" -v end="$(date +%s.%N)" 'BEGIN { printf "%.0f", 4 * n / (end - start) }'
+}
+
+bench_batch()
+{
+	names=$(mktemp)
+	seq -f "f%.0f" "$BATCH_FILES" > "$names"
+
+	mount_kvfs
+	mkdir "$MOUNT/b"
+	start=$(date +%s.%N)
+	(cd "$MOUNT/b" && xargs touch < "$names" && xargs stat -c %s < "$names" > /dev/null &&
+		xargs chmod 600 < "$names" && xargs rm < "$names")
+	echo "batch=off files=$BATCH_FILES items_per_sec=$(batch_rate "$BATCH_FILES" "$start")"
+	unmount_kvfs
+
+	for t in $BATCH_THREADS; do
+		KVFS_BATCH_THREADS=$t mount_kvfs
+		mkdir "$MOUNT/b"
+		errors=0
+		start=$(date +%s.%N)
+		exec 3<> "$MOUNT/.kvfs_batch"
+		for op in "put 0644" stat "chmod 0600" unlink; do
+			sed "s|^|$op /b/|" "$names" >&3
+			errors=$((errors + $(cat <&3 | grep -c "^-")))
+		done
+		exec 3>&-
+		echo "batch=on threads=$t files=$BATCH_FILES items_per_sec=$(batch_rate "$BATCH_FILES" "$start") errors=$errors"
+		unmount_kvfs
+	done
+	rm -f "$names"
+}
+
+wait_mounted()
+{
+	for i in $(seq 100); do
+		if mountpoint -q "$MOUNT"; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	return 1
+}
+
+#A killed daemon loses what it had in memory but not what it had
+#handed to the backing filesystem, so this tests kvfs's own buffers
+#and logs (the write-back cache, packs, the lsm index), not power loss.
+bench_crash()
+{
+	ack=$(mktemp)
+	failed=0
+	mkdir -p "$ROOT" "$MOUNT"
+	for config in $CRASH_CONFIGS; do
+		settings=$(echo "$config" | tr , ' ')
+		for round in $(seq "$CRASH_ROUNDS"); do
+			rm -rf "${ROOT:?}"/*
+			: > "$ack"
+			env $settings "$KVFS" -f "$ROOT" "$MOUNT" &
+			pid=$!
+			wait_mounted || exit 1
+			"$FSBENCH" synclog "$MOUNT" -n "$CRASH_RECORDS" -t 4 -a "$ack" > /dev/null &
+			sleep "$(( RANDOM % 3 )).$(( RANDOM % 10 ))"
+			kill -KILL "$pid"
+			wait
+			fusermount -u -z "$MOUNT"
+			env $settings "$KVFS" "$ROOT" "$MOUNT" || exit 1
+			printf "config=%s round=%s acked=%s " "$config" "$round" "$(wc -l < "$ack")"
+			if ! "$FSBENCH" synccheck "$MOUNT" -n "$CRASH_RECORDS" -t 4 -a "$ack"; then
+				failed=$((failed + 1))
+			fi
+			unmount_kvfs
+		done
+	done
+	rm -f "$ack"
+	printf "crash failed_rounds=%s\n" "$failed"
+	[ "$failed" = 0 ]
+}
+
+#One pass of the suite over dir for target at threads threads.  The
+#reads follow the writes without a remount, so both targets read from
+#the backing directory's page cache and the kvfs/bare ratio is what
+#going through FUSE and kvfs costs.
+suite_target()
+{
+	target=$1
+	dir=$2
+	threads=$3
+	mkdir "$dir/small" "$dir/big" || exit 1
+	for workload in create stat unlink smallfile; do
+		printf "target=%s " "$target"
+		"$FSBENCH" $workload "$dir/small" -n "$SUITE_FILES" -t "$threads"
+	done
+	printf "target=%s " "$target"
+	"$FSBENCH" seqwrite "$dir" -n "$SUITE_MB" -t "$threads"
+	printf "target=%s " "$target"
+	"$FSBENCH" seqread "$dir" -n "$SUITE_MB" -t "$threads"
+	for workload in randwrite randread; do
+		printf "target=%s " "$target"
+		"$FSBENCH" $workload "$dir" -n "$SUITE_RAND_OPS" -t "$threads"
+	done
+	for workload in deep deepstat; do
+		printf "target=%s " "$target"
+		"$FSBENCH" $workload "$dir" -n "$SUITE_FILES" -t "$threads"
+	done
+	"$FSBENCH" create "$dir/big" -n "$SUITE_LIST_FILES" -t "$threads" > /dev/null
+	printf "target=%s " "$target"
+	"$FSBENCH" list "$dir/big" -n "$SUITE_LIST_FILES" -t "$threads"
+}
+
+bench_suite()
+{
+	if [ ! -x "$FSBENCH" ]; then
+		gcc -O2 -Wall -o "$FSBENCH" bench/fsbench.c -lpthread || exit 1
+	fi
+	out=$(mktemp)
+	printf "suite date=%s host=%s cpus=%s rev=%s\n" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+		"$(uname -n)" "$(nproc)" "$(git rev-parse --short HEAD 2> /dev/null || echo none)"
+	for threads in $SUITE_THREADS; do
+		mount_kvfs
+		suite_target kvfs "$MOUNT" "$threads"
+		unmount_kvfs
+		rm -rf "${ROOT:?}"/*
+		suite_target bare "$ROOT" "$threads"
+	done | tee "$out"
+	awk '{
+		for (i = 1; i <= NF; i++) {
+			split($i, kv, "=")
+			f[kv[1]] = kv[2]
+		}
+		k = f["workload"] " " f["threads"]
+		if (!(k in seen)) {
+			seen[k] = 1
+			order[n++] = k
+		}
+		rate[k, f["target"]] = f["ops_per_sec"]
+	}
+	END {
+		for (i = 0; i < n; i++) {
+			split(order[i], w, " ")
+			fuse = rate[order[i], "kvfs"]
+			bare = rate[order[i], "bare"]
+			printf "summary workload=%s threads=%s kvfs_ops_per_sec=%s bare_ops_per_sec=%s ratio=%.3f\n",
+				w[1], w[2], fuse, bare, (bare > 0 ? fuse / bare : 0)
+		}
+	}' "$out"
+	rm -f "$out"
+}
+
+#Results are matched on target, workload and threads; lines without an
+#ops_per_sec (the header, summaries) are skipped.
+bench_compare()
+{
+	if [ ! -r "$1" ] || [ ! -r "$2" ]; then
+		printf "usage: %s compare <old results> <new results>\n" "$0"
+		exit 2
+	fi
+	awk -v pct="$COMPARE_PCT" '
+	function key(   i, kv) {
+		delete f
+		for (i = 1; i <= NF; i++) {
+			split($i, kv, "=")
+			f[kv[1]] = kv[2]
+		}
+		if (!("ops_per_sec" in f) || !("target" in f))
+			return ""
+		return f["target"] " " f["workload"] " " f["threads"]
+	}
+	FNR == NR {
+		if ((k = key()) != "")
+			old[k] = f["ops_per_sec"]
+		next
+	}
+	(k = key()) != "" && (k in old) {
+		split(k, w, " ")
+		change = old[k] > 0 ? (f["ops_per_sec"] - old[k]) * 100 / old[k] : 0
+		slower = change < -pct
+		bad += slower
+		printf "target=%s workload=%s threads=%s old_ops_per_sec=%s new_ops_per_sec=%s change_pct=%.1f%s\n",
+			w[1], w[2], w[3], old[k], f["ops_per_sec"], change, slower ? " REGRESSION" : ""
+	}
+	END {
+		exit bad > 0
+	}' "$1" "$2"
+}
+
+case "$1" in
+keys)
+	bench_keys
+	;;
+attr)
+	bench_attr
+	;;
+create)
+	bench_create
+	;;
+splice)
+	bench_splice
+	;;
+readdir)
+	bench_readdir
+	;;
+threads)
+	bench_threads
+	;;
+rename)
+	bench_rename
+	;;
+writeback)
+	bench_writeback
+	;;
+readahead)
+	bench_readahead
+	;;
+pack)
+	bench_pack
+	;;
+backend)
+	bench_backend
+	;;
+dedup)
+	bench_dedup
+	;;
+compress)
+	bench_compress
+	;;
+sync)
+	bench_sync
+	;;
+io)
+	bench_io
+	;;
+batch)
+	bench_batch
+	;;
+crash)
+	bench_crash
+	;;
+suite)
+	bench_suite
+	;;
+compare)
+	bench_compare "$2" "$3"
+	;;
+*)
+	printf "usage: %s keys|attr|create|splice|readdir|threads|rename|writeback|readahead|pack|backend|dedup|compress|sync|io|batch|crash|suite|compare\n" "$0"
+	exit 2
+	;;
+esac
@@ -0,0 +1,553 @@
+/*
+  fsbench: file system workload generator for bench.sh
+
+  Runs one workload against a directory (a KVFS mount, or the backing
+  directory for comparison) and prints a single result line of
+  key=value pairs.
+
+  Build:  gcc -O2 -Wall -o fsbench bench/fsbench.c -lpthread
+  Usage:  ./fsbench <workload> <dir> [-n files] [-t threads] [-a ackfile]
+
+  Workloads:
+    create     create n empty files
+    smallfile  create n files of 4 KiB each
+    stat       stat the n files made by create
+    unlink     remove the n files made by create
+    seqwrite   write an n MiB file "seq" in 1 MiB blocks (an op is a block,
+               so ops_per_sec is MiB/s); threads write disjoint ranges
+    seqread    read back the file written by seqwrite
+    list       each thread lists dir once (an op is an entry); an error if
+               it doesn't hold exactly the n files made by create
+    append     each thread appends n/threads 100-byte records to a file of
+               its own, "log<thread>", with one write(2) each, as a logger
+               would, then closes it
+    randwrite  n 4 KiB writes at random 4 KiB-aligned offsets of the file
+               written by seqwrite
+    randread   n 4 KiB reads at random offsets of the file, likewise
+    deep       create n empty files in "deep/d/d/.../d", 16 directories down
+               (made by the first thread to need them)
+    deepstat   stat the n files made by deep
+    synclog    like append, to "sync<thread>", with an fdatasync after each
+               record; a thread stops at its first error.  With -a, each
+               record that was synced is acknowledged with a line in
+               ackfile, which should be outside dir
+    synccheck  read back the files written by synclog (same -n and -t): an
+               error for each record that is damaged, or missing though
+               ackfile acknowledges it
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct bench_conf {
+	const char *workload;
+	const char *dir;
+	long files;
+	int threads;
+	const char *ackfile;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	const struct bench_conf *conf;
+	long first, last;	// file indexes [first, last)
+	long ops;
+	long errors;
+};
+
+static struct bench_conf conf = { NULL, NULL, 10000, 1, NULL };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void file_name(char *name, const char *dir, long i)
+{
+	snprintf(name, PATH_MAX, "%s/f%ld", dir, i);
+}
+
+static void *run_create(void *arg)
+{
+	struct bench_worker *w = arg;
+	char name[PATH_MAX];
+	long i;
+	int fd;
+
+	for (i = w->first; i < w->last; i++)
+	{
+		file_name(name, w->conf->dir, i);
+		fd = open(name, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0 || close(fd) < 0)
+			w->errors++;
+		w->ops++;
+	}
+	return NULL;
+}
+
+static void *run_smallfile(void *arg)
+{
+	struct bench_worker *w = arg;
+	char name[PATH_MAX];
+	char data[4096];
+	long i;
+	int fd;
+
+	memset(data, 'k', sizeof(data));
+	for (i = w->first; i < w->last; i++)
+	{
+		file_name(name, w->conf->dir, i);
+		fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, data, sizeof(data)) != sizeof(data) || close(fd) < 0)
+			w->errors++;
+		w->ops++;
+	}
+	return NULL;
+}
+
+static void *run_stat(void *arg)
+{
+	struct bench_worker *w = arg;
+	char name[PATH_MAX];
+	struct stat st;
+	long i;
+
+	for (i = w->first; i < w->last; i++)
+	{
+		file_name(name, w->conf->dir, i);
+		if (stat(name, &st) < 0)
+			w->errors++;
+		w->ops++;
+	}
+	return NULL;
+}
+
+static void *run_unlink(void *arg)
+{
+	struct bench_worker *w = arg;
+	char name[PATH_MAX];
+	long i;
+
+	for (i = w->first; i < w->last; i++)
+	{
+		file_name(name, w->conf->dir, i);
+		if (unlink(name) < 0)
+			w->errors++;
+		w->ops++;
+	}
+	return NULL;
+}
+
+#define SEQ_BLOCK	(1 << 20)
+
+static void *run_seq(struct bench_worker *w, int writing)
+{
+	char name[PATH_MAX];
+	char *block;
+	long i;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s/seq", w->conf->dir);
+	block = malloc(SEQ_BLOCK);
+	memset(block, 'k', SEQ_BLOCK);
+	fd = open(name, writing ? O_CREAT | O_WRONLY : O_RDONLY, 0644);
+	if (fd < 0)
+	{
+		w->errors = w->last - w->first;
+		free(block);
+		return NULL;
+	}
+	for (i = w->first; i < w->last; i++)
+	{
+		off_t offset = (off_t) i * SEQ_BLOCK;
+
+		if ((writing ? pwrite(fd, block, SEQ_BLOCK, offset) : pread(fd, block, SEQ_BLOCK, offset)) != SEQ_BLOCK)
+			w->errors++;
+		w->ops++;
+	}
+	if (close(fd) < 0)
+		w->errors++;
+	free(block);
+	return NULL;
+}
+
+static void *run_seqwrite(void *arg)
+{
+	return run_seq(arg, 1);
+}
+
+static void *run_seqread(void *arg)
+{
+	return run_seq(arg, 0);
+}
+
+static void *run_list(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct dirent *de;
+	long entries = 0;
+	DIR *dp;
+
+	dp = opendir(w->conf->dir);
+	if (dp == NULL)
+	{
+		w->errors++;
+		return NULL;
+	}
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			entries++;
+		w->ops++;
+	}
+	closedir(dp);
+	if (entries != w->conf->files)
+		w->errors++;
+	return NULL;
+}
+
+#define RAND_BLOCK	4096
+
+// Each thread draws its own offsets, seeded by its first op, so a run
+// with the same -n and -t touches the same blocks.
+static void *run_rand(struct bench_worker *w, int writing)
+{
+	char name[PATH_MAX];
+	char block[RAND_BLOCK];
+	unsigned int seed = w->first + 1;
+	struct stat st;
+	off_t blocks;
+	long i;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s/seq", w->conf->dir);
+	memset(block, 'r', sizeof(block));
+	fd = open(name, writing ? O_WRONLY : O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || (blocks = st.st_size / RAND_BLOCK) == 0)
+	{
+		w->errors = w->last - w->first;
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	for (i = w->first; i < w->last; i++)
+	{
+		off_t offset = (off_t) (((unsigned long) rand_r(&seed) << 16 ^ rand_r(&seed)) % blocks) * RAND_BLOCK;
+
+		if ((writing ? pwrite(fd, block, RAND_BLOCK, offset) : pread(fd, block, RAND_BLOCK, offset)) != RAND_BLOCK)
+			w->errors++;
+		w->ops++;
+	}
+	if (close(fd) < 0)
+		w->errors++;
+	return NULL;
+}
+
+static void *run_randwrite(void *arg)
+{
+	return run_rand(arg, 1);
+}
+
+static void *run_randread(void *arg)
+{
+	return run_rand(arg, 0);
+}
+
+#define DEEP_DEPTH	16
+
+// The directory deep files go in; with make, each level is created if
+// it isn't there yet.  Returns -1 if one can't be.
+static int deep_dir(char *name, const char *dir, int make)
+{
+	int depth, len;
+
+	len = snprintf(name, PATH_MAX, "%s/deep", dir);
+	for (depth = 0; depth <= DEEP_DEPTH; depth++)
+	{
+		if (depth > 0)
+			len += snprintf(name + len, PATH_MAX - len, "/d");
+		if (make && mkdir(name, 0755) < 0 && errno != EEXIST)
+			return -1;
+	}
+	return len;
+}
+
+static void *run_deep_files(struct bench_worker *w, int creating)
+{
+	char name[PATH_MAX];
+	struct stat st;
+	long i;
+	int len, fd;
+
+	len = deep_dir(name, w->conf->dir, creating);
+	if (len < 0)
+	{
+		w->errors = w->last - w->first;
+		return NULL;
+	}
+	for (i = w->first; i < w->last; i++)
+	{
+		snprintf(name + len, PATH_MAX - len, "/f%ld", i);
+		if (creating)
+		{
+			fd = open(name, O_CREAT | O_WRONLY, 0644);
+			if (fd < 0 || close(fd) < 0)
+				w->errors++;
+		}
+		else if (stat(name, &st) < 0)
+			w->errors++;
+		w->ops++;
+	}
+	return NULL;
+}
+
+static void *run_deep(void *arg)
+{
+	return run_deep_files(arg, 1);
+}
+
+static void *run_deepstat(void *arg)
+{
+	return run_deep_files(arg, 0);
+}
+
+#define APPEND_RECORD	100
+
+static void *run_append(void *arg)
+{
+	struct bench_worker *w = arg;
+	char name[PATH_MAX];
+	char record[APPEND_RECORD];
+	long i;
+	int fd;
+
+	memset(record, 'k', sizeof(record));
+	record[sizeof(record) - 1] = '\n';
+	snprintf(name, sizeof(name), "%s/log%ld", w->conf->dir, w->first);
+	fd = open(name, O_CREAT | O_WRONLY | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0)
+	{
+		w->errors = w->last - w->first;
+		return NULL;
+	}
+	for (i = w->first; i < w->last; i++)
+	{
+		if (write(fd, record, sizeof(record)) != sizeof(record))
+			w->errors++;
+		w->ops++;
+	}
+	// Where a write-back cache reports what it could not write.
+	if (close(fd) < 0)
+		w->errors++;
+	return NULL;
+}
+
+// A synclog record is its thread's first op and its own number, then
+// padding up to a newline.
+static void sync_record(char *record, long first, long seq)
+{
+	int len = snprintf(record, APPEND_RECORD, "%ld %ld ", first, seq);
+
+	memset(record + len, 'k', APPEND_RECORD - len);
+	record[APPEND_RECORD - 1] = '\n';
+}
+
+static void *run_synclog(void *arg)
+{
+	struct bench_worker *w = arg;
+	char name[PATH_MAX];
+	char record[APPEND_RECORD];
+	char ack[64];
+	int fd, ackfd = -1;
+	long i;
+
+	snprintf(name, sizeof(name), "%s/sync%ld", w->conf->dir, w->first);
+	fd = open(name, O_CREAT | O_WRONLY | O_TRUNC | O_APPEND, 0644);
+	if (w->conf->ackfile != NULL)
+		ackfd = open(w->conf->ackfile, O_CREAT | O_WRONLY | O_APPEND, 0644);
+	if (fd < 0 || (w->conf->ackfile != NULL && ackfd < 0))
+	{
+		w->errors = w->last - w->first;
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	for (i = w->first; i < w->last; i++)
+	{
+		sync_record(record, w->first, i - w->first);
+		w->ops++;
+		if (write(fd, record, sizeof(record)) != sizeof(record) || fdatasync(fd) < 0)
+		{
+			w->errors++;
+			break;
+		}
+		// One short O_APPEND write, so threads' lines don't mix.
+		if (ackfd >= 0 && write(ackfd, ack, snprintf(ack, sizeof(ack), "sync%ld %ld\n",
+			w->first, i - w->first + 1)) < 0)
+			w->errors++;
+	}
+	close(fd);
+	if (ackfd >= 0)
+		close(ackfd);
+	return NULL;
+}
+
+// How many of file's records ackfile acknowledges; 0 without one.
+static long sync_acked(const char *ackfile, const char *file)
+{
+	char line[128], name[64];
+	long n, acked = 0;
+	FILE *fp;
+
+	if (ackfile == NULL || (fp = fopen(ackfile, "r")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (sscanf(line, "%63s %ld", name, &n) == 2 && strcmp(name, file) == 0 && n > acked)
+			acked = n;
+	fclose(fp);
+	return acked;
+}
+
+static void *run_synccheck(void *arg)
+{
+	struct bench_worker *w = arg;
+	char name[PATH_MAX], file[64];
+	char record[APPEND_RECORD], want[APPEND_RECORD];
+	long seq = 0, acked;
+	ssize_t n;
+	int fd;
+
+	snprintf(file, sizeof(file), "sync%ld", w->first);
+	snprintf(name, sizeof(name), "%s/%s", w->conf->dir, file);
+	acked = sync_acked(w->conf->ackfile, file);
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+	{
+		w->errors = acked;
+		return NULL;
+	}
+	// Acknowledged records are counted below if they aren't all here;
+	// past them, a torn last record is fine but a wrong one is not.
+	while ((n = read(fd, record, sizeof(record))) > 0)
+	{
+		sync_record(want, w->first, seq);
+		if (n != sizeof(record) || memcmp(record, want, sizeof(record)) != 0)
+		{
+			if (n == sizeof(record) && seq >= acked)
+				w->errors++;
+			break;
+		}
+		seq++;
+		w->ops++;
+	}
+	if (seq < acked)
+		w->errors += acked - seq;
+	close(fd);
+	return NULL;
+}
+
+static const struct {
+	const char *name;
+	void *(*run)(void *);
+} workloads[] = {
+	{ "create", run_create },
+	{ "smallfile", run_smallfile },
+	{ "stat", run_stat },
+	{ "unlink", run_unlink },
+	{ "seqwrite", run_seqwrite },
+	{ "seqread", run_seqread },
+	{ "list", run_list },
+	{ "append", run_append },
+	{ "randwrite", run_randwrite },
+	{ "randread", run_randread },
+	{ "deep", run_deep },
+	{ "deepstat", run_deepstat },
+	{ "synclog", run_synclog },
+	{ "synccheck", run_synccheck },
+	{ NULL, NULL }
+};
+
+static void usage(const char *argv0)
+{
+	int i;
+
+	fprintf(stderr, "usage: %s <workload> <dir> [-n files] [-t threads] [-a ackfile]\nworkloads:", argv0);
+	for (i = 0; workloads[i].name != NULL; i++)
+		fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_worker *workers;
+	void *(*run)(void *) = NULL;
+	long ops = 0, errors = 0;
+	double start, secs;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "n:t:a:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			conf.ackfile = optarg;
+			break;
+		case 'n':
+			conf.files = atol(optarg);
+			break;
+		case 't':
+			conf.threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || conf.files <= 0 || conf.threads <= 0)
+		usage(argv[0]);
+	conf.workload = argv[optind];
+	conf.dir = argv[optind + 1];
+
+	for (i = 0; workloads[i].name != NULL; i++)
+		if (strcmp(workloads[i].name, conf.workload) == 0)
+			run = workloads[i].run;
+	if (run == NULL)
+		usage(argv[0]);
+
+	workers = calloc(conf.threads, sizeof(*workers));
+	start = now();
+	for (i = 0; i < conf.threads; i++)
+	{
+		workers[i].conf = &conf;
+		workers[i].first = conf.files * i / conf.threads;
+		workers[i].last = conf.files * (i + 1) / conf.threads;
+		pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+	}
+	for (i = 0; i < conf.threads; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		errors += workers[i].errors;
+	}
+	secs = now() - start;
+
+	printf("workload=%s threads=%d ops=%ld errors=%ld secs=%.3f ops_per_sec=%.0f\n",
+	       conf.workload, conf.threads, ops, errors, secs, ops / secs);
+	free(workers);
+	return errors ? 1 : 0;
+}
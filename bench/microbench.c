@@ -0,0 +1,2045 @@
+/*
+  In-process microbenchmarks for kvfs_functions.c
+
+  The FUSE round trip dwarfs the cost of the code paths measured
+  here, so they are timed directly: kvfs_functions.c is compiled
+  into this program and the few framework symbols it needs
+  (fuse_get_context, fuse_buf_*, the log_* helpers, str2md5) are
+  stubbed out below.  Nothing is mounted.
+
+  Build from the project directory (needs the same headers as kvfs):
+
+    gcc -O2 -Wall -D_FILE_OFFSET_BITS=64 `pkg-config fuse --cflags` \
+        -I. -o microbench bench/microbench.c -lcrypto -lpthread
+
+  (compress needs -DHAVE_SYS_XATTR_H too; add -DHAVE_ZLIB_H and -lz
+  to include zlib, and -DHAVE_LINUX_IO_URING_H for uring.)
+
+  Run (BENCH_ROOT overrides the /tmp/kvfs_bench_root backing root):
+
+    ./microbench fullpath [iterations]
+    ./microbench hash [iterations]
+    ./microbench log [iterations]
+    ./microbench dcache [iterations]
+    ./microbench create [files]
+    ./microbench stress [seconds per thread count]
+    ./microbench readdir [entries]
+    ./microbench index [children per directory]
+    ./microbench rename [children]
+    ./microbench writeback [records]
+    ./microbench readahead [MiB]
+    ./microbench pack [objects]
+    ./microbench meta [files]
+    ./microbench compress [MiB]
+    ./microbench opstats [iterations]
+    ./microbench fdcache [files]
+    ./microbench mmap [reads]
+    ./microbench uring [ops per thread count]
+    ./microbench batch [files]
+
+  BENCH_READ_DELAY_US=n makes every pread of the backing store take n
+  microseconds longer, to stand in for a disk or network store.
+*/
+
+// kvfs_functions.c's preads of the backing store come here.
+#define pread(fd, buf, count, offset) bench_pread(fd, buf, count, offset)
+#include "../kvfs_functions.c"
+#undef pread
+
+static long bench_read_delay;
+
+extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+
+ssize_t bench_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	if (bench_read_delay > 0)
+		usleep(bench_read_delay);
+	return pread(fd, buf, count, offset);
+}
+
+#include <ftw.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/wait.h>
+
+///////////////////////////////////////////////////////////
+//
+// Framework stubs
+//
+static struct kvfs_state bench_state;
+static struct fuse_context bench_context;
+
+struct fuse_context *fuse_get_context(void)
+{
+	return &bench_context;
+}
+
+void fuse_exit(struct fuse *f)
+{
+}
+
+size_t fuse_buf_size(const struct fuse_bufvec *bufv)
+{
+	size_t size = 0;
+	size_t i;
+
+	for (i = 0; i < bufv->count; i++)
+		size += bufv->buf[i].size;
+	return size;
+}
+
+// Only what kvfs_write_buf_impl() asks for: one memory buffer to one fd.
+ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags)
+{
+	ssize_t res;
+
+	res = pwrite(dst->buf[0].fd, src->buf[0].mem, src->buf[0].size, dst->buf[0].pos);
+	return res < 0 ? -errno : res;
+}
+
+// Format into a scratch buffer so "before" numbers still pay for
+// printf, which is what the old unconditional log_msg cost.
+static char bench_logbuf[1024];
+
+void log_msg(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(bench_logbuf, sizeof(bench_logbuf), format, ap);
+	va_end(ap);
+}
+
+void log_fi(struct fuse_file_info *fi)
+{
+}
+
+void log_stat(struct stat *si)
+{
+}
+
+void log_statvfs(struct statvfs *sv)
+{
+}
+
+int log_error(char *func)
+{
+	return -errno;
+}
+
+// Same contract as the framework's str2md5(): the caller owns the result.
+char *str2md5(const char *str, int length)
+{
+	char *out = malloc(KVFS_KEY_MAX);
+
+	kvfs_key_md5(str, length, out);
+	return out;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+///////////////////////////////////////////////////////////
+//
+// fullpath: cost of translating one getattr key to a backing path
+//
+
+// kvfs_fullpath() as it was before the root key was cached, except
+// that the str2md5() result is freed so long runs don't exhaust memory.
+static void fullpath_before(char fullpath[PATH_MAX], const char *path)
+{
+	char *root_dir = str2md5("/", 1);
+
+	if (strcmp(path, root_dir) == 0)
+	{
+		strcpy(fullpath, KVFS_DATA->rootdir);
+		log_msg(" accessing root...");
+		free(root_dir);
+		return;
+	}
+	strcpy(fullpath, KVFS_DATA->rootdir);
+	strcat(fullpath, "/");
+	strcat(fullpath, path);
+	free(root_dir);
+
+	log_msg("\nkvfs_fullpath:  rootdir = \"%s\", path = \"%s\", fullpath = \"%s\" : ", KVFS_DATA->rootdir, path, fullpath);
+}
+
+static int bench_fullpath(long iterations)
+{
+	char key[KVFS_KEY_MAX];
+	char fullpath[PATH_MAX];
+	double start, before, after;
+	long i;
+
+	kvfs_str2key("/testdir1/temp1.txt", strlen("/testdir1/temp1.txt"), key);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		fullpath_before(fullpath, key);
+	before = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		kvfs_fullpath(fullpath, key);
+	after = bench_now() - start;
+
+	printf("fullpath  iterations=%ld  before=%.1f ns/call  after=%.1f ns/call  speedup=%.1fx\n",
+	       iterations, before * 1e9 / iterations, after * 1e9 / iterations, before / after);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// hash: key function throughput across path lengths
+//
+static int bench_hash(long iterations)
+{
+	static const size_t lengths[] = { 8, 16, 32, 64, 128, 256, 1024, 4096 };
+	const struct kvfs_keyfn *keyfn;
+	char path[4096], key[KVFS_KEY_MAX];
+	double start, secs;
+	size_t i;
+	long n;
+
+	// Something path-shaped: components separated by slashes.
+	for (i = 0; i < sizeof(path); i++)
+		path[i] = (i % 9 == 0) ? '/' : 'a' + i % 26;
+
+	for (keyfn = kvfs_keyfns; keyfn->name != NULL; keyfn++)
+	{
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+		{
+			start = bench_now();
+			for (n = 0; n < iterations; n++)
+			{
+				path[1] = 'a' + n % 26;	// defeat hoisting
+				keyfn->hash(path, lengths[i], key);
+			}
+			secs = bench_now() - start;
+
+			printf("hash  algorithm=%-6s length=%-5zu %8.1f ns/hash %8.1f MB/s\n",
+			       keyfn->name, lengths[i], secs * 1e9 / iterations,
+			       lengths[i] * (double) iterations / secs / 1e6);
+		}
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// log: cost of one trace line per op, four threads logging at once
+//
+#define BENCH_LOG_THREADS	4
+
+static FILE *bench_sync_log;
+static long bench_log_iterations;
+static int bench_log_mode;	// 0 synchronous stdio, 1 ring buffers
+
+// What log.c's log_msg() does: vfprintf to a line-buffered FILE.
+static void bench_sync_log_msg(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(bench_sync_log, format, ap);
+	va_end(ap);
+}
+
+static void *bench_log_worker(void *arg)
+{
+	char key[KVFS_KEY_MAX] = "08227ee67df92d3f9e3516ba38228da6";
+	long i;
+
+	for (i = 0; i < bench_log_iterations; i++)
+	{
+		if (bench_log_mode == 0)
+			bench_sync_log_msg("\nkvfs_read(path=\"%s\", size=%d, offset=%ld)\n", key, 4096, i);
+		else
+			kvfs_trace("\nkvfs_read(path=\"%s\", size=%d, offset=%ld)\n", key, 4096, i);
+	}
+	return NULL;
+}
+
+static double bench_log_run(int mode)
+{
+	pthread_t threads[BENCH_LOG_THREADS];
+	double start;
+	int i;
+
+	bench_log_mode = mode;
+	start = bench_now();
+	for (i = 0; i < BENCH_LOG_THREADS; i++)
+		pthread_create(&threads[i], NULL, bench_log_worker, NULL);
+	for (i = 0; i < BENCH_LOG_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	return (bench_now() - start) * 1e9 / (bench_log_iterations * BENCH_LOG_THREADS);
+}
+
+static int bench_log(long iterations)
+{
+	char key[KVFS_KEY_MAX];
+	double sync, ring, filtered;
+
+	bench_log_iterations = iterations;
+	bench_sync_log = fopen("/dev/null", "w");
+	setvbuf(bench_sync_log, NULL, _IOLBF, 0);
+	bench_state.logfile = fopen("/dev/null", "w");
+	setenv("KVFS_LOG_LEVEL", "trace", 1);
+	kvfs_str2key("/", 1, key);	// runs kvfs_init(), which starts the log thread
+
+	sync = bench_log_run(0);
+	ring = bench_log_run(1);
+	kvfs_log_level = KVFS_LOG_ERROR;
+	filtered = bench_log_run(1);
+
+	printf("log  threads=%d  synchronous=%.1f ns/line  ring=%.1f ns/line  filtered=%.1f ns/line\n",
+	       BENCH_LOG_THREADS, sync, ring, filtered);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// dcache: kvfs_str2key() on a hot set of paths, path cache off and on
+//
+#define BENCH_DCACHE_THREADS	4
+#define BENCH_DCACHE_PATHS	64
+
+static char bench_paths[BENCH_DCACHE_PATHS][64];
+static long bench_dcache_iterations;
+
+static void *bench_dcache_worker(void *arg)
+{
+	char key[KVFS_KEY_MAX];
+	long i;
+
+	for (i = 0; i < bench_dcache_iterations; i++)
+	{
+		const char *path = bench_paths[(i * 7 + (long) arg) % BENCH_DCACHE_PATHS];
+
+		kvfs_str2key(path, strlen(path), key);
+	}
+	return NULL;
+}
+
+static double bench_dcache_run(void)
+{
+	pthread_t threads[BENCH_DCACHE_THREADS];
+	double start;
+	long i;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_DCACHE_THREADS; i++)
+		pthread_create(&threads[i], NULL, bench_dcache_worker, (void *) i);
+	for (i = 0; i < BENCH_DCACHE_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	return (bench_now() - start) * 1e9 / (bench_dcache_iterations * BENCH_DCACHE_THREADS);
+}
+
+static int bench_dcache(long iterations)
+{
+	char key[KVFS_KEY_MAX];
+	double off, on;
+	int i;
+
+	bench_dcache_iterations = iterations;
+	for (i = 0; i < BENCH_DCACHE_PATHS; i++)
+		snprintf(bench_paths[i], sizeof(bench_paths[i]), "/home/user/project/build/obj%02d/output.o", i);
+
+	setenv("KVFS_HASH", "md5", 1);
+	kvfs_str2key("/", 1, key);	// runs kvfs_init()
+
+	kvfs_dcache_on = 0;
+	off = bench_dcache_run();
+	kvfs_dcache_on = 1;
+	on = bench_dcache_run();
+
+	printf("dcache  threads=%d  paths=%d  off=%.1f ns/lookup  on=%.1f ns/lookup  speedup=%.1fx\n",
+	       BENCH_DCACHE_THREADS, BENCH_DCACHE_PATHS, off, on, off / on);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// create: backing work for each new file, mknod+open+getattr vs create
+//
+static double bench_create_run(long files, int use_create)
+{
+	struct fuse_file_info fi;
+	struct stat st;
+	char name[64], key[KVFS_KEY_MAX];
+	double start;
+	long i;
+
+	start = bench_now();
+	for (i = 0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "/%s%ld", use_create ? "c" : "m", i);
+		kvfs_str2key(name, strlen(name), key);
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY | O_CREAT | O_EXCL;
+		if (use_create)
+		{
+			if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0)
+				return -1;
+			kvfs_fgetattr_impl(key, &st, &fi);
+		}
+		else
+		{
+			// What the kernel does when there is no create()
+			if (kvfs_mknod_impl(key, S_IFREG | 0644, 0) < 0)
+				return -1;
+			fi.flags = O_WRONLY;
+			if (kvfs_open_impl(key, &fi) < 0)
+				return -1;
+			kvfs_getattr_impl(key, &st);
+		}
+		close(fi.fh);
+	}
+	return files / (bench_now() - start);
+}
+
+static void bench_create_clean(long files)
+{
+	char name[64], key[KVFS_KEY_MAX];
+	long i;
+
+	for (i = 0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "/m%ld", i);
+		kvfs_str2key(name, strlen(name), key);
+		kvfs_unlink_impl(key);
+		snprintf(name, sizeof(name), "/c%ld", i);
+		kvfs_str2key(name, strlen(name), key);
+		kvfs_unlink_impl(key);
+	}
+}
+
+static int bench_create(long files)
+{
+	double before, after;
+
+	bench_create_clean(files);
+	before = bench_create_run(files, 0);
+	bench_create_clean(files);
+	after = bench_create_run(files, 1);
+	bench_create_clean(files);
+	if (before < 0 || after < 0)
+	{
+		perror("create");
+		return 1;
+	}
+
+	printf("create  files=%ld  mknod+open=%.0f files/sec  create=%.0f files/sec  speedup=%.2fx\n",
+	       files, before, after, after / before);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// stress: every thread runs whole file lifecycles through the ops
+// (create, write, fgetattr, rename, getattr, open, read, unlink) on
+// files of its own, and lists the root through one directory handle
+// shared by all threads, as FUSE does for an open directory.  Reports
+// lifecycles/sec from 1 thread up to one per CPU, and any op that
+// returned an unexpected result.
+//
+static struct fuse_file_info bench_stress_dir;
+static int bench_stress_stop;
+
+struct bench_stress {
+	pthread_t thread;
+	int id;
+	long ops;
+	long errors;
+};
+
+static int bench_stress_fill(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	return 0;
+}
+
+static void *bench_stress_worker(void *arg)
+{
+	struct bench_stress *w = arg;
+	struct fuse_file_info fi;
+	struct stat st;
+	char name[64], key[KVFS_KEY_MAX], newkey[KVFS_KEY_MAX], data[4096];
+	long i;
+
+	memset(data, 'k', sizeof(data));
+	for (i = 0; !__atomic_load_n(&bench_stress_stop, __ATOMIC_RELAXED); i++)
+	{
+		snprintf(name, sizeof(name), "/s%d_%ld", w->id, i);
+		kvfs_str2key(name, strlen(name), key);
+		snprintf(name, sizeof(name), "/r%d_%ld", w->id, i);
+		kvfs_str2key(name, strlen(name), newkey);
+
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDWR | O_CREAT | O_EXCL;
+		if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0)
+		{
+			w->errors++;
+			continue;
+		}
+		if (kvfs_write_impl(key, data, sizeof(data), 0, &fi) != sizeof(data) ||
+		    kvfs_fgetattr_impl(key, &st, &fi) < 0 || st.st_size != sizeof(data))
+			w->errors++;
+		kvfs_release_impl(key, &fi);
+
+		if (kvfs_rename_impl(key, newkey) < 0)
+			w->errors++;
+
+		// As the FUSE wrappers do for each request: with an index,
+		// the renamed object keeps its key under its new name.
+		snprintf(name, sizeof(name), "/s%d_%ld", w->id, i);
+		kvfs_str2key(name, strlen(name), key);
+		snprintf(name, sizeof(name), "/r%d_%ld", w->id, i);
+		kvfs_str2key(name, strlen(name), newkey);
+		if (kvfs_getattr_impl(key, &st) != -ENOENT ||
+		    kvfs_getattr_impl(newkey, &st) < 0 || st.st_size != sizeof(data))
+			w->errors++;
+
+		fi.flags = O_RDONLY;
+		if (kvfs_open_impl(newkey, &fi) < 0)
+			w->errors++;
+		else
+		{
+			if (kvfs_read_impl(newkey, data, sizeof(data), 0, &fi) != sizeof(data))
+				w->errors++;
+			kvfs_release_impl(newkey, &fi);
+		}
+		if (kvfs_unlink_impl(newkey) < 0)
+			w->errors++;
+
+		if (i % 16 == 0)
+			kvfs_readdir_impl(kvfs_root_key, NULL, bench_stress_fill, 0, &bench_stress_dir);
+		w->ops++;
+	}
+	return NULL;
+}
+
+static int bench_stress(long seconds)
+{
+	struct bench_stress workers[256];
+	char key[KVFS_KEY_MAX];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double start, secs, base = 0;
+	long ops, errors, total_errors = 0;
+	int n, i;
+
+	if (cpus > 256)
+		cpus = 256;
+	kvfs_str2key("/", 1, key);	// runs kvfs_init()
+	if (kvfs_opendir_impl(key, &bench_stress_dir) < 0)
+	{
+		perror("opendir");
+		return 1;
+	}
+
+	for (n = 1; n <= cpus; n = (n * 2 <= cpus || n == cpus) ? n * 2 : cpus)
+	{
+		__atomic_store_n(&bench_stress_stop, 0, __ATOMIC_RELAXED);
+		start = bench_now();
+		for (i = 0; i < n; i++)
+		{
+			workers[i].id = i;
+			workers[i].ops = workers[i].errors = 0;
+			pthread_create(&workers[i].thread, NULL, bench_stress_worker, &workers[i]);
+		}
+		while (bench_now() - start < seconds)
+			usleep(10000);
+		__atomic_store_n(&bench_stress_stop, 1, __ATOMIC_RELAXED);
+		ops = errors = 0;
+		for (i = 0; i < n; i++)
+		{
+			pthread_join(workers[i].thread, NULL);
+			ops += workers[i].ops;
+			errors += workers[i].errors;
+		}
+		secs = bench_now() - start;
+		if (n == 1)
+			base = ops / secs;
+
+		printf("stress  threads=%-3d  %8.0f lifecycles/sec  scaling=%.2fx  errors=%ld\n",
+		       n, ops / secs, ops / secs / base, errors);
+		total_errors += errors;
+		if (n == cpus)
+			break;
+	}
+
+	kvfs_releasedir_impl(key, &bench_stress_dir);
+	return total_errors != 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// readdir: list a huge root through a simulated kernel buffer
+//
+// The streaming listing fills one 4 KiB buffer per call, sized the way
+// libfuse packs struct fuse_dirent, and resumes from the last cookie.
+// "whole" is what libfuse does for a readdir that ignores offsets:
+// collect the entire directory in one growing buffer before the
+// kernel sees any of it.  Each listing is checked against the names
+// that were created: same count, same order-independent checksum.
+//
+#define BENCH_DIRBUF	4096
+#define BENCH_DIRENT_SIZE(namelen)	((24 + (namelen) + 7) & ~7)
+
+struct bench_dirbuf {
+	size_t used, size;	// size 0: grow without limit
+	long entries;
+	off_t last;
+	uint64_t sum;
+};
+
+static int bench_readdir_fill(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	struct bench_dirbuf *b = buf;
+	size_t len = BENCH_DIRENT_SIZE(strlen(name));
+
+	if (b->size != 0 && b->used + len > b->size)
+		return 1;
+	b->used += len;
+	b->entries++;
+	b->last = off;
+	if (name[0] != '.')
+		b->sum += kvfs_xxh64(name, strlen(name));
+	return 0;
+}
+
+static int bench_readdir(long entries)
+{
+	struct fuse_file_info fi, dfi;
+	struct bench_dirbuf whole, chunk;
+	char name[64], key[KVFS_KEY_MAX], root[KVFS_KEY_MAX];
+	uint64_t sum = 0;
+	double start, whole_secs, first, stream_secs;
+	long i, calls = 0, listed = 0;
+	off_t offset;
+
+	kvfs_str2key("/", 1, root);
+	for (i = 0; i < entries; i++)
+	{
+		snprintf(name, sizeof(name), "/e%ld", i);
+		kvfs_str2key(name, strlen(name), key);
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY | O_CREAT;
+		if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0)
+		{
+			perror("create");
+			return 1;
+		}
+		close(fi.fh);
+		// an indexed root lists names, an older one keys
+		if (kvfs_conf.index)
+			sum += kvfs_xxh64(name + 1, strlen(name + 1));
+		else
+			sum += kvfs_xxh64(key, strlen(key));
+	}
+
+	memset(&dfi, 0, sizeof(dfi));
+	memset(&whole, 0, sizeof(whole));
+	kvfs_opendir_impl(root, &dfi);
+	start = bench_now();
+	kvfs_readdir_impl(root, &whole, bench_readdir_fill, 0, &dfi);
+	whole_secs = bench_now() - start;
+	kvfs_releasedir_impl(root, &dfi);
+
+	memset(&dfi, 0, sizeof(dfi));
+	memset(&chunk, 0, sizeof(chunk));
+	kvfs_opendir_impl(root, &dfi);
+	offset = 0;
+	first = 0;
+	start = bench_now();
+	do
+	{
+		chunk.used = chunk.entries = 0;
+		chunk.size = BENCH_DIRBUF;
+		kvfs_readdir_impl(root, &chunk, bench_readdir_fill, offset, &dfi);
+		offset = chunk.last;
+		listed += chunk.entries;
+		if (calls++ == 0)
+			first = bench_now() - start;
+	} while (chunk.entries > 0);
+	stream_secs = bench_now() - start;
+	kvfs_releasedir_impl(root, &dfi);
+
+	printf("readdir  entries=%ld  whole: %.1f ms, first entry after %.1f ms, %zu KiB buffered  %s\n",
+	       entries, whole_secs * 1e3, whole_secs * 1e3, whole.used / 1024,
+	       whole.entries == entries + 2 && whole.sum == sum ? "ok" : "MISMATCH");
+	printf("readdir  entries=%ld  stream: %.1f ms in %ld calls, first entry after %.3f ms, %d KiB buffered  %s\n",
+	       entries, stream_secs * 1e3, calls, first * 1e3, BENCH_DIRBUF / 1024,
+	       listed == entries + 2 && chunk.sum == sum ? "ok" : "MISMATCH");
+
+	for (i = 0; i < entries; i++)
+	{
+		snprintf(name, sizeof(name), "/e%ld", i);
+		kvfs_str2key(name, strlen(name), key);
+		kvfs_unlink_impl(key);
+	}
+	return whole.entries != entries + 2 || whole.sum != sum || listed != entries + 2 || chunk.sum != sum;
+}
+
+///////////////////////////////////////////////////////////
+//
+// index: list one directory of a big tree from the namespace index,
+// against scanning every key in the root, which was the only way to
+// find a directory's children before (and even then only by hashing
+// every candidate name).  Needs a fresh BENCH_ROOT, so the index is on.
+//
+#define BENCH_INDEX_DIRS	100
+
+static int bench_index_fill(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(*(long *) buf)++;
+	return 0;
+}
+
+static void bench_index_names(int op, long children)
+{
+	struct fuse_file_info fi;
+	char name[64], key[KVFS_KEY_MAX];
+	long d, i;
+
+	for (d = 0; d < BENCH_INDEX_DIRS; d++)
+	{
+		snprintf(name, sizeof(name), "/d%ld", d);
+		kvfs_str2key(name, strlen(name), key);
+		if (op == 0)
+			kvfs_mkdir_impl(key, 0755);
+		for (i = 0; i < children; i++)
+		{
+			snprintf(name, sizeof(name), "/d%ld/f%ld", d, i);
+			kvfs_str2key(name, strlen(name), key);
+			if (op == 0)
+			{
+				memset(&fi, 0, sizeof(fi));
+				fi.flags = O_WRONLY | O_CREAT;
+				if (kvfs_create_impl(key, S_IFREG | 0644, &fi) == 0)
+					close(fi.fh);
+			}
+			else
+				kvfs_unlink_impl(key);
+		}
+		if (op != 0)
+		{
+			snprintf(name, sizeof(name), "/d%ld", d);
+			kvfs_str2key(name, strlen(name), key);
+			kvfs_rmdir_impl(key);
+		}
+	}
+}
+
+static int bench_index(long children)
+{
+	struct fuse_file_info dfi;
+	struct dirent *de;
+	char key[KVFS_KEY_MAX];
+	double start, listed, scanned;
+	long entries = 0, keys = 0;
+	DIR *dp;
+
+	kvfs_str2key("/", 1, key);
+	if (!kvfs_conf.index)
+	{
+		fprintf(stderr, "index: %s was made without an index, use an empty BENCH_ROOT\n", kvfs_rootdir);
+		return 1;
+	}
+	bench_index_names(0, children);
+
+	kvfs_str2key("/d42", 4, key);
+	memset(&dfi, 0, sizeof(dfi));
+	start = bench_now();
+	kvfs_opendir_impl(key, &dfi);
+	kvfs_readdir_impl(key, &entries, bench_index_fill, 0, &dfi);
+	kvfs_releasedir_impl(key, &dfi);
+	listed = bench_now() - start;
+
+	start = bench_now();
+	dp = opendir(kvfs_rootdir);
+	while ((de = readdir(dp)) != NULL)
+		keys++;
+	closedir(dp);
+	scanned = bench_now() - start;
+
+	printf("index  keys=%ld  list one directory: %ld entries in %.3f ms  scan root: %ld entries in %.3f ms\n",
+	       BENCH_INDEX_DIRS * (children + 1), entries - 2, listed * 1e3, keys - 2, scanned * 1e3);
+
+	bench_index_names(1, children);
+	return entries - 2 != children;
+}
+
+///////////////////////////////////////////////////////////
+//
+// rename: rename a directory of 10, 10k (or as many as asked for)
+// children.  On an indexed root keys do not change on rename, so it
+// should take the same time whatever is below; the cost of moving
+// each child by itself, which is what keys hashed from full paths
+// need, is timed next to it.  Needs a fresh BENCH_ROOT.
+//
+static void bench_rename_path(char *name, const char *dir, long i, char key[KVFS_KEY_MAX])
+{
+	if (i < 0)
+		snprintf(name, 64, "/%s", dir);
+	else
+		snprintf(name, 64, "/%s/f%ld", dir, i);
+	kvfs_str2key(name, strlen(name), key);
+}
+
+static int bench_rename_one(long children)
+{
+	struct fuse_file_info fi;
+	struct stat st;
+	char name[64], key[KVFS_KEY_MAX], newkey[KVFS_KEY_MAX];
+	double start, dir, each;
+	long i;
+	int bad = 0;
+
+	bench_rename_path(name, "a", -1, key);
+	kvfs_mkdir_impl(key, 0755);
+	for (i = 0; i < children; i++)
+	{
+		bench_rename_path(name, "a", i, key);
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY | O_CREAT;
+		if (kvfs_create_impl(key, S_IFREG | 0644, &fi) == 0)
+			close(fi.fh);
+	}
+
+	start = bench_now();
+	bench_rename_path(name, "a", -1, key);
+	bench_rename_path(name, "b", -1, newkey);
+	bad |= kvfs_rename_impl(key, newkey) != 0;
+	dir = bench_now() - start;
+
+	bench_rename_path(name, "b", children - 1, key);
+	bad |= kvfs_getattr_impl(key, &st) != 0;
+	bench_rename_path(name, "a", 0, key);
+	bad |= kvfs_getattr_impl(key, &st) != -ENOENT;
+
+	bench_rename_path(name, "c", -1, key);
+	kvfs_mkdir_impl(key, 0755);
+	start = bench_now();
+	for (i = 0; i < children; i++)
+	{
+		bench_rename_path(name, "b", i, key);
+		bench_rename_path(name, "c", i, newkey);
+		bad |= kvfs_rename_impl(key, newkey) != 0;
+	}
+	each = bench_now() - start;
+
+	for (i = 0; i < children; i++)
+	{
+		bench_rename_path(name, "c", i, key);
+		kvfs_unlink_impl(key);
+	}
+	bench_rename_path(name, "b", -1, key);
+	kvfs_rmdir_impl(key);
+	bench_rename_path(name, "c", -1, key);
+	kvfs_rmdir_impl(key);
+
+	printf("rename  children=%ld  directory=%.1f us  each child=%.1f ms\n",
+	       children, dir * 1e6, each * 1e3);
+	return bad;
+}
+
+static int bench_rename(long children)
+{
+	char key[KVFS_KEY_MAX];
+
+	kvfs_str2key("/", 1, key);
+	if (!kvfs_conf.index)
+	{
+		fprintf(stderr, "rename: %s was made without an index, use an empty BENCH_ROOT\n", kvfs_rootdir);
+		return 1;
+	}
+	if (children > 0)
+		return bench_rename_one(children);
+	return bench_rename_one(10) | bench_rename_one(10000);
+}
+
+///////////////////////////////////////////////////////////
+//
+// writeback: append 100-byte records to one file through write(),
+// with the write-back cache off and then on (KVFS_WRITEBACK_BYTES, or
+// 128 KiB), and report records/sec, backing writes and amplification.
+//
+#define BENCH_WB_RECORD	100
+
+static double bench_writeback_run(long records, uint64_t *backing)
+{
+	struct fuse_file_info fi;
+	char key[KVFS_KEY_MAX], record[BENCH_WB_RECORD];
+	uint64_t before = __atomic_load_n(&kvfs_wb_stats.backing_writes, __ATOMIC_RELAXED);
+	double start;
+	long i;
+
+	memset(record, 'k', sizeof(record));
+	kvfs_str2key("/wb", 3, key);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0)
+		return -1;
+
+	start = bench_now();
+	for (i = 0; i < records; i++)
+		if (kvfs_write_impl(key, record, sizeof(record), i * sizeof(record), &fi) != sizeof(record))
+			return -1;
+	if (kvfs_flush_impl(key, &fi) < 0)
+		return -1;
+	kvfs_release_impl(key, &fi);
+	start = bench_now() - start;
+
+	*backing = kvfs_conf.wb_bytes ? __atomic_load_n(&kvfs_wb_stats.backing_writes, __ATOMIC_RELAXED) - before : records;
+	kvfs_unlink_impl(key);
+	return records / start;
+}
+
+static int bench_writeback(long records)
+{
+	uint64_t off_writes, on_writes;
+	double off, on;
+	size_t bytes;
+	char key[KVFS_KEY_MAX];
+
+	kvfs_str2key("/", 1, key);
+	bytes = kvfs_conf.wb_bytes ? kvfs_conf.wb_bytes : 128 << 10;
+
+	kvfs_conf.wb_bytes = 0;
+	off = bench_writeback_run(records, &off_writes);
+	kvfs_conf.wb_bytes = bytes;
+	kvfs_wb_init();
+	on = bench_writeback_run(records, &on_writes);
+	if (off < 0 || on < 0)
+	{
+		perror("writeback");
+		return 1;
+	}
+
+	printf("writeback  records=%ld x %d B  buffer=%zu  off=%.0f records/sec (%llu writes)  "
+	       "on=%.0f records/sec (%llu writes)  speedup=%.2fx  amplification=%.4f\n",
+	       records, BENCH_WB_RECORD, bytes, off, (unsigned long long) off_writes,
+	       on, (unsigned long long) on_writes, on / off,
+	       (double) kvfs_wb_stats.backing_bytes / kvfs_wb_stats.bytes);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// readahead: read a file of MiB MiB through read() in 128 KiB
+// requests sequentially, in 128 KiB strides 1 MiB apart, and at
+// random 4 KiB offsets, with read-ahead off and then on
+// (KVFS_READAHEAD, or 1 MiB), and report MiB/sec and the page cache
+// hit rate.  The backing file is dropped from the kernel's cache
+// before every pass; BENCH_READ_DELAY_US adds latency on top.
+//
+#define BENCH_RA_REQUEST	(128 << 10)
+
+static double bench_readahead_run(const char *key, long mib, int pattern, double *hit_rate)
+{
+	struct fuse_file_info fi;
+	static char buf[BENCH_RA_REQUEST];
+	uint64_t served = __atomic_load_n(&kvfs_ra_stats.served, __ATOMIC_RELAXED);
+	uint64_t missed = __atomic_load_n(&kvfs_ra_stats.missed, __ATOMIC_RELAXED);
+	off_t size = mib << 20, off;
+	size_t len;
+	double start;
+	long i, n, bytes = 0;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if (kvfs_open_impl(key, &fi) < 0)
+		return -1;
+	posix_fadvise(fi.fh, 0, 0, POSIX_FADV_DONTNEED);
+	kvfs_pcache_invalidate(key, 0, 0);
+
+	n = pattern == 1 ? size >> 20 : size / BENCH_RA_REQUEST;
+	if (pattern == 2)
+		n *= 4;
+	len = pattern == 2 ? 4096 : BENCH_RA_REQUEST;
+	srandom(1);
+	start = bench_now();
+	for (i = 0; i < n; i++)
+	{
+		if (pattern == 0)
+			off = i * (off_t) BENCH_RA_REQUEST;
+		else if (pattern == 1)
+			off = i * (off_t) (1 << 20);
+		else
+			off = (random() % (size / 4096)) * 4096;
+		if (kvfs_read_impl(key, buf, len, off, &fi) != (int) len)
+			return -1;
+		bytes += len;
+	}
+	start = bench_now() - start;
+	kvfs_release_impl(key, &fi);
+
+	served = __atomic_load_n(&kvfs_ra_stats.served, __ATOMIC_RELAXED) - served;
+	missed = __atomic_load_n(&kvfs_ra_stats.missed, __ATOMIC_RELAXED) - missed;
+	*hit_rate = served + missed ? (double) served / (served + missed) : 0;
+	return bytes / start / (1 << 20);
+}
+
+static int bench_readahead(long mib)
+{
+	static const char *patterns[] = { "sequential", "strided", "random" };
+	struct fuse_file_info fi;
+	static char buf[1 << 20];
+	char key[KVFS_KEY_MAX];
+	uint64_t prefetched = 0, wasted = 0;
+	double off, on, hits;
+	size_t window;
+	long i;
+
+	if (kvfs_conf.ra_bytes == 0)
+	{
+		kvfs_conf.ra_bytes = 1 << 20;
+		kvfs_ra_init();
+	}
+	window = kvfs_conf.ra_bytes;
+
+	kvfs_str2key("/ra", 3, key);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+	memset(buf, 'k', sizeof(buf));
+	if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0)
+	{
+		perror("readahead");
+		return 1;
+	}
+	for (i = 0; i < mib; i++)
+		if (kvfs_write_impl(key, buf, sizeof(buf), i << 20, &fi) != sizeof(buf))
+		{
+			perror("readahead");
+			return 1;
+		}
+	kvfs_fsync_impl(key, 0, &fi);
+	kvfs_release_impl(key, &fi);
+
+	for (i = 0; i < 3; i++)
+	{
+		kvfs_pcache_on = 0;
+		off = bench_readahead_run(key, mib, i, &hits);
+		kvfs_pcache_on = 1;
+		on = bench_readahead_run(key, mib, i, &hits);
+		if (off < 0 || on < 0)
+		{
+			perror("readahead");
+			return 1;
+		}
+		printf("readahead  %-10s  file=%ld MiB  window=%zu  off=%.1f MiB/sec  on=%.1f MiB/sec  "
+		       "speedup=%.2fx  hit_rate=%.4f\n",
+		       patterns[i], mib, window, off, on, on / off, hits);
+	}
+	for (i = 0; i < KVFS_PCACHE_STRIPES; i++)
+	{
+		pthread_mutex_lock(&kvfs_pcache[i].lock);
+		prefetched += kvfs_pcache[i].prefetched;
+		wasted += kvfs_pcache[i].wasted;
+		pthread_mutex_unlock(&kvfs_pcache[i].lock);
+	}
+	printf("readahead  prefetched_blocks=%llu  wasted_blocks=%llu  dropped=%llu\n",
+	       (unsigned long long) prefetched, (unsigned long long) wasted,
+	       (unsigned long long) __atomic_load_n(&kvfs_ra_stats.dropped, __ATOMIC_RELAXED));
+	kvfs_unlink_impl(key);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// pack: create (create+write+release), read (open+read+release) and
+// delete objects of 1 KiB to 64 KiB with packing off and then on
+// (KVFS_PACK_BYTES, or 64 KiB), and report ops/sec for each and the
+// disk blocks and inodes the root uses once they are all written.
+//
+static uint64_t bench_du_bytes;
+static long bench_du_files;
+
+static int bench_du_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if (flag == FTW_F && strstr(path, "/.kvfs_index") == NULL)
+	{
+		bench_du_bytes += (uint64_t) st->st_blocks * 512;
+		bench_du_files++;
+	}
+	return 0;
+}
+
+static void bench_du(void)
+{
+	bench_du_bytes = 0;
+	bench_du_files = 0;
+	nftw(bench_state.rootdir, bench_du_one, 64, FTW_PHYS);
+}
+
+static int bench_pack_run(long objects, size_t size, double rate[3])
+{
+	struct fuse_file_info fi;
+	static char buf[1 << 16];
+	char name[64], key[KVFS_KEY_MAX];
+	double start;
+	long i;
+	int op;
+
+	memset(buf, 'k', sizeof(buf));
+	for (op = 0; op < 3; op++)
+	{
+		if (op == 2)
+			bench_du();
+		start = bench_now();
+		for (i = 0; i < objects; i++)
+		{
+			snprintf(name, sizeof(name), "/pk%ld", i);
+			kvfs_str2key(name, strlen(name), key);
+			memset(&fi, 0, sizeof(fi));
+			if (op == 2)
+			{
+				if (kvfs_unlink_impl(key) < 0)
+					return -1;
+				continue;
+			}
+			fi.flags = op == 0 ? O_WRONLY | O_CREAT | O_EXCL : O_RDONLY;
+			if ((op == 0 ? kvfs_create_impl(key, S_IFREG | 0644, &fi) : kvfs_open_impl(key, &fi)) < 0)
+				return -1;
+			if ((op == 0 ? kvfs_write_impl(key, buf, size, 0, &fi) : kvfs_read_impl(key, buf, size, 0, &fi)) != (int) size)
+				return -1;
+			if (kvfs_release_impl(key, &fi) < 0)
+				return -1;
+		}
+		rate[op] = objects / (bench_now() - start);
+	}
+	return 0;
+}
+
+static int bench_pack(long objects)
+{
+	static const size_t sizes[] = { 1 << 10, 4 << 10, 16 << 10, 64 << 10 };
+	double rate[2][3];
+	uint64_t bytes[2];
+	long files[2];
+	char key[KVFS_KEY_MAX];
+	size_t i;
+	int on;
+
+	kvfs_str2key("/", 1, key);
+	if (!kvfs_conf.index)
+	{
+		fprintf(stderr, "pack: %s has no namespace index\n", bench_state.rootdir);
+		return 1;
+	}
+	if (kvfs_conf.pack_bytes == 0)
+	{
+		kvfs_conf.pack_bytes = 64 << 10;
+		kvfs_pack_init();
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		for (on = 0; on < 2; on++)
+		{
+			kvfs_pack_on = on;
+			if (bench_pack_run(objects, sizes[i], rate[on]) < 0)
+			{
+				perror("pack");
+				return 1;
+			}
+			bytes[on] = bench_du_bytes;
+			files[on] = bench_du_files;
+		}
+		printf("pack  size=%zu  objects=%ld  create off=%.0f on=%.0f ops/sec  read off=%.0f on=%.0f ops/sec  "
+		       "delete off=%.0f on=%.0f ops/sec  disk off=%.1f on=%.1f MiB  files off=%ld on=%ld\n",
+		       sizes[i], objects, rate[0][0], rate[1][0], rate[0][1], rate[1][1], rate[0][2], rate[1][2],
+		       bytes[0] / 1048576.0, bytes[1] / 1048576.0, files[0], files[1]);
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// meta: create, look up, list, rename and unlink files in one
+// directory on each index backend (KVFS_BACKEND), and report ops/sec
+// for each and the files and bytes (st_size: a short symlink takes
+// no blocks, only an inode) the index takes.  A root keeps the backend it
+// was made with and kvfs_init() runs once per process, so each backend
+// gets its own process and its own fresh root under BENCH_ROOT.  The
+// path cache is off, so every lookup goes to the index.
+//
+static const char *bench_meta_dir;
+static uint64_t bench_meta_bytes;
+static long bench_meta_files;
+
+static int bench_meta_du(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if ((flag == FTW_F || flag == FTW_SL) && strstr(path, bench_meta_dir) != NULL)
+	{
+		bench_meta_bytes += st->st_size;
+		bench_meta_files++;
+	}
+	return 0;
+}
+
+static int bench_meta_run(long files)
+{
+	struct fuse_file_info fi;
+	struct stat st;
+	char name[64], newname[64], key[KVFS_KEY_MAX], newkey[KVFS_KEY_MAX];
+	double start, rate[5];
+	long i, entries = 0;
+	int bad = 0;
+
+	kvfs_str2key("/m", 2, key);
+	if (!kvfs_conf.index || kvfs_mkdir_impl(key, 0755) < 0)
+	{
+		fprintf(stderr, "meta: %s is not a fresh root\n", bench_state.rootdir);
+		return 1;
+	}
+
+	start = bench_now();
+	for (i = 0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "/m/f%ld", i);
+		kvfs_str2key(name, strlen(name), key);
+		bad |= kvfs_mknod_impl(key, S_IFREG | 0644, 0) < 0;
+	}
+	rate[0] = files / (bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "/m/f%ld", (i * 7919) % files);
+		kvfs_str2key(name, strlen(name), key);
+		bad |= kvfs_getattr_impl(key, &st) < 0;
+	}
+	rate[1] = files / (bench_now() - start);
+
+	kvfs_str2key("/m", 2, key);
+	memset(&fi, 0, sizeof(fi));
+	start = bench_now();
+	kvfs_opendir_impl(key, &fi);
+	kvfs_readdir_impl(key, &entries, bench_index_fill, 0, &fi);
+	kvfs_releasedir_impl(key, &fi);
+	rate[2] = entries / (bench_now() - start);
+	bad |= entries - 2 != files;
+
+	start = bench_now();
+	for (i = 0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "/m/f%ld", i);
+		snprintf(newname, sizeof(newname), "/m/g%ld", i);
+		kvfs_str2key(name, strlen(name), key);
+		kvfs_str2key(newname, strlen(newname), newkey);
+		bad |= kvfs_rename_impl(key, newkey) < 0;
+	}
+	rate[3] = files / (bench_now() - start);
+
+	bench_meta_dir = kvfs_conf.backend == kvfs_find_backend("lsm") ? "/" KVFS_LSM "/" : "/" KVFS_INDEX "/";
+	nftw(bench_state.rootdir, bench_meta_du, 64, FTW_PHYS);
+
+	start = bench_now();
+	for (i = 0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "/m/g%ld", i);
+		kvfs_str2key(name, strlen(name), key);
+		bad |= kvfs_unlink_impl(key) < 0;
+	}
+	rate[4] = files / (bench_now() - start);
+
+	printf("meta  backend=%s  files=%ld  create=%.0f  stat=%.0f  list=%.0f  rename=%.0f  unlink=%.0f ops/sec  index=%ld files %.1f MiB\n",
+	       kvfs_conf.backend->name, files, rate[0], rate[1], rate[2], rate[3], rate[4],
+	       bench_meta_files, bench_meta_bytes / 1048576.0);
+	return bad;
+}
+
+static int bench_meta(long files)
+{
+	static const char *backends[] = { "passthrough", "lsm" };
+	char root[PATH_MAX];
+	size_t i;
+	pid_t pid;
+	int status, bad = 0;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+	{
+		snprintf(root, sizeof(root), "%s/meta-%s", bench_state.rootdir, backends[i]);
+		if (mkdir(root, 0755) < 0)
+		{
+			fprintf(stderr, "meta: %s: %s, use an empty BENCH_ROOT\n", root, strerror(errno));
+			return 1;
+		}
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0)
+		{
+			bench_state.rootdir = root;
+			setenv("KVFS_BACKEND", backends[i], 1);
+			setenv("KVFS_DCACHE_BYTES", "0", 1);
+			setenv("KVFS_ATTR_TIMEOUT", "0", 1);
+			exit(bench_meta_run(files));
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			bad = 1;
+	}
+	return bad;
+}
+
+///////////////////////////////////////////////////////////
+//
+// compress: for text, binary and incompressible data, the speed of
+// each codec alone on KVFS_COMPRESS_BLOCK blocks and the ratio it
+// gets, then a file of that data written (create+write+release, which
+// compresses it) and read back sequentially through kvfs with
+// compression off and with each codec.
+//
+#ifdef HAVE_SYS_XATTR_H
+static const char *bench_words[] = {
+	"the", "of", "and", "a", "to", "in", "is", "that", "for", "it", "file", "key", "value",
+	"store", "block", "read", "write", "index", "kvfs", "backing", "handle", "when", "which",
+	"with", "compressed", "directory", "returns", "error", "cache", "size",
+};
+
+// Fill buf with data of a kind: 0 text, 1 binary records, 2 random.
+static void bench_compress_fill(char *buf, size_t size, int kind)
+{
+	uint64_t x = 88172645463325252ULL;
+	size_t i = 0, n;
+
+	while (i < size)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		if (kind == 0)
+		{
+			const char *w = bench_words[x % (sizeof(bench_words) / sizeof(bench_words[0]))];
+
+			n = strlen(w);
+			if (n > size - i)
+				n = size - i;
+			memcpy(buf + i, w, n);
+			i += n;
+			if (i < size)
+				buf[i++] = (x >> 40) % 11 == 0 ? '\n' : ' ';
+		}
+		else if (kind == 1)
+		{
+			// A record: sequence number, small counters, a flag word.
+			uint32_t rec[8] = { (uint32_t) (i / 32), (uint32_t) (x % 100), 0, (uint32_t) (x >> 60),
+					    1, 0, (uint32_t) (i / 4096), 0xffffffff };
+
+			n = size - i < sizeof(rec) ? size - i : sizeof(rec);
+			memcpy(buf + i, rec, n);
+			i += n;
+		}
+		else
+		{
+			n = size - i < sizeof(x) ? size - i : sizeof(x);
+			memcpy(buf + i, &x, n);
+			i += n;
+		}
+	}
+}
+
+// Compress and decompress data block by block as kvfs_z_compress()
+// does, blocks that don't shrink staying as they are (and copied as
+// they are on the way back); MiB/s each way.
+static int bench_compress_codec(int codec, const char *data, size_t size, double *pack, double *unpack, size_t *out)
+{
+	size_t bs = (size_t) 1 << kvfs_z_shift, off;
+	char *z = malloc(size), *back = malloc(bs);
+	int *lens = malloc((size / bs + 1) * sizeof(*lens));
+	double start;
+	int len;
+	long i;
+
+	if (z == NULL || back == NULL || lens == NULL)
+		return -1;
+	*out = 0;
+	start = bench_now();
+	for (off = 0, i = 0; off < size; off += bs, i++)
+	{
+		len = size - off < bs ? size - off : bs;
+		lens[i] = kvfs_z_pack(codec, data + off, len, z + *out, len - 1);
+		if (lens[i] < 0)
+			lens[i] = 0;
+		*out += lens[i] ? (size_t) lens[i] : (size_t) len;
+	}
+	*pack = size / (bench_now() - start) / 1048576;
+
+	start = bench_now();
+	for (off = 0, i = 0, *out = 0; off < size; off += bs, i++)
+	{
+		len = size - off < bs ? size - off : bs;
+		if (lens[i] == 0)
+			memcpy(back, data + off, len);
+		else if (kvfs_z_unpack(codec, z + *out, lens[i], back, bs) != len || memcmp(back, data + off, len) != 0)
+			return -1;
+		*out += lens[i] ? (size_t) lens[i] : (size_t) len;
+	}
+	*unpack = size / (bench_now() - start) / 1048576;
+	free(z);
+	free(back);
+	free(lens);
+	return 0;
+}
+
+// Write data as a file and read it back; MiB/s each way.
+static int bench_compress_file(const char *data, size_t size, double *write, double *read, uint64_t *disk)
+{
+	static char buf[128 << 10];
+	struct fuse_file_info fi;
+	char key[KVFS_KEY_MAX];
+	struct stat st;
+	double start;
+	size_t off, len;
+
+	kvfs_str2key("/z", 2, key);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+	start = bench_now();
+	if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0)
+		return -1;
+	for (off = 0; off < size; off += len)
+	{
+		len = size - off < sizeof(buf) ? size - off : sizeof(buf);
+		if (kvfs_write_impl(key, data + off, len, off, &fi) != (int) len)
+			return -1;
+	}
+	if (kvfs_release_impl(key, &fi) < 0 || kvfs_getattr_impl(key, &st) < 0)
+		return -1;
+	*write = size / (bench_now() - start) / 1048576;
+	*disk = (uint64_t) st.st_blocks * 512;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	start = bench_now();
+	if (kvfs_open_impl(key, &fi) < 0)
+		return -1;
+	for (off = 0; off < size; off += len)
+	{
+		len = size - off < sizeof(buf) ? size - off : sizeof(buf);
+		if (kvfs_read_impl(key, buf, len, off, &fi) != (int) len || memcmp(buf, data + off, len) != 0)
+			return -1;
+	}
+	kvfs_release_impl(key, &fi);
+	*read = size / (bench_now() - start) / 1048576;
+	return 0;
+}
+
+static int bench_compress(long mib)
+{
+	static const char *kinds[] = { "text", "binary", "random" };
+	size_t size = (size_t) mib << 20, out = 1;
+	double pack = 0, unpack = 0, write, read;
+	uint64_t disk;
+	char key[KVFS_KEY_MAX], *data;
+	int kind, codec, codecs = 2;
+
+#ifdef HAVE_ZLIB_H
+	codecs = 3;
+#endif
+	// The compression directory is made when kvfs starts with a codec.
+	setenv("KVFS_COMPRESS", "lz4", 0);
+	kvfs_str2key("/z", 2, key);
+	if (!kvfs_z_read_on || (data = malloc(size)) == NULL)
+	{
+		fprintf(stderr, "compress: can't set up compression in %s\n", bench_state.rootdir);
+		return 1;
+	}
+
+	for (kind = 0; kind < 3; kind++)
+	{
+		bench_compress_fill(data, size, kind);
+		for (codec = 0; codec < codecs; codec++)
+		{
+			kvfs_z_codec = codec;
+			kvfs_z_on = codec != 0;
+			if (codec != 0 && bench_compress_codec(codec, data, size, &pack, &unpack, &out) < 0)
+			{
+				fprintf(stderr, "compress: %s does not round-trip\n", kvfs_z_codecs[codec]);
+				return 1;
+			}
+			if (bench_compress_file(data, size, &write, &read, &disk) < 0)
+			{
+				perror("compress");
+				return 1;
+			}
+			if (codec == 0)
+				printf("compress  data=%s  codec=off  MiB=%ld  write=%.0f  read=%.0f MiB/s  disk=%.1f MiB\n",
+				       kinds[kind], mib, write, read, disk / 1048576.0);
+			else
+				printf("compress  data=%s  codec=%s  MiB=%ld  block=%zu  compress=%.0f  decompress=%.0f MiB/s  ratio=%.2f  "
+				       "write=%.0f  read=%.0f MiB/s  disk=%.1f MiB\n",
+				       kinds[kind], kvfs_z_codecs[codec], mib, (size_t) 1 << kvfs_z_shift, pack, unpack,
+				       (double) size / out, write, read, disk / 1048576.0);
+		}
+	}
+	kvfs_unlink_impl(key);
+	free(data);
+	return 0;
+}
+#else
+static int bench_compress(long mib)
+{
+	fprintf(stderr, "compress: build with -DHAVE_SYS_XATTR_H\n");
+	return 1;
+}
+#endif
+
+///////////////////////////////////////////////////////////
+//
+// opstats: what counting every operation (KVFS_OP_STATS) adds to the
+// cheapest one there is, a getattr answered by the attribute cache,
+// and what formatting the counts for .kvfs_stats costs.
+//
+static int bench_opstats(long iterations)
+{
+	struct fuse_file_info fi;
+	struct stat st;
+	char key[KVFS_KEY_MAX], *report;
+	double start, off, on;
+	size_t len;
+	long i;
+
+	kvfs_str2key("/ops", 4, key);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY | O_CREAT;
+	if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0 || kvfs_release_impl(key, &fi) < 0 ||
+	    kvfs_getattr_impl(key, &st) < 0)
+	{
+		perror("opstats");
+		return 1;
+	}
+
+	kvfs_op_on = 0;
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		kvfs_getattr_impl(key, &st);
+	off = bench_now() - start;
+
+	kvfs_op_on = 1;
+	start = bench_now();
+	for (i = 0; i < iterations; i++)
+		kvfs_getattr_impl(key, &st);
+	on = bench_now() - start;
+
+	start = bench_now();
+	report = kvfs_op_report(&len);
+	start = bench_now() - start;
+	free(report);
+	kvfs_unlink_impl(key);
+
+	printf("opstats  iterations=%ld  getattr off=%.1f on=%.1f ns/call  overhead=%.1f ns/call  report=%zu bytes in %.1f us\n",
+	       iterations, off * 1e9 / iterations, on * 1e9 / iterations, (on - off) * 1e9 / iterations, len, start * 1e6);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// fdcache: open, read 4 KiB from and release each of files small
+// files in turn, as a server re-reading hot files does, with the
+// backing fd cache off and then on (KVFS_FD_CACHE, or room for all of
+// them), and report the time per open/read/release and the hit rate.
+//
+#define BENCH_FDC_PASSES	20
+
+static double bench_fdcache_run(char (*keys)[KVFS_KEY_MAX], long files)
+{
+	struct fuse_file_info fi;
+	char buf[4096];
+	double start;
+	long i, pass;
+
+	start = bench_now();
+	for (pass = 0; pass < BENCH_FDC_PASSES; pass++)
+		for (i = 0; i < files; i++)
+		{
+			memset(&fi, 0, sizeof(fi));
+			fi.flags = O_RDONLY;
+			if (kvfs_open_impl(keys[i], &fi) < 0 || kvfs_read_impl(keys[i], buf, sizeof(buf), 0, &fi) < 0 ||
+			    kvfs_release_impl(keys[i], &fi) < 0)
+				return -1;
+		}
+	return (bench_now() - start) * 1e9 / (BENCH_FDC_PASSES * files);
+}
+
+static int bench_fdcache(long files)
+{
+	char (*keys)[KVFS_KEY_MAX], name[64], buf[4096];
+	struct fuse_file_info fi;
+	uint64_t hits = 0, misses = 0;
+	double off, on;
+	size_t entries;
+	long i;
+	int s;
+
+	kvfs_str2key("/", 1, name);	// runs kvfs_init()
+	entries = kvfs_conf.fd_cache ? kvfs_conf.fd_cache : (size_t) files * 2;
+	if ((keys = malloc(files * sizeof(*keys))) == NULL)
+		return 1;
+	memset(buf, 'f', sizeof(buf));
+	for (i = 0; i < files; i++)
+	{
+		snprintf(name, sizeof(name), "/fdc%ld", i);
+		kvfs_str2key(name, strlen(name), keys[i]);
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+		if (kvfs_create_impl(keys[i], S_IFREG | 0644, &fi) < 0 ||
+		    kvfs_write_impl(keys[i], buf, sizeof(buf), 0, &fi) < 0 || kvfs_release_impl(keys[i], &fi) < 0)
+		{
+			perror("fdcache");
+			return 1;
+		}
+	}
+
+	kvfs_conf.fd_cache = 0;
+	off = bench_fdcache_run(keys, files);
+	kvfs_conf.fd_cache = entries;
+	kvfs_fdc_init();
+	on = bench_fdcache_run(keys, files);
+	if (off < 0 || on < 0)
+	{
+		perror("fdcache");
+		return 1;
+	}
+	for (s = 0; s < KVFS_FDC_STRIPES; s++)
+	{
+		hits += kvfs_fdc[s].hits;
+		misses += kvfs_fdc[s].misses;
+	}
+	for (i = 0; i < files; i++)
+		kvfs_unlink_impl(keys[i]);
+	free(keys);
+
+	printf("fdcache  files=%ld  entries=%zu  off=%.0f  on=%.0f ns per open/read/release  speedup=%.2fx  hit_rate=%.4f\n",
+	       files, kvfs_conf.fd_cache, off, on, off / on, hits + misses ? (double) hits / (hits + misses) : 0.0);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// mmap: random 4 KiB reads through read-only handles on 64 files of
+// 64 KiB, with mapping (KVFS_MMAP_BYTES) off and then on, and the
+// time to open and release a handle of a file other handles have
+// mapped.  A pread through BENCH_READ_DELAY_US is slower still; a
+// mapping of a file in the kernel's cache is not.
+//
+#define BENCH_MM_FILES		64
+#define BENCH_MM_SIZE		(64 << 10)
+#define BENCH_MM_READ		4096
+
+static double bench_mmap_run(char (*keys)[KVFS_KEY_MAX], long reads, double *open_ns)
+{
+	struct fuse_file_info fi[BENCH_MM_FILES], extra;
+	char buf[BENCH_MM_READ];
+	unsigned int seed = 1;
+	double start, elapsed;
+	long i;
+	int f;
+
+	for (f = 0; f < BENCH_MM_FILES; f++)
+	{
+		memset(&fi[f], 0, sizeof(fi[f]));
+		fi[f].flags = O_RDONLY;
+		if (kvfs_open_impl(keys[f], &fi[f]) < 0)
+			return -1;
+	}
+
+	start = bench_now();
+	for (i = 0; i < reads; i++)
+	{
+		f = rand_r(&seed) % BENCH_MM_FILES;
+		if (kvfs_read_impl(keys[f], buf, sizeof(buf), rand_r(&seed) % (BENCH_MM_SIZE / 512) * 512,
+				   &fi[f]) < 0)
+			return -1;
+	}
+	elapsed = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < reads / 100; i++)
+	{
+		memset(&extra, 0, sizeof(extra));
+		extra.flags = O_RDONLY;
+		if (kvfs_open_impl(keys[i % BENCH_MM_FILES], &extra) < 0 ||
+		    kvfs_release_impl(keys[i % BENCH_MM_FILES], &extra) < 0)
+			return -1;
+	}
+	*open_ns = (bench_now() - start) * 1e9 / (reads / 100);
+
+	for (f = 0; f < BENCH_MM_FILES; f++)
+		kvfs_release_impl(keys[f], &fi[f]);
+	return elapsed * 1e9 / reads;
+}
+
+static int bench_mmap(long reads)
+{
+	char keys[BENCH_MM_FILES][KVFS_KEY_MAX], name[64], *data;
+	struct fuse_file_info fi;
+	double off, on, off_open, on_open;
+	int f;
+
+	kvfs_str2key("/", 1, name);	// runs kvfs_init()
+	if (reads < 100 || (data = malloc(BENCH_MM_SIZE)) == NULL)
+		return 1;
+	memset(data, 'm', BENCH_MM_SIZE);
+	for (f = 0; f < BENCH_MM_FILES; f++)
+	{
+		snprintf(name, sizeof(name), "/mm%d", f);
+		kvfs_str2key(name, strlen(name), keys[f]);
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+		if (kvfs_create_impl(keys[f], S_IFREG | 0644, &fi) < 0 ||
+		    kvfs_write_impl(keys[f], data, BENCH_MM_SIZE, 0, &fi) < 0 || kvfs_release_impl(keys[f], &fi) < 0)
+		{
+			perror("mmap");
+			return 1;
+		}
+	}
+	free(data);
+
+	kvfs_mm_on = 0;
+	off = bench_mmap_run(keys, reads, &off_open);
+	if (kvfs_conf.mmap_bytes == 0)
+	{
+		kvfs_conf.mmap_bytes = BENCH_MM_SIZE;
+		kvfs_mm_init();
+	}
+	kvfs_mm_on = 1;
+	on = bench_mmap_run(keys, reads, &on_open);
+	if (off < 0 || on < 0)
+	{
+		perror("mmap");
+		return 1;
+	}
+	for (f = 0; f < BENCH_MM_FILES; f++)
+		kvfs_unlink_impl(keys[f]);
+
+	printf("mmap  reads=%ld x %d B  pread=%.0f  mapped=%.0f ns/read  speedup=%.2fx  "
+	       "open+release pread=%.0f  mapped=%.0f ns  maps=%llu\n",
+	       reads, BENCH_MM_READ, off, on, off / on, off_open, on_open,
+	       (unsigned long long) kvfs_mm_stats.maps);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// uring: random 4 KiB reads, then writes, of a 256 MiB file by 1 to 64
+// threads at once, each through a handle of its own, with KVFS_IO=sync
+// and uring; the thread count is the queue depth.  Reports ops/sec and
+// how many requests each io_uring_enter() carried.  BENCH_IO_COLD=1
+// drops the file from the kernel's cache before every run.
+//
+#ifdef HAVE_LINUX_IO_URING_H
+#define BENCH_IO_SIZE		((off_t) 256 << 20)
+#define BENCH_IO_BLOCK		4096
+
+struct bench_io {
+	pthread_t thread;
+	const char *key;
+	long ops;
+	int write;
+	int failed;
+};
+
+static void *bench_io_worker(void *arg)
+{
+	struct bench_io *w = arg;
+	struct fuse_file_info fi;
+	char buf[BENCH_IO_BLOCK];
+	unsigned int seed = (uintptr_t) w;
+	off_t off;
+	long i;
+
+	memset(buf, 'u', sizeof(buf));
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = w->write ? O_WRONLY : O_RDONLY;
+	if (kvfs_open_impl(w->key, &fi) < 0)
+	{
+		w->failed = 1;
+		return NULL;
+	}
+	for (i = 0; i < w->ops; i++)
+	{
+		off = (off_t) (rand_r(&seed) % (BENCH_IO_SIZE / BENCH_IO_BLOCK)) * BENCH_IO_BLOCK;
+		if ((w->write ? kvfs_write_impl(w->key, buf, sizeof(buf), off, &fi)
+			      : kvfs_read_impl(w->key, buf, sizeof(buf), off, &fi)) != sizeof(buf))
+			w->failed = 1;
+	}
+	kvfs_release_impl(w->key, &fi);
+	return NULL;
+}
+
+static double bench_io_run(const char *key, int threads, long ops, int write)
+{
+	struct bench_io workers[64];
+	struct fuse_file_info fi;
+	double start;
+	int i, failed = 0;
+
+	// BENCH_IO_COLD=1 starts every run with the file out of the
+	// kernel's cache, so reads go to the disk.
+	if (getenv("BENCH_IO_COLD") != NULL)
+	{
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_RDONLY;
+		if (kvfs_open_impl(key, &fi) == 0)
+		{
+			fdatasync(fi.fh);
+			posix_fadvise(fi.fh, 0, 0, POSIX_FADV_DONTNEED);
+			kvfs_release_impl(key, &fi);
+		}
+	}
+	start = bench_now();
+	for (i = 0; i < threads; i++)
+	{
+		workers[i].key = key;
+		workers[i].ops = ops / threads;
+		workers[i].write = write;
+		workers[i].failed = 0;
+		pthread_create(&workers[i].thread, NULL, bench_io_worker, &workers[i]);
+	}
+	for (i = 0; i < threads; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		failed |= workers[i].failed;
+	}
+	return failed ? -1 : ops / threads * threads / (bench_now() - start);
+}
+
+static int bench_uring(long ops)
+{
+	static const int depths[] = { 1, 8, 32, 64 };
+	struct fuse_file_info fi;
+	char key[KVFS_KEY_MAX], *data;
+	double rate[2][2];
+	uint64_t requests, enters;
+	int d, write, engine;
+	off_t off;
+
+	setenv("KVFS_IO", "uring", 0);
+	kvfs_str2key("/io", 3, key);	// runs kvfs_init()
+	if (!kvfs_io_on || (data = malloc(1 << 20)) == NULL)
+	{
+		fprintf(stderr, "uring: no io_uring here\n");
+		return 1;
+	}
+	memset(data, 'i', 1 << 20);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if (kvfs_create_impl(key, S_IFREG | 0644, &fi) < 0)
+		return 1;
+	for (off = 0; off < BENCH_IO_SIZE; off += 1 << 20)
+		if (kvfs_write_impl(key, data, 1 << 20, off, &fi) != 1 << 20)
+			return 1;
+	kvfs_release_impl(key, &fi);
+	free(data);
+
+	for (d = 0; d < (int) (sizeof(depths) / sizeof(depths[0])); d++)
+	{
+		requests = kvfs_io_stats.requests;
+		enters = kvfs_io_stats.enters;
+		for (write = 0; write < 2; write++)
+			for (engine = 0; engine < 2; engine++)
+			{
+				kvfs_io_on = engine;
+				rate[write][engine] = bench_io_run(key, depths[d], ops, write);
+				if (rate[write][engine] < 0)
+				{
+					perror("uring");
+					return 1;
+				}
+			}
+		requests = kvfs_io_stats.requests - requests;
+		enters = kvfs_io_stats.enters - enters;
+		printf("uring  depth=%d  ops=%ld x %d B  randread sync=%.0f uring=%.0f ops/sec (%.2fx)  "
+		       "randwrite sync=%.0f uring=%.0f ops/sec (%.2fx)  per_enter=%.2f\n",
+		       depths[d], ops, BENCH_IO_BLOCK, rate[0][0], rate[0][1], rate[0][1] / rate[0][0],
+		       rate[1][0], rate[1][1], rate[1][1] / rate[1][0], enters ? (double) requests / enters : 0.0);
+	}
+	kvfs_unlink_impl(key);
+	return 0;
+}
+#else
+static int bench_uring(long ops)
+{
+	fprintf(stderr, "uring: build with -DHAVE_LINUX_IO_URING_H\n");
+	return 1;
+}
+#endif
+
+///////////////////////////////////////////////////////////
+//
+// batch: put, stat, chmod and unlink files files one call at a time,
+// each translating its path as the FUSE wrappers do, and then as one
+// batch per step through .kvfs_batch, written in 128 KiB pieces as
+// the kernel would, with KVFS_BATCH_THREADS 1 and 4.  In-process a
+// batch saves no FUSE round trips, which is what it is for on a mount
+// ("bench/bench.sh batch"); this shows what parsing costs and what
+// running the items on several threads gains.
+//
+#define BENCH_BATCH_WRITE	(128 << 10)
+
+static const char *bench_batch_ops[] = { "put 0644", "stat", "chmod 0600", "unlink" };
+
+static double bench_batch_calls(long files)
+{
+	struct fuse_file_info fi;
+	struct stat st;
+	char name[64], key[KVFS_KEY_MAX];
+	double start;
+	long i;
+	int op, result = 0;
+
+	start = bench_now();
+	for (op = 0; op < 4; op++)
+		for (i = 0; i < files; i++)
+		{
+			snprintf(name, sizeof(name), "/batch/f%ld", i);
+			kvfs_str2key(name, strlen(name), key);
+			if (op == 0)
+			{
+				memset(&fi, 0, sizeof(fi));
+				fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+				result = kvfs_create_impl(key, S_IFREG | 0644, &fi);
+				if (result == 0)
+					result = kvfs_release_impl(key, &fi);
+			}
+			else if (op == 1)
+				result = kvfs_getattr_impl(key, &st);
+			else if (op == 2)
+				result = kvfs_chmod_impl(key, 0600);
+			else
+				result = kvfs_unlink_impl(key);
+			if (result < 0)
+				return -1;
+		}
+	return (bench_now() - start) * 1e9 / (4 * files);
+}
+
+static double bench_batch_run(long files, char *in, char *out, size_t size)
+{
+	struct fuse_file_info fi;
+	char key[KVFS_KEY_MAX];
+	size_t len, off;
+	double start;
+	long i;
+	int op, n;
+
+	kvfs_str2key(KVFS_BATCH_FILE, strlen(KVFS_BATCH_FILE), key);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	start = bench_now();
+	if (kvfs_open_impl(key, &fi) < 0)
+		return -1;
+	for (op = 0; op < 4; op++)
+	{
+		for (i = 0, len = 0; i < files; i++)
+			len += snprintf(in + len, size - len, "%s /batch/f%ld\n", bench_batch_ops[op], i);
+		for (off = 0; off < len; off += n)
+			if ((n = kvfs_write_impl(key, in + off, len - off < BENCH_BATCH_WRITE ? len - off : BENCH_BATCH_WRITE,
+						 off, &fi)) <= 0)
+				return -1;
+		for (off = 0; (n = kvfs_read_impl(key, out + off, size - off, off, &fi)) > 0; off += n)
+			;
+		out[off] = '\0';
+		if (n < 0 || out[0] == '-' || strstr(out, "\n-") != NULL)
+			return -1;
+	}
+	kvfs_release_impl(key, &fi);
+	return (bench_now() - start) * 1e9 / (4 * files);
+}
+
+static int bench_batch(long files)
+{
+	char key[KVFS_KEY_MAX], *in, *out;
+	size_t size = files * 64 + 1;
+	double calls, one, four;
+
+	kvfs_str2key("/batch", 6, key);
+	kvfs_mkdir_impl(key, 0755);
+	in = malloc(size);
+	out = malloc(size);
+	if (in == NULL || out == NULL)
+		return 1;
+	calls = bench_batch_calls(files);
+	kvfs_conf.batch_threads = 1;
+	one = bench_batch_run(files, in, out, size);
+	kvfs_conf.batch_threads = 4;
+	four = bench_batch_run(files, in, out, size);
+	free(in);
+	free(out);
+	if (calls < 0 || one < 0 || four < 0)
+	{
+		fprintf(stderr, "batch: an item failed\n");
+		return 1;
+	}
+	printf("batch  files=%ld  calls=%.0f  batch_threads1=%.0f  batch_threads4=%.0f ns per item  "
+	       "speedup1=%.2fx  speedup4=%.2fx\n", files, calls, one, four, calls / one, calls / four);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = 1000000;
+
+	bench_state.rootdir = getenv("BENCH_ROOT") ? getenv("BENCH_ROOT") : "/tmp/kvfs_bench_root";
+	bench_state.logfile = NULL;
+	bench_context.private_data = &bench_state;
+	if (getenv("BENCH_READ_DELAY_US"))
+		bench_read_delay = atol(getenv("BENCH_READ_DELAY_US"));
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s fullpath|hash|log|dcache|create|stress|readdir|index|rename|writeback|readahead|pack|meta|compress|opstats|fdcache|mmap|uring|batch [iterations]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		iterations = atol(argv[2]);
+
+	if (strcmp(argv[1], "fullpath") == 0)
+		return bench_fullpath(iterations);
+	if (strcmp(argv[1], "hash") == 0)
+		return bench_hash(iterations);
+	if (strcmp(argv[1], "log") == 0)
+		return bench_log(iterations);
+	if (strcmp(argv[1], "dcache") == 0)
+		return bench_dcache(iterations);
+	if (strcmp(argv[1], "create") == 0)
+		return bench_create(argc > 2 ? iterations : 20000);
+	if (strcmp(argv[1], "stress") == 0)
+		return bench_stress(argc > 2 ? iterations : 2);
+	if (strcmp(argv[1], "readdir") == 0)
+		return bench_readdir(argc > 2 ? iterations : 100000);
+	if (strcmp(argv[1], "index") == 0)
+		return bench_index(argc > 2 ? iterations : 1000);
+	if (strcmp(argv[1], "rename") == 0)
+		return bench_rename(argc > 2 ? iterations : 0);
+	if (strcmp(argv[1], "writeback") == 0)
+		return bench_writeback(argc > 2 ? iterations : 1000000);
+	if (strcmp(argv[1], "readahead") == 0)
+		return bench_readahead(argc > 2 ? iterations : 256);
+	if (strcmp(argv[1], "pack") == 0)
+		return bench_pack(argc > 2 ? iterations : 5000);
+	if (strcmp(argv[1], "meta") == 0)
+		return bench_meta(argc > 2 ? iterations : 20000);
+	if (strcmp(argv[1], "compress") == 0)
+		return bench_compress(argc > 2 ? iterations : 64);
+	if (strcmp(argv[1], "opstats") == 0)
+		return bench_opstats(iterations);
+	if (strcmp(argv[1], "fdcache") == 0)
+		return bench_fdcache(argc > 2 ? iterations : 1000);
+	if (strcmp(argv[1], "mmap") == 0)
+		return bench_mmap(iterations);
+	if (strcmp(argv[1], "uring") == 0)
+		return bench_uring(argc > 2 ? iterations : 200000);
+	if (strcmp(argv[1], "batch") == 0)
+		return bench_batch(argc > 2 ? iterations : 20000);
+
+	fprintf(stderr, "unknown benchmark \"%s\"\n", argv[1]);
+	return 1;
+}
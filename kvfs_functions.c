@@ -17,836 +17,11047 @@
 
 */
 
+// strnlen(), and later Linux-only calls, are hidden by the
+// _XOPEN_SOURCE 500 in params.h unless asked for before any header.
+#define _GNU_SOURCE
+
 #include "kvfs.h"
 #include "log.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/sysmacros.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
 ///////////////////////////////////////////////////////////
 //
-// Prototypes for all these functions, and the C-style comments,
-// come from /usr/include/fuse.h
+// Path-to-key translation
 //
-static void kvfs_fullpath(char fullpath[PATH_MAX], const char *path)
+// Every object lives in the backing store under a key, the hex hash
+// of its path.  The flat layout keeps it at rootdir/<key>; the sharded
+// layout fans keys out as rootdir/<k0k1>/<k2k3>/<key> so no backing
+// directory holds more than a sliver of the namespace.  Neither
+// rootdir nor the key of "/" changes while mounted, so both are
+// computed once, on the first operation, and kvfs_fullpath() only
+// has to copy bytes.
+//
+// The hash and the layout are recorded in rootdir/.kvfs_super the
+// first time a root is mounted, and a later mount that asks for
+// something different is refused rather than silently mixing keys.
+//
+#define KVFS_KEY_MAX	(2 * MD5_DIGEST_LENGTH + 1)
+
+#define KVFS_LAYOUT_FLAT	0
+#define KVFS_LAYOUT_SHARD	1
+
+#define KVFS_SUPER	".kvfs_super"
+
+// Made-up files at the top of the mount (see "Operation statistics"
+// and "Batches"), and the keys they get, which are not hex and so are
+// nobody else's.
+#define KVFS_STATS_FILE	"/.kvfs_stats"
+#define KVFS_STATS_KEY	".kvfs_stats"
+#define KVFS_BATCH_FILE	"/.kvfs_batch"
+#define KVFS_BATCH_KEY	".kvfs_batch"
+
+static pthread_once_t kvfs_init_once = PTHREAD_ONCE_INIT;
+static int kvfs_translated;		// kvfs_str2key() has been called
+static char kvfs_root_key[KVFS_KEY_MAX];
+static char kvfs_rootdir[PATH_MAX];
+static size_t kvfs_rootdir_len;
+
+static const char kvfs_hex[] = "0123456789abcdef";
+
+static void kvfs_key_md5(const char *str, size_t len, char *key)
 {
-	char* root_dir	= str2md5("/",1);
-	if(strcmp(path, root_dir) == 0)
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	int i;
+
+	MD5((const unsigned char *) str, len, digest);
+	for (i = 0; i < MD5_DIGEST_LENGTH; i++)
 	{
-		strcpy(fullpath, KVFS_DATA->rootdir);
-		log_msg(" accessing root...");
-		return ;
+		key[2 * i] = kvfs_hex[digest[i] >> 4];
+		key[2 * i + 1] = kvfs_hex[digest[i] & 0x0f];
 	}
-	strcpy(fullpath, KVFS_DATA->rootdir);
-	strncat(fullpath, "/", 1);
-	strncat(fullpath, path, PATH_MAX);
-	
-	log_msg("\nkvfs_fullpath:  rootdir = \"%s\", path = \"%s\", fullpath = \"%s\" : ", KVFS_DATA->rootdir, path, fullpath);
+	key[2 * i] = '\0';
 }
 
-/** Get file attributes.
- *
- * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
- * ignored.  The 'st_ino' field is ignored except if the 'use_ino'
- * mount option is given.
- */
-int kvfs_getattr_impl(const char *path, struct stat *statbuf)
+// XXH64 (seed 0).  Path keys only need to be well distributed, not
+// cryptographically strong, and this is several times cheaper than
+// MD5 on typical path lengths.
+#define XXH_P1	0x9E3779B185EBCA87ULL
+#define XXH_P2	0xC2B2AE3D27D4EB4FULL
+#define XXH_P3	0x165667B19E3779F9ULL
+#define XXH_P4	0x85EBCA77C2B2AE63ULL
+#define XXH_P5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);
-	
-	log_msg("kvfs_getattr_impl(path=\"%s\", statbuf=0x%x)\n", path, statbuf);
-	
-	result = lstat(fullpath, statbuf);
+	return (x << r) | (x >> (64 - r));
+}
 
-	if (result < 0)
-	{
-		log_msg("Error in getattr");
-		return -errno;
-	}
-	
-	return result;
+static inline uint64_t xxh_read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
 }
 
-/** Read the target of a symbolic link
- *
- * The buffer should be filled with a null terminated string.  The
- * buffer size argument includes the space for the terminating
- * null character.  If the linkname is too long to fit in the
- * buffer, it should be truncated.  The return value should be 0
- * for success.
- */
-// Note the system readlink() will truncate and lose the terminating
-// null.  So, the size passed to to the system readlink() must be one
-// less than the size passed to kvfs_readlink()
-// kvfs_readlink() code by Bernardo F Costa (thanks!)
-int kvfs_readlink_impl(const char *path, char *link, size_t size)
+static inline uint32_t xxh_read32(const unsigned char *p)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);       
-	
-	log_msg("kvfs_readlink_impl(path=\"%s\", link=\"%s\", size=%d)\n", path, link, size);
-	
-	result = readlink(fullpath, link, size - 1);
-	if (result < 0)
-	{
-		log_msg("Error in readlink");
-		return -errno;
-	}
-	link[result] = '\0';
+	uint32_t v;
 
-	//ishan:
-	//result = 0;
-	
-	return result;
+	memcpy(&v, p, sizeof(v));
+	return v;
 }
 
-/** Create a file node
- *
- * There is no create() operation, mknod() will be called for
- * creation of all non-directory, non-symlink nodes.
- */
-// shouldn't that comment be "if" there is no.... ?
-int kvfs_mknod_impl(const char *path, mode_t mode, dev_t dev)
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
 {
-        /* On Linux this could just be 'mknod(path, mode, rdev)' but this
-           is more portable */
+	acc += input * XXH_P2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_P1;
+}
 
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-	
-	log_msg("kvfs_mknod_impl(path=\"%s\", mode=0%3o, dev=%lld)\n", path, mode, dev);
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
 
-	if (S_ISFIFO(mode)) 
-	{
-		result = mkfifo(fullpath, mode);
-	} 
-	else if (S_ISREG(mode))
+static uint64_t kvfs_xxh64(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t h;
+
+	if (len >= 32)
 	{
-	        result = open(fullpath, O_CREAT | O_EXCL | O_WRONLY, mode);
-        	
-		if (result >= 0)
+		uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+
+		do
 		{
-                	result = close(result);
-		}
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
 	}
 	else
 	{
-		result = mknod(fullpath, mode, dev);
+		h = XXH_P5;
 	}
 
-	if (result < 0)
+	h += len;
+	for (; p + 8 <= end; p += 8)
+		h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+	if (p + 4 <= end)
 	{
-		log_msg("Error in mknod");
-		return -errno;
+		h = xxh_rotl(h ^ (xxh_read32(p) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+		p += 4;
 	}
+	for (; p < end; p++)
+		h = xxh_rotl(h ^ (*p * XXH_P5), 11) * XXH_P1;
 
-	return result;
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
 }
 
-/** Create a directory */
-int kvfs_mkdir_impl(const char *path, mode_t mode)
-{	
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-	
-	log_msg("kvfs_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
-	
-	result = mkdir(fullpath, mode);
+static void kvfs_key_xxh64(const char *str, size_t len, char *key)
+{
+	uint64_t h = kvfs_xxh64(str, len);
+	int i;
 
-	if (result < 0)
-	{
-		log_msg("Error in mkdir");
-		return -errno;
-	}
+	for (i = 15; i >= 0; i--, h >>= 4)
+		key[i] = kvfs_hex[h & 0x0f];
+	key[16] = '\0';
+}
 
-	return result;
+static const struct kvfs_keyfn {
+	const char *name;
+	void (*hash)(const char *str, size_t len, char *key);
+} kvfs_keyfns[] = {
+	{ "md5", kvfs_key_md5 },	// default, and what roots made before the superblock use
+	{ "xxh64", kvfs_key_xxh64 },
+	{ NULL, NULL }
+};
+
+static const char *kvfs_layouts[] = { "flat", "shard", NULL };
+
+// Where a namespace index is kept; see "Namespace index" below.
+struct kvfs_backend {
+	const char *name;	// KVFS_BACKEND=
+	const char *super;	// the superblock's "index" line
+	int (*init)(void);
+	// The value of dir/name into value, NUL-terminated.  Returns its
+	// length, or -ENOENT.
+	ssize_t (*get)(const char *dir, const char *name, char *value, size_t size);
+	int (*put)(const char *dir, const char *name, const char *value);
+	int (*del)(const char *dir, const char *name);
+	// Forget dir's list, which must be empty.
+	int (*rmdir)(const char *dir);
+	// Listing the names in dir, "." and ".." first.  readdir returns
+	// NULL at the end (errno 0) or on error, and the cookie to seekdir
+	// to for the entry after the one returned.
+	void *(*opendir)(const char *dir, const char *fullpath);
+	const char *(*readdir)(void *list, off_t *off);
+	void (*seekdir)(void *list, off_t off);
+	void (*closedir)(void *list);
+#ifdef HAVE_SYS_XATTR_H
+	int (*format)(char *buf, size_t size);
+#endif
+};
+
+// Mount-time options.  kvfs.c owns argv, so they reach this file
+// through the environment of the mounting process, e.g.
+//
+//     KVFS_LAYOUT=shard KVFS_HASH=xxh64 ./kvfs rootdir mountdir
+//
+// Options that describe the on-disk format only matter for a new
+// root; an existing root keeps what its superblock says.
+static struct {
+	int layout;
+	const struct kvfs_keyfn *keyfn;
+	uint64_t attr_timeout_ns;
+	long attr_entries;
+	size_t dcache_bytes;
+	int splice;
+	int index;
+	const struct kvfs_backend *backend;	// of the index
+	size_t wb_bytes;
+	size_t ra_bytes;
+	size_t pcache_bytes;
+	size_t pack_bytes;
+	size_t dedup_bytes;
+	size_t z_block;
+	int sync_group;
+	uint64_t sync_wait_ns;
+	size_t fd_cache;
+	size_t mmap_bytes;
+	unsigned int batch_threads;
+} kvfs_conf = { KVFS_LAYOUT_FLAT, &kvfs_keyfns[0] };
+
+static void kvfs_acache_init(void);
+static void kvfs_dcache_init(void);
+static void kvfs_ra_init(void);
+static void kvfs_wb_init(void);
+static void kvfs_io_init(void);
+static void kvfs_fdc_init(void);
+static void kvfs_mm_init(void);
+static void kvfs_mm_invalidate(const char *key);
+static const struct kvfs_backend *kvfs_find_backend(const char *name);
+static void kvfs_index_init(void);
+static void kvfs_pack_init(void);
+static void kvfs_dedup_init(void);
+static void kvfs_dedup_fixstat(const char *key, struct stat *st);
+static void kvfs_z_init(void);
+static int kvfs_z_expand(const char *key, const char *fullpath, int keep);
+static struct kvfs_zfile *kvfs_z_file(int fd);
+static void kvfs_sync_init(void);
+static int kvfs_sync(int fd, int datasync);
+static void kvfs_op_init(void);
+static void kvfs_batch_init(void);
+static int kvfs_is_batch(const char *key);
+static int kvfs_batch_open(struct fuse_file_info *fi);
+static int kvfs_batch_read(struct fuse_file_info *fi, char *buf, size_t size);
+static int kvfs_batch_write(struct fuse_file_info *fi, const char *buf, size_t size);
+static int kvfs_batch_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t size);
+static int kvfs_batch_write_buf(struct fuse_file_info *fi, struct fuse_bufvec *buf);
+static int kvfs_batch_flush(struct fuse_file_info *fi);
+static int kvfs_batch_release(struct fuse_file_info *fi);
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_pack_format(char *buf, size_t size);
+static int kvfs_dedup_format(char *buf, size_t size);
+static int kvfs_z_format(char *buf, size_t size);
+static int kvfs_index_format(char *buf, size_t size);
+static int kvfs_sync_format(char *buf, size_t size);
+static int kvfs_batch_format(char *buf, size_t size);
+#endif
+static void kvfs_index_resolve(const char *path, size_t len, char key[KVFS_KEY_MAX]);
+
+static const char *kvfs_getenv(const char *name, const char *def)
+{
+	const char *value = getenv(name);
+
+	return (value != NULL && *value != '\0') ? value : def;
 }
 
-/** Remove a file */
-int kvfs_unlink_impl(const char *path)
+///////////////////////////////////////////////////////////
+//
+// Logging
+//
+// Operations used to write every trace line straight to the log file,
+// so all FUSE workers took turns on its stdio lock.  Now each thread
+// formats into its own ring of fixed-size lines and a background
+// thread drains the rings to the file.  Nothing on the hot path
+// blocks: a thread whose ring is full drops the line and counts it.
+// The log thread sleeps until a line is queued after it last drained,
+// then gives the rest of a burst KVFS_LOG_FLUSH_MS to arrive before
+// writing it all, so an idle mount doesn't wake it at all.
+//
+// KVFS_LOG_LEVEL=off|error|info|trace picks what is logged at run
+// time (default error).  Building with -DNDEBUG compiles every trace
+// call away entirely.
+//
+#define KVFS_LOG_OFF	0
+#define KVFS_LOG_ERROR	1
+#define KVFS_LOG_INFO	2
+#define KVFS_LOG_TRACE	3
+
+#define KVFS_LOG_LINE	256	// longer lines are truncated
+#define KVFS_LOG_SLOTS	512	// lines per thread, a power of two
+#define KVFS_LOG_FLUSH_MS	20
+
+static int kvfs_log_level = KVFS_LOG_ERROR;
+
+#define kvfs_log(level, ...) \
+	do { if ((level) <= kvfs_log_level) kvfs_log_write(__VA_ARGS__); } while (0)
+#define kvfs_error(...)	kvfs_log(KVFS_LOG_ERROR, __VA_ARGS__)
+#define kvfs_info(...)	kvfs_log(KVFS_LOG_INFO, __VA_ARGS__)
+#ifdef NDEBUG
+#define kvfs_trace(...)	do { } while (0)
+#else
+#define kvfs_trace(...)	kvfs_log(KVFS_LOG_TRACE, __VA_ARGS__)
+#endif
+
+#define kvfs_trace_fi(fi) \
+	kvfs_trace("    fi->flags = 0x%08x, fi->fh = 0x%llx\n", (fi)->flags, (unsigned long long) (fi)->fh)
+
+struct kvfs_logring {
+	struct kvfs_logring *next;
+	uint64_t head;		// written by the owning thread only
+	uint64_t tail;		// written by the log thread only
+	uint64_t dropped;
+	int dead;		// owner has exited; free once drained
+	char lines[KVFS_LOG_SLOTS][KVFS_LOG_LINE];
+};
+
+static pthread_mutex_t kvfs_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kvfs_logring *kvfs_log_rings;
+static __thread struct kvfs_logring *kvfs_log_ring;
+static pthread_key_t kvfs_log_key;
+static FILE *kvfs_log_file;
+static uint64_t kvfs_log_dropped;	// from rings already freed
+static pthread_mutex_t kvfs_log_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvfs_log_wait_cond = PTHREAD_COND_INITIALIZER;
+static int kvfs_log_pending;		// something queued since the last drain
+
+// Wake the log thread, unless someone already did since it drained.
+static void kvfs_log_wake(void)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
+	if (__atomic_exchange_n(&kvfs_log_pending, 1, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&kvfs_log_wait_lock);
+	pthread_cond_signal(&kvfs_log_wait_cond);
+	pthread_mutex_unlock(&kvfs_log_wait_lock);
+}
 
-	log_msg("kvfs_unlink_impl (path=\"%s\")\n", path);
-	result = unlink(fullpath);
+static void kvfs_log_thread_exit(void *arg)
+{
+	struct kvfs_logring *ring = arg;
 
-	if (result < 0)
-	{
-		log_msg("Error in unlink");
-		return -errno;
-	}
-	
-	return result;	
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+	kvfs_log_wake();
 }
 
-/** Remove a directory */
-int kvfs_rmdir_impl(const char *path)
+static struct kvfs_logring *kvfs_log_ring_get(void)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
+	struct kvfs_logring *ring = kvfs_log_ring;
 
-	log_msg("kvfs_rmdir_impl(path=\"%s\")\n", path);
-	result = rmdir(fullpath);
+	if (ring != NULL)
+		return ring;
 
-	if (result < 0)
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	pthread_setspecific(kvfs_log_key, ring);
+
+	pthread_mutex_lock(&kvfs_log_lock);
+	ring->next = kvfs_log_rings;
+	kvfs_log_rings = ring;
+	pthread_mutex_unlock(&kvfs_log_lock);
+
+	kvfs_log_ring = ring;
+	return ring;
+}
+
+static void kvfs_log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void kvfs_log_write(const char *format, ...)
+{
+	struct kvfs_logring *ring;
+	uint64_t head;
+	va_list ap;
+	int saved = errno;	// callers log and then return -errno
+
+	ring = kvfs_log_ring_get();
+	if (ring == NULL || kvfs_log_file == NULL)
 	{
-		log_msg("Error in rmdir");
-		return -errno;
+		errno = saved;
+		return;
+	}
+
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == KVFS_LOG_SLOTS)
+	{
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		errno = saved;
+		return;
 	}
+
+	va_start(ap, format);
+	vsnprintf(ring->lines[head % KVFS_LOG_SLOTS], KVFS_LOG_LINE, format, ap);
+	va_end(ap);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	kvfs_log_wake();
+
+	errno = saved;
+}
+
+// Log what failed and return -errno, like log.c's log_error().
+static int kvfs_log_errno(const char *what)
+{
+	int result = -errno;
+	char msg[128];
+
+	kvfs_error("ERROR %s: %s\n", what, strerror_r(-result, msg, sizeof(msg)));
 	return result;
 }
 
-/** Create a symbolic link */
-// The parameters here are a little bit confusing, but do correspond
-// to the symlink() system call.  The 'path' is where the link points,
-// while the 'link' is the link itself.  So we need to leave the path
-// unaltered, but insert the link into the mounted directory.
-int kvfs_symlink_impl(const char *path, const char *link)
+// Copy everything queued so far to the log file.  Only the log thread
+// (or the exit handler, once it has stopped) calls this.
+static void kvfs_log_drain(void)
 {
-	int result = 0;
-	char fulllink[PATH_MAX];
-	kvfs_fullpath(fulllink, link);   
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
+	struct kvfs_logring **link, *ring;
+	uint64_t head, tail, dropped;
+	int wrote = 0;
 
-	log_msg("kvfs_symlink_impl(path=\"%s\", link=\"%s\")\n", fullpath, fulllink);
-	
-	result = symlink(fullpath, fulllink);
-	if (result < 0)
+	pthread_mutex_lock(&kvfs_log_lock);
+	for (link = &kvfs_log_rings; (ring = *link) != NULL; )
 	{
-		log_msg("Error in symlink\n");
-		log_msg("##################################################");
-		return -errno;
+		int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++, wrote++)
+			fputs(ring->lines[tail % KVFS_LOG_SLOTS], kvfs_log_file);
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped != 0)
+		{
+			fprintf(kvfs_log_file, "kvfs: %llu log lines dropped\n", (unsigned long long) dropped);
+			kvfs_log_dropped += dropped;
+			wrote++;
+		}
+
+		if (dead)
+		{
+			*link = ring->next;
+			free(ring);
+		}
+		else
+		{
+			link = &ring->next;
+		}
 	}
-	return result;
+	pthread_mutex_unlock(&kvfs_log_lock);
+
+	if (wrote)
+		fflush(kvfs_log_file);
 }
 
-/** Rename a file */
-// both path and newpath are fs-relative
-int kvfs_rename_impl(const char *path, const char *newpath)
+static void *kvfs_log_thread(void *arg)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	char fullnewpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-	
-	log_msg("kvfs_rename_impl (fpath=\"%s\", newpath=\"%s\")\n", path, newpath);
-	kvfs_fullpath(fullnewpath, newpath);       
-	result = rename(fullpath, fullnewpath);
-	if (result < 0)
+	struct timespec interval = { 0, KVFS_LOG_FLUSH_MS * 1000 * 1000 };
+
+	for (;;)
 	{
-		log_msg("Error in rename");
-		return -errno;
+		pthread_mutex_lock(&kvfs_log_wait_lock);
+		while (!__atomic_load_n(&kvfs_log_pending, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&kvfs_log_wait_cond, &kvfs_log_wait_lock);
+		pthread_mutex_unlock(&kvfs_log_wait_lock);
+
+		nanosleep(&interval, NULL);
+		// Cleared before draining, so a line queued meanwhile wakes
+		// us again rather than waiting for the next one.
+		__atomic_store_n(&kvfs_log_pending, 0, __ATOMIC_SEQ_CST);
+		kvfs_log_drain();
 	}
-	return result;
+	return NULL;
 }
 
-/** Create a hard link to a file */
-int kvfs_link_impl(const char *path, const char *newpath)
+static void kvfs_log_exit(void)
 {
+	kvfs_log_drain();
+}
 
-	log_msg("#################### starting link ###################");
-	int result = 0;
-	char fullpath[PATH_MAX];
-	char fullnewpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-	kvfs_fullpath(fullnewpath, newpath);   
-	
-	log_msg("kvfs_link(path=\"%s\", newpath=\"%s\")\n", path, newpath);
+static int kvfs_log_parse_level(const char *name)
+{
+	static const char *levels[] = { "off", "error", "info", "trace", NULL };
+	int i;
 
-	result = link(fullpath, fullnewpath);
-	if (result < 0)
-	{
-		log_msg("Error in link");
-		log_msg("####################  link failed ###################");
-		return -errno;
-	}
-	log_msg("####################  link success ###################");
-	return result;
+	for (i = 0; levels[i] != NULL; i++)
+		if (strcmp(levels[i], name) == 0)
+			return i;
+	return KVFS_LOG_ERROR;
 }
 
-/** Change the permission bits of a file */
-int kvfs_chmod_impl(const char *path, mode_t mode)
+// Start the log thread.  Called from kvfs_init() with KVFS_DATA valid.
+static void kvfs_log_start(void)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-	
-	log_msg("\nkvfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+	pthread_t thread;
 
-	result = chmod(fullpath, mode);
-	if (result < 0)
+	kvfs_log_level = kvfs_log_parse_level(kvfs_getenv("KVFS_LOG_LEVEL", "error"));
+	kvfs_log_file = KVFS_DATA->logfile;
+	if (kvfs_log_file == NULL || kvfs_log_level == KVFS_LOG_OFF)
 	{
-		log_msg("Error in chmod");
-		return -errno;
+		kvfs_log_level = KVFS_LOG_OFF;
+		return;
 	}
-	return result;
-}
 
-/** Change the owner and group of a file */
-int kvfs_chown_impl(const char *path, uid_t uid, gid_t gid)
-{
-	int result = 0;
-	char fullpath[PATH_MAX];    
-	kvfs_fullpath(fullpath, path);   
-	log_msg("\nkvfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
-	
-	result = chown(fullpath, uid, gid);
-	
-	if (result < 0)
+	pthread_key_create(&kvfs_log_key, kvfs_log_thread_exit);
+	if (pthread_create(&thread, NULL, kvfs_log_thread, NULL) != 0)
 	{
-		log_msg("Error in chown");
-		return -errno;
+		kvfs_log_level = KVFS_LOG_OFF;
+		return;
 	}
-	return result;	
+	pthread_detach(thread);
+	atexit(kvfs_log_exit);
 }
 
-/** Change the size of a file */
-int kvfs_truncate_impl(const char *path, off_t newsize)
+static double kvfs_getenv_num(const char *name, double def)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-	log_msg("\nkvfs_truncate_impl(path=\"%s\", newsize=%lld)\n", path, newsize);
+	const char *value = getenv(name);
+	char *end;
+	double num;
 
-	result = truncate(fullpath, newsize);
-	
-	if (result < 0)
+	if (value == NULL || *value == '\0')
+		return def;
+	num = strtod(value, &end);
+	if (*end != '\0' || num < 0)
 	{
-		log_msg(" Error in truncate");
-		return -errno;
+		kvfs_error("\nkvfs_init: ignoring %s=\"%s\", using %g\n", name, value, def);
+		return def;
 	}
-	return result;
+	return num;
 }
 
-/** Change the access and/or modification times of a file */
-/* note -- I'll want to change this as soon as 2.6 is in debian testing */
-int kvfs_utime_impl(const char *path, struct utimbuf *ubuf)
+static const struct kvfs_keyfn *kvfs_find_keyfn(const char *name)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
+	const struct kvfs_keyfn *keyfn;
+
+	for (keyfn = kvfs_keyfns; keyfn->name != NULL; keyfn++)
+		if (strcmp(keyfn->name, name) == 0)
+			return keyfn;
+	return NULL;
+}
 
-	log_msg("\nkvfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+static int kvfs_find_layout(const char *name)
+{
+	int i;
 
-	result = utime(fullpath, ubuf);
-	if(result < 0)
+	for (i = 0; kvfs_layouts[i] != NULL; i++)
+		if (strcmp(kvfs_layouts[i], name) == 0)
+			return i;
+	return -1;
+}
+
+// rootdir/name, for the bookkeeping files kept next to the keys.
+static void kvfs_rootfile(char path[PATH_MAX], const char *name)
+{
+	size_t len = strnlen(name, PATH_MAX - kvfs_rootdir_len - 2);
+
+	memcpy(path, kvfs_rootdir, kvfs_rootdir_len);
+	path[kvfs_rootdir_len] = '/';
+	memcpy(path + kvfs_rootdir_len + 1, name, len);
+	path[kvfs_rootdir_len + 1 + len] = '\0';
+}
+
+// Fill hash, layout and the namespace index's backend ("" for none) in
+// from an existing superblock.  Returns 0 if there was one, -1 if not.
+static int kvfs_super_read(char *hash, char *layout, char *index, size_t size)
+{
+	char path[PATH_MAX], line[128], value[64];
+	FILE *fp;
+
+	kvfs_rootfile(path, KVFS_SUPER);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
 	{
-		log_msg("Error in utime!");
-		return -errno;
+		if (sscanf(line, "hash %63s", value) == 1)
+			snprintf(hash, size, "%s", value);
+		else if (sscanf(line, "layout %63s", value) == 1)
+			snprintf(layout, size, "%s", value);
+		else if (sscanf(line, "index %63s", value) == 1)
+			snprintf(index, size, "%s", value);
 	}
-	return result;
+	fclose(fp);
+	return 0;
 }
 
-/** File open operation
- *
- * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
- * will be passed to open().  Open should check if the operation
- * is permitted for the given flags.  Optionally open may also
- * return an arbitrary filehandle in the fuse_file_info structure,
- * which will be passed to all file operations.
- *
- * Changed in version 2.2
- */
-int kvfs_open_impl(const char *path, struct fuse_file_info *fi)
+// Write the superblock through a temporary file, so a crash leaves
+// either the old one or the new one.
+static int kvfs_super_write(void)
 {
-	int fd;
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *fp;
+
+	kvfs_rootfile(path, KVFS_SUPER);
+	kvfs_rootfile(tmp, KVFS_SUPER ".tmp");
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+		return -1;
 
-	log_msg("\nkvfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+	fprintf(fp, "kvfs 1\nhash %s\nlayout %s\n", kvfs_conf.keyfn->name, kvfs_layouts[kvfs_conf.layout]);
+	if (kvfs_conf.index)
+		fprintf(fp, "index %s\n", kvfs_conf.backend->super);
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+	{
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(fp);
+	return rename(tmp, path);
+}
 
-	fd = open(fullpath, fi->flags);
+// A root with no superblock was made before there was one, so it
+// holds MD5 keys; shard directories in it mean kvfs_migrate was run.
+static void kvfs_super_guess(char *hash, char *layout, size_t size, int *empty)
+{
+	struct dirent *de;
+	DIR *dp;
 
-	fi->fh = fd;
-	log_fi(fi);
+	snprintf(hash, size, "md5");
+	snprintf(layout, size, "flat");
+	*empty = 1;
 
-	if (fd < 0)
+	dp = opendir(kvfs_rootdir);
+	if (dp == NULL)
+		return;
+	while ((de = readdir(dp)) != NULL)
 	{
-		log_msg("Error in open");
-		return -errno;
+		if (de->d_name[0] == '.')
+			continue;
+		*empty = 0;
+		if (strspn(de->d_name, kvfs_hex) == 2 && de->d_name[2] == '\0')
+		{
+			snprintf(layout, size, "shard");
+			break;
+		}
 	}
+	closedir(dp);
+}
 
-	return result;
+// Settle on the hash, layout and index backend for this mount.  Returns
+// -1 if the mount options contradict what is already on disk.
+static int kvfs_super_check(void)
+{
+	const char *want_hash = kvfs_getenv("KVFS_HASH", NULL);
+	const char *want_layout = kvfs_getenv("KVFS_LAYOUT", NULL);
+	const char *want_backend = kvfs_getenv("KVFS_BACKEND", NULL);
+	char hash[64], layout[64], index[64] = "";
+	int empty = 0, have_super;
+
+	have_super = kvfs_super_read(hash, layout, index, sizeof(hash)) == 0;
+	if (!have_super)
+		kvfs_super_guess(hash, layout, sizeof(hash), &empty);
+
+	// A brand new root takes whatever the mount asks for.
+	if (empty)
+	{
+		if (want_hash != NULL)
+			snprintf(hash, sizeof(hash), "%s", want_hash);
+		if (want_layout != NULL)
+			snprintf(layout, sizeof(layout), "%s", want_layout);
+	}
+
+	if ((want_hash != NULL && strcmp(want_hash, hash) != 0) ||
+	    (want_layout != NULL && strcmp(want_layout, layout) != 0))
+	{
+		kvfs_error("\nkvfs_init: %s holds hash=%s layout=%s, refusing to mount it as hash=%s layout=%s\n",
+			kvfs_rootdir, hash, layout, want_hash ? want_hash : hash, want_layout ? want_layout : layout);
+		return -1;
+	}
+
+	kvfs_conf.keyfn = kvfs_find_keyfn(hash);
+	kvfs_conf.layout = kvfs_find_layout(layout);
+	if (kvfs_conf.keyfn == NULL || kvfs_conf.layout < 0)
+	{
+		kvfs_error("\nkvfs_init: unknown hash \"%s\" or layout \"%s\"\n", hash, layout);
+		return -1;
+	}
+
+	// Only a root that starts out empty can have every name in its
+	// index; older ones go on listing keys.
+	if (empty)
+		snprintf(index, sizeof(index), "%s", want_backend != NULL ? want_backend : "passthrough");
+	kvfs_conf.index = index[0] != '\0';
+	kvfs_conf.backend = kvfs_find_backend(kvfs_conf.index ? index : "passthrough");
+	if (kvfs_conf.backend == NULL || (want_backend != NULL && kvfs_find_backend(want_backend) == NULL))
+	{
+		kvfs_error("\nkvfs_init: unknown backend \"%s\"\n", kvfs_conf.backend == NULL ? index : want_backend);
+		return -1;
+	}
+	if (want_backend != NULL && kvfs_find_backend(want_backend) != (kvfs_conf.index ? kvfs_conf.backend : NULL))
+	{
+		kvfs_error("\nkvfs_init: %s holds index=%s, refusing to mount it with KVFS_BACKEND=%s\n",
+			kvfs_rootdir, kvfs_conf.index ? kvfs_conf.backend->name : "none", want_backend);
+		return -1;
+	}
+
+	// Only keys from kvfs_str2key() follow the hash and the index.  A
+	// kvfs.c that still hashes paths with str2md5() first gets here
+	// from an _impl instead, and would store md5 keys in a root that
+	// says otherwise.
+	if (!__atomic_load_n(&kvfs_translated, __ATOMIC_RELAXED) &&
+	    (kvfs_conf.index || kvfs_conf.keyfn != kvfs_find_keyfn("md5")))
+	{
+		kvfs_error("\nkvfs_init: kvfs.c translates paths with str2md5(), but %s needs kvfs_str2key() "
+			"(hash=%s index=%s), refusing to mount it\n", kvfs_rootdir, hash, kvfs_conf.index ? index : "none");
+		return -1;
+	}
+
+	if (!have_super && kvfs_super_write() < 0)
+		kvfs_error("\nkvfs_init: could not write %s/%s: %s\n", kvfs_rootdir, KVFS_SUPER, strerror(errno));
+	return 0;
 }
 
-/** Read data from an open file
- *
- * Read should return exactly the number of bytes requested except
- * on EOF or error, otherwise the resultt of the data will be
- * substituted with zeroes.  An exception to this is when the
- * 'direct_io' mount option is specified, in which case the return
- * value of the read system call will reflect the return value of
- * this operation.
- *
- * Changed in version 2.2
- */
-// I don't fully understand the documentation above -- it doesn't
-// match the documentation for the read() system call which says it
-// can return with anything up to the amount of data requested. nor
-// with the fusexmp code which returns the amount of data also
-// returned by read.
-int kvfs_read_impl(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Runs exactly once, from whichever FUSE worker gets there first, so
+// KVFS_DATA is valid here.
+static void kvfs_init(void)
 {
-	int result = 0;
-	log_msg("\nkvfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+	kvfs_log_start();
 
-	log_fi(fi);
-        result = pread(fi->fh, buf, size, offset);
-        if (result < 0)
+	kvfs_rootdir_len = strnlen(KVFS_DATA->rootdir, PATH_MAX - 1);
+	memcpy(kvfs_rootdir, KVFS_DATA->rootdir, kvfs_rootdir_len);
+	kvfs_rootdir[kvfs_rootdir_len] = '\0';
+
+	if (kvfs_super_check() < 0)
 	{
-		result = -errno;
+		// Stop the session, and until it winds down point every
+		// operation at a directory that does not exist, so nothing
+		// touches the root with the wrong keys.
+		fprintf(stderr, "kvfs: refusing to mount %s, see log for details\n", kvfs_rootdir);
+		fuse_exit(fuse_get_context()->fuse);
+		kvfs_conf.layout = KVFS_LAYOUT_FLAT;
+		kvfs_conf.keyfn = &kvfs_keyfns[0];
+		kvfs_conf.index = 0;
+		kvfs_rootdir_len += snprintf(kvfs_rootdir + kvfs_rootdir_len,
+			sizeof(kvfs_rootdir) - kvfs_rootdir_len, "/.kvfs_refused");
 	}
-        return result;
+
+	kvfs_conf.attr_timeout_ns = kvfs_getenv_num("KVFS_ATTR_TIMEOUT", 1.0) * 1e9;
+	kvfs_conf.attr_entries = kvfs_getenv_num("KVFS_ATTR_CACHE", 65536);
+	kvfs_acache_init();
+
+	kvfs_conf.keyfn->hash("/", 1, kvfs_root_key);
+	kvfs_index_init();
+
+	kvfs_conf.dcache_bytes = kvfs_getenv_num("KVFS_DCACHE_BYTES",
+		kvfs_conf.keyfn == kvfs_find_keyfn("md5") || kvfs_conf.index ? 8 << 20 : 0);
+	kvfs_dcache_init();
+
+	kvfs_conf.splice = kvfs_getenv_num("KVFS_SPLICE", 0) != 0;
+	kvfs_io_init();
+
+	kvfs_conf.fd_cache = kvfs_getenv_num("KVFS_FD_CACHE", 0);
+	kvfs_fdc_init();
+
+	kvfs_conf.mmap_bytes = kvfs_getenv_num("KVFS_MMAP_BYTES", 0);
+	kvfs_mm_init();
+
+	kvfs_conf.wb_bytes = kvfs_getenv_num("KVFS_WRITEBACK_BYTES", 0);
+	kvfs_wb_init();
+
+	kvfs_conf.ra_bytes = kvfs_getenv_num("KVFS_READAHEAD", 0);
+	kvfs_conf.pcache_bytes = kvfs_getenv_num("KVFS_PAGECACHE_BYTES", 64 << 20);
+	kvfs_ra_init();
+
+	kvfs_conf.pack_bytes = kvfs_getenv_num("KVFS_PACK_BYTES", 0);
+	kvfs_pack_init();
+
+	kvfs_conf.dedup_bytes = kvfs_getenv_num("KVFS_DEDUP_BYTES", 0);
+	kvfs_dedup_init();
+
+	kvfs_conf.z_block = kvfs_getenv_num("KVFS_COMPRESS_BLOCK", 65536);
+	kvfs_z_init();
+
+	kvfs_conf.sync_wait_ns = kvfs_getenv_num("KVFS_SYNC_WAIT_US", 0) * 1e3;
+	kvfs_sync_init();
+
+	kvfs_op_init();
+	kvfs_batch_init();
+
+	kvfs_info("\nkvfs_init: rootdir = \"%s\", root key = \"%s\", hash = %s, layout = %s, index = %s\n",
+		kvfs_rootdir, kvfs_root_key, kvfs_conf.keyfn->name, kvfs_layouts[kvfs_conf.layout],
+		kvfs_conf.index ? kvfs_conf.backend->name : "none");
 }
 
-/** Write data to an open file
- *
- * Write should return exactly the number of bytes requested
- * except on error.  An exception to this is when the 'direct_io'
- * mount option is specified (see read operation).
- *
- * Changed in version 2.2
- */
-// As  with read(), the documentation above is inconsistent with the
-// documentation for the write() system call.
-int kvfs_write_impl(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+///////////////////////////////////////////////////////////
+//
+// Attribute cache
+//
+// getattr is by far the most frequent operation, and each one used
+// to be an lstat() of the backing file.  Attributes are cached per
+// key for KVFS_ATTR_TIMEOUT seconds (default 1, 0 turns the cache
+// off), up to KVFS_ATTR_CACHE entries.  Every operation in this file
+// that changes a key's attributes invalidates it, and files with more
+// than one hard link are never cached, so the timeout only bounds how
+// long changes made behind KVFS's back stay invisible.  The kernel
+// keeps its own copy for the attr_timeout/entry_timeout given as FUSE
+// mount options; keep those no longer than KVFS_ATTR_TIMEOUT.
+//
+// The table is split into lock stripes, each a small chained hash
+// table with CLOCK eviction.  A stripe's generation is bumped by every
+// invalidation, and a getattr only caches what it read if no
+// invalidation raced with its lstat().
+//
+#define KVFS_ACACHE_STRIPES	64
+
+struct kvfs_aentry {
+	char key[KVFS_KEY_MAX];
+	struct stat st;
+	uint64_t expires;	// CLOCK_MONOTONIC ns
+	int next;		// bucket chain, -1 terminated
+	unsigned char used;
+	unsigned char ref;
+};
+
+struct kvfs_astripe {
+	pthread_mutex_t lock;
+	struct kvfs_aentry *entries;
+	int *buckets;
+	int capacity;
+	int count;
+	int hand;
+	uint64_t gen;
+	uint64_t hits, misses, expired, evictions, invalidations;
+} __attribute__((aligned(64)));
+
+static struct kvfs_astripe kvfs_acache[KVFS_ACACHE_STRIPES];
+
+static uint64_t kvfs_now_ns(void)
 {
-	int result = 0;
-        log_msg("\nkvfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
-        log_fi(fi);
-        result = pwrite(fi->fh, buf, size, offset);
-        if (result < 0)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Keys are already hashes, so a few of their bytes are plenty to pick
+// a stripe and bucket.
+static uint64_t kvfs_keyhash(const char *key)
+{
+	uint64_t h = 0;
+
+	memcpy(&h, key, strnlen(key, sizeof(h)));
+	return h * XXH_P1;
+}
+
+static struct kvfs_astripe *kvfs_acache_stripe(const char *key, uint64_t *h)
+{
+	*h = kvfs_keyhash(key);
+	return &kvfs_acache[*h >> 58];
+}
+
+static void kvfs_acache_init(void)
+{
+	int i, per_stripe;
+
+	if (kvfs_conf.attr_timeout_ns == 0 || kvfs_conf.attr_entries <= 0)
+		return;
+
+	per_stripe = (kvfs_conf.attr_entries + KVFS_ACACHE_STRIPES - 1) / KVFS_ACACHE_STRIPES;
+	for (i = 0; i < KVFS_ACACHE_STRIPES; i++)
 	{
-		return -errno;
+		struct kvfs_astripe *s = &kvfs_acache[i];
+
+		pthread_mutex_init(&s->lock, NULL);
+		s->entries = calloc(per_stripe, sizeof(*s->entries));
+		s->buckets = malloc(per_stripe * sizeof(*s->buckets));
+		if (s->entries == NULL || s->buckets == NULL)
+		{
+			kvfs_error("\nkvfs_acache_init: out of memory, attribute cache disabled\n");
+			kvfs_conf.attr_timeout_ns = 0;
+			return;
+		}
+		memset(s->buckets, -1, per_stripe * sizeof(*s->buckets));
+		s->capacity = per_stripe;
 	}
-        return result;	
 }
 
-/** Get file system statistics
- *
- * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
- *
- * Replaced 'struct statfs' parameter with 'struct statvfs' in
- * version 2.5
- */
-int kvfs_statfs_impl(const char *path, struct statvfs *statv)
+// Unlink entry idx from its bucket chain.  Called with the lock held.
+static void kvfs_acache_unchain(struct kvfs_astripe *s, int idx, uint64_t h)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-	
-	log_msg("\nkvfs_statfs(path=\"%s\", statv=0x%08x)\n", path, statv);
+	int *link = &s->buckets[(h >> 16) % s->capacity];
 
-	result = statvfs(fullpath, statv);
-	if (result < 0)
+	while (*link != idx)
+		link = &s->entries[*link].next;
+	*link = s->entries[idx].next;
+	s->entries[idx].used = 0;
+	s->count--;
+}
+
+static int kvfs_acache_find(struct kvfs_astripe *s, const char *key, uint64_t h)
+{
+	int idx = s->buckets[(h >> 16) % s->capacity];
+
+	while (idx >= 0 && strcmp(s->entries[idx].key, key) != 0)
+		idx = s->entries[idx].next;
+	return idx;
+}
+
+// Copy the cached attributes of key into st.  Returns 0 on a hit.
+static int kvfs_acache_get(const char *key, struct stat *st)
+{
+	struct kvfs_astripe *s;
+	uint64_t h;
+	int idx, result = -1;
+
+	if (kvfs_conf.attr_timeout_ns == 0)
+		return -1;
+
+	s = kvfs_acache_stripe(key, &h);
+	pthread_mutex_lock(&s->lock);
+	idx = kvfs_acache_find(s, key, h);
+	if (idx < 0)
 	{
-		return -errno;
+		s->misses++;
+	}
+	else if (s->entries[idx].expires < kvfs_now_ns())
+	{
+		kvfs_acache_unchain(s, idx, h);
+		s->expired++;
+		s->misses++;
+	}
+	else
+	{
+		*st = s->entries[idx].st;
+		s->entries[idx].ref = 1;
+		s->hits++;
+		result = 0;
 	}
+	pthread_mutex_unlock(&s->lock);
 
-	log_statvfs(statv);
-	
 	return result;
 }
 
-/** Possibly flush cached data
- *
- * BIG NOTE: This is not equivalent to fsync().  It's not a
- * request to sync dirty data.
- *
- * Flush is called on each close() of a file descriptor.  So if a
- * filesystem wants to return write errors in close() and the file
- * has cached dirty data, this is a good place to write back data
- * and return any errors.  Since many applications ignore close()
- * errors this is not always useful.
- *
- * NOTE: The flush() method may be called more than once for each
- * open().  This happens if more than one file descriptor refers
- * to an opened file due to dup(), dup2() or fork() calls.  It is
- * not possible to determine if a flush is final, so each flush
- * should be treated equally.  Multiple write-flush sequences are
- * relatively rare, so this shouldn't be a problem.
- *
- * Filesystems shouldn't assume that flush will always be called
- * after some writes, or that if will be called at all.
- *
- * Changed in version 2.2
- */
-// this is a no-op in BBFS.  It just logs the call and returns success
-int kvfs_flush_impl(const char *path, struct fuse_file_info *fi)
+// Generation to hand back to kvfs_acache_put(); read it before asking
+// the backing store for the attributes.
+static uint64_t kvfs_acache_gen(const char *key)
 {
-    log_msg("\nkvfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
-    log_fi(fi);
-	
-    return 0;
+	struct kvfs_astripe *s;
+	uint64_t h, gen;
+
+	if (kvfs_conf.attr_timeout_ns == 0)
+		return 0;
+
+	s = kvfs_acache_stripe(key, &h);
+	pthread_mutex_lock(&s->lock);
+	gen = s->gen;
+	pthread_mutex_unlock(&s->lock);
+	return gen;
 }
 
-/** Release an open file
- *
- * Release is called when there are no more references to an open
- * file: all file descriptors are closed and all memory mappings
- * are unmapped.
- *
- * For every open() call there will be exactly one release() call
- * with the same flags and file descriptor.  It is possible to
- * have a file opened more than once, in which case only the last
- * release will mean, that no more reads/writes will happen on the
- * file.  The return value of release is ignored.
- *
- * Changed in version 2.2
- */
-int kvfs_release_impl(const char *path, struct fuse_file_info *fi)
+static void kvfs_acache_put(const char *key, const struct stat *st, uint64_t gen)
 {
-	int result = 0;
-	log_msg("\nkvfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+	struct kvfs_astripe *s;
+	struct kvfs_aentry *e;
+	uint64_t h;
+	int idx;
 
-	log_fi(fi);
+	if (kvfs_conf.attr_timeout_ns == 0 || strlen(key) >= KVFS_KEY_MAX)
+		return;
 
-	result = close(fi->fh);
+	// A change through one hard link would leave the others stale,
+	// and hard links are rare enough not to bother tracking them.
+	if (!S_ISDIR(st->st_mode) && st->st_nlink > 1)
+		return;
 
-	if(result < 0)
+	s = kvfs_acache_stripe(key, &h);
+	pthread_mutex_lock(&s->lock);
+	if (s->gen != gen)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+
+	idx = kvfs_acache_find(s, key, h);
+	if (idx < 0)
+	{
+		// CLOCK: sweep until a free slot, or one not used since
+		// the hand last passed it.
+		for (;;)
+		{
+			e = &s->entries[s->hand];
+			idx = s->hand;
+			s->hand = (s->hand + 1) % s->capacity;
+			if (!e->used)
+				break;
+			if (!e->ref)
+			{
+				kvfs_acache_unchain(s, idx, kvfs_keyhash(e->key));
+				s->evictions++;
+				break;
+			}
+			e->ref = 0;
+		}
+		strcpy(e->key, key);
+		e->next = s->buckets[(h >> 16) % s->capacity];
+		s->buckets[(h >> 16) % s->capacity] = idx;
+		e->used = 1;
+		s->count++;
+	}
+
+	e = &s->entries[idx];
+	e->st = *st;
+	e->expires = kvfs_now_ns() + kvfs_conf.attr_timeout_ns;
+	e->ref = 0;
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Forget key after a change to its attributes (or its existence).
+static void kvfs_acache_invalidate(const char *key)
+{
+	struct kvfs_astripe *s;
+	uint64_t h;
+	int idx;
+
+	if (kvfs_conf.attr_timeout_ns == 0)
+		return;
+
+	s = kvfs_acache_stripe(key, &h);
+	pthread_mutex_lock(&s->lock);
+	s->gen++;
+	idx = kvfs_acache_find(s, key, h);
+	if (idx >= 0)
 	{
-		return --errno;
+		kvfs_acache_unchain(s, idx, h);
+		s->invalidations++;
 	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+///////////////////////////////////////////////////////////
+//
+// Path cache
+//
+// A handful of hot paths (config files, lock files, build outputs)
+// are translated over and over, and with MD5 each translation costs
+// far more than looking the answer up.  kvfs_str2key() therefore
+// remembers path -> key for up to KVFS_DCACHE_BYTES of paths (default
+// 8 MiB with MD5 or a namespace index, where a translation walks the
+// index; off otherwise, as xxh64 is about as cheap as the lookup).
+// rename, unlink and rmdir drop every path that maps to the keys they
+// touch.  Renaming a directory changes the key of every path below
+// it, so it starts a new epoch instead: entries from an older epoch
+// are misses, and are dropped when they are next looked at.
+//
+// Like the attribute cache it is split into lock stripes, chosen by
+// path hash.  Each stripe chains its entries both by path and by key,
+// so dropping a key only needs one bucket per stripe, and evicts with
+// CLOCK until it is back under its share of the byte budget.
+//
+#define KVFS_DCACHE_STRIPES	64
+
+struct kvfs_dentry {
+	struct kvfs_dentry *pnext;	// path hash chain
+	struct kvfs_dentry *knext;	// key hash chain
+	struct kvfs_dentry *prev, *next;	// CLOCK ring
+	uint64_t phash;
+	uint64_t khash;
+	uint64_t epoch;
+	size_t len;
+	unsigned char ref;
+	char key[KVFS_KEY_MAX];
+	char path[];
+};
+
+struct kvfs_dstripe {
+	pthread_mutex_t lock;
+	struct kvfs_dentry **pbuckets;
+	struct kvfs_dentry **kbuckets;
+	struct kvfs_dentry *hand;
+	size_t nbuckets;	// power of two
+	size_t bytes, budget;
+	long count;
+	uint64_t gen;
+	uint64_t hits, misses, evictions, invalidations;
+} __attribute__((aligned(64)));
+
+static struct kvfs_dstripe kvfs_dcache[KVFS_DCACHE_STRIPES];
+static int kvfs_dcache_on;
+static uint64_t kvfs_dcache_epoch;
+
+static void kvfs_dcache_init(void)
+{
+	size_t budget, nbuckets;
+	int i;
+
+	if (kvfs_conf.dcache_bytes == 0)
+		return;
+
+	// Budget each stripe, and size its tables for ~128 byte entries.
+	budget = kvfs_conf.dcache_bytes / KVFS_DCACHE_STRIPES;
+	for (nbuckets = 16; nbuckets < budget / 128; nbuckets *= 2)
+		;
+
+	for (i = 0; i < KVFS_DCACHE_STRIPES; i++)
+	{
+		struct kvfs_dstripe *s = &kvfs_dcache[i];
+
+		pthread_mutex_init(&s->lock, NULL);
+		s->pbuckets = calloc(nbuckets, sizeof(*s->pbuckets));
+		s->kbuckets = calloc(nbuckets, sizeof(*s->kbuckets));
+		if (s->pbuckets == NULL || s->kbuckets == NULL)
+		{
+			kvfs_error("\nkvfs_dcache_init: out of memory, path cache disabled\n");
+			return;
+		}
+		s->nbuckets = nbuckets;
+		s->budget = budget;
+	}
+	kvfs_dcache_on = 1;
+}
+
+// Take e out of both chains and the CLOCK ring and free it.  Called
+// with the stripe lock held.
+static void kvfs_dcache_remove(struct kvfs_dstripe *s, struct kvfs_dentry *e)
+{
+	struct kvfs_dentry **link;
+
+	for (link = &s->pbuckets[e->phash & (s->nbuckets - 1)]; *link != e; link = &(*link)->pnext)
+		;
+	*link = e->pnext;
+	for (link = &s->kbuckets[e->khash & (s->nbuckets - 1)]; *link != e; link = &(*link)->knext)
+		;
+	*link = e->knext;
+
+	if (e->next == e)
+	{
+		s->hand = NULL;
+	}
+	else
+	{
+		e->prev->next = e->next;
+		e->next->prev = e->prev;
+		if (s->hand == e)
+			s->hand = e->next;
+	}
+
+	s->bytes -= sizeof(*e) + e->len + 1;
+	s->count--;
+	free(e);
+}
+
+// Look path up.  On a miss, returns -1 and the stripe generation and
+// epoch to hand to kvfs_dcache_put() once the key has been computed.
+static int kvfs_dcache_get(const char *path, size_t len, uint64_t h, char *key, uint64_t *gen, uint64_t *epoch)
+{
+	struct kvfs_dstripe *s = &kvfs_dcache[h >> 58];
+	struct kvfs_dentry *e;
+
+	*epoch = __atomic_load_n(&kvfs_dcache_epoch, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&s->lock);
+	for (e = s->pbuckets[h & (s->nbuckets - 1)]; e != NULL; e = e->pnext)
+	{
+		if (e->phash == h && e->len == len && memcmp(e->path, path, len) == 0)
+		{
+			if (e->epoch != *epoch)
+			{
+				kvfs_dcache_remove(s, e);
+				s->invalidations++;
+				break;
+			}
+			strcpy(key, e->key);
+			e->ref = 1;
+			s->hits++;
+			pthread_mutex_unlock(&s->lock);
+			return 0;
+		}
+	}
+	s->misses++;
+	*gen = s->gen;
+	pthread_mutex_unlock(&s->lock);
+
+	return -1;
+}
+
+static void kvfs_dcache_put(const char *path, size_t len, uint64_t h, const char *key, uint64_t gen, uint64_t epoch)
+{
+	struct kvfs_dstripe *s = &kvfs_dcache[h >> 58];
+	struct kvfs_dentry *e, *victim;
+
+	e = malloc(sizeof(*e) + len + 1);
+	if (e == NULL)
+		return;
+	e->phash = h;
+	e->khash = kvfs_keyhash(key);
+	e->epoch = epoch;
+	e->len = len;
+	e->ref = 0;
+	strcpy(e->key, key);
+	memcpy(e->path, path, len);
+	e->path[len] = '\0';
+
+	pthread_mutex_lock(&s->lock);
+
+	// An invalidation since the miss may have made key stale.  Another
+	// thread may also have beaten us to it.
+	if (s->gen != gen || __atomic_load_n(&kvfs_dcache_epoch, __ATOMIC_ACQUIRE) != epoch)
+	{
+		pthread_mutex_unlock(&s->lock);
+		free(e);
+		return;
+	}
+	for (victim = s->pbuckets[h & (s->nbuckets - 1)]; victim != NULL; victim = victim->pnext)
+	{
+		if (victim->phash == h && victim->len == len && memcmp(victim->path, path, len) == 0)
+		{
+			pthread_mutex_unlock(&s->lock);
+			free(e);
+			return;
+		}
+	}
+
+	// CLOCK: give referenced entries a second chance.
+	while (s->hand != NULL && s->bytes + sizeof(*e) + len + 1 > s->budget)
+	{
+		victim = s->hand;
+		if (victim->ref)
+		{
+			victim->ref = 0;
+			s->hand = victim->next;
+			continue;
+		}
+		kvfs_dcache_remove(s, victim);
+		s->evictions++;
+	}
+
+	e->pnext = s->pbuckets[h & (s->nbuckets - 1)];
+	s->pbuckets[h & (s->nbuckets - 1)] = e;
+	e->knext = s->kbuckets[e->khash & (s->nbuckets - 1)];
+	s->kbuckets[e->khash & (s->nbuckets - 1)] = e;
+	if (s->hand == NULL)
+	{
+		e->prev = e->next = e;
+		s->hand = e;
+	}
+	else
+	{
+		// Just behind the hand, so it is the last to be looked at.
+		e->next = s->hand;
+		e->prev = s->hand->prev;
+		e->prev->next = e;
+		s->hand->prev = e;
+	}
+	s->bytes += sizeof(*e) + len + 1;
+	s->count++;
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Drop every cached path that translates to key.
+static void kvfs_dcache_invalidate(const char *key)
+{
+	uint64_t kh;
+	int i;
+
+	if (!kvfs_dcache_on)
+		return;
+
+	kh = kvfs_keyhash(key);
+	for (i = 0; i < KVFS_DCACHE_STRIPES; i++)
+	{
+		struct kvfs_dstripe *s = &kvfs_dcache[i];
+		struct kvfs_dentry *e, *next;
+
+		pthread_mutex_lock(&s->lock);
+		s->gen++;
+		for (e = s->kbuckets[kh & (s->nbuckets - 1)]; e != NULL; e = next)
+		{
+			next = e->knext;
+			if (e->khash == kh && strcmp(e->key, key) == 0)
+			{
+				kvfs_dcache_remove(s, e);
+				s->invalidations++;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+// Forget every cached path at once.
+static void kvfs_dcache_flush(void)
+{
+	__atomic_add_fetch(&kvfs_dcache_epoch, 1, __ATOMIC_ACQ_REL);
+}
+
+// Key for a path, through the path cache.  With a namespace index the
+// key is whatever the index says, otherwise the path's hash.
+static void kvfs_path2key(const char *str, size_t len, char key[KVFS_KEY_MAX])
+{
+	uint64_t h, gen, epoch;
+
+	if (!kvfs_dcache_on)
+	{
+		if (kvfs_conf.index)
+			kvfs_index_resolve(str, len, key);
+		else
+			kvfs_conf.keyfn->hash(str, len, key);
+		return;
+	}
+
+	h = kvfs_xxh64(str, len);
+	if (kvfs_dcache_get(str, len, h, key, &gen, &epoch) == 0)
+		return;
+	if (kvfs_conf.index)
+		kvfs_index_resolve(str, len, key);
+	else
+		kvfs_conf.keyfn->hash(str, len, key);
+	kvfs_dcache_put(str, len, h, key, gen, epoch);
+}
+
+// The _impl functions only see keys, but the namespace index needs the
+// name a new key stands for.  kvfs.c translates a request's paths (two
+// for rename and link) just before calling its _impl on the same
+// thread, so each thread remembers its last few translations, and an
+// _impl that makes an object looks its name up here.  Without one the
+// object is not made (see kvfs_index_add()).
+#define KVFS_RECENT	4
+
+static __thread struct {
+	char key[KVFS_KEY_MAX];
+	char path[PATH_MAX];
+} kvfs_recent[KVFS_RECENT];
+static __thread unsigned int kvfs_recent_next;
+
+// The path key was last translated from on this thread, or NULL.
+static const char *kvfs_key_path(const char *key)
+{
+	unsigned int i, slot;
+
+	for (i = 1; i <= KVFS_RECENT; i++)
+	{
+		slot = (kvfs_recent_next - i) % KVFS_RECENT;
+		if (strcmp(kvfs_recent[slot].key, key) == 0)
+			return kvfs_recent[slot].path;
+	}
+	return NULL;
+}
+
+/** Hash the first len bytes of str into key
+ *
+ * The key is written as NUL-terminated lowercase hex into the
+ * caller's buffer, so unlike str2md5() nothing is allocated and
+ * nothing has to be freed.  It uses the hash this root was made
+ * with, and the path cache, and tells the namespace index which
+ * name the key stands for, so kvfs.c must call this rather than
+ * str2md5(); a root that needs it is refused otherwise.
+ */
+void kvfs_str2key(const char *str, size_t len, char key[KVFS_KEY_MAX])
+{
+	unsigned int slot;
+
+	if (!__atomic_load_n(&kvfs_translated, __ATOMIC_RELAXED))
+		__atomic_store_n(&kvfs_translated, 1, __ATOMIC_RELAXED);
+	pthread_once(&kvfs_init_once, kvfs_init);
+
+	if (len == sizeof(KVFS_STATS_FILE) - 1 && memcmp(str, KVFS_STATS_FILE, len) == 0)
+	{
+		strcpy(key, KVFS_STATS_KEY);
+		return;
+	}
+	if (len == sizeof(KVFS_BATCH_FILE) - 1 && memcmp(str, KVFS_BATCH_FILE, len) == 0)
+	{
+		strcpy(key, KVFS_BATCH_KEY);
+		return;
+	}
+	kvfs_path2key(str, len, key);
+
+	if (kvfs_conf.index && len < PATH_MAX)
+	{
+		slot = kvfs_recent_next++ % KVFS_RECENT;
+		strcpy(kvfs_recent[slot].key, key);
+		memcpy(kvfs_recent[slot].path, str, len);
+		kvfs_recent[slot].path[len] = '\0';
+	}
+}
+
+///////////////////////////////////////////////////////////
+//
+// I/O engine
+//
+// Backing reads, writes, opens, stats and fsyncs were all blocking
+// system calls, one per call per FUSE worker.  With KVFS_IO=uring
+// (default sync) they go through one io_uring shared by every thread
+// instead.  A thread puts its request on the ring, where the kernel's
+// submission thread (IORING_SETUP_SQPOLL) picks up what all threads
+// queued, and then, like a group commit, whichever thread finds nobody
+// in io_uring_enter() goes in to wait for everyone and hands out
+// whatever completed, so concurrent requests share the system calls.
+// KVFS_IO_DEPTH (default 256) is the ring size, and so the most
+// requests in flight at once; more wait for room.
+//
+// Requests are never submitted by the FUSE workers themselves: work
+// the kernel can't finish at once goes to the submitting task's
+// io-wq threads, and is cancelled if that task exits, which libfuse
+// workers do when they've been idle.  The submission thread lives as
+// long as the ring.  It goes to sleep after KVFS_IO_IDLE_MS
+// (default 2) without work, and the next request wakes it.
+//
+// The calls keep their libc shape (-1 and errno on failure), and go
+// the old way when the ring is not there: built without
+// -DHAVE_LINUX_IO_URING_H, a kernel without io_uring (before 5.6 the
+// opcodes used here are missing) or with it disabled, or an opcode
+// the kernel's probe doesn't list.
+//
+#ifdef HAVE_LINUX_IO_URING_H
+// One request, on its thread's stack until it completes.
+struct kvfs_ioreq {
+	struct kvfs_ioreq *next;	// waiting
+	pthread_cond_t cond;
+	int res;
+	int done;
+};
+
+static struct {
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_tail, *sq_mask, *sq_flags;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int tail;
+	unsigned int inflight;		// queued, not yet reaped
+	int leader;			// a thread is in io_uring_enter()
+	struct kvfs_ioreq *waiting;
+	unsigned char ops[IORING_OP_LAST];	// opcodes the kernel has
+} kvfs_ring = { -1 };
+
+static pthread_mutex_t kvfs_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvfs_io_room = PTHREAD_COND_INITIALIZER;
+static int kvfs_io_on;
+
+static struct {
+	uint64_t requests;	// through the ring
+	uint64_t enters;	// io_uring_enter() calls to wait
+	uint64_t wakeups;	// of the submission thread
+	uint64_t full;		// requests that waited for room
+	uint64_t batch_max;	// most completions one call waited for
+} kvfs_io_stats;
+
+// Which opcodes the kernel knows.  Returns -1 if it can't say.
+static int kvfs_io_probe(void)
+{
+	struct io_uring_probe *probe;
+	int i, n = 256;
+
+	probe = calloc(1, sizeof(*probe) + n * sizeof(probe->ops[0]));
+	if (probe == NULL)
+		return -1;
+	if (syscall(__NR_io_uring_register, kvfs_ring.fd, IORING_REGISTER_PROBE, probe, n) < 0)
+	{
+		free(probe);
+		return -1;
+	}
+	for (i = 0; i < probe->ops_len && i < n; i++)
+		if (probe->ops[i].op < IORING_OP_LAST && (probe->ops[i].flags & IO_URING_OP_SUPPORTED))
+			kvfs_ring.ops[probe->ops[i].op] = 1;
+	free(probe);
+	return 0;
+}
+
+static void kvfs_io_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+	unsigned int *array, i;
+	char *sq, *cq;
+
+	if (strcmp(kvfs_getenv("KVFS_IO", "sync"), "uring") != 0)
+		return;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SQPOLL;
+	p.sq_thread_idle = kvfs_getenv_num("KVFS_IO_IDLE_MS", 2);
+	kvfs_ring.fd = syscall(__NR_io_uring_setup, (unsigned int) kvfs_getenv_num("KVFS_IO_DEPTH", 256), &p);
+	if (kvfs_ring.fd < 0)
+	{
+		kvfs_error("\nkvfs_io_init: io_uring_setup: %s, using synchronous I/O\n", strerror(errno));
+		return;
+	}
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+		sq_len = cq_len;
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, kvfs_ring.fd, IORING_OFF_SQ_RING);
+	cq = sq;
+	if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, kvfs_ring.fd, IORING_OFF_CQ_RING);
+	kvfs_ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, kvfs_ring.fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || kvfs_ring.sqes == MAP_FAILED || kvfs_io_probe() < 0 ||
+	    !kvfs_ring.ops[IORING_OP_READ] || !kvfs_ring.ops[IORING_OP_WRITE])
+	{
+		// The mappings go with the process; this happens once.
+		kvfs_error("\nkvfs_io_init: io_uring lacks what kvfs needs, using synchronous I/O\n");
+		close(kvfs_ring.fd);
+		kvfs_ring.fd = -1;
+		return;
+	}
+
+	kvfs_ring.entries = p.sq_entries;
+	kvfs_ring.sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	kvfs_ring.sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	kvfs_ring.sq_flags = (unsigned int *) (sq + p.sq_off.flags);
+	kvfs_ring.cq_head = (unsigned int *) (cq + p.cq_off.head);
+	kvfs_ring.cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	kvfs_ring.cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	kvfs_ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	kvfs_ring.tail = *kvfs_ring.sq_tail;
+	// Slot i of the submission queue always holds sqes[i].
+	array = (unsigned int *) (sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	kvfs_io_on = 1;
+	kvfs_info("\nkvfs_io_init: io_uring with %u entries\n", p.sq_entries);
+}
+
+// Take what has completed off the ring.  Called by the leader with
+// kvfs_io_lock held.  Returns how many requests were done.
+static unsigned int kvfs_io_reap(void)
+{
+	unsigned int head = *kvfs_ring.cq_head, n = 0;
+	struct kvfs_ioreq *r, **pp;
+
+	while (head != __atomic_load_n(kvfs_ring.cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe = &kvfs_ring.cqes[head & *kvfs_ring.cq_mask];
+
+		r = (struct kvfs_ioreq *) (uintptr_t) cqe->user_data;
+		r->res = cqe->res;
+		r->done = 1;
+		for (pp = &kvfs_ring.waiting; *pp != r; pp = &(*pp)->next)
+			;
+		*pp = r->next;
+		pthread_cond_signal(&r->cond);
+		head++;
+		n++;
+	}
+	__atomic_store_n(kvfs_ring.cq_head, head, __ATOMIC_RELEASE);
+	if (n > 0 && kvfs_ring.inflight == kvfs_ring.entries)
+		pthread_cond_broadcast(&kvfs_io_room);
+	kvfs_ring.inflight -= n;
+	return n;
+}
+
+// Queue sqe, see it through and return its result, -errno on failure.
+static int kvfs_io_submit(const struct io_uring_sqe *sqe)
+{
+	struct kvfs_ioreq req = { NULL, PTHREAD_COND_INITIALIZER, 0, 0 };
+	unsigned int n;
+
+	__atomic_add_fetch(&kvfs_io_stats.requests, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&kvfs_io_lock);
+	if (kvfs_ring.inflight == kvfs_ring.entries)
+		__atomic_add_fetch(&kvfs_io_stats.full, 1, __ATOMIC_RELAXED);
+	while (kvfs_ring.inflight == kvfs_ring.entries)
+		pthread_cond_wait(&kvfs_io_room, &kvfs_io_lock);
+	kvfs_ring.sqes[kvfs_ring.tail & *kvfs_ring.sq_mask] = *sqe;
+	kvfs_ring.sqes[kvfs_ring.tail & *kvfs_ring.sq_mask].user_data = (uintptr_t) &req;
+	__atomic_store_n(kvfs_ring.sq_tail, ++kvfs_ring.tail, __ATOMIC_RELEASE);
+	kvfs_ring.inflight++;
+	req.next = kvfs_ring.waiting;
+	kvfs_ring.waiting = &req;
+	// The submission thread checks for work once more after it says
+	// it sleeps, so either it sees the new tail or this sees the flag.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(kvfs_ring.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+	{
+		syscall(__NR_io_uring_enter, kvfs_ring.fd, 0, 0, IORING_ENTER_SQ_WAKEUP, NULL, 0);
+		__atomic_add_fetch(&kvfs_io_stats.wakeups, 1, __ATOMIC_RELAXED);
+	}
+
+	while (!req.done)
+	{
+		if (kvfs_ring.leader)
+		{
+			pthread_cond_wait(&req.cond, &kvfs_io_lock);
+			continue;
+		}
+		// Wait for everyone until something completes, which may
+		// not be ours.
+		kvfs_ring.leader = 1;
+		pthread_mutex_unlock(&kvfs_io_lock);
+		if (syscall(__NR_io_uring_enter, kvfs_ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR)
+			kvfs_error("\nkvfs_io_submit: io_uring_enter: %s\n", strerror(errno));
+		__atomic_add_fetch(&kvfs_io_stats.enters, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&kvfs_io_lock);
+		n = kvfs_io_reap();
+		if (n > kvfs_io_stats.batch_max)
+			__atomic_store_n(&kvfs_io_stats.batch_max, n, __ATOMIC_RELAXED);
+		kvfs_ring.leader = 0;
+		// Someone still waiting takes over.
+		if (req.done && kvfs_ring.waiting != NULL)
+			pthread_cond_signal(&kvfs_ring.waiting->cond);
+	}
+	pthread_mutex_unlock(&kvfs_io_lock);
+	pthread_cond_destroy(&req.cond);
+	return req.res;
+}
+
+// Fill sqe for op on fd, if the ring can do op.
+static int kvfs_io_prep(struct io_uring_sqe *sqe, int op, int fd)
+{
+	if (!kvfs_io_on || !kvfs_ring.ops[op])
+		return 0;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	return 1;
+}
+
+// A result from kvfs_io_submit() as libc returns it.
+static long kvfs_io_result(int res)
+{
+	if (res >= 0)
+		return res;
+	errno = -res;
+	return -1;
+}
+#else
+static void kvfs_io_init(void)
+{
+	if (strcmp(kvfs_getenv("KVFS_IO", "sync"), "uring") == 0)
+		kvfs_error("\nkvfs_io_init: built without -DHAVE_LINUX_IO_URING_H, using synchronous I/O\n");
+}
+#endif
+
+static ssize_t kvfs_io_pread(int fd, void *buf, size_t size, off_t offset)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct io_uring_sqe sqe;
+
+	if (kvfs_io_prep(&sqe, IORING_OP_READ, fd))
+	{
+		sqe.addr = (uintptr_t) buf;
+		sqe.len = size;
+		sqe.off = offset;
+		return kvfs_io_result(kvfs_io_submit(&sqe));
+	}
+#endif
+	return pread(fd, buf, size, offset);
+}
+
+static ssize_t kvfs_io_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct io_uring_sqe sqe;
+
+	if (kvfs_io_prep(&sqe, IORING_OP_WRITE, fd))
+	{
+		sqe.addr = (uintptr_t) buf;
+		sqe.len = size;
+		sqe.off = offset;
+		return kvfs_io_result(kvfs_io_submit(&sqe));
+	}
+#endif
+	return pwrite(fd, buf, size, offset);
+}
+
+static int kvfs_io_open(const char *path, int flags, mode_t mode)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct io_uring_sqe sqe;
+
+	if (kvfs_io_prep(&sqe, IORING_OP_OPENAT, AT_FDCWD))
+	{
+		sqe.addr = (uintptr_t) path;
+		sqe.open_flags = flags | O_LARGEFILE;
+		sqe.len = mode;
+		return kvfs_io_result(kvfs_io_submit(&sqe));
+	}
+#endif
+	return open(path, flags, mode);
+}
+
+static int kvfs_io_lstat(const char *path, struct stat *st)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct io_uring_sqe sqe;
+	struct statx stx;
+
+	if (kvfs_io_prep(&sqe, IORING_OP_STATX, AT_FDCWD))
+	{
+		sqe.addr = (uintptr_t) path;
+		sqe.statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe.len = STATX_BASIC_STATS;
+		sqe.off = (uintptr_t) &stx;
+		if (kvfs_io_result(kvfs_io_submit(&sqe)) < 0)
+			return -1;
+		memset(st, 0, sizeof(*st));
+		st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+		st->st_ino = stx.stx_ino;
+		st->st_mode = stx.stx_mode;
+		st->st_nlink = stx.stx_nlink;
+		st->st_uid = stx.stx_uid;
+		st->st_gid = stx.stx_gid;
+		st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+		st->st_size = stx.stx_size;
+		st->st_blksize = stx.stx_blksize;
+		st->st_blocks = stx.stx_blocks;
+		st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+		st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+		st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+		st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+		st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+		st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+		return 0;
+	}
+#endif
+	return lstat(path, st);
+}
+
+static int kvfs_io_fsync(int fd, int datasync)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct io_uring_sqe sqe;
+
+	if (kvfs_io_prep(&sqe, IORING_OP_FSYNC, fd))
+	{
+		sqe.fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+		return kvfs_io_result(kvfs_io_submit(&sqe));
+	}
+#endif
+	return datasync ? fdatasync(fd) : fsync(fd);
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_io_format(char *buf, size_t size)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	uint64_t requests = __atomic_load_n(&kvfs_io_stats.requests, __ATOMIC_RELAXED);
+	uint64_t enters = __atomic_load_n(&kvfs_io_stats.enters, __ATOMIC_RELAXED);
+
+	return snprintf(buf, size,
+		"io.engine %s\nio.requests %llu\nio.enters %llu\nio.per_enter %.2f\n"
+		"io.batch_max %llu\nio.wakeups %llu\nio.full %llu\n",
+		kvfs_io_on ? "uring" : "sync", (unsigned long long) requests, (unsigned long long) enters,
+		enters ? (double) requests / enters : 0.0,
+		(unsigned long long) __atomic_load_n(&kvfs_io_stats.batch_max, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_io_stats.wakeups, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_io_stats.full, __ATOMIC_RELAXED));
+#else
+	return snprintf(buf, size, "io.engine sync\n");
+#endif
+}
+#endif
+
+///////////////////////////////////////////////////////////
+//
+// Read-ahead
+//
+// Each read used to be one pread per FUSE request, so a sequential
+// scan waited on the backing store once per 128 KiB.  With
+// KVFS_READAHEAD=n (off by default) a handle that reads sequentially
+// has the data ahead of it read on background threads
+// (KVFS_READAHEAD_THREADS, default 4) into a page cache shared by all
+// handles, KVFS_PAGECACHE_BYTES big (default 64 MiB), and its reads
+// are copied from there when every block they cover is in it.
+//
+// The window starts at two blocks and doubles on every sequential
+// read up to n; a read anywhere else resets it, so strided and random
+// readers never start prefetching.  More is asked for once the reader
+// is within half a window of what was asked for last, as Linux does.
+// Reads near where the last one ended count as sequential, since
+// FUSE worker threads may hand the pieces of a large read over out of
+// order.
+//
+// Blocks are found by key and block number, in lock stripes with
+// CLOCK eviction like the other caches.  Anything that writes or
+// truncates a key drops its blocks and bumps the stripe generation,
+// so a prefetch that read the old data before the write does not
+// cache it.
+//
+#define KVFS_PAGE_SIZE		(128 << 10)
+#define KVFS_PCACHE_STRIPES	16
+#define KVFS_RA_QUEUE		64
+
+struct kvfs_page {
+	struct kvfs_page *next;		// hash chain
+	uint64_t hash;
+	off_t block;
+	size_t len;			// short at the end of the file
+	unsigned char ref;		// CLOCK
+	unsigned char used;		// read since it was prefetched
+	char key[KVFS_KEY_MAX];		// empty for a free slot
+	char *data;
+};
+
+struct kvfs_pstripe {
+	pthread_mutex_t lock;
+	struct kvfs_page **buckets;
+	struct kvfs_page *pages;
+	long nbuckets;
+	long capacity;
+	long count;			// slots handed out so far
+	long hand;
+	uint64_t gen;
+	uint64_t prefetched, wasted;
+};
+
+// What one handle has been reading.
+struct kvfs_rahandle {
+	pthread_mutex_t lock;
+	off_t next;			// where a sequential reader reads next
+	off_t ahead;			// prefetch asked for up to here
+	size_t window;
+};
+
+struct kvfs_rajob {
+	int fd;				// a dup, closed by the worker
+	off_t block;
+	char key[KVFS_KEY_MAX];
+};
+
+static struct kvfs_pstripe kvfs_pcache[KVFS_PCACHE_STRIPES];
+static int kvfs_pcache_on;
+static size_t kvfs_ra_max;
+
+static struct kvfs_rahandle **kvfs_ra_table;
+static int kvfs_ra_fds;
+
+static struct kvfs_rajob kvfs_ra_queue[KVFS_RA_QUEUE];
+static unsigned int kvfs_ra_head, kvfs_ra_tail;
+static pthread_mutex_t kvfs_ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvfs_ra_cond = PTHREAD_COND_INITIALIZER;
+
+static struct {
+	uint64_t served;	// reads copied from the page cache
+	uint64_t missed;	// reads that had to pread
+	uint64_t dropped;	// blocks the threads were too far behind to prefetch
+} kvfs_ra_stats;
+
+// How many fds the per-handle tables cover.  Handles on fds past that
+// are served without them.
+static int kvfs_fd_slots(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 65536)
+		return rl.rlim_cur;
+	return 65536;
+}
+
+static uint64_t kvfs_page_hash(const char *key, off_t block)
+{
+	return kvfs_keyhash(key) ^ ((uint64_t) block * 0x9e3779b97f4a7c15ULL);
+}
+
+static struct kvfs_pstripe *kvfs_page_stripe(uint64_t h)
+{
+	return &kvfs_pcache[(h >> 32) % KVFS_PCACHE_STRIPES];
+}
+
+// Called with the stripe lock held.
+static struct kvfs_page *kvfs_page_find(struct kvfs_pstripe *s, uint64_t h, const char *key, off_t block)
+{
+	struct kvfs_page *p;
+
+	for (p = s->buckets[h & (s->nbuckets - 1)]; p != NULL; p = p->next)
+		if (p->hash == h && p->block == block && strcmp(p->key, key) == 0)
+			return p;
+	return NULL;
+}
+
+// Take p out of its chain and free its slot.  Called with the stripe
+// lock held.
+static void kvfs_page_remove(struct kvfs_pstripe *s, struct kvfs_page *p)
+{
+	struct kvfs_page **pp = &s->buckets[p->hash & (s->nbuckets - 1)];
+
+	while (*pp != p)
+		pp = &(*pp)->next;
+	*pp = p->next;
+	if (!p->used)
+		s->wasted++;
+	p->key[0] = '\0';
+}
+
+// Cache len bytes of block of key, unless the stripe has been
+// invalidated since gen was read.
+static void kvfs_page_put(const char *key, off_t block, const char *data, size_t len, uint64_t gen)
+{
+	uint64_t h = kvfs_page_hash(key, block);
+	struct kvfs_pstripe *s = kvfs_page_stripe(h);
+	struct kvfs_page *p;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->gen != gen || kvfs_page_find(s, h, key, block) != NULL)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+
+	if (s->count < s->capacity)
+		p = &s->pages[s->count++];
+	else
+	{
+		for (;;)
+		{
+			p = &s->pages[s->hand];
+			s->hand = (s->hand + 1) % s->capacity;
+			if (p->key[0] == '\0')
+				break;
+			if (!p->ref)
+			{
+				kvfs_page_remove(s, p);
+				break;
+			}
+			p->ref = 0;
+		}
+	}
+	if (p->data == NULL && (p->data = malloc(KVFS_PAGE_SIZE)) == NULL)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+
+	p->hash = h;
+	p->block = block;
+	p->len = len;
+	p->ref = 0;
+	p->used = 0;
+	strcpy(p->key, key);
+	memcpy(p->data, data, len);
+	p->next = s->buckets[h & (s->nbuckets - 1)];
+	s->buckets[h & (s->nbuckets - 1)] = p;
+	s->prefetched++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Generation of the stripe block of key falls in, for kvfs_page_put().
+static uint64_t kvfs_page_gen(const char *key, off_t block)
+{
+	struct kvfs_pstripe *s = kvfs_page_stripe(kvfs_page_hash(key, block));
+	uint64_t gen;
+
+	pthread_mutex_lock(&s->lock);
+	gen = s->gen;
+	pthread_mutex_unlock(&s->lock);
+	return gen;
+}
+
+static int kvfs_page_cached(const char *key, off_t block)
+{
+	uint64_t h = kvfs_page_hash(key, block);
+	struct kvfs_pstripe *s = kvfs_page_stripe(h);
+	int found;
+
+	pthread_mutex_lock(&s->lock);
+	found = kvfs_page_find(s, h, key, block) != NULL;
+	pthread_mutex_unlock(&s->lock);
+	return found;
+}
+
+// Copy size bytes at offset of key out of the cache.  Returns how many
+// there were, or -1 unless the cache holds all of them.  A short block
+// ended the file when it was read, but a write past it since then
+// only dropped the blocks it touched, so a read that wants more than
+// a short block holds goes to pread instead.
+static ssize_t kvfs_pcache_read(const char *key, char *buf, size_t size, off_t offset)
+{
+	off_t block = offset / KVFS_PAGE_SIZE;
+	size_t done = 0, in, n;
+	struct kvfs_pstripe *s;
+	struct kvfs_page *p;
+	uint64_t h;
+
+	while (done < size)
+	{
+		h = kvfs_page_hash(key, block);
+		s = kvfs_page_stripe(h);
+		pthread_mutex_lock(&s->lock);
+		p = kvfs_page_find(s, h, key, block);
+		if (p == NULL)
+		{
+			pthread_mutex_unlock(&s->lock);
+			return -1;
+		}
+		in = (offset + done) - block * (off_t) KVFS_PAGE_SIZE;
+		n = in < p->len ? p->len - in : 0;
+		if (n < size - done && p->len < KVFS_PAGE_SIZE)
+		{
+			pthread_mutex_unlock(&s->lock);
+			return -1;
+		}
+		if (n > size - done)
+			n = size - done;
+		memcpy(buf + done, p->data + in, n);
+		p->ref = 1;
+		p->used = 1;
+		pthread_mutex_unlock(&s->lock);
+
+		done += n;
+		block++;
+	}
+	return done;
+}
+
+// Drop the cached blocks of key that [offset, offset + len) touches,
+// or all of them if len is 0.
+static void kvfs_pcache_invalidate(const char *key, off_t offset, size_t len)
+{
+	struct kvfs_pstripe *s;
+	struct kvfs_page *p;
+	off_t block;
+	uint64_t h;
+	long i;
+
+	if (!kvfs_pcache_on)
+		return;
+
+	if (len > 0)
+	{
+		for (block = offset / KVFS_PAGE_SIZE; block <= (off_t) ((offset + len - 1) / KVFS_PAGE_SIZE); block++)
+		{
+			h = kvfs_page_hash(key, block);
+			s = kvfs_page_stripe(h);
+			pthread_mutex_lock(&s->lock);
+			p = kvfs_page_find(s, h, key, block);
+			if (p != NULL)
+				kvfs_page_remove(s, p);
+			s->gen++;
+			pthread_mutex_unlock(&s->lock);
+		}
+		return;
+	}
+
+	for (i = 0; i < KVFS_PCACHE_STRIPES; i++)
+	{
+		s = &kvfs_pcache[i];
+		pthread_mutex_lock(&s->lock);
+		for (p = s->pages; p < s->pages + s->count; p++)
+			if (p->key[0] != '\0' && strcmp(p->key, key) == 0)
+				kvfs_page_remove(s, p);
+		s->gen++;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void *kvfs_ra_thread(void *arg)
+{
+	struct kvfs_rajob job;
+	char *buf = malloc(KVFS_PAGE_SIZE);
+	uint64_t gen;
+	ssize_t n;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&kvfs_ra_lock);
+		while (kvfs_ra_head == kvfs_ra_tail)
+			pthread_cond_wait(&kvfs_ra_cond, &kvfs_ra_lock);
+		job = kvfs_ra_queue[kvfs_ra_tail++ % KVFS_RA_QUEUE];
+		pthread_mutex_unlock(&kvfs_ra_lock);
+
+		if (buf != NULL && !kvfs_page_cached(job.key, job.block))
+		{
+			gen = kvfs_page_gen(job.key, job.block);
+			n = kvfs_io_pread(job.fd, buf, KVFS_PAGE_SIZE, job.block * (off_t) KVFS_PAGE_SIZE);
+			if (n > 0)
+				kvfs_page_put(job.key, job.block, buf, n, gen);
+		}
+		close(job.fd);
+	}
+	return NULL;
+}
+
+// Queue blocks [first, last) of key for the read-ahead threads, one
+// job each so that they are read in parallel, and drop the ones the
+// threads are too far behind for.
+static void kvfs_ra_submit(const char *key, int fd, off_t first, off_t last)
+{
+	struct kvfs_rajob *job;
+	int dupfd;
+
+	pthread_mutex_lock(&kvfs_ra_lock);
+	for (; first < last; first++)
+	{
+		if (kvfs_ra_head - kvfs_ra_tail >= KVFS_RA_QUEUE || (dupfd = dup(fd)) < 0)
+		{
+			__atomic_add_fetch(&kvfs_ra_stats.dropped, last - first, __ATOMIC_RELAXED);
+			break;
+		}
+		job = &kvfs_ra_queue[kvfs_ra_head++ % KVFS_RA_QUEUE];
+		job->fd = dupfd;
+		job->block = first;
+		strcpy(job->key, key);
+		pthread_cond_signal(&kvfs_ra_cond);
+	}
+	pthread_mutex_unlock(&kvfs_ra_lock);
+}
+
+static void kvfs_ra_init(void)
+{
+	long capacity, nbuckets, threads, i;
+	pthread_t thread;
+
+	if (kvfs_conf.ra_bytes == 0)
+		return;
+	kvfs_ra_max = kvfs_conf.ra_bytes < 2 * KVFS_PAGE_SIZE ? 2 * KVFS_PAGE_SIZE : kvfs_conf.ra_bytes;
+
+	capacity = kvfs_conf.pcache_bytes / KVFS_PAGE_SIZE / KVFS_PCACHE_STRIPES;
+	if (capacity < 4)
+		capacity = 4;
+	for (nbuckets = 16; nbuckets < capacity * 2; nbuckets *= 2)
+		;
+	for (i = 0; i < KVFS_PCACHE_STRIPES; i++)
+	{
+		struct kvfs_pstripe *s = &kvfs_pcache[i];
+
+		pthread_mutex_init(&s->lock, NULL);
+		s->buckets = calloc(nbuckets, sizeof(*s->buckets));
+		s->pages = calloc(capacity, sizeof(*s->pages));
+		if (s->buckets == NULL || s->pages == NULL)
+		{
+			kvfs_error("\nkvfs_ra_init: out of memory, read-ahead disabled\n");
+			return;
+		}
+		s->nbuckets = nbuckets;
+		s->capacity = capacity;
+	}
+
+	kvfs_ra_fds = kvfs_fd_slots();
+	kvfs_ra_table = calloc(kvfs_ra_fds, sizeof(*kvfs_ra_table));
+	if (kvfs_ra_table == NULL)
+	{
+		kvfs_error("\nkvfs_ra_init: out of memory, read-ahead disabled\n");
+		kvfs_ra_fds = 0;
+		return;
+	}
+
+	threads = kvfs_getenv_num("KVFS_READAHEAD_THREADS", 4);
+	for (i = 0; i < threads; i++)
+	{
+		if (pthread_create(&thread, NULL, kvfs_ra_thread, NULL) != 0)
+			break;
+		pthread_detach(thread);
+	}
+	if (i == 0)
+	{
+		kvfs_error("\nkvfs_ra_init: no read-ahead threads, read-ahead disabled\n");
+		return;
+	}
+	kvfs_pcache_on = 1;
+}
+
+// Serve a read through handle fd from the page cache if it can be,
+// and ask for what a sequential reader will want next.  Returns the
+// bytes read, or -1 to have the caller pread.
+static ssize_t kvfs_ra_read(const char *key, int fd, char *buf, size_t size, off_t offset)
+{
+	struct kvfs_rahandle *h, *none = NULL;
+	off_t end = offset + size, first = 0, last = 0;
+	ssize_t len;
+
+	if (!kvfs_pcache_on || fd < 0 || fd >= kvfs_ra_fds)
+		return -1;
+
+	h = __atomic_load_n(&kvfs_ra_table[fd], __ATOMIC_ACQUIRE);
+	if (h == NULL)
+	{
+		h = calloc(1, sizeof(*h));
+		if (h == NULL)
+			return -1;
+		pthread_mutex_init(&h->lock, NULL);
+		if (!__atomic_compare_exchange_n(&kvfs_ra_table[fd], &none, h, 0,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			pthread_mutex_destroy(&h->lock);
+			free(h);
+			h = none;
+		}
+	}
+
+	pthread_mutex_lock(&h->lock);
+	if (offset >= h->next - KVFS_PAGE_SIZE && offset <= h->next + KVFS_PAGE_SIZE)
+	{
+		h->window = h->window == 0 ? 2 * KVFS_PAGE_SIZE : h->window * 2;
+		if (h->window > kvfs_ra_max)
+			h->window = kvfs_ra_max;
+		if (end + (off_t) h->window / 2 > h->ahead)
+		{
+			first = (h->ahead > end ? h->ahead : end) / KVFS_PAGE_SIZE;
+			last = (end + h->window + KVFS_PAGE_SIZE - 1) / KVFS_PAGE_SIZE;
+			h->ahead = last * KVFS_PAGE_SIZE;
+		}
+	}
+	else
+	{
+		h->window = 0;
+		h->ahead = 0;
+	}
+	h->next = end;
+	pthread_mutex_unlock(&h->lock);
+
+	if (last > first)
+		kvfs_ra_submit(key, fd, first, last);
+
+	len = kvfs_pcache_read(key, buf, size, offset);
+	__atomic_add_fetch(len >= 0 ? &kvfs_ra_stats.served : &kvfs_ra_stats.missed, 1, __ATOMIC_RELAXED);
+	return len;
+}
+
+// Forget handle fd before it is closed.
+static void kvfs_ra_release(int fd)
+{
+	struct kvfs_rahandle *h;
+
+	if (fd < 0 || fd >= kvfs_ra_fds)
+		return;
+	h = __atomic_exchange_n(&kvfs_ra_table[fd], NULL, __ATOMIC_ACQ_REL);
+	if (h != NULL)
+	{
+		pthread_mutex_destroy(&h->lock);
+		free(h);
+	}
+}
+
+///////////////////////////////////////////////////////////
+//
+// Write-back cache
+//
+// Log appenders and shell redirections write a few bytes at a time,
+// and each write used to be a pwrite of its own.  With
+// KVFS_WRITEBACK_BYTES=n (off by default) every handle open for
+// writing gets an n byte buffer the first time it is written to in
+// pieces smaller than that.  Writes that land inside or right after
+// what is buffered are copied in; anything else, and a full buffer,
+// writes the buffer out.  A full buffer only writes up to the last 4
+// KiB boundary and keeps the rest, so a stream of appends goes to the
+// backing file in large aligned pieces.
+//
+// Buffered data is written on flush (each close), fsync and release,
+// before a read through the same handle, and before anything that
+// looks at the key's size or caches its attributes (getattr,
+// fgetattr, readdir, open, truncate), so it is never seen stale
+// through kvfs.  A failed write of
+// buffered data is kept and returned by the next flush or fsync, as
+// close(2) and fsync(2) would.
+//
+// Handles are bare backing fds, so the buffers hang off a table
+// indexed by fd.  Buffers holding data are also on a list, which is
+// how the key-based ops find them.  Lock order: buffer, then list.
+//
+#define KVFS_WB_ALIGN	4096
+
+struct kvfs_wbuf {
+	pthread_mutex_t lock;
+	struct kvfs_wbuf *prev, *next;	// dirty list, under kvfs_wb_lock
+	int refs;			// kvfs_wb_flush_key() users, under kvfs_wb_lock
+	int fd;
+	int error;			// -errno of a failed write, until reported
+	off_t off;
+	size_t len;
+	char key[KVFS_KEY_MAX];
+	char data[];
+};
+
+static struct kvfs_wbuf **kvfs_wb_table;
+static int kvfs_wb_fds;
+static struct kvfs_wbuf kvfs_wb_dirty = { .prev = &kvfs_wb_dirty, .next = &kvfs_wb_dirty };
+static pthread_mutex_t kvfs_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static int kvfs_wb_ndirty;
+
+static struct {
+	uint64_t writes;	// write requests buffered
+	uint64_t bytes;		// bytes in them
+	uint64_t backing_writes;
+	uint64_t backing_bytes;
+	uint64_t errors;
+} kvfs_wb_stats;
+
+static void kvfs_wb_init(void)
+{
+	if (kvfs_conf.wb_bytes == 0)
+		return;
+	kvfs_conf.wb_bytes = (kvfs_conf.wb_bytes + KVFS_WB_ALIGN - 1) & ~(size_t) (KVFS_WB_ALIGN - 1);
+	if (kvfs_wb_table != NULL)
+		return;
+
+	// Handles on fds past the table are not buffered.
+	kvfs_wb_fds = kvfs_fd_slots();
+	kvfs_wb_table = calloc(kvfs_wb_fds, sizeof(*kvfs_wb_table));
+	if (kvfs_wb_table == NULL)
+	{
+		kvfs_error("\nkvfs_wb_init: no memory for %d handles, write-back is off\n", kvfs_wb_fds);
+		kvfs_conf.wb_bytes = 0;
+		kvfs_wb_fds = 0;
+	}
+}
+
+static void kvfs_wb_count(uint64_t *counter, uint64_t n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+// Write out the buffer up to the last KVFS_WB_ALIGN boundary in it, or
+// all of it.  Called with wb->lock held.
+static void kvfs_wb_writeout(struct kvfs_wbuf *wb, int all)
+{
+	off_t end = wb->off + wb->len, cut;
+	size_t done = 0, keep;
+	ssize_t n;
+	char msg[128];
+
+	cut = all ? end : end & ~(off_t) (KVFS_WB_ALIGN - 1);
+	if (cut <= wb->off)
+		cut = end;
+
+	while (done < (size_t) (cut - wb->off))
+	{
+		n = kvfs_io_pwrite(wb->fd, wb->data + done, cut - wb->off - done, wb->off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			// The data is lost; the next flush or fsync says so.
+			wb->error = n < 0 ? -errno : -EIO;
+			kvfs_wb_count(&kvfs_wb_stats.errors, 1);
+			kvfs_error("\nkvfs_wb_writeout: %s at %lld: %s\n", wb->key, (long long) wb->off + done,
+				strerror_r(-wb->error, msg, sizeof(msg)));
+			done = cut - wb->off;
+			break;
+		}
+		kvfs_pcache_invalidate(wb->key, wb->off + done, n);
+		kvfs_mm_invalidate(wb->key);
+		done += n;
+		kvfs_wb_count(&kvfs_wb_stats.backing_writes, 1);
+		kvfs_wb_count(&kvfs_wb_stats.backing_bytes, n);
+	}
+
+	keep = end - cut;
+	memmove(wb->data, wb->data + done, keep);
+	wb->off = cut;
+	wb->len = keep;
+
+	if (keep == 0)
+	{
+		pthread_mutex_lock(&kvfs_wb_lock);
+		if (wb->prev != NULL)
+		{
+			wb->prev->next = wb->next;
+			wb->next->prev = wb->prev;
+			wb->prev = wb->next = NULL;
+			__atomic_sub_fetch(&kvfs_wb_ndirty, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&kvfs_wb_lock);
+	}
+}
+
+// The buffer of handle fd, or NULL.
+static struct kvfs_wbuf *kvfs_wb_find(int fd)
+{
+	if (fd < 0 || fd >= kvfs_wb_fds)
+		return NULL;
+	return __atomic_load_n(&kvfs_wb_table[fd], __ATOMIC_ACQUIRE);
+}
+
+// Buffer a write of size bytes at offset through handle fd.  Returns
+// 1 if it was, 0 if the caller should write it itself, which it may
+// then do without anything buffered getting in the way.
+static int kvfs_wb_write(const char *key, int fd, const char *buf, size_t size, off_t offset)
+{
+	struct kvfs_wbuf *wb, *none = NULL;
+
+	if (kvfs_conf.wb_bytes == 0 || fd < 0 || fd >= kvfs_wb_fds)
+		return 0;
+
+	wb = kvfs_wb_find(fd);
+	if (wb == NULL)
+	{
+		if (size >= kvfs_conf.wb_bytes)
+			return 0;
+		wb = malloc(sizeof(*wb) + kvfs_conf.wb_bytes);
+		if (wb == NULL)
+			return 0;
+		pthread_mutex_init(&wb->lock, NULL);
+		wb->prev = wb->next = NULL;
+		wb->refs = 0;
+		wb->fd = fd;
+		wb->error = 0;
+		wb->off = 0;
+		wb->len = 0;
+		snprintf(wb->key, sizeof(wb->key), "%s", key);
+		// Two writes on a new handle may race to add one.
+		if (!__atomic_compare_exchange_n(&kvfs_wb_table[fd], &none, wb, 0,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			pthread_mutex_destroy(&wb->lock);
+			free(wb);
+			wb = none;
+		}
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb->len > 0 && offset == wb->off + (off_t) wb->len &&
+	    wb->len + size > kvfs_conf.wb_bytes)
+		kvfs_wb_writeout(wb, 0);	// a stream running past the end
+	if (wb->len > 0 && (offset < wb->off || offset > wb->off + (off_t) wb->len ||
+			    offset + size > wb->off + kvfs_conf.wb_bytes))
+		kvfs_wb_writeout(wb, 1);
+	if (size >= kvfs_conf.wb_bytes)
+	{
+		pthread_mutex_unlock(&wb->lock);
+		return 0;
+	}
+
+	if (wb->len == 0)
+	{
+		wb->off = offset;
+		pthread_mutex_lock(&kvfs_wb_lock);
+		wb->next = &kvfs_wb_dirty;
+		wb->prev = kvfs_wb_dirty.prev;
+		wb->prev->next = wb;
+		kvfs_wb_dirty.prev = wb;
+		__atomic_add_fetch(&kvfs_wb_ndirty, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&kvfs_wb_lock);
+	}
+	memcpy(wb->data + (offset - wb->off), buf, size);
+	if (offset + size > wb->off + wb->len)
+		wb->len = offset + size - wb->off;
+	pthread_mutex_unlock(&wb->lock);
+
+	kvfs_wb_count(&kvfs_wb_stats.writes, 1);
+	kvfs_wb_count(&kvfs_wb_stats.bytes, size);
+	return 1;
+}
+
+// Write out what handle fd has buffered.  If report is set, returns
+// the error of any buffered write that failed since it last was, and
+// forgets it.
+static int kvfs_wb_flush(int fd, int report)
+{
+	struct kvfs_wbuf *wb = kvfs_wb_find(fd);
+	int result = 0;
+
+	if (wb == NULL)
+		return 0;
+	pthread_mutex_lock(&wb->lock);
+	if (wb->len > 0)
+		kvfs_wb_writeout(wb, 1);
+	if (report)
+	{
+		result = wb->error;
+		wb->error = 0;
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return result;
+}
+
+// Write out every handle's buffered data for key.  Errors stay with
+// the handles, for their own flush to report.
+static void kvfs_wb_flush_key(const char *key)
+{
+	struct kvfs_wbuf *wb;
+
+	if (__atomic_load_n(&kvfs_wb_ndirty, __ATOMIC_RELAXED) == 0)
+		return;
+	for (;;)
+	{
+		pthread_mutex_lock(&kvfs_wb_lock);
+		for (wb = kvfs_wb_dirty.next; wb != &kvfs_wb_dirty; wb = wb->next)
+			if (strcmp(wb->key, key) == 0)
+				break;
+		if (wb == &kvfs_wb_dirty)
+		{
+			pthread_mutex_unlock(&kvfs_wb_lock);
+			return;
+		}
+		// Keeps release from freeing it once the list lock is dropped.
+		wb->refs++;
+		pthread_mutex_unlock(&kvfs_wb_lock);
+
+		pthread_mutex_lock(&wb->lock);
+		if (wb->len > 0)
+			kvfs_wb_writeout(wb, 1);
+		pthread_mutex_unlock(&wb->lock);
+
+		pthread_mutex_lock(&kvfs_wb_lock);
+		wb->refs--;
+		pthread_mutex_unlock(&kvfs_wb_lock);
+	}
+}
+
+// Write out and drop handle fd's buffer before the fd is closed.
+static int kvfs_wb_release(int fd)
+{
+	struct kvfs_wbuf *wb;
+	int result, refs;
+
+	if (fd < 0 || fd >= kvfs_wb_fds)
+		return 0;
+	wb = __atomic_exchange_n(&kvfs_wb_table[fd], NULL, __ATOMIC_ACQ_REL);
+	if (wb == NULL)
+		return 0;
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb->len > 0)
+		kvfs_wb_writeout(wb, 1);
+	result = wb->error;
+	pthread_mutex_unlock(&wb->lock);
+
+	// Off the list now; wait out a kvfs_wb_flush_key() still holding it.
+	do
+	{
+		pthread_mutex_lock(&kvfs_wb_lock);
+		refs = wb->refs;
+		pthread_mutex_unlock(&kvfs_wb_lock);
+		if (refs > 0)
+			sched_yield();
+	} while (refs > 0);
+
+	pthread_mutex_destroy(&wb->lock);
+	free(wb);
+	return result;
+}
+
+///////////////////////////////////////////////////////////
+//
+// Backing fd cache
+//
+// A program that opens a file, reads a little and closes it again
+// costs a backing open(), with its path walk, and a close() each time.
+// With KVFS_FD_CACHE=n (default 0, off), the backing fds of up to n
+// released handles are kept, by key and open flags, and an open with
+// the same flags takes one instead of opening.  Any number of idle fds
+// may be kept for one key, so concurrent opens of a hot file each find
+// one.  Past n, the least recently released fd is closed.  n is held
+// to a quarter of RLIMIT_NOFILE, since the per-handle tables only
+// cover fds under that.
+//
+// A handle still owns its fd while it is open, so everything keyed by
+// fd is unchanged.  What a cached fd skips is the backing open's
+// checks, so anything that could make one wrong (unlink, rename,
+// chmod, chown, and replacing a backing file for dedup or compression)
+// calls kvfs_fdc_invalidate(), which closes the key's idle fds and
+// bumps its generation.  A handle opened under an older generation is
+// closed on release rather than kept.  Changes made to the root behind
+// kvfs's back are not noticed, which is why this is off by default.
+// Opens with O_TRUNC, creates and fds past the table always open and
+// close.
+//
+#define KVFS_FDC_STRIPES	16
+#define KVFS_FDC_GENS		4096	// generations, by key hash
+
+struct kvfs_fdentry {
+	struct kvfs_fdentry *prev, *next;	// LRU, most recent first
+	struct kvfs_fdentry *chain;		// hash bucket
+	uint64_t hash;
+	int fd;
+	int flags;
+	char key[KVFS_KEY_MAX];
+};
+
+struct kvfs_fdstripe {
+	pthread_mutex_t lock;
+	struct kvfs_fdentry lru;
+	struct kvfs_fdentry **buckets;
+	int nbuckets;		// a power of two
+	int count;
+	int capacity;
+	uint64_t hits, misses, evictions, invalidations, stale;
+} __attribute__((aligned(64)));
+
+// What open put in a handle's fd, looked at by release: the key's
+// generation when opened (0 if not cacheable) above the open flags.
+// Slots are read and written atomically; an fd closed by one thread
+// may be opened by another at once.
+#define KVFS_FDC_HANDLE(gen, flags)	((uint64_t) (gen) << 32 | (uint32_t) (flags))
+
+static struct kvfs_fdstripe kvfs_fdc[KVFS_FDC_STRIPES];
+static uint32_t kvfs_fdc_gens[KVFS_FDC_GENS];
+static uint64_t *kvfs_fdc_table;
+static int kvfs_fdc_fds;
+static int kvfs_fdc_on;
+
+static struct kvfs_fdstripe *kvfs_fdc_stripe(const char *key, uint64_t *h, uint32_t **gen)
+{
+	*h = kvfs_keyhash(key);
+	*gen = &kvfs_fdc_gens[(*h >> 16) % KVFS_FDC_GENS];
+	return &kvfs_fdc[*h >> 60];
+}
+
+// Called with the stripe lock held.
+static void kvfs_fdc_unlink(struct kvfs_fdstripe *s, struct kvfs_fdentry *e)
+{
+	struct kvfs_fdentry **pp = &s->buckets[e->hash & (s->nbuckets - 1)];
+
+	while (*pp != e)
+		pp = &(*pp)->chain;
+	*pp = e->chain;
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	s->count--;
+}
+
+static void kvfs_fdc_init(void)
+{
+	int i, capacity;
+
+	for (i = 0; i < KVFS_FDC_STRIPES; i++)
+	{
+		pthread_mutex_init(&kvfs_fdc[i].lock, NULL);
+		kvfs_fdc[i].lru.prev = kvfs_fdc[i].lru.next = &kvfs_fdc[i].lru;
+	}
+	if (kvfs_conf.fd_cache == 0)
+		return;
+	kvfs_fdc_fds = kvfs_fd_slots();
+	if ((size_t) kvfs_fdc_fds / 4 < kvfs_conf.fd_cache)
+	{
+		kvfs_info("\nkvfs_fdc_init: KVFS_FD_CACHE=%zu is over a quarter of the fd limit, using %d\n",
+			kvfs_conf.fd_cache, kvfs_fdc_fds / 4);
+		kvfs_conf.fd_cache = kvfs_fdc_fds / 4;
+	}
+	kvfs_fdc_table = calloc(kvfs_fdc_fds, sizeof(*kvfs_fdc_table));
+	if (kvfs_fdc_table == NULL || kvfs_conf.fd_cache < KVFS_FDC_STRIPES)
+	{
+		kvfs_error("\nkvfs_fdc_init: no room for an fd cache, it is off\n");
+		free(kvfs_fdc_table);
+		kvfs_fdc_table = NULL;
+		kvfs_conf.fd_cache = 0;
+		return;
+	}
+	capacity = kvfs_conf.fd_cache / KVFS_FDC_STRIPES;
+	for (i = 0; i < KVFS_FDC_STRIPES; i++)
+	{
+		struct kvfs_fdstripe *s = &kvfs_fdc[i];
+
+		s->capacity = capacity;
+		for (s->nbuckets = 1; s->nbuckets < capacity; s->nbuckets <<= 1)
+			;
+		s->buckets = calloc(s->nbuckets, sizeof(*s->buckets));
+		if (s->buckets == NULL)
+		{
+			kvfs_error("\nkvfs_fdc_init: out of memory, the fd cache is off\n");
+			return;
+		}
+	}
+	kvfs_fdc_on = 1;
+}
+
+// An idle backing fd of key opened with flags, or -1.  Either way fd
+// numbers it returns or gets from open() are to be passed to
+// kvfs_fdc_opened().
+static int kvfs_fdc_get(const char *key, int flags, uint32_t *gen)
+{
+	struct kvfs_fdstripe *s;
+	struct kvfs_fdentry *e;
+	uint32_t *g;
+	uint64_t h;
+	int fd = -1;
+
+	*gen = 0;
+	if (!kvfs_fdc_on || (flags & O_TRUNC))
+		return -1;
+	s = kvfs_fdc_stripe(key, &h, &g);
+	pthread_mutex_lock(&s->lock);
+	*gen = *g | 1;		// so never 0
+	for (e = s->buckets[h & (s->nbuckets - 1)]; e != NULL; e = e->chain)
+		if (e->hash == h && e->flags == flags && strcmp(e->key, key) == 0)
+			break;
+	if (e != NULL)
+	{
+		kvfs_fdc_unlink(s, e);
+		fd = e->fd;
+		free(e);
+		s->hits++;
+	}
+	else
+		s->misses++;
+	pthread_mutex_unlock(&s->lock);
+	return fd;
+}
+
+// Handle fd was opened with flags, under generation gen from
+// kvfs_fdc_get().
+static void kvfs_fdc_opened(int fd, int flags, uint32_t gen)
+{
+	if (fd >= 0 && fd < kvfs_fdc_fds)
+	{
+		__atomic_store_n(&kvfs_fdc_table[fd], KVFS_FDC_HANDLE(gen, flags), __ATOMIC_RELEASE);
+	}
+}
+
+// Handle fd of key is being released.  Returns 1 if the fd was kept,
+// and is not to be closed.
+static int kvfs_fdc_put(const char *key, int fd)
+{
+	struct kvfs_fdstripe *s;
+	struct kvfs_fdentry *e, *old = NULL;
+	uint64_t fh;
+	uint32_t *g;
+	uint64_t h;
+
+	if (fd < 0 || fd >= kvfs_fdc_fds)
+		return 0;
+	fh = __atomic_exchange_n(&kvfs_fdc_table[fd], 0, __ATOMIC_ACQ_REL);
+	if (fh >> 32 == 0)
+		return 0;
+	if ((e = malloc(sizeof(*e))) == NULL)
+		return 0;
+	e->fd = fd;
+	e->flags = (int) (uint32_t) fh;
+	snprintf(e->key, sizeof(e->key), "%s", key);
+
+	s = kvfs_fdc_stripe(key, &h, &g);
+	e->hash = h;
+	pthread_mutex_lock(&s->lock);
+	if ((*g | 1) != fh >> 32)
+	{
+		s->stale++;
+		pthread_mutex_unlock(&s->lock);
+		free(e);
+		return 0;
+	}
+	e->chain = s->buckets[h & (s->nbuckets - 1)];
+	s->buckets[h & (s->nbuckets - 1)] = e;
+	e->prev = &s->lru;
+	e->next = s->lru.next;
+	e->next->prev = e;
+	s->lru.next = e;
+	if (++s->count > s->capacity)
+	{
+		old = s->lru.prev;
+		kvfs_fdc_unlink(s, old);
+		s->evictions++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (old != NULL)
+	{
+		close(old->fd);
+		free(old);
+	}
+	return 1;
+}
+
+// Key's backing file is going, or changing in a way an open could
+// notice: close its idle fds and keep its open handles' fds out.
+static void kvfs_fdc_invalidate(const char *key)
+{
+	struct kvfs_fdstripe *s;
+	struct kvfs_fdentry *e, *next, *gone = NULL;
+	uint32_t *g;
+	uint64_t h;
+
+	if (!kvfs_fdc_on)
+		return;
+	s = kvfs_fdc_stripe(key, &h, &g);
+	pthread_mutex_lock(&s->lock);
+	*g += 2;
+	for (e = s->buckets[h & (s->nbuckets - 1)]; e != NULL; e = next)
+	{
+		next = e->chain;
+		if (e->hash != h || strcmp(e->key, key) != 0)
+			continue;
+		kvfs_fdc_unlink(s, e);
+		s->invalidations++;
+		e->next = gone;
+		gone = e;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	for (e = gone; e != NULL; e = next)
+	{
+		next = e->next;
+		close(e->fd);
+		free(e);
+	}
+}
+
+///////////////////////////////////////////////////////////
+//
+// Mapped files
+//
+// Read-mostly files (configuration, models, lookup tables) are read
+// over and over through short-lived handles, one pread per request.
+// With KVFS_MMAP_BYTES=n (default 0, off), a plain backing file of up
+// to n bytes opened read-only is mapped when it is opened, and reads
+// through the handle are copied out of the mapping.  Handles on the
+// same file share one mapping, counted by reference and unmapped when
+// the last of them is released.
+//
+// A mapping covers the file as it was when mapped.  Touching a page
+// of it past the end of a file that has since shrunk raises SIGBUS,
+// so whatever truncates a key through kvfs does it between
+// kvfs_mm_shrink(), which waits for reads in progress and marks the
+// key's mapping stale, and kvfs_mm_shrunk(); handles holding a stale
+// mapping go back to pread.  Writes call kvfs_mm_invalidate() after
+// the fact, since a file that grew is only stale, not dangerous.  An
+// open maps what fstat() told it only if no change was made to the
+// key's bucket meanwhile, and none is under way.  A file replaced
+// under its key (rename, dedup, compression) keeps its old inode alive
+// for the handles mapping it, and the next open maps the new one.
+// Truncating a backing file behind kvfs's back while it is mapped is
+// not noticed, and kills kvfs with SIGBUS, which is why this is off by
+// default.  Compressed files and packed objects are not mapped.
+//
+#define KVFS_MM_STRIPES		16
+#define KVFS_MM_BUCKETS		1024
+
+struct kvfs_map {
+	struct kvfs_map *next;		// hash chain, while it is current
+	pthread_rwlock_t lock;		// held for reading while copying
+	int refs;			// handles, under the stripe lock
+	int current;			// in the chain
+	int stale;
+	dev_t dev;
+	ino_t ino;
+	char *addr;
+	size_t len;
+	uint64_t hash;
+	char key[KVFS_KEY_MAX];
+};
+
+static pthread_mutex_t kvfs_mm_locks[KVFS_MM_STRIPES];
+static struct kvfs_map *kvfs_mm_buckets[KVFS_MM_BUCKETS];
+static uint32_t kvfs_mm_gens[KVFS_MM_BUCKETS];		// changes, by bucket
+static uint32_t kvfs_mm_shrinking[KVFS_MM_BUCKETS];	// truncates under way
+static struct kvfs_map **kvfs_mm_table;	// by handle fd
+static int kvfs_mm_fds;
+static int kvfs_mm_on;
+
+static struct {
+	uint64_t maps;		// files mapped
+	uint64_t shared;	// opens that found their file mapped
+	uint64_t reads;		// reads copied from a mapping
+	uint64_t stale;		// reads that found their mapping stale
+	uint64_t invalidations;
+	uint64_t failed;	// mmap() calls that failed
+	uint64_t raced;		// mappings dropped for a change during the open
+	uint64_t bytes;		// mapped now
+} kvfs_mm_stats;
+
+static void kvfs_mm_init(void)
+{
+	int i;
+
+	for (i = 0; i < KVFS_MM_STRIPES; i++)
+		pthread_mutex_init(&kvfs_mm_locks[i], NULL);
+	if (kvfs_conf.mmap_bytes == 0)
+		return;
+	kvfs_mm_fds = kvfs_fd_slots();
+	kvfs_mm_table = calloc(kvfs_mm_fds, sizeof(*kvfs_mm_table));
+	if (kvfs_mm_table == NULL)
+	{
+		kvfs_error("\nkvfs_mm_init: no memory for %d handles, mapping is off\n", kvfs_mm_fds);
+		kvfs_mm_fds = 0;
+		kvfs_conf.mmap_bytes = 0;
+		return;
+	}
+	kvfs_mm_on = 1;
+}
+
+static pthread_mutex_t *kvfs_mm_lock(uint64_t h)
+{
+	return &kvfs_mm_locks[(h % KVFS_MM_BUCKETS) % KVFS_MM_STRIPES];
+}
+
+// Take m out of its chain.  Called with the stripe lock held.
+static void kvfs_mm_unlink(struct kvfs_map *m)
+{
+	struct kvfs_map **pp = &kvfs_mm_buckets[m->hash % KVFS_MM_BUCKETS];
+
+	while (*pp != m)
+		pp = &(*pp)->next;
+	*pp = m->next;
+	m->current = 0;
+}
+
+// Drop a handle's reference to m.
+static void kvfs_mm_put(struct kvfs_map *m)
+{
+	pthread_mutex_t *lock = kvfs_mm_lock(m->hash);
+	int last;
+
+	pthread_mutex_lock(lock);
+	last = --m->refs == 0;
+	if (last && m->current)
+		kvfs_mm_unlink(m);
+	pthread_mutex_unlock(lock);
+	if (!last)
+		return;
+	munmap(m->addr, m->len);
+	__atomic_sub_fetch(&kvfs_mm_stats.bytes, m->len, __ATOMIC_RELAXED);
+	pthread_rwlock_destroy(&m->lock);
+	free(m);
+}
+
+// Handle fd of key was opened with flags; map its file if it should
+// be, or share the mapping other handles have of it.
+static void kvfs_mm_open(const char *key, int fd, int flags)
+{
+	struct kvfs_map *m, *old = NULL;
+	pthread_mutex_t *lock;
+	struct stat st;
+	uint32_t gen;
+	uint64_t h;
+	void *addr;
+
+	if (!kvfs_mm_on || fd < 0 || fd >= kvfs_mm_fds || (flags & O_ACCMODE) != O_RDONLY ||
+	    (flags & O_TRUNC) || kvfs_z_file(fd) != NULL)
+		return;
+	h = kvfs_keyhash(key);
+	lock = kvfs_mm_lock(h);
+	pthread_mutex_lock(lock);
+	gen = kvfs_mm_gens[h % KVFS_MM_BUCKETS];
+	pthread_mutex_unlock(lock);
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    (uint64_t) st.st_size > kvfs_conf.mmap_bytes)
+		return;
+
+	pthread_mutex_lock(lock);
+	for (m = kvfs_mm_buckets[h % KVFS_MM_BUCKETS]; m != NULL; m = m->next)
+		if (m->hash == h && strcmp(m->key, key) == 0)
+			break;
+	if (m != NULL && m->dev == st.st_dev && m->ino == st.st_ino && m->len == (size_t) st.st_size)
+	{
+		m->refs++;
+		pthread_mutex_unlock(lock);
+		__atomic_add_fetch(&kvfs_mm_stats.shared, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&kvfs_mm_table[fd], m, __ATOMIC_RELEASE);
+		return;
+	}
+	pthread_mutex_unlock(lock);
+
+	// Map outside the lock; if another open got there first, this one
+	// is current instead, which is as good.  If the file changed since
+	// fstat(), the size may be wrong, and the handle just preads.
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED || (m = calloc(1, sizeof(*m))) == NULL)
+	{
+		if (addr != MAP_FAILED)
+			munmap(addr, st.st_size);
+		__atomic_add_fetch(&kvfs_mm_stats.failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	madvise(addr, st.st_size, MADV_WILLNEED);
+	pthread_rwlock_init(&m->lock, NULL);
+	m->refs = 1;
+	m->current = 1;
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	m->addr = addr;
+	m->len = st.st_size;
+	m->hash = h;
+	snprintf(m->key, sizeof(m->key), "%s", key);
+	__atomic_add_fetch(&kvfs_mm_stats.bytes, m->len, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(lock);
+	if (kvfs_mm_gens[h % KVFS_MM_BUCKETS] != gen || kvfs_mm_shrinking[h % KVFS_MM_BUCKETS] > 0)
+	{
+		m->current = 0;
+		pthread_mutex_unlock(lock);
+		kvfs_mm_put(m);
+		__atomic_add_fetch(&kvfs_mm_stats.raced, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&kvfs_mm_stats.maps, 1, __ATOMIC_RELAXED);
+	for (old = kvfs_mm_buckets[h % KVFS_MM_BUCKETS]; old != NULL; old = old->next)
+		if (old->hash == h && strcmp(old->key, key) == 0)
+		{
+			kvfs_mm_unlink(old);
+			break;
+		}
+	m->next = kvfs_mm_buckets[h % KVFS_MM_BUCKETS];
+	kvfs_mm_buckets[h % KVFS_MM_BUCKETS] = m;
+	pthread_mutex_unlock(lock);
+	__atomic_store_n(&kvfs_mm_table[fd], m, __ATOMIC_RELEASE);
+}
+
+// Copy a read through handle fd out of its mapping.  Returns the
+// bytes read, or -1 to have the caller pread.
+static ssize_t kvfs_mm_read(int fd, char *buf, size_t size, off_t offset)
+{
+	struct kvfs_map *m;
+	ssize_t len;
+
+	if (!kvfs_mm_on || fd < 0 || fd >= kvfs_mm_fds)
+		return -1;
+	m = __atomic_load_n(&kvfs_mm_table[fd], __ATOMIC_ACQUIRE);
+	if (m == NULL)
+		return -1;
+	pthread_rwlock_rdlock(&m->lock);
+	if (m->stale)
+	{
+		pthread_rwlock_unlock(&m->lock);
+		__atomic_add_fetch(&kvfs_mm_stats.stale, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	len = 0;
+	if (offset >= 0 && (uint64_t) offset < m->len)
+	{
+		len = m->len - offset < size ? m->len - offset : size;
+		memcpy(buf, m->addr + offset, len);
+	}
+	pthread_rwlock_unlock(&m->lock);
+	__atomic_add_fetch(&kvfs_mm_stats.reads, 1, __ATOMIC_RELAXED);
+	return len;
+}
+
+// Stop serving reads of key from its mapping, and count a change to
+// it; shrinking is added to its truncates under way.  Returns once no
+// read is copying from the mapping.
+static void kvfs_mm_change(const char *key, int shrinking)
+{
+	struct kvfs_map *m;
+	pthread_mutex_t *lock;
+	uint64_t h;
+
+	if (!kvfs_mm_on)
+		return;
+	h = kvfs_keyhash(key);
+	lock = kvfs_mm_lock(h);
+	pthread_mutex_lock(lock);
+	kvfs_mm_gens[h % KVFS_MM_BUCKETS]++;
+	kvfs_mm_shrinking[h % KVFS_MM_BUCKETS] += shrinking;
+	for (m = kvfs_mm_buckets[h % KVFS_MM_BUCKETS]; m != NULL; m = m->next)
+		if (m->hash == h && strcmp(m->key, key) == 0)
+			break;
+	if (m != NULL)
+	{
+		kvfs_mm_unlink(m);
+		pthread_rwlock_wrlock(&m->lock);
+		m->stale = 1;
+		pthread_rwlock_unlock(&m->lock);
+		__atomic_add_fetch(&kvfs_mm_stats.invalidations, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(lock);
+}
+
+// Key was written to.
+static void kvfs_mm_invalidate(const char *key)
+{
+	kvfs_mm_change(key, 0);
+}
+
+// Key is about to be truncated; kvfs_mm_shrunk() once it has been, or
+// has failed to be.
+static void kvfs_mm_shrink(const char *key)
+{
+	kvfs_mm_change(key, 1);
+}
+
+static void kvfs_mm_shrunk(const char *key)
+{
+	kvfs_mm_change(key, -1);
+}
+
+// Forget handle fd before it is closed.
+static void kvfs_mm_release(int fd)
+{
+	struct kvfs_map *m;
+
+	if (fd < 0 || fd >= kvfs_mm_fds)
+		return;
+	m = __atomic_exchange_n(&kvfs_mm_table[fd], NULL, __ATOMIC_ACQ_REL);
+	if (m != NULL)
+		kvfs_mm_put(m);
+}
+
+///////////////////////////////////////////////////////////
+//
+// Statistics
+//
+// Counters from the caches and friends, as text.  Read them with
+//
+//     getfattr --only-values -n user.kvfs.stats mountdir
+//
+#ifdef HAVE_SYS_XATTR_H
+#define KVFS_STATS_XATTR	"user.kvfs.stats"
+
+static int kvfs_stats_format(char *buf, size_t size)
+{
+	uint64_t hits = 0, misses = 0, expired = 0, evictions = 0, invalidations = 0;
+	uint64_t writes, wbytes, bwrites, bbytes, prefetched, wasted;
+	long entries = 0, capacity = 0;
+	size_t bytes;
+	int i, len;
+
+	for (i = 0; i < KVFS_ACACHE_STRIPES && kvfs_conf.attr_timeout_ns != 0; i++)
+	{
+		struct kvfs_astripe *s = &kvfs_acache[i];
+
+		pthread_mutex_lock(&s->lock);
+		hits += s->hits;
+		misses += s->misses;
+		expired += s->expired;
+		evictions += s->evictions;
+		invalidations += s->invalidations;
+		entries += s->count;
+		capacity += s->capacity;
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	len = snprintf(buf, size,
+		"attrcache.hits %llu\nattrcache.misses %llu\nattrcache.hit_rate %.4f\n"
+		"attrcache.expired %llu\nattrcache.evictions %llu\nattrcache.invalidations %llu\n"
+		"attrcache.entries %ld\nattrcache.capacity %ld\n",
+		(unsigned long long) hits, (unsigned long long) misses,
+		hits + misses ? (double) hits / (hits + misses) : 0.0,
+		(unsigned long long) expired, (unsigned long long) evictions,
+		(unsigned long long) invalidations, entries, capacity);
+	if (len < 0 || (size_t) len >= size)
+		return len;
+
+	// Every path cache hit is one hash computation saved.
+	hits = misses = evictions = invalidations = 0;
+	entries = 0;
+	bytes = 0;
+	for (i = 0; i < KVFS_DCACHE_STRIPES && kvfs_dcache_on; i++)
+	{
+		struct kvfs_dstripe *s = &kvfs_dcache[i];
+
+		pthread_mutex_lock(&s->lock);
+		hits += s->hits;
+		misses += s->misses;
+		evictions += s->evictions;
+		invalidations += s->invalidations;
+		entries += s->count;
+		bytes += s->bytes;
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	len += snprintf(buf + len, size - len,
+		"pathcache.hashes_saved %llu\npathcache.misses %llu\npathcache.hit_rate %.4f\n"
+		"pathcache.evictions %llu\npathcache.invalidations %llu\n"
+		"pathcache.entries %ld\npathcache.bytes %zu\npathcache.budget %zu\n",
+		(unsigned long long) hits, (unsigned long long) misses,
+		hits + misses ? (double) hits / (hits + misses) : 0.0,
+		(unsigned long long) evictions, (unsigned long long) invalidations,
+		entries, bytes, kvfs_dcache_on ? kvfs_conf.dcache_bytes : 0);
+	if (len < 0 || (size_t) len >= size)
+		return len;
+
+	// Amplification is backing bytes per byte buffered; below 1 when
+	// buffered data was overwritten before it went out.
+	writes = __atomic_load_n(&kvfs_wb_stats.writes, __ATOMIC_RELAXED);
+	wbytes = __atomic_load_n(&kvfs_wb_stats.bytes, __ATOMIC_RELAXED);
+	bwrites = __atomic_load_n(&kvfs_wb_stats.backing_writes, __ATOMIC_RELAXED);
+	bbytes = __atomic_load_n(&kvfs_wb_stats.backing_bytes, __ATOMIC_RELAXED);
+	len += snprintf(buf + len, size - len,
+		"writeback.writes %llu\nwriteback.bytes %llu\n"
+		"writeback.backing_writes %llu\nwriteback.backing_bytes %llu\n"
+		"writeback.syscalls_saved %lld\nwriteback.amplification %.4f\n"
+		"writeback.errors %llu\nwriteback.dirty_handles %d\nwriteback.buffer %zu\n",
+		(unsigned long long) writes, (unsigned long long) wbytes,
+		(unsigned long long) bwrites, (unsigned long long) bbytes,
+		(long long) (writes - bwrites), wbytes ? (double) bbytes / wbytes : 0.0,
+		(unsigned long long) __atomic_load_n(&kvfs_wb_stats.errors, __ATOMIC_RELAXED),
+		__atomic_load_n(&kvfs_wb_ndirty, __ATOMIC_RELAXED), kvfs_conf.wb_bytes);
+	if (len < 0 || (size_t) len >= size)
+		return len;
+
+	// A wasted block was prefetched and dropped before anyone read it.
+	prefetched = wasted = 0;
+	entries = 0;
+	for (i = 0; i < KVFS_PCACHE_STRIPES && kvfs_pcache_on; i++)
+	{
+		struct kvfs_pstripe *s = &kvfs_pcache[i];
+		struct kvfs_page *p;
+
+		pthread_mutex_lock(&s->lock);
+		prefetched += s->prefetched;
+		wasted += s->wasted;
+		for (p = s->pages; p < s->pages + s->count; p++)
+			entries += p->key[0] != '\0';
+		pthread_mutex_unlock(&s->lock);
+	}
+	hits = __atomic_load_n(&kvfs_ra_stats.served, __ATOMIC_RELAXED);
+	misses = __atomic_load_n(&kvfs_ra_stats.missed, __ATOMIC_RELAXED);
+	len += snprintf(buf + len, size - len,
+		"readahead.served %llu\nreadahead.missed %llu\nreadahead.hit_rate %.4f\n"
+		"readahead.prefetched_blocks %llu\nreadahead.wasted_blocks %llu\nreadahead.dropped %llu\n"
+		"pagecache.blocks %ld\npagecache.budget %zu\n",
+		(unsigned long long) hits, (unsigned long long) misses,
+		hits + misses ? (double) hits / (hits + misses) : 0.0,
+		(unsigned long long) prefetched, (unsigned long long) wasted,
+		(unsigned long long) __atomic_load_n(&kvfs_ra_stats.dropped, __ATOMIC_RELAXED),
+		entries, kvfs_pcache_on ? kvfs_conf.pcache_bytes : 0);
+	if (len < 0 || (size_t) len >= size)
+		return len;
+
+	// A stale fd was released after its key changed, and not kept.
+	hits = misses = evictions = invalidations = expired = 0;
+	entries = capacity = 0;
+	for (i = 0; i < KVFS_FDC_STRIPES && kvfs_fdc_on; i++)
+	{
+		struct kvfs_fdstripe *s = &kvfs_fdc[i];
+
+		pthread_mutex_lock(&s->lock);
+		hits += s->hits;
+		misses += s->misses;
+		evictions += s->evictions;
+		invalidations += s->invalidations;
+		expired += s->stale;
+		entries += s->count;
+		capacity += s->capacity;
+		pthread_mutex_unlock(&s->lock);
+	}
+	len += snprintf(buf + len, size - len,
+		"fdcache.hits %llu\nfdcache.misses %llu\nfdcache.hit_rate %.4f\n"
+		"fdcache.evictions %llu\nfdcache.invalidations %llu\nfdcache.stale %llu\n"
+		"fdcache.entries %ld\nfdcache.capacity %ld\n",
+		(unsigned long long) hits, (unsigned long long) misses,
+		hits + misses ? (double) hits / (hits + misses) : 0.0,
+		(unsigned long long) evictions, (unsigned long long) invalidations,
+		(unsigned long long) expired, entries, capacity);
+	if (len < 0 || (size_t) len >= size)
+		return len;
+
+	len += snprintf(buf + len, size - len,
+		"mmap.maps %llu\nmmap.shared %llu\nmmap.reads %llu\nmmap.stale %llu\n"
+		"mmap.invalidations %llu\nmmap.failed %llu\nmmap.raced %llu\nmmap.bytes %llu\n",
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.maps, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.shared, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.reads, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.stale, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.invalidations, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.failed, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.raced, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_mm_stats.bytes, __ATOMIC_RELAXED));
+	if (len < 0 || (size_t) len >= size)
+		return len;
+
+	len += kvfs_pack_format(buf + len, size - len);
+	if ((size_t) len < size)
+		len += kvfs_dedup_format(buf + len, size - len);
+	if ((size_t) len < size)
+		len += kvfs_z_format(buf + len, size - len);
+	if ((size_t) len < size)
+		len += kvfs_index_format(buf + len, size - len);
+	if ((size_t) len < size)
+		len += kvfs_sync_format(buf + len, size - len);
+	if ((size_t) len < size)
+		len += kvfs_io_format(buf + len, size - len);
+	if ((size_t) len < size)
+		len += kvfs_batch_format(buf + len, size - len);
+	return len;
+}
+#endif
+
+///////////////////////////////////////////////////////////
+//
+// Prototypes for all these functions, and the C-style comments,
+// come from /usr/include/fuse.h
+//
+// kvfs_fullpath() once the root is set up, which kvfs_init() itself
+// needs (see kvfs_dedup_init()).
+static void kvfs_keypath(char fullpath[PATH_MAX], const char *path)
+{
+	char *out;
+	size_t len;
+
+	out = fullpath + kvfs_rootdir_len;
+	memcpy(fullpath, kvfs_rootdir, kvfs_rootdir_len);
+	if (strcmp(path, kvfs_root_key) == 0)
+	{
+		*out = '\0';
+		return;
+	}
+
+	// Keys are fixed-length hex, but never run past PATH_MAX on
+	// whatever the caller hands us.
+	len = strnlen(path, PATH_MAX - kvfs_rootdir_len - 8);
+	*out++ = '/';
+	if (kvfs_conf.layout == KVFS_LAYOUT_SHARD && len > 4)
+	{
+		out[0] = path[0];
+		out[1] = path[1];
+		out[2] = '/';
+		out[3] = path[2];
+		out[4] = path[3];
+		out[5] = '/';
+		out += 6;
+	}
+	memcpy(out, path, len);
+	out[len] = '\0';
+}
+
+static void kvfs_fullpath(char fullpath[PATH_MAX], const char *path)
+{
+	pthread_once(&kvfs_init_once, kvfs_init);
+	kvfs_keypath(fullpath, path);
+
+	kvfs_trace("\nkvfs_fullpath:  rootdir = \"%s\", path = \"%s\", fullpath = \"%s\" : ", kvfs_rootdir, path, fullpath);
+}
+
+// Create the shard directories above fullpath.  Operations that make a
+// new key try the backing call first and only come here on ENOENT, so
+// an existing shard costs nothing.  Returns 0 if the call is worth
+// retrying, -1 (with errno untouched) in the flat layout.
+static int kvfs_mkshard(const char *fullpath)
+{
+	char dir[PATH_MAX];
+
+	if (kvfs_conf.layout != KVFS_LAYOUT_SHARD)
+		return -1;
+
+	memcpy(dir, fullpath, kvfs_rootdir_len + 3);
+	dir[kvfs_rootdir_len + 3] = '\0';
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	memcpy(dir, fullpath, kvfs_rootdir_len + 6);
+	dir[kvfs_rootdir_len + 6] = '\0';
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+// FUSE runs operations on as many threads as there are requests, and
+// every thread working on an open directory gets the same handle.  A
+// listing can't be shared like that, so it comes with a lock.
+// (File handles are bare backing fds; pread/pwrite need no lock.)
+struct kvfs_dirhandle {
+	pthread_mutex_t lock;
+	void *list;	// the backend's listing, or a DIR without an index
+	int index;	// list holds names from the namespace index
+	char key[KVFS_KEY_MAX];
+	off_t next;	// cookie of the next entry to list
+	// The entry that didn't fit in the last buffer, listed first next
+	// time instead of seeking back to it.
+	int held;
+	off_t held_off;
+	char held_name[NAME_MAX + 1];
+	// The shard directories of a sharded root, found when it is first
+	// listed (see kvfs_readdir_shards()).
+	unsigned int *shards;
+	int nshards;
+};
+
+// Stat a listed key for the attribute cache, so the getattr calls
+// that usually follow a listing are hits.  Returns the attributes for
+// filler, or NULL when the cache is off.
+static struct stat *kvfs_readdir_stat(DIR *dp, const char *name, struct stat *st)
+{
+	uint64_t gen;
+
+	if (kvfs_conf.attr_timeout_ns == 0 || name[0] == '.')
+		return NULL;
+
+	kvfs_wb_flush_key(name);
+	gen = kvfs_acache_gen(name);
+	if (fstatat(dirfd(dp), name, st, AT_SYMLINK_NOFOLLOW) < 0)
+		return NULL;
+	kvfs_dedup_fixstat(name, st);
+	kvfs_acache_put(name, st, gen);
+	return st;
+}
+
+static int kvfs_shard_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+// The fan-out directory names ("00" to "ff") in directory fd, as
+// numbers in order, into names[256].  Closes fd.
+static int kvfs_shard_names(int fd, unsigned int *names)
+{
+	struct dirent *de;
+	DIR *dp;
+	int n = 0;
+
+	if (fd < 0)
+		return 0;
+	if ((dp = fdopendir(fd)) == NULL)
+	{
+		close(fd);
+		return 0;
+	}
+	while ((de = readdir(dp)) != NULL && n < 256)
+		if (strspn(de->d_name, kvfs_hex) == 2 && de->d_name[2] == '\0')
+			names[n++] = strtoul(de->d_name, NULL, 16);
+	closedir(dp);
+	qsort(names, n, sizeof(*names), kvfs_shard_cmp);
+	return n;
+}
+
+// Find the shard directories below the sharded root dp, ab/cd as
+// 0xabcd, in order: two levels of readdir rather than an open of each
+// of the 65536 that might be there.
+static int kvfs_shard_list(DIR *dp, struct kvfs_dirhandle *dh)
+{
+	unsigned int top[256], low[256], *shards;
+	char name[4];
+	int ntop, nlow, i, j;
+
+	free(dh->shards);
+	dh->shards = NULL;
+	dh->nshards = 0;
+	ntop = kvfs_shard_names(openat(dirfd(dp), ".", O_RDONLY | O_DIRECTORY), top);
+	for (i = 0; i < ntop; i++)
+	{
+		snprintf(name, sizeof(name), "%02x", top[i]);
+		nlow = kvfs_shard_names(openat(dirfd(dp), name, O_RDONLY | O_DIRECTORY), low);
+		if (nlow == 0)
+			continue;
+		shards = realloc(dh->shards, (dh->nshards + nlow) * sizeof(*shards));
+		if (shards == NULL)
+			return -ENOMEM;
+		dh->shards = shards;
+		for (j = 0; j < nlow; j++)
+			dh->shards[dh->nshards++] = top[i] << 8 | low[j];
+	}
+	return 0;
+}
+
+// List every key below a sharded root, two fan-out levels down,
+// starting after the entry whose cookie is offset.  The shard
+// directories are found again whenever the listing starts over.
+//
+// "." and ".." have cookies 1 and 2.  The nth key listed from shard
+// directory ab/cd has cookie (0xabcd + 1) << 32 | n: shard directories
+// hold few keys, so resuming at one by reading past the first n is
+// cheap, and it doesn't depend on the backing fs's own offsets.
+#define KVFS_SHARD_COOKIE(shard, n)	((((off_t) (shard) + 1) << 32) | (n))
+
+static int kvfs_readdir_shards(struct kvfs_dirhandle *dh, void *buf, fuse_fill_dir_t filler, off_t offset)
+{
+	DIR *dp = dh->list;
+	struct stat st;
+	struct dirent *de;
+	DIR *leaf;
+	char name[8];
+	unsigned int shard;
+	off_t n, skip;
+	int i, fd;
+
+	if ((offset == 0 || dh->shards == NULL) && kvfs_shard_list(dp, dh) < 0)
+		return -ENOMEM;
+	if (offset < 1 && filler(buf, ".", NULL, 1) != 0)
+		return 0;
+	if (offset < 2 && filler(buf, "..", NULL, 2) != 0)
+		return 0;
+
+	shard = offset > 2 ? (offset >> 32) - 1 : 0;
+	skip = offset > 2 ? offset & 0xffffffff : 0;
+
+	for (i = 0; i < dh->nshards; i++)
+	{
+		if (dh->shards[i] < shard)
+			continue;
+		if (dh->shards[i] > shard)
+			skip = 0;
+		shard = dh->shards[i];
+
+		snprintf(name, sizeof(name), "%02x/%02x", (shard >> 8) & 255, shard & 255);
+		fd = openat(dirfd(dp), name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			continue;
+		if ((leaf = fdopendir(fd)) == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		n = 0;
+		while ((de = readdir(leaf)) != NULL)
+		{
+			if (de->d_name[0] == '.' || ++n <= skip)
+				continue;
+			if (filler(buf, de->d_name, kvfs_readdir_stat(leaf, de->d_name, &st), KVFS_SHARD_COOKIE(shard, n)) != 0)
+			{
+				closedir(leaf);
+				return 0;
+			}
+		}
+		closedir(leaf);
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////
+//
+// Packed small objects
+//
+// Every file used to be a backing file of its own, so a 1 KiB file
+// cost an inode and a whole block, and making one cost the backing
+// store's create, write and close.  With KVFS_PACK_BYTES=n (off by
+// default, and only on roots with a namespace index) regular files
+// made while mounted are instead records in append-only segment files
+// under rootdir/.kvfs_pack, as long as they stay no bigger than n.  A
+// table in memory, rebuilt by reading the segments at mount, says
+// where the newest record of each packed key is.
+//
+// A record is a header, the key and the whole object, checksummed
+// together.  Changing an object or its attributes appends a new
+// record, and unlinking it appends a tombstone.  While a packed object
+// is open its data is kept in memory, shared by all its handles, and
+// written out as one record by flush, fsync and the last release.  An
+// object written past n, or given a hard link or an xattr, is moved
+// out to an ordinary backing file and stays one.
+//
+// Superseded records and tombstones are dead space.  Once over half a
+// full segment is dead, a background thread copies its live records
+// to the newest segment and deletes it.  A tombstone is copied along
+// unless its key has been made again since, or nothing older than its
+// segment is left, so a deleted key cannot come back from an older
+// segment.  Records are appended under the table lock, so the
+// segments hold each key's records in the order the table saw them.
+//
+#define KVFS_PACK		".kvfs_pack"
+#define KVFS_PACK_SEGMENT	(16 << 20)
+#define KVFS_PACK_MAX		(1 << 20)	// the largest n
+#define KVFS_PACK_MAGIC		0x6b767062
+#define KVFS_PACK_PUT		1
+#define KVFS_PACK_DEL		2
+
+// Set in fi->fh when it is a struct kvfs_pobj rather than an fd.
+#define KVFS_PACK_FH		(1ULL << 63)
+
+// What kvfs_pack_setattr() changes.
+#define KVFS_PACK_MODE		1
+#define KVFS_PACK_OWNER		2
+#define KVFS_PACK_TIMES		4
+
+struct kvfs_prec {
+	uint32_t magic;
+	uint8_t type;
+	uint8_t keylen;
+	uint16_t pad;
+	uint32_t len;			// object bytes after the key
+	uint32_t mode;
+	uint32_t uid, gid;
+	int64_t atime, mtime, ctime;	// ns since the epoch
+	uint64_t sum;			// xxh64 of the record with this 0
+};
+
+struct kvfs_pentry {
+	struct kvfs_pentry *next;	// hash chain
+	uint64_t hash;
+	struct kvfs_prec rec;		// header of its newest record
+	uint32_t seg;
+	off_t off;
+	struct kvfs_pobj *obj;		// while open
+	char key[KVFS_KEY_MAX];
+};
+
+struct kvfs_pseg {
+	int fd;
+	uint32_t id;
+	off_t size, dead;
+	int refs;			// readers outside the table lock
+	int gone;			// compacted, close once refs is 0
+};
+
+// An open packed object.  Its lock is taken before kvfs_pack_lock.
+struct kvfs_pobj {
+	pthread_mutex_t lock;
+	char key[KVFS_KEY_MAX];
+	char *data;
+	size_t len, cap;		// len is also read by getattr, atomically
+	int64_t mtime;			// when last written, 0 if not since the record
+	int refs;			// under kvfs_pack_lock
+	int dirty;
+	int error;			// reading it in failed
+	int fd;				// its backing file once moved out, else -1
+};
+
+static pthread_mutex_t kvfs_pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvfs_pack_cond = PTHREAD_COND_INITIALIZER;
+static int kvfs_pack_on;
+static int kvfs_pack_dirfd = -1;
+static mode_t kvfs_pack_umask;
+
+static struct kvfs_pentry **kvfs_pack_buckets;
+static long kvfs_pack_nbuckets, kvfs_pack_count;
+
+static struct kvfs_pseg **kvfs_pack_segs;	// by id, NULL once deleted
+static uint32_t kvfs_pack_nsegs, kvfs_pack_capsegs;
+static struct kvfs_pseg *kvfs_pack_active;
+static int kvfs_pack_compact_wanted;
+
+static struct {
+	uint64_t compactions;
+	uint64_t moved_out;
+} kvfs_pack_stats;
+
+static int64_t kvfs_pack_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t kvfs_pack_reclen(const struct kvfs_prec *rec)
+{
+	return sizeof(*rec) + rec->keylen + (rec->type == KVFS_PACK_PUT ? rec->len : 0);
+}
+
+static struct kvfs_pobj *kvfs_pack_obj(struct fuse_file_info *fi)
+{
+	if (!(fi->fh & KVFS_PACK_FH))
+		return NULL;
+	return (struct kvfs_pobj *) (uintptr_t) (fi->fh & ~KVFS_PACK_FH);
+}
+
+// Called with kvfs_pack_lock held, as are all the table functions.
+static struct kvfs_pentry *kvfs_pack_find(const char *key)
+{
+	uint64_t h = kvfs_keyhash(key);
+	struct kvfs_pentry *e;
+
+	for (e = kvfs_pack_buckets[h & (kvfs_pack_nbuckets - 1)]; e != NULL; e = e->next)
+		if (e->hash == h && strcmp(e->key, key) == 0)
+			return e;
+	return NULL;
+}
+
+static void kvfs_pack_insert(struct kvfs_pentry *e)
+{
+	struct kvfs_pentry **buckets, *next;
+	long i, nbuckets;
+
+	// Keep chains short by doubling; a failed grow only costs speed.
+	if (kvfs_pack_count >= kvfs_pack_nbuckets &&
+	    (buckets = calloc(kvfs_pack_nbuckets * 2, sizeof(*buckets))) != NULL)
+	{
+		nbuckets = kvfs_pack_nbuckets * 2;
+		for (i = 0; i < kvfs_pack_nbuckets; i++)
+			for (struct kvfs_pentry *p = kvfs_pack_buckets[i]; p != NULL; p = next)
+			{
+				next = p->next;
+				p->next = buckets[p->hash & (nbuckets - 1)];
+				buckets[p->hash & (nbuckets - 1)] = p;
+			}
+		free(kvfs_pack_buckets);
+		kvfs_pack_buckets = buckets;
+		kvfs_pack_nbuckets = nbuckets;
+	}
+
+	e->hash = kvfs_keyhash(e->key);
+	e->next = kvfs_pack_buckets[e->hash & (kvfs_pack_nbuckets - 1)];
+	kvfs_pack_buckets[e->hash & (kvfs_pack_nbuckets - 1)] = e;
+	kvfs_pack_count++;
+}
+
+static void kvfs_pack_unchain(struct kvfs_pentry *e)
+{
+	struct kvfs_pentry **pp = &kvfs_pack_buckets[e->hash & (kvfs_pack_nbuckets - 1)];
+
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+	kvfs_pack_count--;
+}
+
+// Count bytes of segment id as dead, and wake the compactor if that
+// makes a full segment more than half dead.
+static void kvfs_pack_kill(uint32_t id, size_t bytes)
+{
+	struct kvfs_pseg *s = id < kvfs_pack_nsegs ? kvfs_pack_segs[id] : NULL;
+
+	if (s == NULL)
+		return;
+	s->dead += bytes;
+	if (s != kvfs_pack_active && s->dead * 2 > s->size)
+	{
+		kvfs_pack_compact_wanted = 1;
+		pthread_cond_signal(&kvfs_pack_cond);
+	}
+}
+
+static struct kvfs_pseg *kvfs_pack_segment(uint32_t id, int flags)
+{
+	struct kvfs_pseg *s, **segs;
+	char name[16];
+	struct stat st;
+
+	if (id >= kvfs_pack_capsegs)
+	{
+		segs = realloc(kvfs_pack_segs, (id + 64) * sizeof(*segs));
+		if (segs == NULL)
+			return NULL;
+		memset(segs + kvfs_pack_capsegs, 0, (id + 64 - kvfs_pack_capsegs) * sizeof(*segs));
+		kvfs_pack_segs = segs;
+		kvfs_pack_capsegs = id + 64;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	snprintf(name, sizeof(name), "%08x", id);
+	s->fd = openat(kvfs_pack_dirfd, name, O_RDWR | flags, 0644);
+	if (s->fd < 0 || fstat(s->fd, &st) < 0)
+	{
+		kvfs_log_errno("kvfs_pack_segment open");
+		if (s->fd >= 0)
+			close(s->fd);
+		free(s);
+		return NULL;
+	}
+	s->id = id;
+	s->size = st.st_size;
+	kvfs_pack_segs[id] = s;
+	if (id >= kvfs_pack_nsegs)
+		kvfs_pack_nsegs = id + 1;
+	return s;
+}
+
+// Drop a reference taken on a segment to read it outside the lock.
+static void kvfs_pack_unref(struct kvfs_pseg *s)
+{
+	pthread_mutex_lock(&kvfs_pack_lock);
+	if (--s->refs == 0 && s->gone)
+	{
+		close(s->fd);
+		free(s);
+	}
+	pthread_mutex_unlock(&kvfs_pack_lock);
+}
+
+// Append the n byte record rec to the newest segment, starting a new
+// one when it is full.
+static int kvfs_pack_write_raw(const char *rec, size_t n, uint32_t *seg, off_t *off)
+{
+	struct kvfs_pseg *s = kvfs_pack_active, *old;
+	ssize_t written;
+
+	if (s->size >= KVFS_PACK_SEGMENT && (s = kvfs_pack_segment(kvfs_pack_nsegs, O_CREAT | O_EXCL)) != NULL)
+	{
+		old = kvfs_pack_active;
+		kvfs_pack_active = s;
+		kvfs_pack_kill(old->id, 0);
+	}
+	else
+		s = kvfs_pack_active;
+
+	written = pwrite(s->fd, rec, n, s->size);
+	if (written != (ssize_t) n)
+		return written < 0 ? -errno : -EIO;
+	*seg = s->id;
+	*off = s->size;
+	s->size += n;
+	return 0;
+}
+
+// Append a record with hdr's type and attributes for key, followed by
+// hdr->len bytes of data.  hdr is updated to the header as written.
+static int kvfs_pack_append(struct kvfs_prec *hdr, const char *key, const char *data,
+			    uint32_t *seg, off_t *off)
+{
+	struct kvfs_prec rec = *hdr;
+	size_t n;
+	char *buf;
+	int result;
+
+	rec.magic = KVFS_PACK_MAGIC;
+	rec.keylen = strlen(key);
+	rec.pad = 0;
+	rec.sum = 0;
+	if (rec.type != KVFS_PACK_PUT)
+		rec.len = 0;
+	n = kvfs_pack_reclen(&rec);
+	buf = malloc(n);
+	if (buf == NULL)
+		return -ENOMEM;
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), key, rec.keylen);
+	if (rec.len > 0)
+		memcpy(buf + sizeof(rec) + rec.keylen, data, rec.len);
+	rec.sum = kvfs_xxh64(buf, n);
+	memcpy(buf + offsetof(struct kvfs_prec, sum), &rec.sum, sizeof(rec.sum));
+
+	result = kvfs_pack_write_raw(buf, n, seg, off);
+	free(buf);
+	if (result == 0)
+		*hdr = rec;
+	return result;
+}
+
+// Check the record at off in a segment read into buf.  Returns its
+// length, or 0 if it is torn or not a record.
+static size_t kvfs_pack_check(const char *buf, off_t off, off_t size)
+{
+	struct kvfs_prec rec;
+	uint64_t sum, zero = 0;
+	size_t n;
+	char *tmp;
+
+	if (size - off < (off_t) sizeof(rec))
+		return 0;
+	memcpy(&rec, buf + off, sizeof(rec));
+	if (rec.magic != KVFS_PACK_MAGIC || rec.keylen == 0 || rec.keylen >= KVFS_KEY_MAX ||
+	    (rec.type != KVFS_PACK_PUT && rec.type != KVFS_PACK_DEL))
+		return 0;
+	n = kvfs_pack_reclen(&rec);
+	if ((off_t) n > size - off)
+		return 0;
+
+	// The sum was taken with its own field zeroed.
+	tmp = malloc(n);
+	if (tmp == NULL)
+		return 0;
+	memcpy(tmp, buf + off, n);
+	memcpy(tmp + offsetof(struct kvfs_prec, sum), &zero, sizeof(zero));
+	sum = kvfs_xxh64(tmp, n);
+	free(tmp);
+	return sum == rec.sum ? n : 0;
+}
+
+// Read a whole segment into memory.
+static char *kvfs_pack_slurp(struct kvfs_pseg *s)
+{
+	char *buf = malloc(s->size > 0 ? s->size : 1);
+	off_t done = 0;
+	ssize_t n;
+
+	while (buf != NULL && done < s->size)
+	{
+		n = pread(s->fd, buf + done, s->size - done, done);
+		if (n <= 0)
+		{
+			free(buf);
+			return NULL;
+		}
+		done += n;
+	}
+	return buf;
+}
+
+// Bring the table up to date with segment s, at mount.
+static void kvfs_pack_replay(struct kvfs_pseg *s)
+{
+	struct kvfs_prec rec;
+	struct kvfs_pentry *e;
+	char key[KVFS_KEY_MAX];
+	off_t off;
+	size_t n;
+	char *buf;
+
+	buf = kvfs_pack_slurp(s);
+	if (buf == NULL)
+	{
+		kvfs_error("\nkvfs_pack_replay: cannot read segment %08x\n", s->id);
+		return;
+	}
+
+	for (off = 0; off < s->size; off += n)
+	{
+		n = kvfs_pack_check(buf, off, s->size);
+		if (n == 0)
+		{
+			// Torn by a crash mid-append; the next append goes here.
+			kvfs_error("\nkvfs_pack_replay: segment %08x ends in a bad record at %lld, dropped\n",
+				s->id, (long long) off);
+			if (ftruncate(s->fd, off) == 0)
+				s->size = off;
+			break;
+		}
+		memcpy(&rec, buf + off, sizeof(rec));
+		memcpy(key, buf + off + sizeof(rec), rec.keylen);
+		key[rec.keylen] = '\0';
+
+		e = kvfs_pack_find(key);
+		if (e != NULL)
+			kvfs_pack_kill(e->seg, kvfs_pack_reclen(&e->rec));
+		if (rec.type == KVFS_PACK_DEL)
+		{
+			kvfs_pack_kill(s->id, n);
+			if (e != NULL)
+			{
+				kvfs_pack_unchain(e);
+				free(e);
+			}
+			continue;
+		}
+		if (e == NULL)
+		{
+			e = calloc(1, sizeof(*e));
+			if (e == NULL)
+				break;
+			strcpy(e->key, key);
+			kvfs_pack_insert(e);
+		}
+		e->rec = rec;
+		e->seg = s->id;
+		e->off = off;
+	}
+	free(buf);
+}
+
+// Copy what is still live in segment s to the newest segment, then
+// delete s.
+static void kvfs_pack_compact(struct kvfs_pseg *s)
+{
+	struct kvfs_prec rec;
+	struct kvfs_pentry *e;
+	char key[KVFS_KEY_MAX], name[16];
+	uint32_t id, seg, first = UINT32_MAX;
+	int oldest = 1, more;
+	off_t off, to;
+	size_t n;
+	char *buf;
+
+	buf = kvfs_pack_slurp(s);
+	if (buf == NULL)
+	{
+		kvfs_error("\nkvfs_pack_compact: cannot read segment %08x\n", s->id);
+		return;
+	}
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	for (id = 0; id < s->id; id++)
+		if (kvfs_pack_segs[id] != NULL)
+			oldest = 0;
+	pthread_mutex_unlock(&kvfs_pack_lock);
+
+	for (off = 0; off < s->size; off += n)
+	{
+		n = kvfs_pack_check(buf, off, s->size);
+		if (n == 0)
+			break;
+		memcpy(&rec, buf + off, sizeof(rec));
+		memcpy(key, buf + off + sizeof(rec), rec.keylen);
+		key[rec.keylen] = '\0';
+
+		pthread_mutex_lock(&kvfs_pack_lock);
+		e = kvfs_pack_find(key);
+		if (rec.type == KVFS_PACK_PUT && e != NULL && e->seg == s->id && e->off == off)
+		{
+			if (kvfs_pack_write_raw(buf + off, n, &seg, &to) == 0)
+			{
+				e->seg = seg;
+				e->off = to;
+				first = seg < first ? seg : first;
+			}
+		}
+		else if (rec.type == KVFS_PACK_DEL && !oldest && e == NULL)
+		{
+			if (kvfs_pack_write_raw(buf + off, n, &seg, &to) == 0)
+			{
+				kvfs_pack_kill(seg, n);
+				first = seg < first ? seg : first;
+			}
+		}
+		pthread_mutex_unlock(&kvfs_pack_lock);
+	}
+	free(buf);
+	if (off < s->size)
+	{
+		kvfs_error("\nkvfs_pack_compact: bad record in segment %08x at %lld, kept\n", s->id, (long long) off);
+		return;
+	}
+
+	// The copies must be on disk before the originals go.  Only this
+	// thread deletes segments, so the newer ones stay put.
+	for (id = first, more = 1; more; id++)
+	{
+		struct kvfs_pseg *t = NULL;
+
+		pthread_mutex_lock(&kvfs_pack_lock);
+		more = id < kvfs_pack_nsegs;
+		if (more && (t = kvfs_pack_segs[id]) != NULL)
+			t->refs++;
+		pthread_mutex_unlock(&kvfs_pack_lock);
+		if (t != NULL)
+		{
+			fdatasync(t->fd);
+			kvfs_pack_unref(t);
+		}
+	}
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	kvfs_pack_segs[s->id] = NULL;
+	snprintf(name, sizeof(name), "%08x", s->id);
+	unlinkat(kvfs_pack_dirfd, name, 0);
+	kvfs_pack_stats.compactions++;
+	s->gone = 1;
+	if (s->refs == 0)
+	{
+		close(s->fd);
+		free(s);
+	}
+	pthread_mutex_unlock(&kvfs_pack_lock);
+}
+
+static void *kvfs_pack_thread(void *arg)
+{
+	struct kvfs_pseg *s;
+	uint32_t id;
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	for (;;)
+	{
+		while (!kvfs_pack_compact_wanted)
+			pthread_cond_wait(&kvfs_pack_cond, &kvfs_pack_lock);
+		kvfs_pack_compact_wanted = 0;
+
+		// Oldest first, so tombstones can be dropped sooner.
+		for (id = 0; id < kvfs_pack_nsegs; id++)
+		{
+			s = kvfs_pack_segs[id];
+			if (s == NULL || s == kvfs_pack_active || s->dead * 2 <= s->size)
+				continue;
+			pthread_mutex_unlock(&kvfs_pack_lock);
+			kvfs_pack_compact(s);
+			pthread_mutex_lock(&kvfs_pack_lock);
+		}
+	}
+	return NULL;
+}
+
+static int kvfs_pack_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void kvfs_pack_init(void)
+{
+	char path[PATH_MAX];
+	uint32_t *ids = NULL, *more;
+	size_t nids = 0, capids = 0, i;
+	struct dirent *de;
+	pthread_t thread;
+	DIR *dp;
+	int fd;
+
+	if (kvfs_conf.pack_bytes == 0)
+		return;
+	if (!kvfs_conf.index)
+	{
+		kvfs_error("\nkvfs_pack_init: KVFS_PACK_BYTES needs a root with a namespace index, packing is off\n");
+		return;
+	}
+	if (kvfs_conf.pack_bytes > KVFS_PACK_MAX)
+		kvfs_conf.pack_bytes = KVFS_PACK_MAX;
+
+	kvfs_pack_umask = umask(0);
+	umask(kvfs_pack_umask);
+
+	kvfs_rootfile(path, KVFS_PACK);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+	{
+		kvfs_log_errno("kvfs_pack_init mkdir");
+		return;
+	}
+	kvfs_pack_dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	fd = kvfs_pack_dirfd >= 0 ? dup(kvfs_pack_dirfd) : -1;
+	dp = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dp == NULL)
+	{
+		kvfs_log_errno("kvfs_pack_init open");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	kvfs_pack_nbuckets = 1024;
+	kvfs_pack_buckets = calloc(kvfs_pack_nbuckets, sizeof(*kvfs_pack_buckets));
+
+	// Segments are named by id in hex, and replayed oldest first.
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (strlen(de->d_name) != 8 || strspn(de->d_name, kvfs_hex) != 8)
+			continue;
+		if (nids == capids)
+		{
+			capids = capids ? capids * 2 : 16;
+			more = realloc(ids, capids * sizeof(*ids));
+			if (more == NULL)
+				break;
+			ids = more;
+		}
+		ids[nids++] = strtoul(de->d_name, NULL, 16);
+	}
+	closedir(dp);
+	if (kvfs_pack_buckets == NULL)
+	{
+		kvfs_error("\nkvfs_pack_init: out of memory, packing is off\n");
+		free(ids);
+		return;
+	}
+	if (nids > 0)
+		qsort(ids, nids, sizeof(*ids), kvfs_pack_cmp);
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	for (i = 0; i < nids; i++)
+		if (kvfs_pack_segment(ids[i], 0) != NULL)
+			kvfs_pack_replay(kvfs_pack_segs[ids[i]]);
+	kvfs_pack_active = nids > 0 ? kvfs_pack_segs[ids[nids - 1]] : NULL;
+	if (kvfs_pack_active == NULL || kvfs_pack_active->size >= KVFS_PACK_SEGMENT)
+		kvfs_pack_active = kvfs_pack_segment(kvfs_pack_nsegs, O_CREAT | O_EXCL);
+	pthread_mutex_unlock(&kvfs_pack_lock);
+	free(ids);
+	if (kvfs_pack_active == NULL)
+	{
+		kvfs_error("\nkvfs_pack_init: no segment to append to, packing is off\n");
+		return;
+	}
+
+	if (pthread_create(&thread, NULL, kvfs_pack_thread, NULL) != 0)
+	{
+		kvfs_error("\nkvfs_pack_init: no compaction thread, packing is off\n");
+		return;
+	}
+	pthread_detach(thread);
+	kvfs_pack_on = 1;
+	kvfs_info("\nkvfs_pack_init: %ld packed objects in %u segments\n", kvfs_pack_count, kvfs_pack_nsegs);
+}
+
+// Fill st from the table if key is packed.  Returns 0 if it is, 1 if
+// it is not.
+static int kvfs_pack_stat(const char *key, struct stat *st)
+{
+	struct kvfs_pentry *e;
+	int64_t mtime = 0;
+
+	if (!kvfs_pack_on)
+		return 1;
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	e = kvfs_pack_find(key);
+	if (e == NULL)
+	{
+		pthread_mutex_unlock(&kvfs_pack_lock);
+		return 1;
+	}
+	memset(st, 0, sizeof(*st));
+	st->st_ino = kvfs_keyhash(key);
+	st->st_mode = e->rec.mode;
+	st->st_nlink = 1;
+	st->st_uid = e->rec.uid;
+	st->st_gid = e->rec.gid;
+	st->st_size = e->rec.len;
+	if (e->obj != NULL)
+	{
+		st->st_size = __atomic_load_n(&e->obj->len, __ATOMIC_RELAXED);
+		mtime = __atomic_load_n(&e->obj->mtime, __ATOMIC_RELAXED);
+	}
+	if (mtime == 0)
+		mtime = e->rec.mtime;
+	st->st_blksize = 4096;
+	st->st_blocks = (st->st_size + 511) / 512;
+	st->st_atim.tv_sec = e->rec.atime / 1000000000;
+	st->st_atim.tv_nsec = e->rec.atime % 1000000000;
+	st->st_mtim.tv_sec = mtime / 1000000000;
+	st->st_mtim.tv_nsec = mtime % 1000000000;
+	st->st_ctim.tv_sec = (e->rec.ctime > mtime ? e->rec.ctime : mtime) / 1000000000;
+	st->st_ctim.tv_nsec = (e->rec.ctime > mtime ? e->rec.ctime : mtime) % 1000000000;
+	pthread_mutex_unlock(&kvfs_pack_lock);
+	return 0;
+}
+
+// lstat() of a key, packed or not.
+static int kvfs_pack_lstat(const char *key, const char *fullpath, struct stat *st)
+{
+	if (kvfs_pack_stat(key, st) == 0)
+		return 0;
+	return lstat(fullpath, st);
+}
+
+// Take a reference to key's open object, opening it if need be.
+// Returns 1 if key is not packed.
+static int kvfs_pack_get(const char *key, struct kvfs_pobj **objp)
+{
+	struct kvfs_pentry *e;
+	struct kvfs_pobj *obj;
+	struct kvfs_pseg *s;
+	off_t off;
+	ssize_t n;
+
+	if (!kvfs_pack_on)
+		return 1;
+
+	// A fresh object is locked before the table, keeping the order
+	// every other path uses.  Whoever finds it next waits on its lock
+	// until the data is in.
+	obj = calloc(1, sizeof(*obj));
+	if (obj == NULL)
+		return -ENOMEM;
+	pthread_mutex_init(&obj->lock, NULL);
+	strcpy(obj->key, key);
+	obj->refs = 1;
+	obj->fd = -1;
+	pthread_mutex_lock(&obj->lock);
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	e = kvfs_pack_find(key);
+	if (e == NULL || e->obj != NULL)
+	{
+		if (e != NULL)
+		{
+			e->obj->refs++;
+			*objp = e->obj;
+		}
+		pthread_mutex_unlock(&kvfs_pack_lock);
+		pthread_mutex_unlock(&obj->lock);
+		pthread_mutex_destroy(&obj->lock);
+		free(obj);
+		return e == NULL ? 1 : 0;
+	}
+	e->obj = obj;
+	obj->len = obj->cap = e->rec.len;
+	s = kvfs_pack_segs[e->seg];
+	s->refs++;
+	off = e->off + sizeof(e->rec) + e->rec.keylen;
+	pthread_mutex_unlock(&kvfs_pack_lock);
+
+	obj->data = malloc(obj->len > 0 ? obj->len : 1);
+	if (obj->data == NULL)
+	{
+		obj->cap = 0;
+		obj->error = -ENOMEM;
+	}
+	else
+	{
+		n = obj->len > 0 ? pread(s->fd, obj->data, obj->len, off) : 0;
+		if (n != (ssize_t) obj->len)
+			obj->error = n < 0 ? -errno : -EIO;
+	}
+	kvfs_pack_unref(s);
+	pthread_mutex_unlock(&obj->lock);
+
+	*objp = obj;
+	return 0;
+}
+
+// Write out a changed object as a new record.  Called with obj->lock
+// held.
+static int kvfs_pack_sync(struct kvfs_pobj *obj)
+{
+	struct kvfs_pentry *e;
+	struct kvfs_prec rec;
+	uint32_t seg;
+	off_t off;
+	int result = 0;
+
+	if (!obj->dirty || obj->fd >= 0)
+		return obj->error;
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	e = kvfs_pack_find(obj->key);
+	if (e != NULL && e->obj == obj)
+	{
+		rec = e->rec;
+		rec.len = obj->len;
+		if (obj->mtime != 0)
+			rec.mtime = rec.ctime = obj->mtime;
+		result = kvfs_pack_append(&rec, obj->key, obj->data, &seg, &off);
+		if (result == 0)
+		{
+			kvfs_pack_kill(e->seg, kvfs_pack_reclen(&e->rec));
+			e->rec = rec;
+			e->seg = seg;
+			e->off = off;
+		}
+	}
+	pthread_mutex_unlock(&kvfs_pack_lock);
+
+	if (result == 0)
+	{
+		obj->dirty = 0;
+		__atomic_store_n(&obj->mtime, 0, __ATOMIC_RELAXED);
+	}
+	return result;
+}
+
+// Move obj out to a backing file of its own.  Called with obj->lock
+// held.
+static int kvfs_pack_moveout(struct kvfs_pobj *obj)
+{
+	struct kvfs_pentry *e;
+	struct kvfs_prec rec, del;
+	struct timespec times[2];
+	char fullpath[PATH_MAX];
+	uint32_t seg;
+	off_t off;
+	int fd, result;
+
+	if (obj->error)
+		return obj->error;
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	e = kvfs_pack_find(obj->key);
+	if (e == NULL || e->obj != obj)
+	{
+		pthread_mutex_unlock(&kvfs_pack_lock);
+		return -ENOENT;
+	}
+	rec = e->rec;
+	pthread_mutex_unlock(&kvfs_pack_lock);
+
+	kvfs_fullpath(fullpath, obj->key);
+	fd = open(fullpath, O_RDWR | O_CREAT | O_TRUNC, rec.mode & 07777);
+	if (fd < 0 && errno == ENOENT && kvfs_mkshard(fullpath) == 0)
+		fd = open(fullpath, O_RDWR | O_CREAT | O_TRUNC, rec.mode & 07777);
+	if (fd < 0)
+		return -errno;
+	if (pwrite(fd, obj->data, obj->len, 0) != (ssize_t) obj->len)
+	{
+		result = -EIO;
+		goto fail;
+	}
+	// The owner carries over only if kvfs may give files away.
+	if (fchown(fd, rec.uid, rec.gid) < 0 && errno != EPERM)
+	{
+		result = -errno;
+		goto fail;
+	}
+	times[0].tv_sec = rec.atime / 1000000000;
+	times[0].tv_nsec = rec.atime % 1000000000;
+	if (obj->mtime != 0)
+		rec.mtime = obj->mtime;
+	times[1].tv_sec = rec.mtime / 1000000000;
+	times[1].tv_nsec = rec.mtime % 1000000000;
+	futimens(fd, times);
+
+	// Now the backing file is whole, the packed copy goes.
+	memset(&del, 0, sizeof(del));
+	del.type = KVFS_PACK_DEL;
+	pthread_mutex_lock(&kvfs_pack_lock);
+	e = kvfs_pack_find(obj->key);
+	if (e == NULL || e->obj != obj)
+		result = -ENOENT;	// unlinked meanwhile
+	else
+		result = kvfs_pack_append(&del, obj->key, NULL, &seg, &off);
+	if (result == 0)
+	{
+		kvfs_pack_kill(e->seg, kvfs_pack_reclen(&e->rec));
+		kvfs_pack_kill(seg, sizeof(del) + strlen(obj->key));
+		kvfs_pack_unchain(e);
+		free(e);
+		kvfs_pack_stats.moved_out++;
+	}
+	pthread_mutex_unlock(&kvfs_pack_lock);
+	if (result < 0)
+		goto fail;
+
+	obj->fd = fd;
+	obj->dirty = 0;
+	free(obj->data);
+	obj->data = NULL;
+	obj->cap = 0;
+	kvfs_acache_invalidate(obj->key);
+	return 0;
+
+fail:
+	close(fd);
+	unlink(fullpath);
+	return result;
+}
+
+// Drop a reference from kvfs_pack_get() or a handle, writing out the
+// object if it was the last.
+static int kvfs_pack_release(struct kvfs_pobj *obj)
+{
+	struct kvfs_pentry *e;
+	int result, last;
+
+	pthread_mutex_lock(&obj->lock);
+	result = kvfs_pack_sync(obj);
+	pthread_mutex_unlock(&obj->lock);
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	last = --obj->refs == 0;
+	if (last && (e = kvfs_pack_find(obj->key)) != NULL && e->obj == obj)
+		e->obj = NULL;
+	pthread_mutex_unlock(&kvfs_pack_lock);
+
+	if (last)
+	{
+		if (obj->fd >= 0)
+			close(obj->fd);
+		pthread_mutex_destroy(&obj->lock);
+		free(obj->data);
+		free(obj);
+	}
+	return result;
+}
+
+// Open key if it is packed.  Returns 1 if it is not.
+static int kvfs_pack_open(const char *key, struct fuse_file_info *fi)
+{
+	struct kvfs_pobj *obj;
+	int result;
+
+	result = kvfs_pack_get(key, &obj);
+	if (result != 0)
+		return result;
+
+	pthread_mutex_lock(&obj->lock);
+	result = obj->error;
+	if (result == 0 && (fi->flags & O_TRUNC))
+	{
+		if (obj->fd >= 0)
+			result = ftruncate(obj->fd, 0) < 0 ? -errno : 0;
+		else
+		{
+			obj->dirty = 1;
+			__atomic_store_n(&obj->len, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&obj->mtime, kvfs_pack_now(), __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&obj->lock);
+
+	if (result < 0)
+	{
+		kvfs_pack_release(obj);
+		return result;
+	}
+	fi->fh = KVFS_PACK_FH | (uintptr_t) obj;
+	return 0;
+}
+
+// Make key a new, empty packed object, and open it if fi is given.
+// Returns 1 if packing is off or key already has a backing file.
+static int kvfs_pack_create(const char *key, mode_t mode, struct fuse_file_info *fi)
+{
+	struct kvfs_pentry *e;
+	struct kvfs_pobj *obj = NULL;
+	struct stat statbuf;
+	char fullpath[PATH_MAX];
+	int result;
+
+	if (!kvfs_pack_on)
+		return 1;
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return -ENOMEM;
+	strcpy(e->key, key);
+	e->rec.type = KVFS_PACK_PUT;
+	e->rec.mode = S_IFREG | (mode & 07777 & ~kvfs_pack_umask);
+	e->rec.uid = geteuid();
+	e->rec.gid = getegid();
+	e->rec.atime = e->rec.mtime = e->rec.ctime = kvfs_pack_now();
+	if (fi != NULL)
+	{
+		obj = calloc(1, sizeof(*obj));
+		if (obj == NULL)
+		{
+			free(e);
+			return -ENOMEM;
+		}
+		pthread_mutex_init(&obj->lock, NULL);
+		strcpy(obj->key, key);
+		obj->refs = 1;
+		obj->fd = -1;
+	}
+
+	// A name that already has a backing file keeps it.
+	kvfs_fullpath(fullpath, key);
+	if (lstat(fullpath, &statbuf) == 0)
+		result = 1;
+	else
+	{
+		pthread_mutex_lock(&kvfs_pack_lock);
+		if (kvfs_pack_find(key) != NULL)
+			result = -EEXIST;
+		else
+			result = kvfs_pack_append(&e->rec, key, NULL, &e->seg, &e->off);
+		if (result == 0)
+		{
+			e->obj = obj;
+			kvfs_pack_insert(e);
+		}
+		pthread_mutex_unlock(&kvfs_pack_lock);
+	}
+
+	if (result != 0)
+	{
+		free(e);
+		if (obj != NULL)
+		{
+			pthread_mutex_destroy(&obj->lock);
+			free(obj);
+		}
+		// create without O_EXCL opens what is already there
+		if (result == -EEXIST && fi != NULL && !(fi->flags & O_EXCL))
+			result = kvfs_pack_open(key, fi);
+		return result;
+	}
+	if (fi != NULL)
+		fi->fh = KVFS_PACK_FH | (uintptr_t) obj;
+	return 0;
+}
+
+static int kvfs_pack_read(struct kvfs_pobj *obj, char *buf, size_t size, off_t offset)
+{
+	int result;
+
+	pthread_mutex_lock(&obj->lock);
+	if (obj->fd >= 0)
+	{
+		kvfs_wb_flush_key(obj->key);
+		result = pread(obj->fd, buf, size, offset);
+		if (result < 0)
+			result = -errno;
+	}
+	else if (obj->error)
+		result = obj->error;
+	else if (offset >= (off_t) obj->len)
+		result = 0;
+	else
+	{
+		result = size < obj->len - offset ? size : obj->len - offset;
+		memcpy(buf, obj->data + offset, result);
+	}
+	pthread_mutex_unlock(&obj->lock);
+	return result;
+}
+
+// Make room for size bytes of data.  Called with obj->lock held.
+static int kvfs_pack_reserve(struct kvfs_pobj *obj, size_t size)
+{
+	size_t cap = obj->cap ? obj->cap : 4096;
+	char *data;
+
+	if (size <= obj->cap)
+		return 0;
+	while (cap < size)
+		cap *= 2;
+	if (cap > kvfs_conf.pack_bytes)
+		cap = kvfs_conf.pack_bytes;
+	data = realloc(obj->data, cap);
+	if (data == NULL)
+		return -ENOMEM;
+	obj->data = data;
+	obj->cap = cap;
+	return 0;
+}
+
+// Set obj's size, moving it out if it grows past the limit.  Called
+// with obj->lock held.
+static int kvfs_pack_resize(struct kvfs_pobj *obj, off_t size)
+{
+	int result;
+
+	if (obj->error)
+		return obj->error;
+	if (obj->fd < 0 && size > (off_t) kvfs_conf.pack_bytes && (result = kvfs_pack_moveout(obj)) < 0)
+		return result;
+	if (obj->fd >= 0)
+	{
+		kvfs_wb_flush_key(obj->key);
+		if (ftruncate(obj->fd, size) < 0)
+			return -errno;
+		kvfs_pcache_invalidate(obj->key, 0, 0);
+		return 0;
+	}
+
+	result = kvfs_pack_reserve(obj, size);
+	if (result < 0)
+		return result;
+	if (size > (off_t) obj->len)
+		memset(obj->data + obj->len, 0, size - obj->len);
+	__atomic_store_n(&obj->len, size, __ATOMIC_RELAXED);
+	__atomic_store_n(&obj->mtime, kvfs_pack_now(), __ATOMIC_RELAXED);
+	obj->dirty = 1;
+	return 0;
+}
+
+static int kvfs_pack_write(struct kvfs_pobj *obj, const char *buf, size_t size, off_t offset)
+{
+	int result = 0;
+
+	pthread_mutex_lock(&obj->lock);
+	if (obj->fd < 0 && offset + size > kvfs_conf.pack_bytes)
+		result = kvfs_pack_moveout(obj);
+	if (result < 0)
+		;
+	else if (obj->fd >= 0)
+	{
+		result = pwrite(obj->fd, buf, size, offset);
+		if (result < 0)
+			result = -errno;
+		else
+			kvfs_pcache_invalidate(obj->key, offset, result);
+	}
+	else if ((result = obj->error) == 0 &&
+		 (offset + size <= obj->len || (result = kvfs_pack_resize(obj, offset + size)) == 0))
+	{
+		memcpy(obj->data + offset, buf, size);
+		__atomic_store_n(&obj->mtime, kvfs_pack_now(), __ATOMIC_RELAXED);
+		obj->dirty = 1;
+		result = size;
+	}
+	pthread_mutex_unlock(&obj->lock);
+	return result;
+}
+
+// write_buf for a packed object: the data has to be in memory, so
+// anything in a pipe is copied out first.
+static int kvfs_pack_write_buf(struct kvfs_pobj *obj, const char *key, struct fuse_bufvec *buf, off_t offset)
+{
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+	ssize_t result;
+
+	if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		result = kvfs_pack_write(obj, buf->buf[0].mem, buf->buf[0].size, offset);
+	else
+	{
+		mem.buf[0].mem = malloc(size);
+		if (mem.buf[0].mem == NULL)
+			return -ENOMEM;
+		result = fuse_buf_copy(&mem, buf, 0);
+		if (result >= 0)
+			result = kvfs_pack_write(obj, mem.buf[0].mem, result, offset);
+		free(mem.buf[0].mem);
+	}
+	kvfs_acache_invalidate(key);
+	return result;
+}
+
+static int kvfs_pack_flush(struct kvfs_pobj *obj)
+{
+	int result;
+
+	pthread_mutex_lock(&obj->lock);
+	result = kvfs_pack_sync(obj);
+	pthread_mutex_unlock(&obj->lock);
+	return result;
+}
+
+// Write out obj and wait for it to reach the disk.
+static int kvfs_pack_fsync(struct kvfs_pobj *obj, int datasync)
+{
+	struct kvfs_pentry *e;
+	struct kvfs_pseg *s = NULL;
+	int result;
+
+	pthread_mutex_lock(&obj->lock);
+	result = kvfs_pack_sync(obj);
+	if (result == 0 && obj->fd >= 0)
+		result = kvfs_sync(obj->fd, datasync);
+	else if (result == 0)
+	{
+		pthread_mutex_lock(&kvfs_pack_lock);
+		e = kvfs_pack_find(obj->key);
+		if (e != NULL && (s = kvfs_pack_segs[e->seg]) != NULL)
+			s->refs++;
+		pthread_mutex_unlock(&kvfs_pack_lock);
+		if (s != NULL)
+		{
+			result = kvfs_sync(s->fd, 1);
+			kvfs_pack_unref(s);
+		}
+	}
+	pthread_mutex_unlock(&obj->lock);
+	return result;
+}
+
+static int kvfs_pack_fstat(struct kvfs_pobj *obj, struct stat *st)
+{
+	int result = 0;
+
+	pthread_mutex_lock(&obj->lock);
+	if (obj->fd >= 0)
+		result = fstat(obj->fd, st) < 0 ? -errno : 0;
+	else if (kvfs_pack_stat(obj->key, st) != 0)
+	{
+		// unlinked while open
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFREG | 0600;
+		st->st_uid = geteuid();
+		st->st_gid = getegid();
+		st->st_size = obj->len;
+		st->st_blksize = 4096;
+	}
+	pthread_mutex_unlock(&obj->lock);
+	return result;
+}
+
+// Truncate key if it is packed.  Returns 1 if it is not.
+static int kvfs_pack_truncate(const char *key, off_t size)
+{
+	struct kvfs_pobj *obj;
+	int result, sync;
+
+	result = kvfs_pack_get(key, &obj);
+	if (result != 0)
+		return result;
+
+	pthread_mutex_lock(&obj->lock);
+	result = kvfs_pack_resize(obj, size);
+	pthread_mutex_unlock(&obj->lock);
+	sync = kvfs_pack_release(obj);
+	return result < 0 ? result : sync;
+}
+
+// Change what is flagged in what, if key is packed.  Returns 1 if it
+// is not, or was moved out; the backing file is then the caller's.
+static int kvfs_pack_setattr(const char *key, int what, mode_t mode, uid_t uid, gid_t gid,
+			     const struct utimbuf *ubuf)
+{
+	struct kvfs_pentry *e;
+	struct kvfs_pobj *obj;
+	int64_t now = kvfs_pack_now();
+	int result;
+
+	result = kvfs_pack_get(key, &obj);
+	if (result != 0)
+		return result;
+
+	pthread_mutex_lock(&obj->lock);
+	result = obj->fd >= 0 ? 1 : obj->error;
+	pthread_mutex_lock(&kvfs_pack_lock);
+	e = kvfs_pack_find(key);
+	if (result == 0 && e != NULL && e->obj == obj)
+	{
+		if (what & KVFS_PACK_MODE)
+			e->rec.mode = S_IFREG | (mode & 07777);
+		if ((what & KVFS_PACK_OWNER) && uid != (uid_t) -1)
+			e->rec.uid = uid;
+		if ((what & KVFS_PACK_OWNER) && gid != (gid_t) -1)
+			e->rec.gid = gid;
+		if (what & KVFS_PACK_TIMES)
+		{
+			e->rec.atime = ubuf ? (int64_t) ubuf->actime * 1000000000 : now;
+			e->rec.mtime = ubuf ? (int64_t) ubuf->modtime * 1000000000 : now;
+			__atomic_store_n(&obj->mtime, 0, __ATOMIC_RELAXED);
+		}
+		e->rec.ctime = now;
+		obj->dirty = 1;
+	}
+	pthread_mutex_unlock(&kvfs_pack_lock);
+	if (result == 0)
+		result = kvfs_pack_sync(obj);
+	pthread_mutex_unlock(&obj->lock);
+
+	kvfs_pack_release(obj);
+	return result;
+}
+
+// Move key out to a backing file if it is packed, for what only a
+// backing file has (hard links, xattrs).
+static int kvfs_pack_unpack(const char *key)
+{
+	struct kvfs_pobj *obj;
+	int result;
+
+	result = kvfs_pack_get(key, &obj);
+	if (result != 0)
+		return result > 0 ? 0 : result;
+
+	pthread_mutex_lock(&obj->lock);
+	result = obj->fd >= 0 ? 0 : kvfs_pack_moveout(obj);
+	pthread_mutex_unlock(&obj->lock);
+	kvfs_pack_release(obj);
+	return result;
+}
+
+// Unlink key if it is packed.  Returns 1 if it is not.  Open handles
+// keep what they have in memory.
+static int kvfs_pack_unlink(const char *key)
+{
+	struct kvfs_pentry *e;
+	struct kvfs_prec del;
+	uint32_t seg;
+	off_t off;
+	int result;
+
+	if (!kvfs_pack_on)
+		return 1;
+
+	memset(&del, 0, sizeof(del));
+	del.type = KVFS_PACK_DEL;
+	pthread_mutex_lock(&kvfs_pack_lock);
+	e = kvfs_pack_find(key);
+	if (e == NULL)
+	{
+		pthread_mutex_unlock(&kvfs_pack_lock);
+		return 1;
+	}
+	result = kvfs_pack_append(&del, key, NULL, &seg, &off);
+	if (result == 0)
+	{
+		kvfs_pack_kill(e->seg, kvfs_pack_reclen(&e->rec));
+		kvfs_pack_kill(seg, sizeof(del) + strlen(key));
+		kvfs_pack_unchain(e);
+		free(e);
+	}
+	pthread_mutex_unlock(&kvfs_pack_lock);
+	return result;
+}
+
+// access() for a packed key, which kvfs owns like its backing files.
+// Returns 1 if key is not packed.
+static int kvfs_pack_access(const char *key, int mask)
+{
+	struct stat st;
+
+	if (kvfs_pack_stat(key, &st) != 0)
+		return 1;
+	if (((mask & R_OK) && !(st.st_mode & S_IRUSR)) ||
+	    ((mask & W_OK) && !(st.st_mode & S_IWUSR)) ||
+	    ((mask & X_OK) && !(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))))
+		return -EACCES;
+	return 0;
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_pack_format(char *buf, size_t size)
+{
+	off_t bytes = 0, dead = 0;
+	long segments = 0;
+	uint32_t id;
+	int len;
+
+	if (!kvfs_pack_on)
+		return 0;
+
+	pthread_mutex_lock(&kvfs_pack_lock);
+	for (id = 0; id < kvfs_pack_nsegs; id++)
+		if (kvfs_pack_segs[id] != NULL)
+		{
+			segments++;
+			bytes += kvfs_pack_segs[id]->size;
+			dead += kvfs_pack_segs[id]->dead;
+		}
+	len = snprintf(buf, size,
+		"pack.objects %ld\npack.segments %ld\npack.bytes %lld\npack.dead_bytes %lld\n"
+		"pack.compactions %llu\npack.moved_out %llu\n",
+		kvfs_pack_count, segments, (long long) bytes, (long long) dead,
+		(unsigned long long) kvfs_pack_stats.compactions,
+		(unsigned long long) kvfs_pack_stats.moved_out);
+	pthread_mutex_unlock(&kvfs_pack_lock);
+	return len;
+}
+#endif
+
+///////////////////////////////////////////////////////////
+//
+// Key holds
+//
+// Deduplication and compression both replace a key's backing file
+// with another inode holding the same bytes: a link to a shared copy,
+// or a compressed file.  That must not happen while a handle could
+// still write to the old inode, nor while another operation is
+// replacing it too, so each key with an open writing handle or a
+// replacement going on has an entry here.  Holding a key busy waits
+// for whoever has it; the replacements themselves only start when the
+// last writing handle is released (kvfs_hold_last()).
+//
+#define KVFS_HOLD_KEYS		1024		// hash chains for held keys
+
+struct kvfs_hkey {
+	struct kvfs_hkey *next;
+	int writers;
+	int busy;
+	char key[KVFS_KEY_MAX];
+};
+
+static pthread_mutex_t kvfs_hold_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvfs_hold_cond = PTHREAD_COND_INITIALIZER;
+static int kvfs_hold_on;	// a stored form is on
+static struct kvfs_hkey *kvfs_holds[KVFS_HOLD_KEYS];
+
+// Whether an open with these flags makes a writing handle.
+#define KVFS_HOLD_WRITER(flags)	(((flags) & O_ACCMODE) != O_RDONLY || ((flags) & O_TRUNC))
+
+static struct kvfs_hkey *kvfs_hold_key(const char *key, int create)
+{
+	struct kvfs_hkey **pp = &kvfs_holds[kvfs_keyhash(key) % KVFS_HOLD_KEYS], *k;
+
+	for (k = *pp; k != NULL; k = k->next)
+		if (strcmp(k->key, key) == 0)
+			return k;
+	if (!create || (k = calloc(1, sizeof(*k))) == NULL)
+		return NULL;
+	snprintf(k->key, sizeof(k->key), "%s", key);
+	k->next = *pp;
+	*pp = k;
+	return k;
+}
+
+static void kvfs_hold_key_free(struct kvfs_hkey *k)
+{
+	struct kvfs_hkey **pp = &kvfs_holds[kvfs_keyhash(k->key) % KVFS_HOLD_KEYS];
+
+	while (*pp != k)
+		pp = &(*pp)->next;
+	*pp = k->next;
+	free(k);
+}
+
+// Hold key busy.  With nowait, only if it has no writers either;
+// returns -EBUSY if not.
+static int kvfs_hold(const char *key, int nowait)
+{
+	struct kvfs_hkey *k;
+
+	pthread_mutex_lock(&kvfs_hold_lock);
+	// (The entry goes when a holder with no writers lets go, so it is
+	// looked up again after each wait.)
+	while ((k = kvfs_hold_key(key, 1)) != NULL && k->busy && !nowait)
+		pthread_cond_wait(&kvfs_hold_cond, &kvfs_hold_lock);
+	if (k == NULL || (nowait && (k->busy || k->writers > 0)))
+	{
+		pthread_mutex_unlock(&kvfs_hold_lock);
+		return k == NULL ? -ENOMEM : -EBUSY;
+	}
+	k->busy = 1;
+	pthread_mutex_unlock(&kvfs_hold_lock);
+	return 0;
+}
+
+// Let go of key, which has writers more writing handles now.
+static void kvfs_unhold(const char *key, int writers)
+{
+	struct kvfs_hkey *k;
+
+	pthread_mutex_lock(&kvfs_hold_lock);
+	k = kvfs_hold_key(key, 0);
+	if (k != NULL)
+	{
+		k->busy = 0;
+		k->writers += writers;
+		if (k->writers <= 0)
+			kvfs_hold_key_free(k);
+		pthread_cond_broadcast(&kvfs_hold_cond);
+	}
+	pthread_mutex_unlock(&kvfs_hold_lock);
+}
+
+// A writing handle of key was released.  Returns 1 if it was the last
+// one, with key held busy for the caller to replace its backing file.
+static int kvfs_hold_last(const char *key)
+{
+	struct kvfs_hkey *k;
+	int last = 0;
+
+	pthread_mutex_lock(&kvfs_hold_lock);
+	while ((k = kvfs_hold_key(key, 0)) != NULL && k->busy)
+		pthread_cond_wait(&kvfs_hold_cond, &kvfs_hold_lock);
+	if (k != NULL)
+	{
+		last = --k->writers == 0;
+		if (last)
+			k->busy = 1;
+		else
+			pthread_cond_broadcast(&kvfs_hold_cond);
+	}
+	pthread_mutex_unlock(&kvfs_hold_lock);
+	return last;
+}
+
+// Hold one or two keys busy while their backing files are unlinked or
+// renamed, so a file being replaced is not put back under a name that
+// just went away.  Keys are taken in order.
+static void kvfs_hold_keys(const char *key, const char *key2)
+{
+	if (!kvfs_hold_on)
+		return;
+	if (key2 != NULL && strcmp(key, key2) > 0)
+	{
+		const char *t = key;
+
+		key = key2;
+		key2 = t;
+	}
+	kvfs_hold(key, 0);
+	if (key2 != NULL && strcmp(key, key2) != 0)
+		kvfs_hold(key2, 0);
+}
+
+static void kvfs_unhold_keys(const char *key, const char *key2)
+{
+	if (!kvfs_hold_on)
+		return;
+	kvfs_unhold(key, 0);
+	if (key2 != NULL && strcmp(key, key2) != 0)
+		kvfs_unhold(key2, 0);
+}
+
+// Without an index a renamed file has another key, and its handles
+// are released under that one.  Both keys are held.
+static void kvfs_hold_rekey(const char *key, const char *newkey)
+{
+	struct kvfs_hkey *k, *nk;
+
+	if (!kvfs_hold_on || strcmp(key, newkey) == 0)
+		return;
+	pthread_mutex_lock(&kvfs_hold_lock);
+	k = kvfs_hold_key(key, 0);
+	nk = kvfs_hold_key(newkey, 0);
+	if (k != NULL && nk != NULL)
+	{
+		nk->writers += k->writers;
+		k->writers = 0;
+	}
+	pthread_mutex_unlock(&kvfs_hold_lock);
+}
+
+///////////////////////////////////////////////////////////
+//
+// Deduplication
+//
+// With KVFS_DEDUP_BYTES=n, regular backing files of at least n bytes
+// are stored once per distinct content.  The store is a directory of
+// chunks, rootdir/.kvfs_dedup/<xxh64 of the content>[.<n>], and a key
+// whose content is in it is another hard link to the chunk: its
+// backing file is the chunk's inode.  A chunk goes once its last key
+// does (its link count drops to 1).
+//
+// The unit is the whole file rather than blocks of it, because a
+// handle is a backing fd: splice, read-ahead and the write-back cache
+// all read and write through it, and a file made of shared blocks
+// would have no fd to hand them.
+//
+// A file is looked at when the last handle that could write it is
+// released.  Its content hash is looked up among the chunks and then
+// among recently closed files (kvfs_dedup_seen); a match is compared
+// byte for byte, and only then is a file that matched another one
+// moved into the store.  So a file nothing else shares stays an
+// ordinary backing file, and one that keeps being appended to is not
+// copied each time it is opened.
+//
+// Only the content decides what is shared.  A key's mode, owner and
+// times are its own, kept in a sidecar, rootdir/.kvfs_dedup/.keys/<key>,
+// which is written before the key is linked to a chunk; getattr and
+// access go by it rather than by the chunk inode, and chmod, chown and
+// utime of a shared key only rewrite it.  Reading a shared key leaves
+// its access time alone.
+//
+// A shared inode must not change under the other keys, so whatever
+// would change a key's data, or attributes a sidecar has no room for,
+// first gives it a private copy with the sidecar's attributes
+// (kvfs_dedup_unshare): an open for writing, truncate, xattr changes,
+// and a hard link, which keeps hard links meaning one file rather
+// than two that happen to match.  The key is held busy while it is
+// copied, moved or its sidecar rewritten, and never moved while a
+// writing handle is open, so no fd can write to a chunk (see "Key
+// holds").  getattr reports a shared file as having one link.
+//
+// Chunks are linked in and out with link(2) and rename(2), so after
+// a crash every key has either its old inode or the chunk's; the mount
+// deletes temporary files, chunks no key links to and sidecars of keys
+// that are not linked to a chunk (a sidecar is only read for a key
+// that is).
+//
+#define KVFS_DEDUP		".kvfs_dedup"
+#define KVFS_DEDUP_BLOCK	(1 << 20)	// bytes hashed or compared at a time
+#define KVFS_DEDUP_SEEN		65536		// recently closed files remembered
+#define KVFS_DEDUP_KEYS		".keys"		// sidecars, in the store
+
+struct kvfs_chunk {
+	struct kvfs_chunk *next_sum, *next_ino;
+	uint64_t sum;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	nlink_t refs;		// keys linked to it
+	char name[32];
+};
+
+// A shared key's sidecar: what getattr reports for it in place of the
+// chunk inode's.
+struct kvfs_dmeta {
+	uint32_t mode;
+	uint32_t uid, gid;
+	uint32_t pad;
+	int64_t atime, mtime, ctime;	// ns since the epoch
+};
+
+// A closed file no chunk matched, in case the next one matches it.
+struct kvfs_dseen {
+	uint64_t sum;
+	off_t size;
+	ino_t ino;
+	char key[KVFS_KEY_MAX];
+};
+
+static pthread_mutex_t kvfs_dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int kvfs_dedup_on;
+static int kvfs_dedup_dirfd = -1;
+static int kvfs_dedup_keysfd = -1;
+static struct kvfs_chunk **kvfs_dedup_sums, **kvfs_dedup_inos;
+static long kvfs_dedup_nbuckets, kvfs_dedup_count;
+static struct kvfs_dseen *kvfs_dedup_seen;
+
+static struct {
+	uint64_t chunk_bytes;	// stored once
+	uint64_t shared_bytes;	// the sum of each shared file's size
+	uint64_t refs;
+	uint64_t hashed;
+	uint64_t merged;	// files that became links to a chunk
+	uint64_t unshared;	// files copied back out
+} kvfs_dedup_stats;
+
+static struct kvfs_chunk *kvfs_dedup_by_ino(dev_t dev, ino_t ino)
+{
+	struct kvfs_chunk *c;
+
+	for (c = kvfs_dedup_inos[ino & (kvfs_dedup_nbuckets - 1)]; c != NULL; c = c->next_ino)
+		if (c->ino == ino && c->dev == dev)
+			return c;
+	return NULL;
+}
+
+static void kvfs_dedup_insert(struct kvfs_chunk *c)
+{
+	struct kvfs_chunk **sums, **inos, *p, *next;
+	long i, nbuckets;
+
+	// Keep chains short by doubling; a failed grow only costs speed.
+	if (kvfs_dedup_count >= kvfs_dedup_nbuckets &&
+	    (sums = calloc(kvfs_dedup_nbuckets * 2, sizeof(*sums))) != NULL)
+	{
+		inos = calloc(kvfs_dedup_nbuckets * 2, sizeof(*inos));
+		if (inos == NULL)
+			free(sums);
+		else
+		{
+			nbuckets = kvfs_dedup_nbuckets * 2;
+			for (i = 0; i < kvfs_dedup_nbuckets; i++)
+			{
+				for (p = kvfs_dedup_sums[i]; p != NULL; p = next)
+				{
+					next = p->next_sum;
+					p->next_sum = sums[p->sum & (nbuckets - 1)];
+					sums[p->sum & (nbuckets - 1)] = p;
+				}
+				for (p = kvfs_dedup_inos[i]; p != NULL; p = next)
+				{
+					next = p->next_ino;
+					p->next_ino = inos[p->ino & (nbuckets - 1)];
+					inos[p->ino & (nbuckets - 1)] = p;
+				}
+			}
+			free(kvfs_dedup_sums);
+			free(kvfs_dedup_inos);
+			kvfs_dedup_sums = sums;
+			kvfs_dedup_inos = inos;
+			kvfs_dedup_nbuckets = nbuckets;
+		}
+	}
+
+	c->next_sum = kvfs_dedup_sums[c->sum & (kvfs_dedup_nbuckets - 1)];
+	kvfs_dedup_sums[c->sum & (kvfs_dedup_nbuckets - 1)] = c;
+	c->next_ino = kvfs_dedup_inos[c->ino & (kvfs_dedup_nbuckets - 1)];
+	kvfs_dedup_inos[c->ino & (kvfs_dedup_nbuckets - 1)] = c;
+	kvfs_dedup_count++;
+	kvfs_dedup_stats.chunk_bytes += c->size;
+	kvfs_dedup_stats.shared_bytes += c->refs * c->size;
+	kvfs_dedup_stats.refs += c->refs;
+}
+
+// Drop one key's link to c, and c itself once no key has one.  Called
+// with kvfs_dedup_lock held.
+static void kvfs_dedup_deref(struct kvfs_chunk *c)
+{
+	struct kvfs_chunk **pp;
+	struct stat st;
+
+	if (c->refs > 0)
+	{
+		c->refs--;
+		kvfs_dedup_stats.shared_bytes -= c->size;
+		kvfs_dedup_stats.refs--;
+	}
+	if (fstatat(kvfs_dedup_dirfd, c->name, &st, 0) == 0 && st.st_nlink > 1)
+		return;
+
+	unlinkat(kvfs_dedup_dirfd, c->name, 0);
+	for (pp = &kvfs_dedup_sums[c->sum & (kvfs_dedup_nbuckets - 1)]; *pp != c; pp = &(*pp)->next_sum)
+		;
+	*pp = c->next_sum;
+	for (pp = &kvfs_dedup_inos[c->ino & (kvfs_dedup_nbuckets - 1)]; *pp != c; pp = &(*pp)->next_ino)
+		;
+	*pp = c->next_ino;
+	kvfs_dedup_count--;
+	kvfs_dedup_stats.chunk_bytes -= c->size;
+	kvfs_dedup_stats.shared_bytes -= c->refs * c->size;
+	kvfs_dedup_stats.refs -= c->refs;
+	free(c);
+}
+
+// The content hash of size bytes of fd, in blocks of buf.
+static int kvfs_dedup_hash(int fd, off_t size, char *buf, uint64_t *sum)
+{
+	uint64_t h[2] = { (uint64_t) size, 0 };
+	off_t off;
+	ssize_t n;
+
+	for (off = 0; off < size; off += n)
+	{
+		n = pread(fd, buf, KVFS_DEDUP_BLOCK, off);
+		if (n <= 0)
+			return -1;
+		h[1] = kvfs_xxh64(buf, n);
+		h[0] = kvfs_xxh64(h, sizeof(h));
+	}
+	*sum = h[0];
+	__atomic_add_fetch(&kvfs_dedup_stats.hashed, size, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// Whether fd and other hold the same size bytes.
+static int kvfs_dedup_same(int fd, int other, off_t size, char *buf)
+{
+	char *obuf = buf + KVFS_DEDUP_BLOCK;
+	off_t off;
+	ssize_t n;
+
+	for (off = 0; off < size; off += n)
+	{
+		n = pread(fd, buf, KVFS_DEDUP_BLOCK, off);
+		if (n <= 0 || pread(other, obuf, n, off) != n || memcmp(buf, obuf, n) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void kvfs_dedup_meta_of(const struct stat *st, struct kvfs_dmeta *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->mode = st->st_mode & 07777;
+	m->uid = st->st_uid;
+	m->gid = st->st_gid;
+	m->atime = (int64_t) st->st_atim.tv_sec * 1000000000 + st->st_atim.tv_nsec;
+	m->mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	m->ctime = (int64_t) st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+static int kvfs_dedup_meta_get(const char *key, struct kvfs_dmeta *m)
+{
+	ssize_t n;
+	int fd;
+
+	fd = openat(kvfs_dedup_keysfd, key, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, m, sizeof(*m));
+	close(fd);
+	return n == sizeof(*m) ? 0 : -EIO;
+}
+
+// Replace key's sidecar with m, durably, since a key linked to a chunk
+// has no other record of its attributes.
+static int kvfs_dedup_meta_put(const char *key, const struct kvfs_dmeta *m)
+{
+	char tmp[32];
+	int fd, result = 0;
+
+	snprintf(tmp, sizeof(tmp), "tmp.%ld", (long) syscall(SYS_gettid));
+	fd = openat(kvfs_dedup_keysfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, m, sizeof(*m)) != sizeof(*m) || fdatasync(fd) < 0)
+		result = errno ? -errno : -EIO;
+	if (close(fd) < 0 && result == 0)
+		result = -errno;
+	if (result == 0 && renameat(kvfs_dedup_keysfd, tmp, kvfs_dedup_keysfd, key) < 0)
+		result = -errno;
+	if (result < 0)
+		unlinkat(kvfs_dedup_keysfd, tmp, 0);
+	return result;
+}
+
+// Whether st is a chunk's inode.
+static int kvfs_dedup_chunk(const struct stat *st)
+{
+	int found;
+
+	if (!S_ISREG(st->st_mode) || st->st_nlink < 2)
+		return 0;
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	found = kvfs_dedup_by_ino(st->st_dev, st->st_ino) != NULL;
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	return found;
+}
+
+// Replace key's backing file, whose attributes are st, with a link to
+// chunk c.
+static int kvfs_dedup_link(struct kvfs_chunk *c, const char *key, const char *fullpath,
+			   const struct stat *st)
+{
+	struct kvfs_dmeta m;
+	char tmp[32];
+	int result;
+
+	kvfs_dedup_meta_of(st, &m);
+	result = kvfs_dedup_meta_put(key, &m);
+	if (result < 0)
+		return result;
+
+	snprintf(tmp, sizeof(tmp), "tmp.%ld", (long) syscall(SYS_gettid));
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	if (linkat(kvfs_dedup_dirfd, c->name, kvfs_dedup_dirfd, tmp, 0) < 0 ||
+	    renameat(kvfs_dedup_dirfd, tmp, AT_FDCWD, fullpath) < 0)
+	{
+		result = -errno;
+		unlinkat(kvfs_dedup_dirfd, tmp, 0);
+	}
+	else
+	{
+		c->refs++;
+		kvfs_dedup_stats.shared_bytes += c->size;
+		kvfs_dedup_stats.refs++;
+		kvfs_dedup_stats.merged++;
+	}
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	kvfs_acache_invalidate(key);
+	kvfs_fdc_invalidate(key);
+	return result;
+}
+
+// Make the backing file fd (of key, at fullpath) a chunk with content
+// hash sum, linked only to that key.  Its mode becomes one that lets
+// kvfs read it whatever mode its keys have.
+static struct kvfs_chunk *kvfs_dedup_store(int fd, const char *key, const char *fullpath, uint64_t sum)
+{
+	struct kvfs_chunk *c;
+	struct kvfs_dmeta m;
+	struct stat st;
+	unsigned int n;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+	kvfs_dedup_meta_of(&st, &m);
+	if (kvfs_dedup_meta_put(key, &m) < 0 || (c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	c->sum = sum;
+	c->size = st.st_size;
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	c->refs = 1;
+
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	for (n = 0; ; n++)
+	{
+		if (n == 0)
+			snprintf(c->name, sizeof(c->name), "%016llx", (unsigned long long) sum);
+		else
+			snprintf(c->name, sizeof(c->name), "%016llx.%u", (unsigned long long) sum, n);
+		if (linkat(AT_FDCWD, fullpath, kvfs_dedup_dirfd, c->name, 0) == 0)
+			break;
+		if (errno != EEXIST)
+		{
+			pthread_mutex_unlock(&kvfs_dedup_lock);
+			free(c);
+			return NULL;
+		}
+	}
+	kvfs_dedup_insert(c);
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	fchmod(fd, 0444);
+	return c;
+}
+
+// A link to a chunk would lose a file's xattrs, so files with any
+// (compressed ones among them) are left alone.
+static int kvfs_dedup_has_xattrs(int fd)
+{
+#ifdef HAVE_SYS_XATTR_H
+	return flistxattr(fd, NULL, 0) > 0;
+#else
+	return 0;
+#endif
+}
+
+// Share key's content with a chunk or a recently closed file if one
+// holds the same.  Called with key held busy and no writers.
+static void kvfs_dedup_file(const char *key, const char *fullpath)
+{
+	char names[4][32], other[PATH_MAX], *buf;
+	struct kvfs_chunk *c;
+	struct kvfs_dseen seen;
+	struct stat st, ost;
+	uint64_t sum;
+	int fd, ofd, i, n = 0;
+
+	if (!kvfs_dedup_on)
+		return;
+	fd = open(fullpath, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return;
+	buf = malloc(2 * KVFS_DEDUP_BLOCK);
+	if (buf == NULL || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+	    st.st_size < (off_t) kvfs_conf.dedup_bytes || kvfs_dedup_has_xattrs(fd) ||
+	    kvfs_dedup_hash(fd, st.st_size, buf, &sum) < 0)
+		goto out;
+
+	// A chunk with this content?
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	for (c = kvfs_dedup_sums[sum & (kvfs_dedup_nbuckets - 1)]; c != NULL && n < 4; c = c->next_sum)
+		if (c->sum == sum && c->size == st.st_size)
+			strcpy(names[n++], c->name);
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	for (i = 0; i < n; i++)
+	{
+		ofd = openat(kvfs_dedup_dirfd, names[i], O_RDONLY);
+		if (ofd < 0)
+			continue;
+		if (fstat(ofd, &ost) == 0 && ost.st_size == st.st_size &&
+		    kvfs_dedup_same(fd, ofd, st.st_size, buf))
+		{
+			pthread_mutex_lock(&kvfs_dedup_lock);
+			c = kvfs_dedup_by_ino(ost.st_dev, ost.st_ino);
+			pthread_mutex_unlock(&kvfs_dedup_lock);
+			// (A chunk is only freed by the thread that takes
+			// its last key, which cannot be this one.)
+			if (c != NULL)
+				kvfs_dedup_link(c, key, fullpath, &st);
+			close(ofd);
+			goto out;
+		}
+		close(ofd);
+	}
+
+	// A file closed a while ago?  Then both go into the store.
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	seen = kvfs_dedup_seen[sum % KVFS_DEDUP_SEEN];
+	kvfs_dedup_seen[sum % KVFS_DEDUP_SEEN].sum = sum;
+	kvfs_dedup_seen[sum % KVFS_DEDUP_SEEN].size = st.st_size;
+	kvfs_dedup_seen[sum % KVFS_DEDUP_SEEN].ino = st.st_ino;
+	strcpy(kvfs_dedup_seen[sum % KVFS_DEDUP_SEEN].key, key);
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	if (seen.sum != sum || seen.size != st.st_size || seen.key[0] == '\0' || strcmp(seen.key, key) == 0 ||
+	    kvfs_hold(seen.key, 1) < 0)
+		goto out;
+
+	kvfs_fullpath(other, seen.key);
+	ofd = open(other, O_RDONLY | O_NOFOLLOW);
+	if (ofd >= 0 && fstat(ofd, &ost) == 0 && ost.st_size == st.st_size && kvfs_dedup_has_xattrs(ofd))
+	{
+		// Compressed when it was closed (which gave it another
+		// inode)?  It goes into the store plain.
+		close(ofd);
+		ofd = kvfs_z_expand(seen.key, other, 1) == 0 ? open(other, O_RDONLY | O_NOFOLLOW) : -1;
+		if (ofd >= 0 && fstat(ofd, &ost) == 0)
+			seen.ino = ost.st_ino;
+	}
+	if (ofd >= 0)
+	{
+		if (fstat(ofd, &ost) == 0 && ost.st_ino == seen.ino && ost.st_nlink == 1 &&
+		    ost.st_size == st.st_size && !kvfs_dedup_has_xattrs(ofd) &&
+		    kvfs_dedup_same(fd, ofd, st.st_size, buf) &&
+		    (c = kvfs_dedup_store(ofd, seen.key, other, sum)) != NULL)
+		{
+			// The one that was first keeps its inode.
+			kvfs_acache_invalidate(seen.key);
+			kvfs_fdc_invalidate(seen.key);
+			kvfs_dedup_link(c, key, fullpath, &st);
+		}
+		close(ofd);
+	}
+	kvfs_unhold(seen.key, 0);
+
+out:
+	free(buf);
+	close(fd);
+}
+
+// Copy size bytes of in to out.
+static int kvfs_dedup_copy(int in, int out, off_t size)
+{
+	char buf[65536];
+	off_t off = 0;
+	ssize_t n;
+
+	while (off < size)
+	{
+		n = copy_file_range(in, NULL, out, NULL, size - off, 0);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	// Some filesystems can't; copy what is left by hand.
+	while (off < size)
+	{
+		n = pread(in, buf, sizeof(buf), off);
+		if (n <= 0 || pwrite(out, buf, n, off) != n)
+			return -1;
+		off += n;
+	}
+	return 0;
+}
+
+// If key's backing file is a chunk, replace it with a private copy (an
+// empty one if keep is 0) with the attributes in key's sidecar.  The
+// sidecar is left for the mount to delete, since getattr may have
+// stat'ed the chunk a moment ago and still be about to read it.
+// Called with key held busy.
+static int kvfs_dedup_unshare(const char *key, const char *fullpath, int keep)
+{
+	struct kvfs_chunk *c;
+	struct kvfs_dmeta m;
+	struct timespec times[2];
+	struct stat st;
+	char tmp[32];
+	int in, out, result = 0;
+
+	if (!kvfs_dedup_on || lstat(fullpath, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2)
+		return 0;
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	c = kvfs_dedup_by_ino(st.st_dev, st.st_ino);
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	if (c == NULL)
+		return 0;	// a hard link
+	if (kvfs_dedup_meta_get(key, &m) < 0)
+		kvfs_dedup_meta_of(&st, &m);
+
+	snprintf(tmp, sizeof(tmp), "tmp.%ld", (long) syscall(SYS_gettid));
+	out = openat(kvfs_dedup_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out < 0)
+		return -errno;
+	in = keep ? open(fullpath, O_RDONLY) : -1;
+	if ((keep && (in < 0 || kvfs_dedup_copy(in, out, st.st_size) < 0)) ||
+	    (fchown(out, m.uid, m.gid) < 0 && errno != EPERM) ||
+	    fchmod(out, m.mode & 07777) < 0)
+		result = errno ? -errno : -EIO;
+	times[0].tv_sec = m.atime / 1000000000;
+	times[0].tv_nsec = m.atime % 1000000000;
+	times[1].tv_sec = m.mtime / 1000000000;
+	times[1].tv_nsec = m.mtime % 1000000000;
+	if (result == 0 && (futimens(out, times) < 0 || fdatasync(out) < 0))
+		result = -errno;
+	if (in >= 0)
+		close(in);
+	if (close(out) < 0 && result == 0)
+		result = -errno;
+
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	if (result == 0 && renameat(kvfs_dedup_dirfd, tmp, AT_FDCWD, fullpath) < 0)
+		result = -errno;
+	if (result < 0)
+		unlinkat(kvfs_dedup_dirfd, tmp, 0);
+	else
+	{
+		kvfs_dedup_deref(c);
+		kvfs_dedup_stats.unshared++;
+	}
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	kvfs_acache_invalidate(key);
+	kvfs_fdc_invalidate(key);
+	return result;
+}
+
+// Whether fullpath may be linked to a chunk; if so, st is for
+// kvfs_dedup_drop() once the name is gone.
+static int kvfs_dedup_shared(const char *fullpath, struct stat *st)
+{
+	return kvfs_dedup_on && lstat(fullpath, st) == 0 && S_ISREG(st->st_mode) && st->st_nlink > 1;
+}
+
+// Key, whose backing file was st, was unlinked or renamed over: if st
+// was a chunk, drop that key's reference and its sidecar.
+static void kvfs_dedup_drop(const char *key, const struct stat *st)
+{
+	struct kvfs_chunk *c;
+
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	c = kvfs_dedup_by_ino(st->st_dev, st->st_ino);
+	if (c != NULL)
+		kvfs_dedup_deref(c);
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	if (c != NULL)
+		unlinkat(kvfs_dedup_keysfd, key, 0);
+}
+
+// unlink() key's backing file, and the chunk it was if no other key
+// has it.
+static int kvfs_dedup_unlink(const char *key, const char *fullpath)
+{
+	struct stat st;
+	int shared;
+
+	shared = kvfs_dedup_shared(fullpath, &st);
+	if (unlink(fullpath) < 0)
+		return -1;
+	if (shared)
+		kvfs_dedup_drop(key, &st);
+	return 0;
+}
+
+// Key's backing file was renamed to newkey's: its sidecar goes along.
+static void kvfs_dedup_rekey(const char *key, const char *newkey)
+{
+	if (kvfs_dedup_on)
+		renameat(kvfs_dedup_keysfd, key, kvfs_dedup_keysfd, newkey);
+}
+
+// A shared file has one name as far as anyone outside can tell, and
+// key's own mode, owner and times.
+static void kvfs_dedup_fixstat(const char *key, struct stat *st)
+{
+	struct kvfs_dmeta m;
+
+	if (!kvfs_dedup_on || !kvfs_dedup_chunk(st))
+		return;
+	st->st_nlink = 1;
+	if (kvfs_dedup_meta_get(key, &m) < 0)
+		return;
+	st->st_mode = S_IFREG | (m.mode & 07777);
+	st->st_uid = m.uid;
+	st->st_gid = m.gid;
+	st->st_atim.tv_sec = m.atime / 1000000000;
+	st->st_atim.tv_nsec = m.atime % 1000000000;
+	st->st_mtim.tv_sec = m.mtime / 1000000000;
+	st->st_mtim.tv_nsec = m.mtime % 1000000000;
+	st->st_ctim.tv_sec = m.ctime / 1000000000;
+	st->st_ctim.tv_nsec = m.ctime % 1000000000;
+}
+
+// Change what is flagged in what (as for kvfs_pack_setattr()) in
+// key's sidecar if key is linked to a chunk.  Returns 1 if it is not;
+// the backing file is then the caller's.  Called with key held busy.
+static int kvfs_dedup_setattr(const char *key, const char *fullpath, int what, mode_t mode, uid_t uid,
+			      gid_t gid, const struct utimbuf *ubuf)
+{
+	struct kvfs_dmeta m;
+	struct stat st;
+	int64_t now;
+
+	if (!kvfs_dedup_on || lstat(fullpath, &st) < 0 || !kvfs_dedup_chunk(&st))
+		return 1;
+	if (kvfs_dedup_meta_get(key, &m) < 0)
+		kvfs_dedup_meta_of(&st, &m);
+
+	now = kvfs_pack_now();
+	if (what & KVFS_PACK_MODE)
+		m.mode = mode & 07777;
+	if ((what & KVFS_PACK_OWNER) && uid != (uid_t) -1)
+		m.uid = uid;
+	if ((what & KVFS_PACK_OWNER) && gid != (gid_t) -1)
+		m.gid = gid;
+	if (what & KVFS_PACK_TIMES)
+	{
+		m.atime = ubuf ? (int64_t) ubuf->actime * 1000000000 : now;
+		m.mtime = ubuf ? (int64_t) ubuf->modtime * 1000000000 : now;
+	}
+	m.ctime = now;
+	return kvfs_dedup_meta_put(key, &m);
+}
+
+// access() for a key linked to a chunk, by its sidecar's mode, as
+// kvfs_pack_access() does for a packed one.  Returns 1 if key is not
+// linked to a chunk.
+static int kvfs_dedup_access(const char *key, const char *fullpath, int mask)
+{
+	struct kvfs_dmeta m;
+	struct stat st;
+
+	if (!kvfs_dedup_on || lstat(fullpath, &st) < 0 || !kvfs_dedup_chunk(&st) ||
+	    kvfs_dedup_meta_get(key, &m) < 0)
+		return 1;
+	if (((mask & R_OK) && !(m.mode & S_IRUSR)) ||
+	    ((mask & W_OK) && !(m.mode & S_IWUSR)) ||
+	    ((mask & X_OK) && !(m.mode & (S_IXUSR | S_IXGRP | S_IXOTH))))
+		return -EACCES;
+	return 0;
+}
+
+static void kvfs_dedup_init(void)
+{
+	char path[PATH_MAX];
+	struct kvfs_chunk *c;
+	struct dirent *de;
+	struct stat st;
+	unsigned long long sum;
+	DIR *dp;
+	int fd;
+
+	if (kvfs_conf.dedup_bytes == 0)
+		return;
+
+	kvfs_dedup_nbuckets = 1024;
+	kvfs_dedup_sums = calloc(kvfs_dedup_nbuckets, sizeof(*kvfs_dedup_sums));
+	kvfs_dedup_inos = calloc(kvfs_dedup_nbuckets, sizeof(*kvfs_dedup_inos));
+	kvfs_dedup_seen = calloc(KVFS_DEDUP_SEEN, sizeof(*kvfs_dedup_seen));
+	kvfs_rootfile(path, KVFS_DEDUP);
+	if (kvfs_dedup_sums == NULL || kvfs_dedup_inos == NULL || kvfs_dedup_seen == NULL ||
+	    (mkdir(path, 0755) < 0 && errno != EEXIST) ||
+	    (kvfs_dedup_dirfd = open(path, O_RDONLY | O_DIRECTORY)) < 0 ||
+	    (mkdirat(kvfs_dedup_dirfd, KVFS_DEDUP_KEYS, 0700) < 0 && errno != EEXIST) ||
+	    (kvfs_dedup_keysfd = openat(kvfs_dedup_dirfd, KVFS_DEDUP_KEYS, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		kvfs_log_errno("kvfs_dedup_init");
+		return;
+	}
+
+	// Chunks some key still links to; the rest is left from a crash.
+	fd = dup(kvfs_dedup_dirfd);
+	dp = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dp == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		kvfs_log_errno("kvfs_dedup_init opendir");
+		return;
+	}
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		if (sscanf(de->d_name, "%16llx", &sum) != 1 || strlen(de->d_name) >= sizeof(c->name) ||
+		    fstatat(kvfs_dedup_dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISREG(st.st_mode) || st.st_nlink < 2 || (c = calloc(1, sizeof(*c))) == NULL)
+		{
+			unlinkat(kvfs_dedup_dirfd, de->d_name, 0);
+			continue;
+		}
+		c->sum = sum;
+		c->size = st.st_size;
+		c->dev = st.st_dev;
+		c->ino = st.st_ino;
+		c->refs = st.st_nlink - 1;
+		strcpy(c->name, de->d_name);
+		kvfs_dedup_insert(c);
+	}
+	closedir(dp);
+
+	// Sidecars of keys that are linked to a chunk; the rest are left
+	// from a crash or from keys that have been unshared since.
+	fd = dup(kvfs_dedup_keysfd);
+	dp = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dp == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		kvfs_log_errno("kvfs_dedup_init opendir");
+		return;
+	}
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		if (strlen(de->d_name) < KVFS_KEY_MAX && strncmp(de->d_name, "tmp.", 4) != 0)
+			kvfs_keypath(path, de->d_name);
+		else
+			path[0] = '\0';
+		if (path[0] == '\0' || lstat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2 ||
+		    kvfs_dedup_by_ino(st.st_dev, st.st_ino) == NULL)
+			unlinkat(kvfs_dedup_keysfd, de->d_name, 0);
+	}
+	closedir(dp);
+
+	kvfs_dedup_on = 1;
+	kvfs_hold_on = 1;
+	kvfs_info("\nkvfs_dedup_init: %ld chunks, %llu bytes\n", kvfs_dedup_count,
+		(unsigned long long) kvfs_dedup_stats.chunk_bytes);
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_dedup_format(char *buf, size_t size)
+{
+	uint64_t stored, shared;
+	long chunks;
+	int len;
+
+	if (!kvfs_dedup_on)
+		return 0;
+
+	pthread_mutex_lock(&kvfs_dedup_lock);
+	chunks = kvfs_dedup_count;
+	stored = kvfs_dedup_stats.chunk_bytes;
+	shared = kvfs_dedup_stats.shared_bytes;
+	len = snprintf(buf, size,
+		"dedup.chunks %ld\ndedup.chunk_bytes %llu\ndedup.files %llu\ndedup.file_bytes %llu\n"
+		"dedup.ratio %.4f\ndedup.saved_bytes %llu\ndedup.hashed_bytes %llu\ndedup.merged %llu\n"
+		"dedup.unshared %llu\n",
+		chunks, (unsigned long long) stored, (unsigned long long) kvfs_dedup_stats.refs,
+		(unsigned long long) shared, stored ? (double) shared / stored : 1.0,
+		(unsigned long long) (shared - stored),
+		(unsigned long long) __atomic_load_n(&kvfs_dedup_stats.hashed, __ATOMIC_RELAXED),
+		(unsigned long long) kvfs_dedup_stats.merged, (unsigned long long) kvfs_dedup_stats.unshared);
+	pthread_mutex_unlock(&kvfs_dedup_lock);
+	return len;
+}
+#endif
+
+
+///////////////////////////////////////////////////////////
+//
+// Compression
+//
+// With KVFS_COMPRESS=lz4, or zlib when built with HAVE_ZLIB_H and
+// linked with -lz, a regular backing file is compressed in blocks of
+// KVFS_COMPRESS_BLOCK bytes (default 65536) when the last handle that
+// could write it is released.  The compressed file holds an index of
+// the blocks' compressed lengths followed by the blocks, and a hole
+// out to the file's real size, so stat needs no help and st_blocks
+// shows what it takes on disk.  A user.kvfs.z xattr marks it and says
+// how to read it; kvfs hides that one from its callers.
+//
+// lz4 is the LZ4 block format, written here so kvfs needs no library
+// for it.  zlib is slower and compresses harder.
+//
+// A handle that only reads a compressed file decompresses the blocks a
+// read touches, keeping the last one for the next read.  Anything that
+// would write to it, truncate it or hard-link it first turns it back
+// into a plain file (kvfs_z_expand()), as a shared copy is unshared.
+// Blocks that do not shrink are stored as they are, and a file is
+// left alone unless compressing saves an eighth of it, or if it has a
+// user.kvfs.compress xattr of "off", "no" or "0"; setting that xattr
+// expands it.
+//
+// Compressed files are read whenever rootdir/.kvfs_compress exists, so
+// a root stays readable when mounted again without KVFS_COMPRESS.
+//
+#define KVFS_Z			".kvfs_compress"
+#define KVFS_Z_XATTR		"user.kvfs.z"
+#define KVFS_Z_OPT		"user.kvfs.compress"
+#define KVFS_Z_MAGIC		0x6b76667a
+#define KVFS_Z_MIN		8192		// smaller files are not worth it
+#define KVFS_Z_RAW		(1U << 31)	// an index entry's block is stored as is
+#define KVFS_Z_PROBE		8		// raw blocks before giving a file up
+
+#define KVFS_Z_LZ4		1
+#define KVFS_Z_ZLIB		2
+
+// The value of KVFS_Z_XATTR.
+struct kvfs_zhdr {
+	uint32_t magic;
+	uint8_t codec;
+	uint8_t shift;		// log2 of the block size
+	uint16_t pad;
+	uint64_t size;		// uncompressed
+	uint64_t nblocks;
+	uint64_t sum;		// xxh64 of the index
+};
+
+// A compressed file open for reading.
+struct kvfs_zfile {
+	pthread_mutex_t lock;
+	struct kvfs_zhdr hdr;
+	uint32_t *lens;		// the index
+	off_t *offs;		// where each block starts
+	char *cbuf;		// a block as stored
+	char *block;		// the last block read, decompressed
+	int64_t cached;		// which one that is, or -1
+};
+
+// (Compressed files are marked with an xattr, so without xattrs there
+// are none.)
+#ifdef HAVE_SYS_XATTR_H
+static const char *kvfs_z_codecs[] = { "off", "lz4", "zlib" };
+
+static int kvfs_z_on;		// compressing
+static int kvfs_z_read_on;	// reading compressed files
+static int kvfs_z_dirfd = -1;
+static int kvfs_z_codec, kvfs_z_shift;
+static struct kvfs_zfile **kvfs_z_table;	// by fd
+static int kvfs_z_fds;
+
+static struct {
+	uint64_t files;
+	uint64_t in_bytes, out_bytes;
+	uint64_t skipped;	// did not shrink enough
+	uint64_t expanded;
+	uint64_t blocks;	// decompressed for readers
+} kvfs_z_stats;
+
+#define KVFS_LZ4_HASHLOG	12
+#define KVFS_LZ4_MINMATCH	4
+#define KVFS_LZ4_LASTLITERALS	5	// the format ends in literals
+#define KVFS_LZ4_MFLIMIT	12	// and no match starts closer to the end
+
+static uint32_t kvfs_lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Append a length continued past the 15 its token nibble holds.
+static uint8_t *kvfs_lz4_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+// One sequence: the literals from anchor, then a match of mlen bytes
+// off bytes back (none if mlen is 0).  Returns NULL if it won't fit.
+static uint8_t *kvfs_lz4_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor, size_t lits,
+				  size_t off, size_t mlen)
+{
+	uint8_t *token = op;
+
+	if ((size_t) (oend - op) < 1 + lits + lits / 255 + 1 + 2 + mlen / 255 + 1)
+		return NULL;
+	op++;
+	*token = (lits >= 15 ? 15 : lits) << 4;
+	if (lits >= 15)
+		op = kvfs_lz4_length(op, lits - 15);
+	memcpy(op, anchor, lits);
+	op += lits;
+	if (mlen == 0)
+		return op;
+
+	*op++ = off;
+	*op++ = off >> 8;
+	mlen -= KVFS_LZ4_MINMATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if (mlen >= 15)
+		op = kvfs_lz4_length(op, mlen - 15);
+	return op;
+}
+
+// Greedy LZ4 with a single-entry hash table, as LZ4's fast mode does.
+// Returns the compressed length, or -1 if it is over cap.
+static int kvfs_lz4_compress(const char *src, int len, char *dst, int cap)
+{
+	uint32_t table[1 << KVFS_LZ4_HASHLOG];
+	const uint8_t *base = (const uint8_t *) src, *ip = base, *anchor = base, *end = base + len;
+	const uint8_t *mflimit = end - KVFS_LZ4_MFLIMIT, *mlimit = end - KVFS_LZ4_LASTLITERALS;
+	const uint8_t *ref, *mp, *rp;
+	uint8_t *op = (uint8_t *) dst, *oend = op + cap;
+	unsigned int misses = 0;
+	uint32_t h;
+
+	if (len > KVFS_LZ4_MFLIMIT)
+	{
+		memset(table, 0, sizeof(table));
+		ip++;
+		while (ip < mflimit)
+		{
+			h = (kvfs_lz4_read32(ip) * 2654435761U) >> (32 - KVFS_LZ4_HASHLOG);
+			ref = base + table[h];
+			table[h] = ip - base;
+			if (ref >= ip || ip - ref > 65535 || kvfs_lz4_read32(ref) != kvfs_lz4_read32(ip))
+			{
+				// skip faster through data that doesn't match
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+
+			while (ip > anchor && ref > base && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			mp = ip + KVFS_LZ4_MINMATCH;
+			rp = ref + KVFS_LZ4_MINMATCH;
+			while (mp + 8 <= mlimit)	// a word at a time, then the rest
+			{
+				uint64_t x, y;
+
+				memcpy(&x, mp, 8);
+				memcpy(&y, rp, 8);
+				if (x != y)
+					break;
+				mp += 8;
+				rp += 8;
+			}
+			for (; mp < mlimit && *mp == *rp; mp++, rp++)
+				;
+			op = kvfs_lz4_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+			if (op == NULL)
+				return -1;
+			ip = anchor = mp;
+			if (ip - 2 >= base && ip < mflimit)
+				table[(kvfs_lz4_read32(ip - 2) * 2654435761U) >> (32 - KVFS_LZ4_HASHLOG)] = ip - 2 - base;
+		}
+	}
+	op = kvfs_lz4_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return op == NULL ? -1 : (char *) op - dst;
+}
+
+// Returns the decompressed length, or -1 if src is not a valid block
+// of at most cap bytes.
+static int kvfs_lz4_decompress(const char *src, int len, char *dst, int cap)
+{
+	const uint8_t *ip = (const uint8_t *) src, *iend = ip + len;
+	uint8_t *op = (uint8_t *) dst, *oend = op + cap, *ref;
+	size_t n, off;
+	unsigned int token, b;
+
+	while (ip < iend)
+	{
+		token = *ip++;
+		n = token >> 4;
+		if (n == 15)
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				n += b;
+			} while (b == 255);
+		if (n > (size_t) (iend - ip) || n > (size_t) (oend - op))
+			return -1;
+		// Short copies are done 16 bytes at a time where there is
+		// room to overrun; the next copy writes over the excess.
+		if (n <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);
+		else
+			memcpy(op, ip, n);
+		op += n;
+		ip += n;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t) (op - (uint8_t *) dst))
+			return -1;
+		n = token & 15;
+		if (n == 15)
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				n += b;
+			} while (b == 255);
+		n += KVFS_LZ4_MINMATCH;
+		if (n > (size_t) (oend - op))
+			return -1;
+		ref = op - off;
+		if (n <= 16 && off >= 16 && oend - op >= 16)
+			memcpy(op, ref, 16);
+		else if (off >= n)
+			memcpy(op, ref, n);
+		else
+			for (b = 0; b < n; b++)	// a run repeating its last off bytes
+				op[b] = ref[b];
+		op += n;
+	}
+	return (char *) op - dst;
+}
+
+// Compress len bytes of src into at most cap bytes of dst.  Returns
+// the compressed length, or -1 if it doesn't fit.
+static int kvfs_z_pack(int codec, const char *src, int len, char *dst, int cap)
+{
+	switch (codec)
+	{
+	case KVFS_Z_LZ4:
+		return kvfs_lz4_compress(src, len, dst, cap);
+#ifdef HAVE_ZLIB_H
+	case KVFS_Z_ZLIB:
+	{
+		uLongf n = cap;
+
+		return compress2((Bytef *) dst, &n, (const Bytef *) src, len, Z_DEFAULT_COMPRESSION) == Z_OK ? (int) n : -1;
+	}
+#endif
+	}
+	return -1;
+}
+
+static int kvfs_z_unpack(int codec, const char *src, int len, char *dst, int cap)
+{
+	switch (codec)
+	{
+	case KVFS_Z_LZ4:
+		return kvfs_lz4_decompress(src, len, dst, cap);
+#ifdef HAVE_ZLIB_H
+	case KVFS_Z_ZLIB:
+	{
+		uLongf n = cap;
+
+		return uncompress((Bytef *) dst, &n, (const Bytef *) src, len) == Z_OK ? (int) n : -1;
+	}
+#endif
+	}
+	return -1;
+}
+
+static int kvfs_z_optout(const char *value, size_t size)
+{
+	return (size == 3 && memcmp(value, "off", 3) == 0) || (size == 2 && memcmp(value, "no", 2) == 0) ||
+	       (size == 1 && value[0] == '0');
+}
+
+static void kvfs_z_free(struct kvfs_zfile *z)
+{
+	if (z == NULL)
+		return;
+	pthread_mutex_destroy(&z->lock);
+	free(z->lens);
+	free(z->offs);
+	free(z->cbuf);
+	free(z);
+}
+
+// Read the index of the backing file open as fd.  Returns NULL if it
+// is not compressed, or with *error set if it can't be read.
+static struct kvfs_zfile *kvfs_z_load(int fd, int *error)
+{
+	struct kvfs_zfile *z;
+	struct kvfs_zhdr hdr;
+	size_t bs, n, i;
+	ssize_t len;
+
+	*error = 0;
+	len = fgetxattr(fd, KVFS_Z_XATTR, &hdr, sizeof(hdr));
+	if (len < 0)
+	{
+		if (errno != ENODATA && errno != ENOTSUP)
+			*error = errno;
+		return NULL;
+	}
+	bs = (size_t) 1 << (hdr.shift & 31);
+	if (len != sizeof(hdr) || hdr.magic != KVFS_Z_MAGIC || hdr.codec < KVFS_Z_LZ4 ||
+	    hdr.codec > KVFS_Z_ZLIB || hdr.shift < 12 || hdr.shift > 20 ||
+	    hdr.nblocks != (hdr.size + bs - 1) / bs)
+	{
+		*error = EIO;
+		return NULL;
+	}
+
+	n = hdr.nblocks;
+	z = calloc(1, sizeof(*z));
+	if (z == NULL)
+	{
+		*error = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&z->lock, NULL);
+	if ((z->lens = malloc(n * sizeof(*z->lens) + 1)) == NULL ||
+	    (z->offs = malloc(n * sizeof(*z->offs) + 1)) == NULL || (z->cbuf = malloc(2 * bs)) == NULL)
+	{
+		*error = ENOMEM;
+		goto fail;
+	}
+	z->hdr = hdr;
+	z->block = z->cbuf + bs;
+	z->cached = -1;
+
+	if (pread(fd, z->lens, n * sizeof(*z->lens), 0) != (ssize_t) (n * sizeof(*z->lens)) ||
+	    kvfs_xxh64(z->lens, n * sizeof(*z->lens)) != hdr.sum)
+	{
+		kvfs_error("\nkvfs_z_load: bad index in a compressed file\n");
+		*error = EIO;
+		goto fail;
+	}
+	z->offs[0] = n * sizeof(*z->lens);
+	for (i = 0; i < n; i++)
+	{
+		if ((z->lens[i] & ~KVFS_Z_RAW) > bs)
+		{
+			*error = EIO;
+			goto fail;
+		}
+		if (i + 1 < n)
+			z->offs[i + 1] = z->offs[i] + (z->lens[i] & ~KVFS_Z_RAW);
+	}
+	return z;
+
+fail:
+	kvfs_z_free(z);
+	return NULL;
+}
+
+// Read size bytes at offset from compressed file z, open as fd.
+static ssize_t kvfs_z_read(struct kvfs_zfile *z, int fd, char *buf, size_t size, off_t offset)
+{
+	size_t bs = (size_t) 1 << z->hdr.shift, done = 0, in, blen, n, len;
+	uint64_t b;
+	int result = 0;
+
+	if (offset < 0)
+		return -EINVAL;
+	if ((uint64_t) offset >= z->hdr.size)
+		return 0;
+	if (size > z->hdr.size - offset)
+		size = z->hdr.size - offset;
+
+	pthread_mutex_lock(&z->lock);
+	while (done < size)
+	{
+		b = (offset + done) / bs;
+		in = (offset + done) % bs;
+		blen = b + 1 < z->hdr.nblocks ? bs : z->hdr.size - b * bs;
+		if (z->cached != (int64_t) b)
+		{
+			len = z->lens[b] & ~KVFS_Z_RAW;
+			if (z->lens[b] & KVFS_Z_RAW)
+			{
+				if (len != blen || pread(fd, z->block, len, z->offs[b]) != (ssize_t) len)
+					result = -EIO;
+			}
+			else if (pread(fd, z->cbuf, len, z->offs[b]) != (ssize_t) len ||
+				 kvfs_z_unpack(z->hdr.codec, z->cbuf, len, z->block, blen) != (int) blen)
+				result = -EIO;
+			if (result < 0)
+			{
+				z->cached = -1;
+				break;
+			}
+			z->cached = b;
+			__atomic_add_fetch(&kvfs_z_stats.blocks, 1, __ATOMIC_RELAXED);
+		}
+		n = blen - in < size - done ? blen - in : size - done;
+		memcpy(buf + done, z->block + in, n);
+		done += n;
+	}
+	pthread_mutex_unlock(&z->lock);
+	return done > 0 ? (ssize_t) done : result;
+}
+
+// The compressed file read through handle fd, or NULL.
+static struct kvfs_zfile *kvfs_z_file(int fd)
+{
+	if (!kvfs_z_read_on || fd < 0 || fd >= kvfs_z_fds)
+		return NULL;
+	return __atomic_load_n(&kvfs_z_table[fd], __ATOMIC_ACQUIRE);
+}
+
+// A handle that only reads was opened as fd; if its file is
+// compressed, reads through it decompress.
+static int kvfs_z_open(int fd)
+{
+	struct kvfs_zfile *z;
+	int error;
+
+	if (!kvfs_z_read_on)
+		return 0;
+	z = kvfs_z_load(fd, &error);
+	if (z == NULL)
+		return -error;
+	if (fd >= kvfs_z_fds)
+	{
+		kvfs_z_free(z);
+		return -EMFILE;
+	}
+	__atomic_store_n(&kvfs_z_table[fd], z, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Forget handle fd before it is closed.
+static void kvfs_z_release(int fd)
+{
+	if (!kvfs_z_read_on || fd < 0 || fd >= kvfs_z_fds)
+		return;
+	kvfs_z_free(__atomic_exchange_n(&kvfs_z_table[fd], NULL, __ATOMIC_ACQ_REL));
+}
+
+// Drop the marker from an xattr list of len bytes; returns the new length.
+static ssize_t kvfs_z_hide(char *list, ssize_t len)
+{
+	char *name;
+	size_t n;
+
+	if (!kvfs_z_read_on)
+		return len;
+	for (name = list; name < list + len; name += n)
+	{
+		n = strlen(name) + 1;
+		if (strcmp(name, KVFS_Z_XATTR) == 0)
+		{
+			memmove(name, name + n, list + len - (name + n));
+			return len - n;
+		}
+	}
+	return len;
+}
+
+// Give out, which is to replace in (with attributes st), in's owner,
+// mode, times and xattrs but the marker, and make it durable.
+static int kvfs_z_finish(int in, int out, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	char *list = NULL, *value = NULL, *name;
+	ssize_t len, n;
+	int result = -1;
+
+	len = flistxattr(in, NULL, 0);
+	if (len > 0)
+	{
+		list = malloc(len);
+		value = malloc(XATTR_SIZE_MAX);
+		if (list == NULL || value == NULL || (len = flistxattr(in, list, len)) < 0)
+			goto out;
+		for (name = list; name < list + len; name += strlen(name) + 1)
+		{
+			if (strcmp(name, KVFS_Z_XATTR) == 0)
+				continue;
+			n = fgetxattr(in, name, value, XATTR_SIZE_MAX);
+			if (n < 0 || fsetxattr(out, name, value, n, 0) < 0)
+				goto out;
+		}
+	}
+	if ((fchown(out, st->st_uid, st->st_gid) < 0 && errno != EPERM) ||
+	    fchmod(out, st->st_mode & 07777) < 0 || futimens(out, times) < 0 || fdatasync(out) < 0)
+		goto out;
+	result = 0;
+out:
+	free(list);
+	free(value);
+	return result;
+}
+
+// Compress key's backing file if it is worth it.  Called with key held
+// busy and no writers.
+static void kvfs_z_compress(const char *key, const char *fullpath)
+{
+	size_t bs = (size_t) 1 << kvfs_z_shift, blen;
+	struct kvfs_zhdr hdr = { KVFS_Z_MAGIC, kvfs_z_codec, kvfs_z_shift, 0, 0, 0, 0 };
+	uint32_t *lens = NULL;
+	char *buf = NULL, tmp[32], opt[8];
+	const char *src;
+	struct stat st;
+	off_t off, limit;
+	uint64_t b;
+	int in, out = -1, len, raw = 0, done = 0;
+	ssize_t n;
+
+	if (!kvfs_z_on)
+		return;
+	in = open(fullpath, O_RDONLY | O_NOFOLLOW);
+	if (in < 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "tmp.%ld", (long) syscall(SYS_gettid));
+	if (fstat(in, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 || st.st_size < KVFS_Z_MIN ||
+	    fgetxattr(in, KVFS_Z_XATTR, NULL, 0) >= 0 ||
+	    ((n = fgetxattr(in, KVFS_Z_OPT, opt, sizeof(opt))) > 0 && kvfs_z_optout(opt, n)))
+		goto out;
+
+	hdr.size = st.st_size;
+	hdr.nblocks = (st.st_size + bs - 1) / bs;
+	lens = malloc(hdr.nblocks * sizeof(*lens));
+	buf = malloc(2 * bs);
+	if (lens == NULL || buf == NULL ||
+	    (out = openat(kvfs_z_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		goto out;
+
+	off = hdr.nblocks * sizeof(*lens);
+	limit = st.st_size - st.st_size / 8;
+	for (b = 0; b < hdr.nblocks; b++)
+	{
+		blen = b + 1 < hdr.nblocks ? bs : st.st_size - b * bs;
+		if (pread(in, buf, blen, b * bs) != (ssize_t) blen)
+			goto out;
+		len = kvfs_z_pack(kvfs_z_codec, buf, blen, buf + bs, blen - 1);
+		if (len > 0)
+		{
+			lens[b] = len;
+			src = buf + bs;
+		}
+		else
+		{
+			lens[b] = blen | KVFS_Z_RAW;
+			len = blen;
+			src = buf;
+			raw++;
+		}
+		if (off + len > limit || (raw == KVFS_Z_PROBE && b + 1 == KVFS_Z_PROBE))
+		{
+			__atomic_add_fetch(&kvfs_z_stats.skipped, 1, __ATOMIC_RELAXED);
+			goto out;
+		}
+		if (pwrite(out, src, len, off) != len)
+			goto out;
+		off += len;
+	}
+	hdr.sum = kvfs_xxh64(lens, hdr.nblocks * sizeof(*lens));
+	if (pwrite(out, lens, hdr.nblocks * sizeof(*lens), 0) != (ssize_t) (hdr.nblocks * sizeof(*lens)) ||
+	    ftruncate(out, st.st_size) < 0 || fsetxattr(out, KVFS_Z_XATTR, &hdr, sizeof(hdr), 0) < 0 ||
+	    kvfs_z_finish(in, out, &st) < 0 || close(out) < 0)
+	{
+		kvfs_log_errno("kvfs_z_compress");
+		out = -1;
+		goto out;
+	}
+	out = -1;
+	if (renameat(kvfs_z_dirfd, tmp, AT_FDCWD, fullpath) < 0)
+	{
+		kvfs_log_errno("kvfs_z_compress rename");
+		goto out;
+	}
+	done = 1;
+	kvfs_acache_invalidate(key);
+	kvfs_fdc_invalidate(key);
+	__atomic_add_fetch(&kvfs_z_stats.files, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kvfs_z_stats.in_bytes, st.st_size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kvfs_z_stats.out_bytes, off, __ATOMIC_RELAXED);
+
+out:
+	if (out >= 0)
+		close(out);
+	if (!done)
+		unlinkat(kvfs_z_dirfd, tmp, 0);
+	free(lens);
+	free(buf);
+	close(in);
+}
+
+// If key's backing file is compressed, replace it with a plain one (an
+// empty one if keep is 0).  Called with key held busy.
+static int kvfs_z_expand(const char *key, const char *fullpath, int keep)
+{
+	struct kvfs_zfile *z;
+	struct stat st;
+	char tmp[32], *buf = NULL;
+	off_t off;
+	ssize_t n;
+	int in, out, result = 0;
+
+	if (!kvfs_z_read_on)
+		return 0;
+	in = open(fullpath, O_RDONLY | O_NOFOLLOW);
+	if (in < 0)
+		return 0;	// the operation will say why
+	z = kvfs_z_load(in, &result);
+	if (z == NULL || fstat(in, &st) < 0)
+	{
+		result = z == NULL ? -result : -errno;
+		kvfs_z_free(z);
+		close(in);
+		return result;
+	}
+
+	snprintf(tmp, sizeof(tmp), "tmp.%ld", (long) syscall(SYS_gettid));
+	out = openat(kvfs_z_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out < 0)
+		result = -errno;
+	else if (keep && (buf = malloc((size_t) 1 << z->hdr.shift)) == NULL)
+		result = -ENOMEM;
+	for (off = 0; keep && result == 0 && (uint64_t) off < z->hdr.size; off += n)
+	{
+		n = kvfs_z_read(z, in, buf, (size_t) 1 << z->hdr.shift, off);
+		if (n <= 0)
+			result = n < 0 ? n : -EIO;
+		else if (pwrite(out, buf, n, off) != n)
+			result = -EIO;
+	}
+	if (result == 0 && kvfs_z_finish(in, out, &st) < 0)
+		result = -errno;
+	if (out >= 0 && close(out) < 0 && result == 0)
+		result = -errno;
+	if (result == 0 && renameat(kvfs_z_dirfd, tmp, AT_FDCWD, fullpath) < 0)
+		result = -errno;
+	if (result < 0 && out >= 0)
+		unlinkat(kvfs_z_dirfd, tmp, 0);
+	free(buf);
+	kvfs_z_free(z);
+	close(in);
+
+	if (result == 0)
+	{
+		kvfs_acache_invalidate(key);
+		kvfs_fdc_invalidate(key);
+		__atomic_add_fetch(&kvfs_z_stats.expanded, 1, __ATOMIC_RELAXED);
+	}
+	return result;
+}
+
+static void kvfs_z_init(void)
+{
+	const char *codec = kvfs_getenv("KVFS_COMPRESS", "off");
+	char path[PATH_MAX];
+	struct dirent *de;
+	size_t i;
+	DIR *dp;
+	int fd;
+
+	kvfs_z_codec = -1;
+	for (i = 0; i < sizeof(kvfs_z_codecs) / sizeof(*kvfs_z_codecs); i++)
+		if (strcmp(codec, kvfs_z_codecs[i]) == 0)
+			kvfs_z_codec = i;
+#ifndef HAVE_ZLIB_H
+	if (kvfs_z_codec == KVFS_Z_ZLIB)
+		kvfs_z_codec = -1;
+#endif
+	if (kvfs_z_codec < 0)
+	{
+		kvfs_error("\nkvfs_z_init: KVFS_COMPRESS=%s is not available here, compression is off\n", codec);
+		kvfs_z_codec = 0;
+	}
+	for (kvfs_z_shift = 12; kvfs_z_shift < 20 && ((size_t) 1 << kvfs_z_shift) < kvfs_conf.z_block; kvfs_z_shift++)
+		;
+
+	kvfs_rootfile(path, KVFS_Z);
+	if (kvfs_z_codec != 0 && mkdir(path, 0755) < 0 && errno != EEXIST)
+	{
+		kvfs_log_errno("kvfs_z_init mkdir");
+		return;
+	}
+	kvfs_z_dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (kvfs_z_dirfd < 0)
+		return;		// nothing was ever compressed here
+
+	kvfs_z_fds = kvfs_fd_slots();
+	kvfs_z_table = calloc(kvfs_z_fds, sizeof(*kvfs_z_table));
+	if (kvfs_z_table == NULL)
+	{
+		kvfs_error("\nkvfs_z_init: out of memory, compressed files can't be read\n");
+		return;
+	}
+
+	// What a crash left half written.
+	fd = dup(kvfs_z_dirfd);
+	dp = fd >= 0 ? fdopendir(fd) : NULL;
+	while (dp != NULL && (de = readdir(dp)) != NULL)
+		if (strncmp(de->d_name, "tmp.", 4) == 0)
+			unlinkat(kvfs_z_dirfd, de->d_name, 0);
+	if (dp != NULL)
+		closedir(dp);
+	else if (fd >= 0)
+		close(fd);
+
+	kvfs_z_read_on = 1;
+	kvfs_z_on = kvfs_z_codec != 0;
+	kvfs_hold_on = 1;
+	kvfs_info("\nkvfs_z_init: codec %s, blocks of %zu bytes\n", kvfs_z_codecs[kvfs_z_codec],
+		(size_t) 1 << kvfs_z_shift);
+}
+
+static int kvfs_z_format(char *buf, size_t size)
+{
+	uint64_t in = __atomic_load_n(&kvfs_z_stats.in_bytes, __ATOMIC_RELAXED);
+	uint64_t out = __atomic_load_n(&kvfs_z_stats.out_bytes, __ATOMIC_RELAXED);
+
+	if (!kvfs_z_read_on)
+		return 0;
+	return snprintf(buf, size,
+		"compress.codec %s\ncompress.files %llu\ncompress.in_bytes %llu\ncompress.out_bytes %llu\n"
+		"compress.ratio %.4f\ncompress.skipped %llu\ncompress.expanded %llu\ncompress.blocks_read %llu\n",
+		kvfs_z_codecs[kvfs_z_codec],
+		(unsigned long long) __atomic_load_n(&kvfs_z_stats.files, __ATOMIC_RELAXED),
+		(unsigned long long) in, (unsigned long long) out, out ? (double) in / out : 1.0,
+		(unsigned long long) __atomic_load_n(&kvfs_z_stats.skipped, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_z_stats.expanded, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_z_stats.blocks, __ATOMIC_RELAXED));
+}
+#else
+static void kvfs_z_init(void)
+{
+	if (strcmp(kvfs_getenv("KVFS_COMPRESS", "off"), "off") != 0)
+		kvfs_error("\nkvfs_z_init: compression needs xattr support, it is off\n");
+}
+
+static struct kvfs_zfile *kvfs_z_file(int fd)
+{
+	return NULL;
+}
+
+static ssize_t kvfs_z_read(struct kvfs_zfile *z, int fd, char *buf, size_t size, off_t offset)
+{
+	return -EIO;
+}
+
+static int kvfs_z_open(int fd)
+{
+	return 0;
+}
+
+static void kvfs_z_release(int fd)
+{
+}
+
+static void kvfs_z_compress(const char *key, const char *fullpath)
+{
+}
+
+static int kvfs_z_expand(const char *key, const char *fullpath, int keep)
+{
+	return 0;
+}
+#endif
+
+///////////////////////////////////////////////////////////
+//
+// Stored forms
+//
+// The operations below bracket whatever changes a key's backing file
+// with kvfs_store_begin() and kvfs_store_end(), and report writing
+// handles going away to kvfs_store_release(), which is where a file is
+// deduplicated or compressed.
+//
+#define KVFS_STORE_ATTRS	0	// only attributes change
+#define KVFS_STORE_WRITE	1	// so may the data
+#define KVFS_STORE_TRUNC	2	// the data is thrown away
+#define KVFS_STORE_STAT		3	// only mode, owner or times change
+
+// Before changing key's data or attributes through its path: hold it,
+// and give it a plain inode of its own.  For KVFS_STORE_STAT a shared
+// key stays shared; the caller changes it with kvfs_dedup_setattr().
+static int kvfs_store_begin(const char *key, const char *fullpath, int how)
+{
+	int result;
+
+	if (!kvfs_hold_on)
+		return 0;
+	result = kvfs_hold(key, 0);
+	if (result == 0 && how != KVFS_STORE_STAT)
+		result = kvfs_dedup_unshare(key, fullpath, how != KVFS_STORE_TRUNC);
+	if (result == 0 && how != KVFS_STORE_ATTRS && how != KVFS_STORE_STAT)
+		result = kvfs_z_expand(key, fullpath, how != KVFS_STORE_TRUNC);
+	if (result < 0)
+		kvfs_unhold(key, 0);
+	return result;
+}
+
+// writers is 1 if a writing handle was opened.
+static void kvfs_store_end(const char *key, int writers)
+{
+	if (kvfs_hold_on)
+		kvfs_unhold(key, writers);
+}
+
+// A writing handle of key was released.
+static void kvfs_store_release(const char *key)
+{
+	char fullpath[PATH_MAX];
+
+	if (!kvfs_hold_on || !kvfs_hold_last(key))
+		return;
+	kvfs_fullpath(fullpath, key);
+	kvfs_dedup_file(key, fullpath);
+	kvfs_z_compress(key, fullpath);
+	kvfs_unhold(key, 0);
+}
+
+///////////////////////////////////////////////////////////
+//
+// Sync
+//
+// fsync and fdatasync of a file sync its backing file.  fsyncdir has
+// no one backing file to sync: a directory's entries are spread over
+// backing files in the root or its shards, the pack and the namespace
+// index, so it syncs the whole backing filesystem with syncfs(2).
+//
+// Syncs of the backing filesystem are group commits.  A request joins
+// the queue; if no sync is running it takes the queue and syncs for
+// all of it, otherwise it waits for the running sync to finish and for
+// itself to be taken or led by someone.  Requests that arrive during
+// one syncfs are all covered by the next.  With KVFS_SYNC=group the
+// fsyncs of files join the queue too, and a leader that finds itself
+// alone syncs only its own file.  KVFS_SYNC_WAIT_US has a leader wait
+// that long for others to join first.
+//
+// syncfs reports writeback errors from anywhere on the backing
+// filesystem (Linux 5.8 and later), and an error fails every request
+// in the batch, so no request hears of success that wasn't had.
+//
+struct kvfs_syncreq {
+	struct kvfs_syncreq *next;
+	int fd;			// a backing file, or -1 for the filesystem
+	int datasync;
+	int done;
+	int result;
+};
+
+static pthread_mutex_t kvfs_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvfs_sync_cond = PTHREAD_COND_INITIALIZER;
+static struct kvfs_syncreq *kvfs_sync_queue;
+static int kvfs_sync_busy;	// a leader is syncing
+static int kvfs_sync_fd = -1;	// the root, for syncfs()
+
+// The group counters change under kvfs_sync_lock, the rest atomically.
+static struct {
+	uint64_t requests;
+	uint64_t file_syncs;
+	uint64_t ns;		// in syncs of either kind
+	uint64_t errors;
+	uint64_t groups;	// syncfs() calls
+	uint64_t grouped;	// requests they covered
+	uint64_t batch_max;
+} kvfs_sync_stats;
+
+static void kvfs_sync_count(int file, uint64_t ns, int result)
+{
+	__atomic_fetch_add(&kvfs_sync_stats.ns, ns, __ATOMIC_RELAXED);
+	if (file)
+		__atomic_fetch_add(&kvfs_sync_stats.file_syncs, 1, __ATOMIC_RELAXED);
+	if (result < 0)
+		__atomic_fetch_add(&kvfs_sync_stats.errors, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t kvfs_sync_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int kvfs_sync_file(int fd, int datasync)
+{
+	return kvfs_io_fsync(fd, datasync) < 0 ? -errno : 0;
+}
+
+static int kvfs_sync_fs(void)
+{
+	if (kvfs_sync_fd < 0)
+	{
+		sync();
+		return 0;
+	}
+	return syncfs(kvfs_sync_fd) < 0 ? -errno : 0;
+}
+
+// Sync backing file fd, or the backing filesystem if fd is -1, as part
+// of a group commit.
+static int kvfs_sync_group(int fd, int datasync)
+{
+	struct kvfs_syncreq req = { NULL, fd, datasync, 0, 0 }, *batch, *r;
+	struct timespec wait;
+	uint64_t start, n = 0;
+	int result;
+
+	__atomic_fetch_add(&kvfs_sync_stats.requests, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&kvfs_sync_lock);
+	req.next = kvfs_sync_queue;
+	kvfs_sync_queue = &req;
+	while (!req.done && kvfs_sync_busy)
+		pthread_cond_wait(&kvfs_sync_cond, &kvfs_sync_lock);
+	if (req.done)
+	{
+		pthread_mutex_unlock(&kvfs_sync_lock);
+		return req.result;
+	}
+
+	// Lead: sync for everyone queued by now.
+	kvfs_sync_busy = 1;
+	if (kvfs_conf.sync_wait_ns > 0)
+	{
+		pthread_mutex_unlock(&kvfs_sync_lock);
+		wait.tv_sec = kvfs_conf.sync_wait_ns / 1000000000ULL;
+		wait.tv_nsec = kvfs_conf.sync_wait_ns % 1000000000ULL;
+		nanosleep(&wait, NULL);
+		pthread_mutex_lock(&kvfs_sync_lock);
+	}
+	batch = kvfs_sync_queue;
+	kvfs_sync_queue = NULL;
+	pthread_mutex_unlock(&kvfs_sync_lock);
+
+	for (r = batch; r != NULL; r = r->next)
+		n++;
+	start = kvfs_sync_clock();
+	if (n == 1 && fd >= 0)
+		result = kvfs_sync_file(fd, datasync);
+	else
+		result = kvfs_sync_fs();
+
+	kvfs_sync_count(n == 1 && fd >= 0, kvfs_sync_clock() - start, result);
+	pthread_mutex_lock(&kvfs_sync_lock);
+	if (n > 1 || fd < 0)
+	{
+		kvfs_sync_stats.groups++;
+		kvfs_sync_stats.grouped += n;
+		if (n > kvfs_sync_stats.batch_max)
+			kvfs_sync_stats.batch_max = n;
+	}
+	// The waiters' requests are on their stacks; once done is set
+	// they may return, so r->next is read first.
+	for (r = batch; r != NULL; r = batch)
+	{
+		batch = r->next;
+		r->result = result;
+		r->done = 1;
+	}
+	kvfs_sync_busy = 0;
+	pthread_cond_broadcast(&kvfs_sync_cond);
+	pthread_mutex_unlock(&kvfs_sync_lock);
+	return result;
+}
+
+// fsync or fdatasync of backing file fd.
+static int kvfs_sync(int fd, int datasync)
+{
+	uint64_t start;
+	int result;
+
+	if (kvfs_conf.sync_group)
+		return kvfs_sync_group(fd, datasync);
+	__atomic_fetch_add(&kvfs_sync_stats.requests, 1, __ATOMIC_RELAXED);
+	start = kvfs_sync_clock();
+	result = kvfs_sync_file(fd, datasync);
+	kvfs_sync_count(1, kvfs_sync_clock() - start, result);
+	return result;
+}
+
+static void kvfs_sync_init(void)
+{
+	const char *mode = kvfs_getenv("KVFS_SYNC", "file");
+
+	if (strcmp(mode, "group") == 0)
+		kvfs_conf.sync_group = 1;
+	else if (strcmp(mode, "file") != 0)
+		kvfs_error("\nkvfs_sync_init: ignoring KVFS_SYNC=%s, using file\n", mode);
+	kvfs_sync_fd = open(kvfs_rootdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (kvfs_sync_fd < 0)
+		kvfs_log_errno("kvfs_sync_init open");
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_sync_format(char *buf, size_t size)
+{
+	uint64_t requests, syncs, groups, grouped;
+	int len;
+
+	pthread_mutex_lock(&kvfs_sync_lock);
+	requests = __atomic_load_n(&kvfs_sync_stats.requests, __ATOMIC_RELAXED);
+	syncs = __atomic_load_n(&kvfs_sync_stats.file_syncs, __ATOMIC_RELAXED);
+	groups = kvfs_sync_stats.groups;
+	grouped = kvfs_sync_stats.grouped;
+	len = snprintf(buf, size,
+		"sync.mode %s\nsync.requests %llu\nsync.file_syncs %llu\nsync.group_commits %llu\n"
+		"sync.grouped_requests %llu\nsync.batch_mean %.2f\nsync.batch_max %llu\n"
+		"sync.mean_us %.1f\nsync.errors %llu\n",
+		kvfs_conf.sync_group ? "group" : "file",
+		(unsigned long long) requests, (unsigned long long) syncs,
+		(unsigned long long) groups, (unsigned long long) grouped,
+		groups ? (double) grouped / groups : 0.0,
+		(unsigned long long) kvfs_sync_stats.batch_max,
+		syncs + groups ? __atomic_load_n(&kvfs_sync_stats.ns, __ATOMIC_RELAXED) / 1e3 / (syncs + groups) : 0.0,
+		(unsigned long long) __atomic_load_n(&kvfs_sync_stats.errors, __ATOMIC_RELAXED));
+	pthread_mutex_unlock(&kvfs_sync_lock);
+	return len;
+}
+#endif
+
+///////////////////////////////////////////////////////////
+//
+// Namespace index
+//
+// Backing objects are named by key, so the names behind them are kept
+// in an index, a map from (dir, name) to a short string:
+//
+//     <dir key>, <name>  ->  <key>              what a directory holds
+//     up, <key>          ->  <dir key>/<name>   where a key is listed
+//
+// Listing a directory is then a scan of its own entries, which takes
+// time in proportion to its children and gives their real names, and
+// a key can be unlisted from its "up" entry without knowing its path.
+// Objects are created before they are listed and unlisted before they
+// are removed, so the worst a crash can leave is an object nobody
+// sees.
+//
+// Names come from kvfs_key_path(), and an object that can't be listed
+// under its name is removed again and its operation fails.  Roots made
+// before the index existed have no "index" line in their superblock
+// and go on listing keys.
+//
+// On an indexed root a key is not the hash of its path: a path's key
+// is whatever its parent's list says, and a name that is not listed
+// gets hash(<parent key>/<name>), salted if that key is taken.  So a
+// key is fixed when its object is made, and rename only moves one
+// entry, however many objects lie below a renamed directory.
+//
+// Where the index is kept is up to the backend a root was made with
+// (KVFS_BACKEND, recorded as the superblock's "index" line):
+//
+//     passthrough  one symlink per entry under rootdir/.kvfs_index
+//     lsm          a log-structured store under rootdir/.kvfs_lsm
+//
+// Objects stay in backing files (or the pack) with either, since their
+// data is handed around as backing fds for splice, read-ahead and the
+// write-back cache.  What the lsm backend saves is the backing
+// filesystem's metadata work for names: creating a file costs the
+// passthrough backend two symlinks, and a rename a symlink and a
+// rename(2) more, where the lsm backend appends to a file it already
+// has open.
+//
+
+// A DIR stream, as listed by the passthrough backend and by
+// directories of a root without an index.
+static const char *kvfs_dir_readdir(void *list, off_t *off)
+{
+	struct dirent *de;
+
+	errno = 0;
+	de = readdir(list);
+	if (de == NULL)
+		return NULL;
+	*off = de->d_off;
+	return de->d_name;
+}
+
+static void kvfs_dir_seekdir(void *list, off_t off)
+{
+	if (off == 0)
+		rewinddir(list);
+	else
+		seekdir(list, off);
+}
+
+static void kvfs_dir_closedir(void *list)
+{
+	closedir(list);
+}
+
+///////////////////////////////////////////////////////////
+//
+// Index backend: passthrough
+//
+// Each entry is a symlink, .kvfs_index/<dir>/<name> -> value.  Links
+// are made with symlink(2), or renamed over the old one, so after a
+// crash each one is either old or new.
+//
+#define KVFS_INDEX	".kvfs_index"
+
+static int kvfs_index_fd = -1;
+
+static int kvfs_passthrough_init(void)
+{
+	char path[PATH_MAX];
+	int result;
+
+	kvfs_rootfile(path, KVFS_INDEX);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return kvfs_log_errno("kvfs_index_init mkdir");
+	kvfs_index_fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (kvfs_index_fd < 0 || (mkdirat(kvfs_index_fd, "up", 0755) < 0 && errno != EEXIST))
+	{
+		result = kvfs_log_errno("kvfs_index_init open");
+		if (kvfs_index_fd >= 0)
+			close(kvfs_index_fd);
+		kvfs_index_fd = -1;
+		return result;
+	}
+	return 0;
+}
+
+static ssize_t kvfs_passthrough_get(const char *dir, const char *name, char *value, size_t size)
+{
+	char entry[PATH_MAX];
+	ssize_t n;
+
+	snprintf(entry, sizeof(entry), "%s/%s", dir, name);
+	n = readlinkat(kvfs_index_fd, entry, value, size - 1);
+	if (n < 0)
+		return -errno;
+	value[n] = '\0';
+	return n;
+}
+
+// A new name is one symlink; replacing one goes through a temporary
+// name.
+static int kvfs_passthrough_put(const char *dir, const char *name, const char *value)
+{
+	char tmp[32], entry[PATH_MAX];
+	int result;
+
+	snprintf(entry, sizeof(entry), "%s/%s", dir, name);
+
+	result = symlinkat(value, kvfs_index_fd, entry);
+	if (result < 0 && errno == ENOENT)
+	{
+		// the directory's first child
+		if (mkdirat(kvfs_index_fd, dir, 0755) == 0 || errno == EEXIST)
+			result = symlinkat(value, kvfs_index_fd, entry);
+	}
+	if (result == 0 || errno != EEXIST)
+		return result < 0 ? -errno : 0;
+
+	snprintf(tmp, sizeof(tmp), ".tmp.%ld", (long) syscall(SYS_gettid));
+	unlinkat(kvfs_index_fd, tmp, 0);	// left over from a crash
+	if (symlinkat(value, kvfs_index_fd, tmp) < 0)
+		return -errno;
+	if (renameat(kvfs_index_fd, tmp, kvfs_index_fd, entry) < 0)
+	{
+		result = -errno;
+		unlinkat(kvfs_index_fd, tmp, 0);
+		return result;
+	}
+	return 0;
+}
+
+static int kvfs_passthrough_del(const char *dir, const char *name)
+{
+	char entry[PATH_MAX];
+
+	snprintf(entry, sizeof(entry), "%s/%s", dir, name);
+	return unlinkat(kvfs_index_fd, entry, 0) < 0 ? -errno : 0;
+}
+
+static int kvfs_passthrough_rmdir(const char *dir)
+{
+	if (unlinkat(kvfs_index_fd, dir, AT_REMOVEDIR) < 0 && errno != ENOENT)
+		return -errno;
+	return 0;
+}
+
+// A directory with no children may not have a list yet.
+static void *kvfs_passthrough_opendir(const char *dir, const char *fullpath)
+{
+	struct stat st;
+	DIR *dp;
+	int fd;
+
+	fd = openat(kvfs_index_fd, dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 && errno == ENOENT)
+	{
+		if (stat(fullpath, &st) < 0)
+			return NULL;
+		if (!S_ISDIR(st.st_mode))
+		{
+			errno = ENOTDIR;
+			return NULL;
+		}
+		if (mkdirat(kvfs_index_fd, dir, 0755) < 0 && errno != EEXIST)
+			return NULL;
+		fd = openat(kvfs_index_fd, dir, O_RDONLY | O_DIRECTORY);
+	}
+	if (fd < 0)
+		return NULL;
+
+	dp = fdopendir(fd);
+	if (dp == NULL)
+		close(fd);
+	return dp;
+}
+
+///////////////////////////////////////////////////////////
+//
+// Index backend: lsm
+//
+// Entries are keyed "<dir>/<name>", so a directory's are adjacent in
+// key order.  Every update is appended to a write-ahead log and put in
+// a sorted in-memory table (a skip list).  Once the table holds
+// KVFS_LSM_MEMTABLE bytes, a new log and table take over, and a
+// background thread writes the full table out as a run: an immutable
+// file of sorted entries and an index of their offsets, mapped into
+// memory.  (Updates that keep replacing the same entries fill the log
+// rather than the table, so a table is also written out once its log
+// reaches KVFS_LSM_WAL bytes.)  A deletion is an entry too, so it
+// hides older ones.
+//
+// Lookups try the table, the one being written out, then the runs from
+// newest to oldest.  A listing merges the same sources from a name
+// onwards.  When there are more than KVFS_LSM_RUNS runs the thread
+// merges the newest few, along with older ones up to twice their size;
+// a merge that takes in the oldest run drops deletions.
+//
+// rootdir/.kvfs_lsm/manifest names the runs, oldest first, and the
+// oldest log not yet in a run.  It is replaced only once a new run is
+// on disk, and logs and runs it no longer needs are deleted only after
+// that, so a crash at any point leaves a consistent manifest.  At mount
+// the remaining logs are replayed, up to any record torn by a crash,
+// and written out at once.
+//
+// One read-write lock covers the tables and the list of runs: a lookup
+// holds it shared, an update exclusively, for a log append and a skip
+// list insert.  Runs are only unmapped once merged away under it.
+//
+#define KVFS_LSM		".kvfs_lsm"
+#define KVFS_LSM_MEMTABLE	(4 << 20)	// bytes of entries in a table
+#define KVFS_LSM_WAL		(16 << 20)	// bytes logged for one table
+#define KVFS_LSM_RUNS		8
+#define KVFS_LSM_HEIGHT		16		// of the skip lists
+#define KVFS_LSM_DEAD		0xffff		// value length of a deletion
+#define KVFS_LSM_MAGIC		0x6b7666736c736d31ULL
+#define KVFS_LSM_KEY_MAX	(KVFS_KEY_MAX + NAME_MAX + 2)
+
+// A log record or run entry: this, then the key, then the value.
+struct kvfs_lrec {
+	uint32_t sum;		// low half of the xxh64 of the rest
+	uint16_t klen;
+	uint16_t vlen;		// KVFS_LSM_DEAD for a deletion
+};
+
+struct kvfs_lnode {
+	uint16_t klen, vlen;
+	uint8_t height;
+	struct kvfs_lnode *next[];	// then the key and the value
+};
+
+#define KVFS_LNODE_KEY(n)	((char *) ((n)->next + (n)->height))
+
+struct kvfs_ltable {
+	struct kvfs_lnode *head;
+	int height;
+	size_t bytes;
+	long count;
+	uint32_t wal;		// the log its entries are in
+	int walfd;
+	off_t walsize;
+};
+
+struct kvfs_lrun {
+	uint32_t id;
+	char *map;
+	size_t size;
+	uint64_t count;
+	const uint64_t *index;	// offset of each entry, in key order
+};
+
+// The end of a run.
+struct kvfs_lfoot {
+	uint64_t magic;
+	uint64_t count;
+	uint64_t index;		// offset of the index, 8-aligned
+	uint64_t sum;		// xxh64 of the index
+};
+
+// Entries in key order, for kvfs_lsm_write_run(): from a table, or
+// merged from runs (newest last).
+struct kvfs_liter {
+	struct kvfs_lnode *node;
+	struct kvfs_lrun **runs;
+	uint64_t *pos;
+	int nruns;
+	int drop;		// leave deletions out
+};
+
+static pthread_rwlock_t kvfs_lsm_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t kvfs_lsm_bg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvfs_lsm_bg_cond = PTHREAD_COND_INITIALIZER;
+static int kvfs_lsm_dirfd = -1;
+static struct kvfs_ltable *kvfs_lsm_mem;
+static struct kvfs_ltable *kvfs_lsm_imm;	// full, being written out
+static struct kvfs_lrun **kvfs_lsm_runs;	// oldest first
+static int kvfs_lsm_nruns;
+static uint32_t kvfs_lsm_next_id;
+static uint32_t kvfs_lsm_seed = 0x9e3779b9;
+
+static struct {
+	uint64_t flushes;
+	uint64_t compactions;
+	uint64_t wal_bytes;
+} kvfs_lsm_stats;
+
+static int kvfs_lsm_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+
+	return c != 0 ? c : (alen > blen) - (alen < blen);
+}
+
+static size_t kvfs_lsm_key(char key[KVFS_LSM_KEY_MAX], const char *dir, const char *name)
+{
+	int n = snprintf(key, KVFS_LSM_KEY_MAX, "%s/%s", dir, name);
+
+	return n < KVFS_LSM_KEY_MAX ? n : KVFS_LSM_KEY_MAX - 1;
+}
+
+static struct kvfs_ltable *kvfs_lsm_table(uint32_t wal, int walfd)
+{
+	struct kvfs_ltable *t = calloc(1, sizeof(*t));
+
+	if (t == NULL)
+		return NULL;
+	t->head = calloc(1, sizeof(*t->head) + KVFS_LSM_HEIGHT * sizeof(t->head->next[0]));
+	if (t->head == NULL)
+	{
+		free(t);
+		return NULL;
+	}
+	t->head->height = KVFS_LSM_HEIGHT;
+	t->height = 1;
+	t->wal = wal;
+	t->walfd = walfd;
+	return t;
+}
+
+static void kvfs_lsm_table_free(struct kvfs_ltable *t)
+{
+	struct kvfs_lnode *n, *next;
+
+	for (n = t->head->next[0]; n != NULL; n = next)
+	{
+		next = n->next[0];
+		free(n);
+	}
+	free(t->head);
+	if (t->walfd >= 0)
+		close(t->walfd);
+	free(t);
+}
+
+// The first node at or after key (after it if after), filling prev, if
+// given, with the last node before that at each level.
+static struct kvfs_lnode *kvfs_lsm_seek_table(struct kvfs_ltable *t, const char *key, size_t klen,
+					      int after, struct kvfs_lnode **prev)
+{
+	struct kvfs_lnode *n = t->head, *next;
+	int level, c;
+
+	for (level = t->height - 1; level >= 0; level--)
+	{
+		while ((next = n->next[level]) != NULL &&
+		       ((c = kvfs_lsm_cmp(KVFS_LNODE_KEY(next), next->klen, key, klen)) < 0 || (after && c == 0)))
+			n = next;
+		if (prev != NULL)
+			prev[level] = n;
+	}
+	return n->next[0];
+}
+
+// Set key in t, replacing any entry it has.  Called with kvfs_lsm_lock
+// held exclusively.
+static int kvfs_lsm_insert(struct kvfs_ltable *t, const char *key, size_t klen, const char *value, size_t vlen)
+{
+	struct kvfs_lnode *prev[KVFS_LSM_HEIGHT], *n, *old;
+	size_t vbytes = vlen == KVFS_LSM_DEAD ? 0 : vlen;
+	int height = 1, i;
+
+	// Each level up holds a quarter of the one below.
+	kvfs_lsm_seed ^= kvfs_lsm_seed << 13;
+	kvfs_lsm_seed ^= kvfs_lsm_seed >> 17;
+	kvfs_lsm_seed ^= kvfs_lsm_seed << 5;
+	for (i = 0; height < KVFS_LSM_HEIGHT && ((kvfs_lsm_seed >> i) & 3) == 0; i += 2)
+		height++;
+
+	n = malloc(sizeof(*n) + height * sizeof(n->next[0]) + klen + vbytes);
+	if (n == NULL)
+		return -ENOMEM;
+	n->klen = klen;
+	n->vlen = vlen;
+	n->height = height;
+	memcpy(KVFS_LNODE_KEY(n), key, klen);
+	memcpy(KVFS_LNODE_KEY(n) + klen, value, vbytes);
+
+	for (i = t->height; i < KVFS_LSM_HEIGHT; i++)
+		prev[i] = t->head;
+	old = kvfs_lsm_seek_table(t, key, klen, 0, prev);
+	if (old != NULL && kvfs_lsm_cmp(KVFS_LNODE_KEY(old), old->klen, key, klen) == 0)
+	{
+		for (i = 0; i < old->height; i++)
+			prev[i]->next[i] = old->next[i];
+		t->bytes -= sizeof(struct kvfs_lrec) + old->klen + (old->vlen == KVFS_LSM_DEAD ? 0 : old->vlen);
+		t->count--;
+		free(old);
+	}
+
+	if (height > t->height)
+		t->height = height;
+	for (i = 0; i < height; i++)
+	{
+		n->next[i] = prev[i]->next[i];
+		prev[i]->next[i] = n;
+	}
+	t->bytes += sizeof(struct kvfs_lrec) + klen + vbytes;
+	t->count++;
+	return 0;
+}
+
+// Entry i of run r: its header into rec, and its key.
+static const char *kvfs_lsm_run_entry(const struct kvfs_lrun *r, uint64_t i, struct kvfs_lrec *rec)
+{
+	const char *p = r->map + r->index[i];
+
+	memcpy(rec, p, sizeof(*rec));
+	return p + sizeof(*rec);
+}
+
+// The first entry of r at or after key (after it if after), or
+// r->count.
+static uint64_t kvfs_lsm_seek_run(const struct kvfs_lrun *r, const char *key, size_t klen, int after)
+{
+	uint64_t lo = 0, hi = r->count, mid;
+	struct kvfs_lrec rec;
+	const char *k;
+	int c;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		k = kvfs_lsm_run_entry(r, mid, &rec);
+		c = kvfs_lsm_cmp(k, rec.klen, key, klen);
+		if (c < 0 || (after && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void kvfs_lsm_run_free(struct kvfs_lrun *r)
+{
+	munmap(r->map, r->size);
+	free(r);
+}
+
+static struct kvfs_lrun *kvfs_lsm_load_run(uint32_t id)
+{
+	struct kvfs_lfoot foot;
+	struct kvfs_lrun *r;
+	struct stat st;
+	char name[32];
+	void *map;
+	int fd;
+
+	snprintf(name, sizeof(name), "run.%08x", id);
+	fd = openat(kvfs_lsm_dirfd, name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(foot))
+	{
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	memcpy(&foot, (char *) map + st.st_size - sizeof(foot), sizeof(foot));
+	if (foot.magic != KVFS_LSM_MAGIC || foot.index % 8 != 0 ||
+	    foot.index + foot.count * 8 + sizeof(foot) != (uint64_t) st.st_size ||
+	    kvfs_xxh64((char *) map + foot.index, foot.count * 8) != foot.sum ||
+	    (r = malloc(sizeof(*r))) == NULL)
+	{
+		munmap(map, st.st_size);
+		errno = EIO;
+		return NULL;
+	}
+	r->id = id;
+	r->map = map;
+	r->size = st.st_size;
+	r->count = foot.count;
+	r->index = (const uint64_t *) (r->map + foot.index);
+	return r;
+}
+
+// The next entry from it, or 0 at the end.
+static int kvfs_lsm_iter_next(struct kvfs_liter *it, const char **key, size_t *klen,
+			      const char **value, size_t *vlen)
+{
+	struct kvfs_lrec rec;
+	const char *k;
+	int i, best;
+
+	if (it->runs == NULL)
+	{
+		if (it->node == NULL)
+			return 0;
+		*key = KVFS_LNODE_KEY(it->node);
+		*klen = it->node->klen;
+		*value = *key + *klen;
+		*vlen = it->node->vlen;
+		it->node = it->node->next[0];
+		return 1;
+	}
+
+	for (;;)
+	{
+		// Of equal keys, the newest run's wins and the rest are
+		// passed over.
+		best = -1;
+		for (i = it->nruns - 1; i >= 0; i--)
+		{
+			if (it->pos[i] == it->runs[i]->count)
+				continue;
+			k = kvfs_lsm_run_entry(it->runs[i], it->pos[i], &rec);
+			if (best < 0 || kvfs_lsm_cmp(k, rec.klen, *key, *klen) < 0)
+			{
+				best = i;
+				*key = k;
+				*klen = rec.klen;
+				*value = k + rec.klen;
+				*vlen = rec.vlen;
+			}
+		}
+		if (best < 0)
+			return 0;
+		for (i = 0; i < it->nruns; i++)
+		{
+			if (it->pos[i] == it->runs[i]->count)
+				continue;
+			k = kvfs_lsm_run_entry(it->runs[i], it->pos[i], &rec);
+			if (kvfs_lsm_cmp(k, rec.klen, *key, *klen) == 0)
+				it->pos[i]++;
+		}
+		if (!(it->drop && *vlen == KVFS_LSM_DEAD))
+			return 1;
+	}
+}
+
+// Write the entries from it out as run id, and map it.
+static struct kvfs_lrun *kvfs_lsm_write_run(uint32_t id, struct kvfs_liter *it)
+{
+	static const char zero[8];
+	char name[32], tmp[32], buf[sizeof(struct kvfs_lrec) + KVFS_LSM_KEY_MAX + PATH_MAX];
+	struct kvfs_lfoot foot;
+	struct kvfs_lrec rec;
+	uint64_t *index = NULL, *more, cap = 0, count = 0, off = 0;
+	const char *key, *value;
+	size_t klen, vlen, n;
+	FILE *fp = NULL;
+	int fd, ok = 1;
+
+	snprintf(name, sizeof(name), "run.%08x", id);
+	snprintf(tmp, sizeof(tmp), "run.%08x.tmp", id);
+	fd = openat(kvfs_lsm_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0 && (fp = fdopen(fd, "w")) == NULL)
+		close(fd);
+	if (fp == NULL)
+		return NULL;
+
+	while (ok && kvfs_lsm_iter_next(it, &key, &klen, &value, &vlen))
+	{
+		if (count == cap)
+		{
+			cap = cap ? cap * 2 : 4096;
+			more = realloc(index, cap * sizeof(*index));
+			if (more == NULL)
+			{
+				ok = 0;
+				break;
+			}
+			index = more;
+		}
+		index[count++] = off;
+
+		n = klen + (vlen == KVFS_LSM_DEAD ? 0 : vlen);
+		rec.klen = klen;
+		rec.vlen = vlen;
+		memcpy(buf, &rec, sizeof(rec));
+		memcpy(buf + sizeof(rec), key, n);
+		n += sizeof(rec);
+		rec.sum = kvfs_xxh64(buf + sizeof(rec.sum), n - sizeof(rec.sum));
+		memcpy(buf, &rec.sum, sizeof(rec.sum));
+		ok = fwrite(buf, n, 1, fp) == 1;
+		off += n;
+	}
+
+	foot.magic = KVFS_LSM_MAGIC;
+	foot.count = count;
+	foot.index = (off + 7) & ~7ULL;
+	foot.sum = kvfs_xxh64(index, count * sizeof(*index));
+	if (ok && foot.index > off)
+		ok = fwrite(zero, foot.index - off, 1, fp) == 1;
+	if (ok && count > 0)
+		ok = fwrite(index, count * sizeof(*index), 1, fp) == 1;
+	if (ok)
+		ok = fwrite(&foot, sizeof(foot), 1, fp) == 1;
+	free(index);
+	if (ok)
+		ok = fflush(fp) == 0 && fdatasync(fd) == 0;
+	if (fclose(fp) != 0)
+		ok = 0;
+	if (!ok || renameat(kvfs_lsm_dirfd, tmp, kvfs_lsm_dirfd, name) < 0)
+	{
+		kvfs_log_errno("kvfs_lsm_write_run");
+		unlinkat(kvfs_lsm_dirfd, tmp, 0);
+		return NULL;
+	}
+	return kvfs_lsm_load_run(id);
+}
+
+// Replace the manifest with the runs and logs in use now.  Only the
+// background thread (or init, before it starts) changes the runs.
+static int kvfs_lsm_manifest(void)
+{
+	uint32_t wal;
+	FILE *fp = NULL;
+	int fd, i, ok;
+
+	pthread_rwlock_rdlock(&kvfs_lsm_lock);
+	wal = kvfs_lsm_imm != NULL ? kvfs_lsm_imm->wal : kvfs_lsm_mem->wal;
+	pthread_rwlock_unlock(&kvfs_lsm_lock);
+
+	fd = openat(kvfs_lsm_dirfd, "manifest.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0 && (fp = fdopen(fd, "w")) == NULL)
+		close(fd);
+	if (fp == NULL)
+		return kvfs_log_errno("kvfs_lsm_manifest");
+
+	ok = fprintf(fp, "kvfs lsm 1\nwal %08x\n", wal) > 0;
+	for (i = 0; ok && i < kvfs_lsm_nruns; i++)
+		ok = fprintf(fp, "run %08x\n", kvfs_lsm_runs[i]->id) > 0;
+	if (ok)
+		ok = fflush(fp) == 0 && fdatasync(fd) == 0;
+	if (fclose(fp) != 0)
+		ok = 0;
+	if (!ok || renameat(kvfs_lsm_dirfd, "manifest.tmp", kvfs_lsm_dirfd, "manifest") < 0 ||
+	    fsync(kvfs_lsm_dirfd) < 0)
+		return kvfs_log_errno("kvfs_lsm_manifest");
+	return 0;
+}
+
+static int kvfs_lsm_open_wal(uint32_t id)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "wal.%08x", id);
+	return openat(kvfs_lsm_dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+}
+
+static void kvfs_lsm_unlink_wal(uint32_t id)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "wal.%08x", id);
+	unlinkat(kvfs_lsm_dirfd, name, 0);
+}
+
+// Start a new table and log, and hand the full one to the background
+// thread.  Called with kvfs_lsm_lock held exclusively.  Returns
+// -EBUSY if the last one is still being written out.
+static int kvfs_lsm_rotate(void)
+{
+	struct kvfs_ltable *t;
+	uint32_t id;
+	int fd;
+
+	if (kvfs_lsm_imm != NULL)
+		return -EBUSY;
+
+	id = __atomic_fetch_add(&kvfs_lsm_next_id, 1, __ATOMIC_RELAXED);
+	fd = kvfs_lsm_open_wal(id);
+	t = fd >= 0 ? kvfs_lsm_table(id, fd) : NULL;
+	if (t == NULL)
+	{
+		// Keep filling this one; the next update tries again.
+		kvfs_log_errno("kvfs_lsm_rotate");
+		if (fd >= 0)
+		{
+			close(fd);
+			kvfs_lsm_unlink_wal(id);
+		}
+		return 0;
+	}
+
+	__atomic_store_n(&kvfs_lsm_imm, kvfs_lsm_mem, __ATOMIC_RELEASE);
+	kvfs_lsm_mem = t;
+	pthread_mutex_lock(&kvfs_lsm_bg_lock);
+	pthread_cond_broadcast(&kvfs_lsm_bg_cond);
+	pthread_mutex_unlock(&kvfs_lsm_bg_lock);
+	return 0;
+}
+
+// Log and apply one update; value NULL deletes.
+static int kvfs_lsm_write(const char *dir, const char *name, const char *value)
+{
+	char buf[sizeof(struct kvfs_lrec) + KVFS_LSM_KEY_MAX + PATH_MAX];
+	struct kvfs_lrec rec;
+	size_t klen, vlen, n;
+	ssize_t written;
+	int result;
+
+	vlen = value != NULL ? strlen(value) : 0;
+	if (vlen >= PATH_MAX)
+		return -ENAMETOOLONG;
+	klen = kvfs_lsm_key(buf + sizeof(rec), dir, name);
+	if (value != NULL)
+		memcpy(buf + sizeof(rec) + klen, value, vlen);
+	rec.klen = klen;
+	rec.vlen = value != NULL ? vlen : KVFS_LSM_DEAD;
+	memcpy(buf, &rec, sizeof(rec));
+	n = sizeof(rec) + klen + vlen;
+	rec.sum = kvfs_xxh64(buf + sizeof(rec.sum), n - sizeof(rec.sum));
+	memcpy(buf, &rec.sum, sizeof(rec.sum));
+
+	for (;;)
+	{
+		pthread_rwlock_wrlock(&kvfs_lsm_lock);
+		if ((kvfs_lsm_mem->bytes < KVFS_LSM_MEMTABLE && kvfs_lsm_mem->walsize < KVFS_LSM_WAL) ||
+		    kvfs_lsm_rotate() == 0)
+			break;
+		pthread_rwlock_unlock(&kvfs_lsm_lock);
+
+		// Both tables are full: wait for the older one to be written.
+		pthread_mutex_lock(&kvfs_lsm_bg_lock);
+		while (__atomic_load_n(&kvfs_lsm_imm, __ATOMIC_ACQUIRE) != NULL)
+			pthread_cond_wait(&kvfs_lsm_bg_cond, &kvfs_lsm_bg_lock);
+		pthread_mutex_unlock(&kvfs_lsm_bg_lock);
+	}
+
+	written = write(kvfs_lsm_mem->walfd, buf, n);
+	if (written != (ssize_t) n)
+	{
+		// Leave no torn record for later ones to follow.
+		result = written < 0 ? -errno : -EIO;
+		if (written > 0 && ftruncate(kvfs_lsm_mem->walfd, kvfs_lsm_mem->walsize) < 0)
+			kvfs_log_errno("kvfs_lsm_write ftruncate");
+	}
+	else
+	{
+		kvfs_lsm_mem->walsize += n;
+		result = kvfs_lsm_insert(kvfs_lsm_mem, buf + sizeof(rec), klen, buf + sizeof(rec) + klen, rec.vlen);
+		kvfs_lsm_stats.wal_bytes += n;
+	}
+	pthread_rwlock_unlock(&kvfs_lsm_lock);
+	return result;
+}
+
+static int kvfs_lsm_put(const char *dir, const char *name, const char *value)
+{
+	return kvfs_lsm_write(dir, name, value);
+}
+
+static int kvfs_lsm_del(const char *dir, const char *name)
+{
+	return kvfs_lsm_write(dir, name, NULL);
+}
+
+static ssize_t kvfs_lsm_get(const char *dir, const char *name, char *value, size_t size)
+{
+	struct kvfs_ltable *tables[2];
+	struct kvfs_lnode *n;
+	struct kvfs_lrun *r;
+	struct kvfs_lrec rec;
+	char key[KVFS_LSM_KEY_MAX];
+	const char *k, *v = NULL;
+	size_t klen, vlen = 0;
+	uint64_t i;
+	ssize_t result;
+	int s;
+
+	klen = kvfs_lsm_key(key, dir, name);
+
+	pthread_rwlock_rdlock(&kvfs_lsm_lock);
+	tables[0] = kvfs_lsm_mem;
+	tables[1] = kvfs_lsm_imm;
+	for (s = 0; s < 2 && v == NULL; s++)
+	{
+		if (tables[s] == NULL)
+			continue;
+		n = kvfs_lsm_seek_table(tables[s], key, klen, 0, NULL);
+		if (n != NULL && kvfs_lsm_cmp(KVFS_LNODE_KEY(n), n->klen, key, klen) == 0)
+		{
+			v = KVFS_LNODE_KEY(n) + n->klen;
+			vlen = n->vlen;
+		}
+	}
+	for (s = kvfs_lsm_nruns - 1; s >= 0 && v == NULL; s--)
+	{
+		r = kvfs_lsm_runs[s];
+		i = kvfs_lsm_seek_run(r, key, klen, 0);
+		if (i == r->count)
+			continue;
+		k = kvfs_lsm_run_entry(r, i, &rec);
+		if (kvfs_lsm_cmp(k, rec.klen, key, klen) == 0)
+		{
+			v = k + rec.klen;
+			vlen = rec.vlen;
+		}
+	}
+
+	if (v == NULL || vlen == KVFS_LSM_DEAD)
+		result = -ENOENT;
+	else
+	{
+		result = vlen < size ? vlen : size - 1;
+		memcpy(value, v, result);
+		value[result] = '\0';
+	}
+	pthread_rwlock_unlock(&kvfs_lsm_lock);
+	return result;
+}
+
+// The first name in dir after the one in after ("" for the first)
+// into name.  Returns 1, or 0 if there are no more.
+static int kvfs_lsm_next(const char *dir, const char *after, char name[NAME_MAX + 1])
+{
+	struct kvfs_ltable *t;
+	struct kvfs_lnode *n;
+	struct kvfs_lrun *r;
+	struct kvfs_lrec rec;
+	char lo[KVFS_LSM_KEY_MAX];
+	const char *k, *best;
+	size_t plen, lolen, kl, blen = 0;
+	uint64_t i;
+	int s, strict, dead = 0, found;
+
+	plen = kvfs_lsm_key(lo, dir, "");
+	lolen = kvfs_lsm_key(lo, dir, after);
+	strict = after[0] != '\0';
+
+	pthread_rwlock_rdlock(&kvfs_lsm_lock);
+	for (;;)
+	{
+		// Newest first, so of equal keys the first seen is kept.
+		best = NULL;
+		for (s = 0; s < 2 + kvfs_lsm_nruns; s++)
+		{
+			if (s < 2)
+			{
+				t = s == 0 ? kvfs_lsm_mem : kvfs_lsm_imm;
+				if (t == NULL || (n = kvfs_lsm_seek_table(t, lo, lolen, strict, NULL)) == NULL)
+					continue;
+				k = KVFS_LNODE_KEY(n);
+				kl = n->klen;
+				rec.vlen = n->vlen;
+			}
+			else
+			{
+				r = kvfs_lsm_runs[kvfs_lsm_nruns - 1 - (s - 2)];
+				i = kvfs_lsm_seek_run(r, lo, lolen, strict);
+				if (i == r->count)
+					continue;
+				k = kvfs_lsm_run_entry(r, i, &rec);
+				kl = rec.klen;
+			}
+			if (kl < plen || memcmp(k, lo, plen) != 0)
+				continue;
+			if (best == NULL || kvfs_lsm_cmp(k, kl, best, blen) < 0)
+			{
+				best = k;
+				blen = kl;
+				dead = rec.vlen == KVFS_LSM_DEAD;
+			}
+		}
+
+		if (best == NULL)
+		{
+			found = 0;
+			break;
+		}
+		if (!dead && blen - plen <= NAME_MAX)
+		{
+			memcpy(name, best + plen, blen - plen);
+			name[blen - plen] = '\0';
+			found = 1;
+			break;
+		}
+		// a deleted name: look past it
+		memcpy(lo, best, blen);
+		lolen = blen;
+		strict = 1;
+	}
+	pthread_rwlock_unlock(&kvfs_lsm_lock);
+	return found;
+}
+
+static int kvfs_lsm_rmdir(const char *dir)
+{
+	char name[NAME_MAX + 1];
+
+	return kvfs_lsm_next(dir, "", name) ? -ENOTEMPTY : 0;
+}
+
+struct kvfs_llist {
+	char dir[KVFS_KEY_MAX];
+	char last[NAME_MAX + 1];	// the last name listed
+	char name[NAME_MAX + 1];
+	off_t pos;			// entries listed, "." and ".." too
+};
+
+static void *kvfs_lsm_opendir(const char *dir, const char *fullpath)
+{
+	struct kvfs_llist *l;
+	struct stat st;
+
+	if (stat(fullpath, &st) < 0)
+		return NULL;
+	if (!S_ISDIR(st.st_mode))
+	{
+		errno = ENOTDIR;
+		return NULL;
+	}
+	l = calloc(1, sizeof(*l));
+	if (l != NULL)
+		snprintf(l->dir, sizeof(l->dir), "%s", dir);
+	return l;
+}
+
+// Cookies count entries, so the one after the nth is n.
+static const char *kvfs_lsm_readdir(void *list, off_t *off)
+{
+	struct kvfs_llist *l = list;
+
+	errno = 0;
+	if (l->pos < 2)
+		strcpy(l->name, l->pos == 0 ? "." : "..");
+	else if (kvfs_lsm_next(l->dir, l->last, l->name))
+		strcpy(l->last, l->name);
+	else
+		return NULL;
+	*off = ++l->pos;
+	return l->name;
+}
+
+// Going back means listing again from the start.
+static void kvfs_lsm_seekdir(void *list, off_t off)
+{
+	struct kvfs_llist *l = list;
+	off_t next;
+
+	if (off == l->pos)
+		return;
+	l->pos = 0;
+	l->last[0] = '\0';
+	while (l->pos < off && kvfs_lsm_readdir(l, &next) != NULL)
+		;
+}
+
+static void kvfs_lsm_closedir(void *list)
+{
+	free(list);
+}
+
+// Write out the full table.  Run by the background thread only.
+static int kvfs_lsm_flush(void)
+{
+	struct kvfs_ltable *t = __atomic_load_n(&kvfs_lsm_imm, __ATOMIC_ACQUIRE);
+	struct kvfs_lrun *r, **more;
+	struct kvfs_liter it = { t->head->next[0] };
+
+	r = kvfs_lsm_write_run(t->wal, &it);
+	if (r == NULL)
+		return -1;
+
+	// Lookups walk the array, so it only moves under the lock.
+	pthread_rwlock_wrlock(&kvfs_lsm_lock);
+	more = realloc(kvfs_lsm_runs, (kvfs_lsm_nruns + 1) * sizeof(*more));
+	if (more == NULL)
+	{
+		pthread_rwlock_unlock(&kvfs_lsm_lock);
+		kvfs_lsm_run_free(r);
+		return -1;
+	}
+	kvfs_lsm_runs = more;
+	kvfs_lsm_runs[kvfs_lsm_nruns++] = r;
+	__atomic_store_n(&kvfs_lsm_imm, NULL, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&kvfs_lsm_lock);
+
+	pthread_mutex_lock(&kvfs_lsm_bg_lock);
+	pthread_cond_broadcast(&kvfs_lsm_bg_cond);
+	pthread_mutex_unlock(&kvfs_lsm_bg_lock);
+
+	// Until the manifest names the run, only the log has its entries.
+	if (kvfs_lsm_manifest() == 0)
+		kvfs_lsm_unlink_wal(t->wal);
+	kvfs_lsm_table_free(t);
+	__atomic_add_fetch(&kvfs_lsm_stats.flushes, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// Merge the newest runs, and older ones up to twice their size, into
+// one.  Run by the background thread only.
+static int kvfs_lsm_compact(void)
+{
+	struct kvfs_lrun **runs = kvfs_lsm_runs, *r;
+	struct kvfs_liter it = { NULL };
+	int first = kvfs_lsm_nruns - 2, n, i;
+	size_t newer;
+
+	newer = runs[first]->size + runs[first + 1]->size;
+	while (first > 0 && runs[first - 1]->size <= 2 * newer)
+		newer += runs[--first]->size;
+	n = kvfs_lsm_nruns - first;
+
+	it.runs = runs + first;
+	it.nruns = n;
+	it.pos = calloc(n, sizeof(*it.pos));
+	it.drop = first == 0;
+	r = it.pos != NULL ? kvfs_lsm_write_run(__atomic_fetch_add(&kvfs_lsm_next_id, 1, __ATOMIC_RELAXED), &it) : NULL;
+	free(it.pos);
+	if (r == NULL)
+		return -1;
+
+	// The merged runs stay mapped until no lookup can be in them.
+	it.runs = malloc(n * sizeof(*it.runs));
+	if (it.runs == NULL)
+	{
+		kvfs_lsm_run_free(r);
+		return -1;
+	}
+	memcpy(it.runs, runs + first, n * sizeof(*it.runs));
+	pthread_rwlock_wrlock(&kvfs_lsm_lock);
+	runs[first] = r;
+	kvfs_lsm_nruns = first + 1;
+	pthread_rwlock_unlock(&kvfs_lsm_lock);
+
+	if (kvfs_lsm_manifest() == 0)
+		for (i = 0; i < n; i++)
+		{
+			char name[32];
+
+			snprintf(name, sizeof(name), "run.%08x", it.runs[i]->id);
+			unlinkat(kvfs_lsm_dirfd, name, 0);
+		}
+	for (i = 0; i < n; i++)
+		kvfs_lsm_run_free(it.runs[i]);
+	free(it.runs);
+	__atomic_add_fetch(&kvfs_lsm_stats.compactions, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void *kvfs_lsm_thread(void *arg)
+{
+	int result;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&kvfs_lsm_bg_lock);
+		while (__atomic_load_n(&kvfs_lsm_imm, __ATOMIC_ACQUIRE) == NULL && kvfs_lsm_nruns <= KVFS_LSM_RUNS)
+			pthread_cond_wait(&kvfs_lsm_bg_cond, &kvfs_lsm_bg_lock);
+		pthread_mutex_unlock(&kvfs_lsm_bg_lock);
+
+		if (__atomic_load_n(&kvfs_lsm_imm, __ATOMIC_ACQUIRE) != NULL)
+			result = kvfs_lsm_flush();
+		else
+			result = kvfs_lsm_compact();
+		if (result < 0)
+			sleep(1);	// out of space or memory; try again later
+	}
+	return NULL;
+}
+
+// Apply log id to t, stopping at a torn record.
+static int kvfs_lsm_replay(uint32_t id, struct kvfs_ltable *t)
+{
+	struct kvfs_lrec rec;
+	struct stat st;
+	char name[32], *buf;
+	off_t off;
+	size_t n;
+	int fd;
+
+	snprintf(name, sizeof(name), "wal.%08x", id);
+	fd = openat(kvfs_lsm_dirfd, name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	buf = malloc(st.st_size > 0 ? st.st_size : 1);
+	if (buf == NULL || pread(fd, buf, st.st_size, 0) != st.st_size)
+	{
+		free(buf);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	for (off = 0; off + (off_t) sizeof(rec) <= st.st_size; off += n)
+	{
+		memcpy(&rec, buf + off, sizeof(rec));
+		n = sizeof(rec) + rec.klen + (rec.vlen == KVFS_LSM_DEAD ? 0 : rec.vlen);
+		if (off + (off_t) n > st.st_size || rec.klen >= KVFS_LSM_KEY_MAX ||
+		    (uint32_t) kvfs_xxh64(buf + off + sizeof(rec.sum), n - sizeof(rec.sum)) != rec.sum)
+			break;
+		if (kvfs_lsm_insert(t, buf + off + sizeof(rec), rec.klen, buf + off + sizeof(rec) + rec.klen, rec.vlen) < 0)
+		{
+			free(buf);
+			return -1;
+		}
+	}
+	if (off < st.st_size)
+		kvfs_error("\nkvfs_lsm_replay: log %08x ends in a bad record at %lld, dropped\n", id, (long long) off);
+	free(buf);
+	return 0;
+}
+
+static int kvfs_lsm_init(void)
+{
+	char path[PATH_MAX], line[64];
+	struct kvfs_ltable *replayed = NULL;
+	struct kvfs_liter it = { NULL };
+	struct kvfs_lrun *r, **more;
+	uint32_t *wals = NULL, *morewals, id, floor = 0, top = 0;
+	size_t nwals = 0, capwals = 0, i;
+	struct dirent *de;
+	pthread_t thread;
+	FILE *fp = NULL;
+	DIR *dp;
+	int fd, known;
+
+	kvfs_rootfile(path, KVFS_LSM);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return kvfs_log_errno("kvfs_lsm_init mkdir");
+	kvfs_lsm_dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (kvfs_lsm_dirfd < 0)
+		return kvfs_log_errno("kvfs_lsm_init open");
+
+	// The runs the manifest names, oldest first.
+	fd = openat(kvfs_lsm_dirfd, "manifest", O_RDONLY);
+	if (fd >= 0 && (fp = fdopen(fd, "r")) == NULL)
+		close(fd);
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (sscanf(line, "wal %x", &id) == 1)
+			floor = id;
+		else if (sscanf(line, "run %x", &id) == 1)
+		{
+			r = kvfs_lsm_load_run(id);
+			more = r != NULL ? realloc(kvfs_lsm_runs, (kvfs_lsm_nruns + 1) * sizeof(*more)) : NULL;
+			if (more == NULL)
+			{
+				fclose(fp);
+				return kvfs_log_errno("kvfs_lsm_init run");
+			}
+			kvfs_lsm_runs = more;
+			kvfs_lsm_runs[kvfs_lsm_nruns++] = r;
+		}
+		else
+			continue;
+		if (id >= top)
+			top = id + 1;
+	}
+	if (fp != NULL)
+		fclose(fp);
+
+	// Logs from the floor up are replayed, oldest first; everything
+	// else is left over from a crash.
+	fd = dup(kvfs_lsm_dirfd);
+	dp = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dp == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		return kvfs_log_errno("kvfs_lsm_init opendir");
+	}
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (de->d_name[0] == '.' || strcmp(de->d_name, "manifest") == 0)
+			continue;
+		if (sscanf(de->d_name, "wal.%x", &id) == 1 && strlen(de->d_name) == 12 && id >= floor)
+		{
+			if (nwals == capwals)
+			{
+				capwals = capwals ? capwals * 2 : 16;
+				morewals = realloc(wals, capwals * sizeof(*wals));
+				if (morewals == NULL)
+					break;
+				wals = morewals;
+			}
+			wals[nwals++] = id;
+			if (id >= top)
+				top = id + 1;
+			continue;
+		}
+		known = 0;
+		if (sscanf(de->d_name, "run.%x", &id) == 1 && strlen(de->d_name) == 12)
+			for (i = 0; i < (size_t) kvfs_lsm_nruns; i++)
+				known |= kvfs_lsm_runs[i]->id == id;
+		if (!known)
+			unlinkat(kvfs_lsm_dirfd, de->d_name, 0);
+	}
+	closedir(dp);
+	if (nwals > 0)
+		qsort(wals, nwals, sizeof(*wals), kvfs_pack_cmp);
+	kvfs_lsm_next_id = top;
+
+	replayed = kvfs_lsm_table(0, -1);
+	for (i = 0; replayed != NULL && i < nwals; i++)
+		if (kvfs_lsm_replay(wals[i], replayed) < 0)
+		{
+			kvfs_error("\nkvfs_lsm_init: cannot replay log %08x\n", wals[i]);
+			free(wals);
+			kvfs_lsm_table_free(replayed);
+			return -EIO;
+		}
+
+	// What was replayed becomes the newest run at once.
+	r = NULL;
+	if (replayed != NULL && replayed->count > 0)
+	{
+		it.node = replayed->head->next[0];
+		r = kvfs_lsm_write_run(kvfs_lsm_next_id++, &it);
+		more = r != NULL ? realloc(kvfs_lsm_runs, (kvfs_lsm_nruns + 1) * sizeof(*more)) : NULL;
+		if (more == NULL)
+		{
+			free(wals);
+			kvfs_lsm_table_free(replayed);
+			return -EIO;
+		}
+		kvfs_lsm_runs = more;
+		kvfs_lsm_runs[kvfs_lsm_nruns++] = r;
+	}
+	if (replayed != NULL)
+		kvfs_lsm_table_free(replayed);
+
+	id = kvfs_lsm_next_id++;
+	fd = kvfs_lsm_open_wal(id);
+	kvfs_lsm_mem = fd >= 0 ? kvfs_lsm_table(id, fd) : NULL;
+	if (kvfs_lsm_mem == NULL || kvfs_lsm_manifest() < 0)
+	{
+		free(wals);
+		return kvfs_log_errno("kvfs_lsm_init log");
+	}
+	for (i = 0; i < nwals; i++)
+		kvfs_lsm_unlink_wal(wals[i]);
+	free(wals);
+
+	if (pthread_create(&thread, NULL, kvfs_lsm_thread, NULL) != 0)
+		return kvfs_log_errno("kvfs_lsm_init thread");
+	pthread_detach(thread);
+	kvfs_info("\nkvfs_lsm_init: %d runs, %zu logs replayed\n", kvfs_lsm_nruns, nwals);
+	return 0;
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_lsm_format(char *buf, size_t size)
+{
+	uint64_t entries = 0, bytes = 0;
+	size_t mem;
+	long count;
+	int i, runs;
+
+	pthread_rwlock_rdlock(&kvfs_lsm_lock);
+	mem = kvfs_lsm_mem->bytes + (kvfs_lsm_imm != NULL ? kvfs_lsm_imm->bytes : 0);
+	count = kvfs_lsm_mem->count + (kvfs_lsm_imm != NULL ? kvfs_lsm_imm->count : 0);
+	runs = kvfs_lsm_nruns;
+	for (i = 0; i < runs; i++)
+	{
+		entries += kvfs_lsm_runs[i]->count;
+		bytes += kvfs_lsm_runs[i]->size;
+	}
+	pthread_rwlock_unlock(&kvfs_lsm_lock);
+
+	return snprintf(buf, size,
+		"lsm.memtable_bytes %zu\nlsm.memtable_entries %ld\nlsm.runs %d\nlsm.run_entries %llu\n"
+		"lsm.run_bytes %llu\nlsm.flushes %llu\nlsm.compactions %llu\nlsm.wal_bytes %llu\n",
+		mem, count, runs, (unsigned long long) entries, (unsigned long long) bytes,
+		(unsigned long long) __atomic_load_n(&kvfs_lsm_stats.flushes, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_lsm_stats.compactions, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_lsm_stats.wal_bytes, __ATOMIC_RELAXED));
+}
+#endif
+
+static const struct kvfs_backend kvfs_backends[] = {
+	{ "passthrough", "yes", kvfs_passthrough_init, kvfs_passthrough_get, kvfs_passthrough_put,
+	  kvfs_passthrough_del, kvfs_passthrough_rmdir, kvfs_passthrough_opendir,
+	  kvfs_dir_readdir, kvfs_dir_seekdir, kvfs_dir_closedir,
+#ifdef HAVE_SYS_XATTR_H
+	  NULL
+#endif
+	},
+	{ "lsm", "lsm", kvfs_lsm_init, kvfs_lsm_get, kvfs_lsm_put,
+	  kvfs_lsm_del, kvfs_lsm_rmdir, kvfs_lsm_opendir,
+	  kvfs_lsm_readdir, kvfs_lsm_seekdir, kvfs_lsm_closedir,
+#ifdef HAVE_SYS_XATTR_H
+	  kvfs_lsm_format
+#endif
+	},
+	{ NULL }
+};
+
+// By KVFS_BACKEND name or superblock word.
+static const struct kvfs_backend *kvfs_find_backend(const char *name)
+{
+	const struct kvfs_backend *b;
+
+	for (b = kvfs_backends; b->name != NULL; b++)
+		if (strcmp(b->name, name) == 0 || strcmp(b->super, name) == 0)
+			return b;
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////
+//
+// Namespace index operations, on whichever backend the root has
+//
+static void kvfs_index_init(void)
+{
+	if (!kvfs_conf.index)
+		return;
+
+	if (kvfs_conf.backend->init() < 0)
+	{
+		kvfs_error("\nkvfs_index_init: cannot open the %s index, names are off\n", kvfs_conf.backend->name);
+		kvfs_conf.index = 0;
+	}
+}
+
+// The key a new object called name in directory dirkey would get: the
+// first of hash(dirkey/name), hash(dirkey/name/1), ... that is not
+// listed anywhere, as one is that was renamed away from this name.  A
+// name cannot hold a '/', so no other name hashes the same string.
+static void kvfs_index_newkey(const char *dirkey, const char *name, size_t len, char key[KVFS_KEY_MAX])
+{
+	char str[KVFS_KEY_MAX + NAME_MAX + 16], up[PATH_MAX];
+	unsigned int salt;
+	int n;
+
+	n = snprintf(str, sizeof(str), "%s/%.*s", dirkey, (int) len, name);
+	kvfs_conf.keyfn->hash(str, n, key);
+	for (salt = 1; ; salt++)
+	{
+		if (kvfs_conf.backend->get("up", key, up, sizeof(up)) == -ENOENT)
+			return;
+		n = snprintf(str, sizeof(str), "%s/%.*s/%u", dirkey, (int) len, name, salt);
+		kvfs_conf.keyfn->hash(str, n, key);
+	}
+}
+
+// Translate path through the index: the parent's key (through the path
+// cache), then one lookup of the name in the parent's list.
+static void kvfs_index_resolve(const char *path, size_t len, char key[KVFS_KEY_MAX])
+{
+	char dirkey[KVFS_KEY_MAX], entry[NAME_MAX + 1];
+	const char *name;
+	ssize_t n;
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	name = memrchr(path, '/', len);
+	if (name == NULL || len <= 1)
+	{
+		strcpy(key, kvfs_root_key);
+		return;
+	}
+	name++;
+
+	kvfs_path2key(path, name - path > 1 ? name - path - 1 : 1, dirkey);
+	if (len - (name - path) > NAME_MAX)
+	{
+		// never listed, so never made
+		kvfs_index_newkey(dirkey, name, NAME_MAX, key);
+		return;
+	}
+
+	snprintf(entry, sizeof(entry), "%.*s", (int) (len - (name - path)), name);
+	n = kvfs_conf.backend->get(dirkey, entry, key, KVFS_KEY_MAX);
+	if (n > 0)
+		return;
+	kvfs_index_newkey(dirkey, name, len - (name - path), key);
+}
+
+// Split an "up" value, <dir key>/<name>, in place.
+static const char *kvfs_index_split(char *up)
+{
+	char *slash = strchr(up, '/');
+
+	if (slash == NULL)
+		return "";
+	*slash = '\0';
+	return slash + 1;
+}
+
+// Unlist whatever dir/name holds if it is still key: a rename may have
+// listed another key under that name since.
+static void kvfs_index_unlist(const char *dir, const char *name, const char *key)
+{
+	char target[KVFS_KEY_MAX];
+
+	if (kvfs_conf.backend->get(dir, name, target, sizeof(target)) >= 0 && strcmp(target, key) == 0)
+		kvfs_conf.backend->del(dir, name);
+}
+
+// List key under path, the name it was translated from.  Returns 0 if
+// it is listed there now (it may have been already) and otherwise a
+// negative errno with nothing changed, so the caller can remove the
+// object it just made.
+static int kvfs_index_add(const char *key, const char *path)
+{
+	const char *slash;
+	char dirkey[KVFS_KEY_MAX], up[PATH_MAX], target[KVFS_KEY_MAX], msg[128];
+	int result;
+
+	if (!kvfs_conf.index)
+		return 0;
+
+	if (path == NULL)
+	{
+		kvfs_error("\nkvfs_index_add: no name known for %s\n", key);
+		return -EIO;
+	}
+	slash = strrchr(path, '/');
+	if (slash == NULL || slash[1] == '\0')
+		return -EINVAL;
+
+	kvfs_path2key(path, slash == path ? 1 : slash - path, dirkey);
+	if (kvfs_conf.backend->get(dirkey, slash + 1, target, sizeof(target)) >= 0 && strcmp(target, key) == 0)
+		return 0;
+	if (snprintf(up, sizeof(up), "%s/%s", dirkey, slash + 1) >= (int) sizeof(up))
+		return -ENAMETOOLONG;
+
+	result = kvfs_conf.backend->put(dirkey, slash + 1, key);
+	if (result == 0)
+	{
+		result = kvfs_conf.backend->put("up", key, up);
+		if (result < 0)
+			kvfs_index_unlist(dirkey, slash + 1, key);
+	}
+	if (result < 0)
+		kvfs_error("\nkvfs_index_add: listing %s as %s: %s\n", key, path, strerror_r(-result, msg, sizeof(msg)));
+	return result;
+}
+
+// Unlist key from wherever its "up" entry says it is listed, and leave
+// that entry in up (empty if there was none) for kvfs_index_relist().
+static void kvfs_index_del(const char *key, char up[PATH_MAX])
+{
+	char dir[PATH_MAX];
+	const char *name;
+
+	up[0] = '\0';
+	if (!kvfs_conf.index)
+		return;
+
+	if (kvfs_conf.backend->get("up", key, up, PATH_MAX) < 0)
+	{
+		up[0] = '\0';
+		return;
+	}
+	strcpy(dir, up);
+	name = kvfs_index_split(dir);
+	kvfs_index_unlist(dir, name, key);
+	kvfs_conf.backend->del("up", key);
+}
+
+// List key again where kvfs_index_del() found it, when the object
+// could not be removed after all.
+static void kvfs_index_relist(const char *key, const char *up)
+{
+	char dir[PATH_MAX], msg[128];
+	const char *name;
+	int result;
+
+	if (up[0] == '\0')
+		return;
+	strcpy(dir, up);
+	name = kvfs_index_split(dir);
+	result = kvfs_conf.backend->put(dir, name, key);
+	if (result == 0)
+		result = kvfs_conf.backend->put("up", key, up);
+	if (result < 0)
+		kvfs_error("\nkvfs_index_relist: listing %s as %s: %s\n", key, up, strerror_r(-result, msg, sizeof(msg)));
+}
+
+// Drop a directory's list of children, which must be empty.
+static int kvfs_index_rmdir(const char *key)
+{
+	if (!kvfs_conf.index)
+		return 0;
+	return kvfs_conf.backend->rmdir(key);
+}
+
+// Rename key to newpath, the name newkey was translated from, which
+// is listed as newkey if it exists.  Only the index changes: key goes
+// on naming the same backing object, so a directory keeps its children
+// and its list of them.  The new name is listed before the old one is
+// unlisted, so a crash in between leaves the object under both names
+// rather than neither.
+static int kvfs_index_move(const char *key, const char *newkey, const char *newpath)
+{
+	const char *slash, *oldname;
+	char fullpath[PATH_MAX], fullnewpath[PATH_MAX], dirkey[KVFS_KEY_MAX];
+	char up[PATH_MAX], oldup[PATH_MAX];
+	struct stat st, newst;
+	int result, exists;
+
+	if (strcmp(key, newkey) == 0)
+		return 0;
+	if (newpath == NULL)
+	{
+		kvfs_error("\nkvfs_index_move: no name known for %s\n", newkey);
+		return -EIO;
+	}
+	slash = strrchr(newpath, '/');
+	if (slash == NULL || slash[1] == '\0')
+		return -EINVAL;
+
+	kvfs_fullpath(fullpath, key);
+	kvfs_fullpath(fullnewpath, newkey);
+	if (kvfs_pack_lstat(key, fullpath, &st) < 0)
+		return -errno;
+	exists = kvfs_pack_lstat(newkey, fullnewpath, &newst) == 0;
+	if (exists)
+	{
+		if (S_ISDIR(st.st_mode) && !S_ISDIR(newst.st_mode))
+			return -ENOTDIR;
+		if (!S_ISDIR(st.st_mode) && S_ISDIR(newst.st_mode))
+			return -EISDIR;
+		// a directory renamed over must be empty
+		result = kvfs_index_rmdir(newkey);
+		if (result < 0)
+			return result;
+	}
+
+	kvfs_path2key(newpath, slash == newpath ? 1 : slash - newpath, dirkey);
+	snprintf(up, sizeof(up), "%s/%s", dirkey, slash + 1);
+
+	if (kvfs_conf.backend->get("up", key, oldup, sizeof(oldup)) < 0)
+		oldup[0] = '\0';
+
+	result = kvfs_conf.backend->put(dirkey, slash + 1, key);
+	if (result == 0)
+		result = kvfs_conf.backend->put("up", key, up);
+	if (result < 0)
+		return result;
+
+	if (oldup[0] != '\0')
+	{
+		oldname = kvfs_index_split(oldup);
+		kvfs_index_unlist(oldup, oldname, key);
+	}
+
+	if (exists)
+	{
+		kvfs_conf.backend->del("up", newkey);
+		if (S_ISDIR(newst.st_mode))
+			rmdir(fullnewpath);
+		else if (kvfs_pack_unlink(newkey) != 0)
+			kvfs_dedup_unlink(newkey, fullnewpath);
+	}
+
+	// Every path below a renamed directory now has another key.
+	if (S_ISDIR(st.st_mode))
+		kvfs_dcache_flush();
+	return 0;
+}
+
+// kvfs_readdir_stat() for a name listed in directory dirkey: stat the
+// key it stands for.
+static struct stat *kvfs_index_stat(const char *dirkey, const char *name, struct stat *st)
+{
+	char key[KVFS_KEY_MAX], fullpath[PATH_MAX];
+	uint64_t gen;
+
+	if (kvfs_conf.attr_timeout_ns == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return NULL;
+
+	if (kvfs_conf.backend->get(dirkey, name, key, sizeof(key)) < 0)
+		return NULL;
+
+	if (kvfs_pack_stat(key, st) == 0)
+		return st;
+	kvfs_fullpath(fullpath, key);
+	kvfs_wb_flush_key(key);
+	gen = kvfs_acache_gen(key);
+	if (lstat(fullpath, st) < 0)
+		return NULL;
+	kvfs_dedup_fixstat(key, st);
+	kvfs_acache_put(key, st, gen);
+	return st;
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_index_format(char *buf, size_t size)
+{
+	int len;
+
+	len = snprintf(buf, size, "index.backend %s\n", kvfs_conf.index ? kvfs_conf.backend->name : "none");
+	if (len < 0 || (size_t) len >= size || !kvfs_conf.index || kvfs_conf.backend->format == NULL)
+		return len;
+	return len + kvfs_conf.backend->format(buf + len, size - len);
+}
+#endif
+
+static struct stat *kvfs_dirhandle_stat(struct kvfs_dirhandle *dh, const char *name, struct stat *st)
+{
+	if (dh->index)
+		return kvfs_index_stat(dh->key, name, st);
+	return kvfs_readdir_stat(dh->list, name, st);
+}
+
+/** Get file attributes.
+ *
+ * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
+ * ignored.  The 'st_ino' field is ignored except if the 'use_ino'
+ * mount option is given.
+ */
+static int kvfs_getattr_op(const char *path, struct stat *statbuf)
+{
+	int result = 0;
+	uint64_t gen;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);
+	
+	kvfs_trace("kvfs_getattr_impl(path=\"%s\", statbuf=%p)\n", path, statbuf);
+
+	if (kvfs_pack_stat(path, statbuf) == 0)
+		return 0;
+
+	// The size has to count what is still buffered.
+	kvfs_wb_flush_key(path);
+	if (kvfs_acache_get(path, statbuf) == 0)
+	{
+		return 0;
+	}
+
+	gen = kvfs_acache_gen(path);
+	result = kvfs_io_lstat(fullpath, statbuf);
+
+	if (result < 0)
+	{
+		kvfs_trace("Error in getattr");
+		return -errno;
+	}
+
+	kvfs_dedup_fixstat(path, statbuf);
+	kvfs_acache_put(path, statbuf, gen);
+	
+	return result;
+}
+
+/** Read the target of a symbolic link
+ *
+ * The buffer should be filled with a null terminated string.  The
+ * buffer size argument includes the space for the terminating
+ * null character.  If the linkname is too long to fit in the
+ * buffer, it should be truncated.  The return value should be 0
+ * for success.
+ */
+// Note the system readlink() will truncate and lose the terminating
+// null.  So, the size passed to to the system readlink() must be one
+// less than the size passed to kvfs_readlink()
+// kvfs_readlink() code by Bernardo F Costa (thanks!)
+static int kvfs_readlink_op(const char *path, char *link, size_t size)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);       
+	
+	kvfs_trace("kvfs_readlink_impl(path=\"%s\", link=\"%s\", size=%zu)\n", path, link, size);
+	
+	result = readlink(fullpath, link, size - 1);
+	if (result < 0)
+	{
+		kvfs_trace("Error in readlink");
+		return -errno;
+	}
+	link[result] = '\0';
+
+	//ishan:
+	//result = 0;
+	
+	return result;
+}
+
+/** Create a file node
+ *
+ * There is no create() operation, mknod() will be called for
+ * creation of all non-directory, non-symlink nodes.
+ */
+// KVFS has a create() (kvfs_create_impl), so regular files only come
+// through here from mknod(2) itself.
+static int kvfs_mknod_backing(const char *fullpath, mode_t mode, dev_t dev)
+{
+        /* On Linux this could just be 'mknod(path, mode, rdev)' but this
+           is more portable */
+	int result;
+
+	if (S_ISFIFO(mode)) 
+	{
+		result = mkfifo(fullpath, mode);
+	} 
+	else if (S_ISREG(mode))
+	{
+	        result = open(fullpath, O_CREAT | O_EXCL | O_WRONLY, mode);
+        	
+		if (result >= 0)
+		{
+                	result = close(result);
+		}
+	}
+	else
+	{
+		result = mknod(fullpath, mode, dev);
+	}
+
+	return result;
+}
+
+static int kvfs_mknod_op(const char *path, const char *name, mode_t mode, dev_t dev)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+	
+	kvfs_trace("kvfs_mknod_impl(path=\"%s\", mode=0%3o, dev=%lld)\n", path, mode, (long long) dev);
+
+	result = S_ISREG(mode) ? kvfs_pack_create(path, mode, NULL) : 1;
+	if (result <= 0)
+	{
+		if (result == 0)
+		{
+			kvfs_acache_invalidate(path);
+			result = kvfs_index_add(path, name);
+			if (result < 0)
+				kvfs_pack_unlink(path);
+		}
+		return result;
+	}
+
+	result = kvfs_mknod_backing(fullpath, mode, dev);
+	if (result < 0 && errno == ENOENT && kvfs_mkshard(fullpath) == 0)
+	{
+		result = kvfs_mknod_backing(fullpath, mode, dev);
+	}
+
+	if (result < 0)
+	{
+		kvfs_trace("Error in mknod");
+		return -errno;
+	}
+
+	kvfs_acache_invalidate(path);
+	result = kvfs_index_add(path, name);
+	if (result < 0)
+		unlink(fullpath);
+	return result;
+}
+
+/** Create a directory */
+static int kvfs_mkdir_op(const char *path, const char *name, mode_t mode)
+{	
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+	
+	kvfs_trace("kvfs_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
+	
+	result = mkdir(fullpath, mode);
+	if (result < 0 && errno == ENOENT && kvfs_mkshard(fullpath) == 0)
+	{
+		result = mkdir(fullpath, mode);
+	}
+
+	if (result < 0)
+	{
+		kvfs_trace("Error in mkdir");
+		return -errno;
+	}
+
+	kvfs_acache_invalidate(path);
+	result = kvfs_index_add(path, name);
+	if (result < 0)
+		rmdir(fullpath);
+	return result;
+}
+
+/** Remove a file */
+static int kvfs_unlink_op(const char *path)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	char up[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("kvfs_unlink_impl (path=\"%s\")\n", path);
+	kvfs_index_del(path, up);
+	result = kvfs_pack_unlink(path);
+	if (result > 0)
+	{
+		kvfs_hold_keys(path, NULL);
+		result = kvfs_dedup_unlink(path, fullpath) < 0 ? -errno : 0;
+		kvfs_unhold_keys(path, NULL);
+	}
+
+	if (result < 0)
+	{
+		kvfs_trace("Error in unlink");
+		kvfs_index_relist(path, up);
+		return result;
+	}
+	
+	kvfs_pcache_invalidate(path, 0, 0);
+	kvfs_acache_invalidate(path);
+	kvfs_fdc_invalidate(path);
+	kvfs_dcache_invalidate(path);
+	return result;	
+}
+
+/** Remove a directory */
+static int kvfs_rmdir_op(const char *path)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	char up[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("kvfs_rmdir_impl(path=\"%s\")\n", path);
+
+	// The backing directory is always empty; whether the directory
+	// is, only the index knows.
+	result = kvfs_index_rmdir(path);
+	if (result < 0)
+		return result;
+
+	kvfs_index_del(path, up);
+	result = rmdir(fullpath);
+
+	if (result < 0)
+	{
+		result = -errno;
+		kvfs_trace("Error in rmdir");
+		kvfs_index_relist(path, up);
+		return result;
+	}
+	kvfs_acache_invalidate(path);
+	kvfs_dcache_invalidate(path);
+	return result;
+}
+
+/** Create a symbolic link */
+// The parameters here are a little bit confusing, but do correspond
+// to the symlink() system call.  The 'path' is where the link points,
+// while the 'link' is the link itself.  So we need to leave the path
+// unaltered, but insert the link into the mounted directory.
+static int kvfs_symlink_op(const char *path, const char *link, const char *name)
+{
+	int result = 0;
+	char fulllink[PATH_MAX];
+	kvfs_fullpath(fulllink, link);   
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("kvfs_symlink_impl(path=\"%s\", link=\"%s\")\n", fullpath, fulllink);
+	
+	result = symlink(fullpath, fulllink);
+	if (result < 0 && errno == ENOENT && kvfs_mkshard(fulllink) == 0)
+	{
+		result = symlink(fullpath, fulllink);
+	}
+	if (result < 0)
+	{
+		kvfs_trace("Error in symlink\n");
+		kvfs_trace("##################################################");
+		return -errno;
+	}
+	kvfs_acache_invalidate(link);
+	result = kvfs_index_add(link, name);
+	if (result < 0)
+		unlink(fulllink);
+	return result;
+}
+
+/** Rename a file */
+// both path and newpath are fs-relative
+static int kvfs_rename_op(const char *path, const char *newpath, const char *newname)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	char fullnewpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+	
+	kvfs_trace("kvfs_rename_impl (fpath=\"%s\", newpath=\"%s\")\n", path, newpath);
+	kvfs_fullpath(fullnewpath, newpath);       
+
+	kvfs_hold_keys(path, newpath);
+	// With an index, keys outlive names and only the index changes.
+	if (kvfs_conf.index)
+	{
+		result = kvfs_index_move(path, newpath, newname);
+	}
+	else
+	{
+		struct stat st, newst;
+		int moving = kvfs_dedup_shared(fullpath, &st);
+		int shared = kvfs_dedup_shared(fullnewpath, &newst);
+
+		// buffers are found by key, which is about to change
+		kvfs_wb_flush_key(path);
+		result = rename(fullpath, fullnewpath);
+		if (result < 0 && errno == ENOENT && kvfs_mkshard(fullnewpath) == 0)
+		{
+			result = rename(fullpath, fullnewpath);
+		}
+		if (result < 0)
+			result = -errno;
+		else
+		{
+			kvfs_hold_rekey(path, newpath);
+			if (shared)
+				kvfs_dedup_drop(newpath, &newst);
+			if (moving)
+				kvfs_dedup_rekey(path, newpath);
+		}
+	}
+	kvfs_unhold_keys(path, newpath);
+	if (result < 0)
+	{
+		kvfs_trace("Error in rename");
+		return result;
+	}
+	kvfs_pcache_invalidate(path, 0, 0);
+	kvfs_pcache_invalidate(newpath, 0, 0);
+	kvfs_acache_invalidate(path);
+	kvfs_acache_invalidate(newpath);
+	kvfs_fdc_invalidate(path);
+	kvfs_fdc_invalidate(newpath);
+	kvfs_dcache_invalidate(path);
+	kvfs_dcache_invalidate(newpath);
+	return result;
+}
+
+/** Create a hard link to a file */
+static int kvfs_link_op(const char *path, const char *newpath, const char *newname)
+{
+
+	kvfs_trace("#################### starting link ###################");
+	int result = 0;
+	char fullpath[PATH_MAX];
+	char fullnewpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+	kvfs_fullpath(fullnewpath, newpath);   
+	
+	kvfs_trace("kvfs_link(path=\"%s\", newpath=\"%s\")\n", path, newpath);
+
+	// Only a backing file can have two names, and only a plain one of
+	// its own: a hard link to a shared file would be a link to every
+	// key with the same content, and a compressed one could not be
+	// expanded without splitting the two names.
+	result = kvfs_pack_unpack(path);
+	if (result >= 0)
+		result = kvfs_store_begin(path, fullpath, KVFS_STORE_WRITE);
+	if (result < 0)
+		return result;
+
+	result = link(fullpath, fullnewpath);
+	if (result < 0 && errno == ENOENT && kvfs_mkshard(fullnewpath) == 0)
+	{
+		result = link(fullpath, fullnewpath);
+	}
+	if (result < 0)
+		result = -errno;
+	kvfs_store_end(path, 0);
+	if (result < 0)
+	{
+		kvfs_trace("Error in link");
+		kvfs_trace("####################  link failed ###################");
+		return result;
+	}
+	result = kvfs_index_add(newpath, newname);
+	if (result < 0)
+		unlink(fullnewpath);
+	kvfs_acache_invalidate(path);
+	kvfs_acache_invalidate(newpath);
+	if (result < 0)
+		return result;
+	kvfs_trace("####################  link success ###################");
+	return result;
+}
+
+/** Change the permission bits of a file */
+static int kvfs_chmod_op(const char *path, mode_t mode)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+	
+	kvfs_trace("\nkvfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+
+	result = kvfs_pack_setattr(path, KVFS_PACK_MODE, mode, -1, -1, NULL);
+	if (result <= 0)
+		return result;
+
+	result = kvfs_store_begin(path, fullpath, KVFS_STORE_STAT);
+	if (result < 0)
+		return result;
+	result = kvfs_dedup_setattr(path, fullpath, KVFS_PACK_MODE, mode, -1, -1, NULL);
+	if (result > 0)
+		result = chmod(fullpath, mode) < 0 ? -errno : 0;
+	kvfs_store_end(path, 0);
+	if (result < 0)
+	{
+		kvfs_trace("Error in chmod");
+		return result;
+	}
+	kvfs_acache_invalidate(path);
+	kvfs_fdc_invalidate(path);
+	return result;
+}
+
+/** Change the owner and group of a file */
+static int kvfs_chown_op(const char *path, uid_t uid, gid_t gid)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];    
+	kvfs_fullpath(fullpath, path);   
+	kvfs_trace("\nkvfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
+
+	result = kvfs_pack_setattr(path, KVFS_PACK_OWNER, 0, uid, gid, NULL);
+	if (result <= 0)
+		return result;
+	
+	result = kvfs_store_begin(path, fullpath, KVFS_STORE_STAT);
+	if (result < 0)
+		return result;
+	result = kvfs_dedup_setattr(path, fullpath, KVFS_PACK_OWNER, 0, uid, gid, NULL);
+	if (result > 0)
+		result = chown(fullpath, uid, gid) < 0 ? -errno : 0;
+	kvfs_store_end(path, 0);
+	
+	if (result < 0)
+	{
+		kvfs_trace("Error in chown");
+		return result;
+	}
+	kvfs_acache_invalidate(path);
+	kvfs_fdc_invalidate(path);
+	return result;	
+}
+
+/** Change the size of a file */
+static int kvfs_truncate_op(const char *path, off_t newsize)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+	kvfs_trace("\nkvfs_truncate_impl(path=\"%s\", newsize=%lld)\n", path, (long long) newsize);
+
+	result = kvfs_pack_truncate(path, newsize);
+	if (result <= 0)
+	{
+		kvfs_acache_invalidate(path);
+		return result;
+	}
+
+	kvfs_wb_flush_key(path);
+	kvfs_mm_shrink(path);
+	result = kvfs_store_begin(path, fullpath, newsize ? KVFS_STORE_WRITE : KVFS_STORE_TRUNC);
+	if (result < 0)
+	{
+		kvfs_mm_shrunk(path);
+		return result;
+	}
+	result = truncate(fullpath, newsize) < 0 ? -errno : 0;
+	kvfs_store_end(path, 0);
+	kvfs_mm_shrunk(path);
+	
+	if (result < 0)
+	{
+		kvfs_trace(" Error in truncate");
+		return result;
+	}
+	kvfs_pcache_invalidate(path, 0, 0);
+	kvfs_acache_invalidate(path);
+	return result;
+}
+
+/** Change the access and/or modification times of a file */
+/* note -- I'll want to change this as soon as 2.6 is in debian testing */
+static int kvfs_utime_op(const char *path, struct utimbuf *ubuf)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("\nkvfs_utime(path=\"%s\", ubuf=%p)\n", path, ubuf);
+
+	result = kvfs_pack_setattr(path, KVFS_PACK_TIMES, 0, -1, -1, ubuf);
+	if (result <= 0)
+		return result;
+
+	result = kvfs_store_begin(path, fullpath, KVFS_STORE_STAT);
+	if (result < 0)
+		return result;
+	result = kvfs_dedup_setattr(path, fullpath, KVFS_PACK_TIMES, 0, -1, -1, ubuf);
+	if (result > 0)
+		result = utime(fullpath, ubuf) < 0 ? -errno : 0;
+	kvfs_store_end(path, 0);
+	if(result < 0)
+	{
+		kvfs_trace("Error in utime!");
+		return result;
+	}
+	kvfs_acache_invalidate(path);
+	return result;
+}
+
+/** File open operation
+ *
+ * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
+ * will be passed to open().  Open should check if the operation
+ * is permitted for the given flags.  Optionally open may also
+ * return an arbitrary filehandle in the fuse_file_info structure,
+ * which will be passed to all file operations.
+ *
+ * Changed in version 2.2
+ */
+static int kvfs_open_op(const char *path, struct fuse_file_info *fi)
+{
+	int fd;
+	int result = 0;
+	uint32_t gen;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("\nkvfs_open(path\"%s\", fi=%p)\n", path, fi);
+
+	result = kvfs_pack_open(path, fi);
+	if (result <= 0)
+		return result;
+	result = 0;
+
+	// close-to-open: what other handles buffered is visible here
+	kvfs_wb_flush_key(path);
+	if (fi->flags & O_TRUNC)
+		kvfs_mm_shrink(path);
+	if (KVFS_HOLD_WRITER(fi->flags))
+	{
+		// a shared or compressed file is made plain before anything
+		// can write to it
+		result = kvfs_store_begin(path, fullpath,
+			fi->flags & O_TRUNC ? KVFS_STORE_TRUNC : KVFS_STORE_WRITE);
+		if (result < 0)
+		{
+			if (fi->flags & O_TRUNC)
+				kvfs_mm_shrunk(path);
+			return result;
+		}
+	}
+	fd = kvfs_fdc_get(path, fi->flags, &gen);
+	if (fd < 0)
+		fd = kvfs_io_open(fullpath, fi->flags, 0);
+	if (fd < 0)
+		result = -errno;
+	if (fi->flags & O_TRUNC)
+		kvfs_mm_shrunk(path);
+	if (KVFS_HOLD_WRITER(fi->flags))
+		kvfs_store_end(path, fd >= 0);
+	else if (fd >= 0)
+	{
+		result = kvfs_z_open(fd);
+		if (result < 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	kvfs_fdc_opened(fd, fi->flags, gen);
+	kvfs_mm_open(path, fd, fi->flags);
+
+	fi->fh = fd;
+	kvfs_trace_fi(fi);
+
+	if (fd < 0)
+	{
+		kvfs_trace("Error in open");
+		return result;
+	}
+	if (fi->flags & O_TRUNC)
+		kvfs_pcache_invalidate(path, 0, 0);
+
+	return result;
+}
+
+/** Read data from an open file
+ *
+ * Read should return exactly the number of bytes requested except
+ * on EOF or error, otherwise the resultt of the data will be
+ * substituted with zeroes.  An exception to this is when the
+ * 'direct_io' mount option is specified, in which case the return
+ * value of the read system call will reflect the return value of
+ * this operation.
+ *
+ * Changed in version 2.2
+ */
+// I don't fully understand the documentation above -- it doesn't
+// match the documentation for the read() system call which says it
+// can return with anything up to the amount of data requested. nor
+// with the fusexmp code which returns the amount of data also
+// returned by read.
+static int kvfs_read_op(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	int result = 0;
+	kvfs_trace("\nkvfs_read(path=\"%s\", buf=%p, size=%zu, offset=%lld, fi=%p)\n", path, buf, size, (long long) offset, fi);
+
+	kvfs_trace_fi(fi);
+	if (kvfs_pack_obj(fi) != NULL)
+		return kvfs_pack_read(kvfs_pack_obj(fi), buf, size, offset);
+	if (kvfs_z_file(fi->fh) != NULL)
+		return kvfs_z_read(kvfs_z_file(fi->fh), fi->fh, buf, size, offset);
+	result = kvfs_mm_read(fi->fh, buf, size, offset);
+	if (result >= 0)
+		return result;
+	kvfs_wb_flush(fi->fh, 0);
+	result = kvfs_ra_read(path, fi->fh, buf, size, offset);
+	if (result >= 0)
+		return result;
+        result = kvfs_io_pread(fi->fh, buf, size, offset);
+        if (result < 0)
+	{
+		result = -errno;
+	}
+        return result;
+}
+
+/** Write data to an open file
+ *
+ * Write should return exactly the number of bytes requested
+ * except on error.  An exception to this is when the 'direct_io'
+ * mount option is specified (see read operation).
+ *
+ * Changed in version 2.2
+ */
+// As  with read(), the documentation above is inconsistent with the
+// documentation for the write() system call.
+static int kvfs_write_op(const char *path, const char *buf, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	int result = 0;
+        kvfs_trace("\nkvfs_write(path=\"%s\", buf=%p, size=%zu, offset=%lld, fi=%p)\n", path, buf, size, (long long) offset, fi);
+        kvfs_trace_fi(fi);
+	if (kvfs_pack_obj(fi) != NULL)
+	{
+		result = kvfs_pack_write(kvfs_pack_obj(fi), buf, size, offset);
+		kvfs_acache_invalidate(path);
+		return result;
+	}
+	if (kvfs_wb_write(path, fi->fh, buf, size, offset))
+	{
+		kvfs_acache_invalidate(path);
+		return size;
+	}
+        result = kvfs_io_pwrite(fi->fh, buf, size, offset);
+        if (result < 0)
+	{
+		return -errno;
+	}
+	kvfs_pcache_invalidate(path, offset, result);
+	kvfs_mm_invalidate(path);
+	kvfs_acache_invalidate(path);
+        return result;	
+}
+
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and
+ * returned in a generic buffer.
+ *
+ * No actual copying of data has to take place, the source
+ * file descriptor may simply be stored in the buffer for
+ * later data transfer.
+ *
+ * The buffer must be allocated dynamically and stored at the
+ * location pointed to by bufp.  If the buffer contains memory
+ * regions, they too must be allocated using malloc().  The
+ * allocated memory will be freed by the caller.
+ *
+ * Introduced in version 2.9
+ */
+// With KVFS_SPLICE set the buffer just names the backing fd and
+// offset, and libfuse splices the data from the backing file to
+// /dev/fuse without it passing through user space (given the
+// splice_read/splice_write mount options).  Otherwise the data is
+// read into memory, as read() would.
+static int kvfs_read_buf_op(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	int result = 0;
+	struct fuse_bufvec *src;
+	ssize_t len;
+
+	kvfs_trace("\nkvfs_read_buf(path=\"%s\", bufp=%p, size=%zu, offset=%lld, fi=%p)\n", path, bufp, size, (long long) offset, fi);
+	kvfs_trace_fi(fi);
+	if (kvfs_pack_obj(fi) == NULL)
+		kvfs_wb_flush(fi->fh, 0);
+
+	src = malloc(sizeof(*src));
+	if (src == NULL)
+		return -ENOMEM;
+	*src = FUSE_BUFVEC_INIT(size);
+
+	// Data the read-ahead threads fetched, mapped files, packed objects
+	// and compressed files are handed over from memory even when
+	// splicing.
+	len = -1;
+	if (kvfs_pack_obj(fi) != NULL || kvfs_z_file(fi->fh) != NULL)
+	{
+		src->buf[0].mem = malloc(size);
+		if (src->buf[0].mem == NULL)
+			len = -ENOMEM;
+		else if (kvfs_pack_obj(fi) != NULL)
+			len = kvfs_pack_read(kvfs_pack_obj(fi), src->buf[0].mem, size, offset);
+		else
+			len = kvfs_z_read(kvfs_z_file(fi->fh), fi->fh, src->buf[0].mem, size, offset);
+		if (len < 0)
+		{
+			free(src->buf[0].mem);
+			free(src);
+			return len;
+		}
+	}
+	else if (kvfs_pcache_on || kvfs_mm_on || !kvfs_conf.splice)
+	{
+		src->buf[0].mem = malloc(size);
+		if (src->buf[0].mem == NULL)
+		{
+			free(src);
+			return -ENOMEM;
+		}
+		len = kvfs_mm_read(fi->fh, src->buf[0].mem, size, offset);
+		if (len < 0)
+			len = kvfs_ra_read(path, fi->fh, src->buf[0].mem, size, offset);
+		if (len < 0 && kvfs_conf.splice)
+		{
+			free(src->buf[0].mem);
+			src->buf[0].mem = NULL;
+		}
+	}
+
+	if (len < 0 && kvfs_conf.splice)
+	{
+		src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src->buf[0].fd = fi->fh;
+		src->buf[0].pos = offset;
+	}
+	else
+	{
+		if (len < 0)
+			len = kvfs_io_pread(fi->fh, src->buf[0].mem, size, offset);
+		if (len < 0)
+		{
+			result = -errno;
+			free(src->buf[0].mem);
+			free(src);
+			return result;
+		}
+		src->buf[0].size = len;
+	}
+
+	*bufp = src;
+	return result;
+}
+
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer.  Use fuse_buf_copy() to transfer data to
+ * the destination.
+ *
+ * Introduced in version 2.9
+ */
+// When the kernel handed the data over in a pipe, fuse_buf_copy()
+// splices it straight into the backing file if KVFS_SPLICE is set.
+static int kvfs_write_buf_op(const char *path, struct fuse_bufvec *buf, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	int result = 0;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	kvfs_trace("\nkvfs_write_buf(path=\"%s\", buf=%p, size=%zu, offset=%lld, fi=%p)\n", path, buf, fuse_buf_size(buf), (long long) offset, fi);
+	kvfs_trace_fi(fi);
+
+	if (kvfs_pack_obj(fi) != NULL)
+		return kvfs_pack_write_buf(kvfs_pack_obj(fi), path, buf, offset);
+
+	// Data in a pipe goes straight to the file, past anything buffered.
+	if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+	{
+		if (kvfs_wb_write(path, fi->fh, buf->buf[0].mem, buf->buf[0].size, offset))
+		{
+			kvfs_acache_invalidate(path);
+			return buf->buf[0].size;
+		}
+	}
+	else
+		kvfs_wb_flush(fi->fh, 0);
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	result = fuse_buf_copy(&dst, buf, kvfs_conf.splice ? FUSE_BUF_SPLICE_NONBLOCK : FUSE_BUF_NO_SPLICE);
+	if (result < 0)
+		return result;
+
+	kvfs_pcache_invalidate(path, offset, result);
+	kvfs_mm_invalidate(path);
+	kvfs_acache_invalidate(path);
+	return result;
+}
+
+/** Get file system statistics
+ *
+ * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
+ *
+ * Replaced 'struct statfs' parameter with 'struct statvfs' in
+ * version 2.5
+ */
+static int kvfs_statfs_op(const char *path, struct statvfs *statv)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+	
+	kvfs_trace("\nkvfs_statfs(path=\"%s\", statv=%p)\n", path, statv);
+
+	result = statvfs(fullpath, statv);
+	if (result < 0)
+	{
+		return -errno;
+	}
+
+	kvfs_trace("    f_bsize = %lu, f_blocks = %llu, f_bfree = %llu\n", statv->f_bsize,
+		(unsigned long long) statv->f_blocks, (unsigned long long) statv->f_bfree);
+	
+	return result;
+}
+
+/** Possibly flush cached data
+ *
+ * BIG NOTE: This is not equivalent to fsync().  It's not a
+ * request to sync dirty data.
+ *
+ * Flush is called on each close() of a file descriptor.  So if a
+ * filesystem wants to return write errors in close() and the file
+ * has cached dirty data, this is a good place to write back data
+ * and return any errors.  Since many applications ignore close()
+ * errors this is not always useful.
+ *
+ * NOTE: The flush() method may be called more than once for each
+ * open().  This happens if more than one file descriptor refers
+ * to an opened file due to dup(), dup2() or fork() calls.  It is
+ * not possible to determine if a flush is final, so each flush
+ * should be treated equally.  Multiple write-flush sequences are
+ * relatively rare, so this shouldn't be a problem.
+ *
+ * Filesystems shouldn't assume that flush will always be called
+ * after some writes, or that if will be called at all.
+ *
+ * Changed in version 2.2
+ */
+// This is a no-op in BBFS.  Here it writes out what the handle has
+// buffered, and is where a failed buffered write is reported.
+static int kvfs_flush_op(const char *path, struct fuse_file_info *fi)
+{
+    kvfs_trace("\nkvfs_flush(path=\"%s\", fi=%p)\n", path, fi);
+    kvfs_trace_fi(fi);
+	
+    if (kvfs_pack_obj(fi) != NULL)
+	    return kvfs_pack_flush(kvfs_pack_obj(fi));
+    return kvfs_wb_flush(fi->fh, 1);
+}
+
+/** Release an open file
+ *
+ * Release is called when there are no more references to an open
+ * file: all file descriptors are closed and all memory mappings
+ * are unmapped.
+ *
+ * For every open() call there will be exactly one release() call
+ * with the same flags and file descriptor.  It is possible to
+ * have a file opened more than once, in which case only the last
+ * release will mean, that no more reads/writes will happen on the
+ * file.  The return value of release is ignored.
+ *
+ * Changed in version 2.2
+ */
+static int kvfs_release_op(const char *path, struct fuse_file_info *fi)
+{
+	int result = 0;
+	kvfs_trace("\nkvfs_release(path=\"%s\", fi=%p)\n", path, fi);
+
+	kvfs_trace_fi(fi);
+
+	// Nobody hears what release returns, so this is only logged.
+	if (kvfs_pack_obj(fi) != NULL)
+	{
+		if (kvfs_pack_release(kvfs_pack_obj(fi)) < 0)
+			kvfs_error("\nkvfs_release: writes to packed %s were lost\n", path);
+		return 0;
+	}
+	result = kvfs_wb_release(fi->fh);
+	if (result < 0)
+		kvfs_error("\nkvfs_release: buffered writes to %s were lost\n", path);
+	kvfs_ra_release(fi->fh);
+	kvfs_mm_release(fi->fh);
+	kvfs_z_release(fi->fh);
+
+	// Kept for the next open, unless storing it anew (below) drops it.
+	if (!kvfs_fdc_put(path, fi->fh))
+		result = close(fi->fh) < 0 ? -errno : 0;
+	if (KVFS_HOLD_WRITER(fi->flags))
+		kvfs_store_release(path);
+
+	return result;	
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+static int kvfs_fsync_op(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int result = 0;
+	kvfs_trace("\nkvfs_fsync(path=\"%s\", datasync=%d, fi=%p)\n", path, datasync, fi);
+	kvfs_trace_fi(fi);
+
+	if (kvfs_pack_obj(fi) != NULL)
+		return kvfs_pack_fsync(kvfs_pack_obj(fi), datasync);
+
+	result = kvfs_wb_flush(fi->fh, 1);
+	if (result < 0)
+		return result;
+
+	// BBFS only synced when built with HAVE_FDATASYNC, and otherwise
+	// said it had.  fdatasync() is always there on Linux.
+	return kvfs_sync(fi->fh, datasync);
+}
+
+#ifdef HAVE_SYS_XATTR_H
+/** Set extended attributes */
+static int kvfs_setxattr_op(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("kvfs_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%zu, flags=0x%08x)\n", path, name, value, size, flags);
+
+	if (strcmp(name, KVFS_Z_XATTR) == 0)
+		return -EPERM;
+
+	// Records have no room for xattrs.  A file opted out of
+	// compression is expanded now rather than on its next write.
+	result = kvfs_pack_unpack(path);
+	if (result >= 0)
+		result = kvfs_store_begin(path, fullpath,
+					  strcmp(name, KVFS_Z_OPT) == 0 && kvfs_z_optout(value, size) ?
+					  KVFS_STORE_WRITE : KVFS_STORE_ATTRS);
+	if (result < 0)
+		return result;
+	
+	result = lsetxattr(fullpath, name, value, size, flags) < 0 ? -errno : 0;
+	kvfs_store_end(path, 0);
+	if(result < 0)
+	{
+		return result;	
+	}
+	kvfs_acache_invalidate(path);
+	kvfs_fdc_invalidate(path);	// an ACL may have changed
+	return result;
+}
+
+/** Get extended attributes */
+static int kvfs_getxattr_op(const char *path, const char *name, char *value, size_t size)
+{
+	int result = 0;	
+	struct stat st;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("kvfs_getxattr(path = \"%s\", name = \"%s\", value = %p, size = %zu)\n", path, name, value, size);
+
+	if (strcmp(path, kvfs_root_key) == 0 && strcmp(name, KVFS_STATS_XATTR) == 0)
+	{
+		char stats[8192];
+
+		result = kvfs_stats_format(stats, sizeof(stats));
+		if (size == 0)
+			return result;
+		if ((size_t) result > size)
+			return -ERANGE;
+		memcpy(value, stats, result);
+		return result;
+	}
+
+	if (kvfs_pack_stat(path, &st) == 0 || strcmp(name, KVFS_Z_XATTR) == 0)
+		return -ENODATA;
+
+	result = lgetxattr(fullpath, name, value, size);	
+	if(result < 0)
+	{
+		return -errno;
+	}
+        kvfs_trace("    value = \"%s\"\n", value);
+	return result;
+}
+
+/** List extended attributes */
+static int kvfs_listxattr_op(const char *path, char *list, size_t size)
+{
+	char* ptr;
+	int result = 0;
+	struct stat st;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   
+
+	kvfs_trace("kvfs_listxattr(path=\"%s\", list=%p, size=%zu)\n", path, list, size);
+
+	if (kvfs_pack_stat(path, &st) == 0)
+		return 0;
+
+	// (Without a buffer the size asked for may be a marker too long.)
+	result = llistxattr(fullpath, list, size);
+	if (result > 0 && size > 0)
+		result = kvfs_z_hide(list, result);
+
+	if (result >= 0) 
+	{
+        	kvfs_trace("    returned attributes (length %d):\n", result);
+        	for (ptr = list; ptr < list + result; ptr += strlen(ptr)+1)
+		{  
+			kvfs_trace("    \"%s\"\n", ptr);
+		}
+	}
+
+	return result;
+
+
+//    return -1;
+}
+
+/** Remove extended attributes */
+static int kvfs_removexattr_op(const char *path, const char *name)
+{
+	int result = 0;
+	struct stat st;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   	
+
+	kvfs_trace("\nkvfs_removexattr(path=\"%s\", name=\"%s\")\n", path, name);
+
+	if (kvfs_pack_stat(path, &st) == 0)
+		return -ENODATA;
+	if (strcmp(name, KVFS_Z_XATTR) == 0)
+		return -EPERM;
+
+	result = kvfs_store_begin(path, fullpath, KVFS_STORE_ATTRS);
+	if (result < 0)
+		return result;
+	result = lremovexattr(fullpath, name) < 0 ? -errno : 0;
+	kvfs_store_end(path, 0);
+
+	if(result < 0)
+	{
+		return result;
+	}
+	kvfs_acache_invalidate(path);
+	kvfs_fdc_invalidate(path);
+	return result;
+}
+#endif
+
+/** Open directory
+ *
+ * This method should check if the open operation is permitted for
+ * this  directory
+ *
+ * Introduced in version 2.3
+ */
+static int kvfs_opendir_op(const char *path, struct fuse_file_info *fi)
+{
+	void *list;
+	struct kvfs_dirhandle *dh;
+	int result = 0;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);   	
+	
+	kvfs_trace("\nkvfs_opendir(path=\"%s\", fi=%p)\n", path, fi);
+
+	if (kvfs_conf.index)
+		list = kvfs_conf.backend->opendir(path, fullpath);
+	else
+		list = opendir(fullpath);
+	kvfs_trace("    opendir returned 0x%p\n", list);
+
+	if (list == NULL)
+	{
+		return kvfs_log_errno("kvfs_opendir opendir");
+	}
+
+	dh = malloc(sizeof(*dh));
+	if (dh == NULL)
+	{
+		if (kvfs_conf.index)
+			kvfs_conf.backend->closedir(list);
+		else
+			closedir(list);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&dh->lock, NULL);
+	dh->list = list;
+	dh->index = kvfs_conf.index;
+	snprintf(dh->key, sizeof(dh->key), "%s", path);
+	dh->next = 0;
+	dh->held = 0;
+	dh->shards = NULL;
+	dh->nshards = 0;
+
+	fi->fh = (uintptr_t) dh;
+	kvfs_trace_fi(fi);
+
+	return result;
+}
+
+/** Read directory
+ *
+ * This supersedes the old getdir() interface.  New applications
+ * should use this.
+ *
+ * The filesystem may choose between two modes of operation:
+ *
+ * 1) The readdir implementation ignores the offset parameter, and
+ * passes zero to the filler function's offset.  The filler
+ * function will not return '1' (unless an error happens), so the
+ * whole directory is read in a single readdir operation.  This
+ * works just like the old getdir() method.
+ *
+ * 2) The readdir implementation keeps track of the offsets of the
+ * directory entries.  It uses the offset parameter and always
+ * passes non-zero offset to the filler function.  When the buffer
+ * is full (or an error happens) the filler function will return
+ * '1'.
+ *
+ * Introduced in version 2.3
+ */
+// KVFS uses mode 2, so a huge directory streams through the kernel a
+// buffer at a time instead of being collected whole by libfuse first.
+// The cookies are the listing's own: the index backend's, or without
+// an index the backing directory's d_off, or in a sharded root see
+// kvfs_readdir_shards().  Listing from where the last call stopped,
+// the common case, needs no seek.
+//
+// Each entry is stat'ed into the attribute cache and handed to filler,
+// so the getattr the kernel sends for it is a cache hit; libfuse 2.9
+// has no readdirplus to pass the attributes along itself.
+static int kvfs_readdir_op(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+	       struct fuse_file_info *fi)
+{
+	int result = 0;
+	struct kvfs_dirhandle *dh;
+	const char *name;
+	off_t off;
+	struct stat st;
+
+	kvfs_trace("\nkvfs_readdir(path=\"%s\", buf=%p, filler=%p, offset=%lld, fi=%p)\n",
+            path, buf, (void *) filler, (long long) offset, fi);
+
+	dh = (struct kvfs_dirhandle *) (uintptr_t) fi->fh;
+	pthread_mutex_lock(&dh->lock);
+
+	if (!dh->index && kvfs_conf.layout == KVFS_LAYOUT_SHARD && strcmp(path, kvfs_root_key) == 0)
+	{
+		result = kvfs_readdir_shards(dh, buf, filler, offset);
+		pthread_mutex_unlock(&dh->lock);
+		return result;
+	}
+
+	if (offset != dh->next)
+	{
+		if (dh->index)
+			kvfs_conf.backend->seekdir(dh->list, offset);
+		else
+			kvfs_dir_seekdir(dh->list, offset);
+		dh->next = offset;
+		dh->held = 0;
+	}
+
+	if (dh->held)
+	{
+		if (filler(buf, dh->held_name, kvfs_dirhandle_stat(dh, dh->held_name, &st), dh->held_off) != 0)
+		{
+			pthread_mutex_unlock(&dh->lock);
+			return result;
+		}
+		dh->held = 0;
+		dh->next = dh->held_off;
+	}
+
+	for (;;)
+	{
+		if (dh->index)
+			name = kvfs_conf.backend->readdir(dh->list, &off);
+		else
+			name = kvfs_dir_readdir(dh->list, &off);
+		if (name == NULL)
+		{
+			if (errno != 0)
+				result = kvfs_log_errno("kvfs_readdir readdir");
+			break;
+		}
+		// superblock and other bookkeeping files in the root
+		if (!dh->index && strncmp(name, ".kvfs", 5) == 0)
+		{
+			dh->next = off;
+			continue;
+		}
+		kvfs_trace("calling filler with name %s\n", name);
+		if (filler(buf, name, kvfs_dirhandle_stat(dh, name, &st), off) != 0)
+		{
+			// Buffer full: the next call starts with this entry.
+			strcpy(dh->held_name, name);
+			dh->held_off = off;
+			dh->held = 1;
+			break;
+		}
+		dh->next = off;
+	}
+
+	pthread_mutex_unlock(&dh->lock);
+   	kvfs_trace_fi(fi);
+
+	return result;
+}
+
+/** Release directory
+ *
+ * Introduced in version 2.3
+ */
+static int kvfs_releasedir_op(const char *path, struct fuse_file_info *fi)
+{
+	int result = 0;
+	struct kvfs_dirhandle *dh = (struct kvfs_dirhandle *) (uintptr_t) fi->fh;
+
+	kvfs_trace("\nkvfs_releasedir(path=\"%s\", fi=%p)\n",
+            path, fi);
+	kvfs_trace_fi(fi);
+
+	if (dh->index)
+		kvfs_conf.backend->closedir(dh->list);
+	else
+		closedir(dh->list);
+	pthread_mutex_destroy(&dh->lock);
+	free(dh->shards);
+	free(dh);
+
+	return result;
+
+}
+
+/** Synchronize directory contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data
+ *
+ * Introduced in version 2.3
+ */
+// Called when a user calls fsync on a directory.  See "Sync" for why
+// it syncs the whole backing filesystem.
+static int kvfs_fsyncdir_op(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int result = 0;
+
+    	kvfs_trace("\nkvfs_fsyncdir(path=\"%s\", datasync=%d, fi=%p)\n",
+            path, datasync, fi);
+   	kvfs_trace_fi(fi);
+
+	result = kvfs_sync_group(-1, datasync);
+	return result;
+}
+
+static int kvfs_access_op(const char *path, int mask)
+{
+	int result = 0;
+    char fullpath[PATH_MAX];
+
+	kvfs_trace("\nkvfs_access(path=\"%s\", mask=0%o)\n",
+            path, mask);
+    kvfs_fullpath(fullpath, path);   
+
+	result = kvfs_pack_access(path, mask);
+	if (result > 0)
+		result = kvfs_dedup_access(path, fullpath, mask);
+	if (result <= 0)
+		return result;
+
+	result = access(fullpath, mask);
+
+	if (result < 0)
+		result = kvfs_log_errno("kvfs_access access");
+
+	return result;
+}
+
+/**
+ * Create and open a file
+ *
+ * If the file does not exist, first create it with the specified
+ * mode, and then open it.
+ *
+ * If this method is not implemented or under Linux kernel
+ * versions earlier than 2.6.15, the mknod() and open() methods
+ * will be called instead.
+ *
+ * Introduced in version 2.5
+ */
+// The backing file is created and opened with the caller's own flags
+// in one open(), so a new file costs one syscall instead of mknod's
+// open+close followed by open().  The kernel follows create with an
+// fgetattr, which the fstat here has already answered.
+static int kvfs_create_op(const char *path, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	int fd;
+	int result = 0;
+	uint64_t gen;
+	struct stat statbuf;
+	char fullpath[PATH_MAX];
+	kvfs_fullpath(fullpath, path);
+
+	kvfs_trace("\nkvfs_create(path=\"%s\", mode=0%03o, fi=%p)\n", path, mode, fi);
+
+	// A packed object costs one append instead of a backing file.
+	result = kvfs_pack_create(path, mode, fi);
+	if (result <= 0)
+	{
+		if (result == 0)
+		{
+			kvfs_trace_fi(fi);
+			kvfs_acache_invalidate(path);
+			result = kvfs_index_add(path, name);
+			if (result < 0)
+			{
+				kvfs_release_op(path, fi);
+				kvfs_pack_unlink(path);
+			}
+		}
+		return result;
+	}
+	if (fi->flags & O_TRUNC)
+		kvfs_mm_shrink(path);
+	result = kvfs_store_begin(path, fullpath,
+			fi->flags & O_TRUNC ? KVFS_STORE_TRUNC : KVFS_STORE_WRITE);
+	if (result < 0)
+	{
+		if (fi->flags & O_TRUNC)
+			kvfs_mm_shrunk(path);
+		return result;
+	}
+
+	fd = kvfs_io_open(fullpath, fi->flags | O_CREAT, mode);
+	if (fd < 0 && errno == ENOENT && kvfs_mkshard(fullpath) == 0)
+	{
+		fd = kvfs_io_open(fullpath, fi->flags | O_CREAT, mode);
+	}
+	result = fd < 0 ? -errno : 0;
+	if (fi->flags & O_TRUNC)
+		kvfs_mm_shrunk(path);
+	kvfs_store_end(path, fd >= 0 && KVFS_HOLD_WRITER(fi->flags));
+	if (fd < 0)
+	{
+		kvfs_trace("Error in create");
+		return result;
+	}
+
+	fi->fh = fd;
+	kvfs_trace_fi(fi);
+	// Not listed, so nobody else can have it open.
+	result = kvfs_index_add(path, name);
+	if (result < 0)
+	{
+		kvfs_release_op(path, fi);
+		kvfs_fdc_invalidate(path);
+		unlink(fullpath);
+		kvfs_acache_invalidate(path);
+		return result;
+	}
+	if (fi->flags & O_TRUNC)
+		kvfs_pcache_invalidate(path, 0, 0);
+
+	// The open may have created or truncated the file; seed the cache
+	// with what it looks like now.
+	kvfs_acache_invalidate(path);
+	gen = kvfs_acache_gen(path);
+	if (fstat(fd, &statbuf) == 0)
+		kvfs_acache_put(path, &statbuf, gen);
+
+	return result;
+}
+
+/**
+ * Change the size of an open file
+ *
+ * This method is called instead of the truncate() method if the
+ * truncation was invoked from an ftruncate() system call.
+ *
+ * If this method is not implemented or under Linux kernel
+ * versions earlier than 2.6.15, the truncate() method will be
+ * called instead.
+ *
+ * Introduced in version 2.5
+ */
+static int kvfs_ftruncate_op(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+	int result = 0;
+	kvfs_trace("\nkvfs_ftruncate(path=\"%s\", offset=%lld, fi=%p)\n",
+        path, (long long) offset, fi);
+	kvfs_trace_fi(fi);
+
+	if (kvfs_pack_obj(fi) != NULL)
+	{
+		struct kvfs_pobj *obj = kvfs_pack_obj(fi);
+
+		pthread_mutex_lock(&obj->lock);
+		result = kvfs_pack_resize(obj, offset);
+		pthread_mutex_unlock(&obj->lock);
+		kvfs_acache_invalidate(path);
+		return result;
+	}
+
+	kvfs_wb_flush_key(path);
+	kvfs_mm_shrink(path);
+	result = ftruncate(fi->fh, offset);
+	if (result < 0)
+    	result = kvfs_log_errno("kvfs_ftruncate ftruncate");
+	kvfs_mm_shrunk(path);
+
+	kvfs_pcache_invalidate(path, 0, 0);
+	kvfs_acache_invalidate(path);
+	return result;
+}
+
+/**
+ * Get attributes from an open file
+ *
+ * This method is called instead of the getattr() method if the
+ * file information is available.
+ *
+ * Currently this is only called after the create() method if that
+ * is implemented (see above).  Later it may be called for
+ * invocations of fstat() too.
+ *
+ * Introduced in version 2.5
+ */
+static int kvfs_fgetattr_op(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+	int result = 0;
+	uint64_t gen;
+
+	kvfs_trace("\nkvfs_fgetattr(path=\"%s\", statbuf=%p, fi=%p)\n",
+        path, statbuf, fi);
+	kvfs_trace_fi(fi);
+
+    // On FreeBSD, trying to do anything with the mountpoint ends up
+    // opening it, and then using the FD for an fgetattr.  So in the
+    // special case of a path of "/", I need to do a getattr on the
+    // underlying root directory instead of doing the fgetattr().
+	if (!strcmp(path, kvfs_root_key))
+    	return kvfs_getattr_op(path, statbuf);
+
+	if (kvfs_pack_obj(fi) != NULL)
+		return kvfs_pack_fstat(kvfs_pack_obj(fi), statbuf);
+
+	kvfs_wb_flush_key(path);
+	if (kvfs_acache_get(path, statbuf) == 0)
+		return 0;
+
+	gen = kvfs_acache_gen(path);
+	result = fstat(fi->fh, statbuf);
+	if (result < 0)
+    	return kvfs_log_errno("kvfs_fgetattr fstat");
+
+	kvfs_dedup_fixstat(path, statbuf);
+	kvfs_acache_put(path, statbuf, gen);
+	kvfs_trace("    st_mode = 0%o, st_size = %lld\n", statbuf->st_mode, (long long) statbuf->st_size);
+
+	return result;
+}
+
+
+///////////////////////////////////////////////////////////
+//
+// Operation statistics
+//
+// Each _impl above is the entry point kvfs.c calls, and times the
+// operation it wraps.  Every thread counts its own calls, errors,
+// bytes and time per operation, with a histogram of latencies in
+// buckets an eighth of a power of two wide (so percentiles are within
+// about 12%), and the per-thread tables are only added up when someone
+// asks.  KVFS_OP_STATS=0 turns this off.
+//
+// The totals and percentiles, with everything user.kvfs.stats shows,
+// can be read from mountdir/.kvfs_stats, which is made up on the spot
+// and not listed, or are written to kvfs.log on SIGUSR1:
+//
+//     cat mountdir/.kvfs_stats
+//     kill -USR1 $(pidof kvfs)
+//
+#define KVFS_OP_BUCKETS		304		// up to 2^40 ns, about 18 minutes
+
+enum {
+	KVFS_OP_GETATTR, KVFS_OP_READLINK, KVFS_OP_MKNOD, KVFS_OP_MKDIR, KVFS_OP_UNLINK,
+	KVFS_OP_RMDIR, KVFS_OP_SYMLINK, KVFS_OP_RENAME, KVFS_OP_LINK, KVFS_OP_CHMOD,
+	KVFS_OP_CHOWN, KVFS_OP_TRUNCATE, KVFS_OP_UTIME, KVFS_OP_OPEN, KVFS_OP_READ,
+	KVFS_OP_WRITE, KVFS_OP_READ_BUF, KVFS_OP_WRITE_BUF, KVFS_OP_STATFS, KVFS_OP_FLUSH,
+	KVFS_OP_RELEASE, KVFS_OP_FSYNC, KVFS_OP_SETXATTR, KVFS_OP_GETXATTR, KVFS_OP_LISTXATTR,
+	KVFS_OP_REMOVEXATTR, KVFS_OP_OPENDIR, KVFS_OP_READDIR, KVFS_OP_RELEASEDIR, KVFS_OP_FSYNCDIR,
+	KVFS_OP_ACCESS, KVFS_OP_CREATE, KVFS_OP_FTRUNCATE, KVFS_OP_FGETATTR, KVFS_OPS
+};
+
+static const char *kvfs_op_names[KVFS_OPS] = {
+	"getattr", "readlink", "mknod", "mkdir", "unlink",
+	"rmdir", "symlink", "rename", "link", "chmod",
+	"chown", "truncate", "utime", "open", "read",
+	"write", "read_buf", "write_buf", "statfs", "flush",
+	"release", "fsync", "setxattr", "getxattr", "listxattr",
+	"removexattr", "opendir", "readdir", "releasedir", "fsyncdir",
+	"access", "create", "ftruncate", "fgetattr",
+};
+
+struct kvfs_opcount {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t max_ns;
+	uint64_t hist[KVFS_OP_BUCKETS];
+};
+
+// One thread's counts.  Only the owner writes them, so it needs no
+// lock, only stores that a reader adding them up can't tear.
+struct kvfs_opstats {
+	struct kvfs_opstats *next;
+	struct kvfs_opcount ops[KVFS_OPS];
+};
+
+static int kvfs_op_on;
+static pthread_mutex_t kvfs_op_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kvfs_opstats *kvfs_op_threads;
+static struct kvfs_opstats kvfs_op_exited;	// from threads that are gone
+static __thread struct kvfs_opstats *kvfs_op_mine;
+static pthread_key_t kvfs_op_key;
+static int kvfs_op_pipe[2] = { -1, -1 };	// SIGUSR1 to the dump thread
+
+#define KVFS_OP_ADD(field, n)	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+static unsigned int kvfs_op_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < 8)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	if (msb >= 40)
+		return KVFS_OP_BUCKETS - 1;
+	return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+// The largest latency that lands in bucket b.
+static uint64_t kvfs_op_bucket_max(unsigned int b)
+{
+	if (b < 8)
+		return b;
+	return ((uint64_t) (8 + b % 8 + 1) << (b / 8 - 1)) - 1;
+}
+
+static void kvfs_op_add(struct kvfs_opstats *to, const struct kvfs_opstats *from)
+{
+	const struct kvfs_opcount *f;
+	struct kvfs_opcount *t;
+	int i, b;
+
+	for (i = 0; i < KVFS_OPS; i++)
+	{
+		f = &from->ops[i];
+		t = &to->ops[i];
+		if (__atomic_load_n(&f->calls, __ATOMIC_RELAXED) == 0)
+			continue;
+		t->calls += __atomic_load_n(&f->calls, __ATOMIC_RELAXED);
+		t->errors += __atomic_load_n(&f->errors, __ATOMIC_RELAXED);
+		t->bytes += __atomic_load_n(&f->bytes, __ATOMIC_RELAXED);
+		t->ns += __atomic_load_n(&f->ns, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&f->max_ns, __ATOMIC_RELAXED) > t->max_ns)
+			t->max_ns = __atomic_load_n(&f->max_ns, __ATOMIC_RELAXED);
+		for (b = 0; b < KVFS_OP_BUCKETS; b++)
+			t->hist[b] += __atomic_load_n(&f->hist[b], __ATOMIC_RELAXED);
+	}
+}
+
+// A thread is going away: keep what it counted.
+static void kvfs_op_thread_exit(void *arg)
+{
+	struct kvfs_opstats *mine = arg, **pp;
+
+	pthread_mutex_lock(&kvfs_op_lock);
+	kvfs_op_add(&kvfs_op_exited, mine);
+	for (pp = &kvfs_op_threads; *pp != mine; pp = &(*pp)->next)
+		;
+	*pp = mine->next;
+	pthread_mutex_unlock(&kvfs_op_lock);
+	free(mine);
+}
+
+static uint64_t kvfs_op_clock(void)
+{
+	struct timespec ts;
+
+	if (!kvfs_op_on)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Count an operation that started at start (kvfs_op_clock()) and
+// moved bytes; returns its result.
+static int kvfs_op_done(int op, uint64_t start, int result, uint64_t bytes)
+{
+	struct kvfs_opstats *mine = kvfs_op_mine;
+	struct kvfs_opcount *c;
+	uint64_t ns;
+
+	if (!kvfs_op_on || start == 0)
+		return result;
+	ns = kvfs_op_clock() - start;
+	if (mine == NULL)
+	{
+		mine = calloc(1, sizeof(*mine));
+		if (mine == NULL)
+			return result;
+		pthread_mutex_lock(&kvfs_op_lock);
+		mine->next = kvfs_op_threads;
+		kvfs_op_threads = mine;
+		pthread_mutex_unlock(&kvfs_op_lock);
+		pthread_setspecific(kvfs_op_key, mine);
+		kvfs_op_mine = mine;
+	}
+
+	c = &mine->ops[op];
+	KVFS_OP_ADD(c->calls, 1);
+	KVFS_OP_ADD(c->errors, result < 0);
+	KVFS_OP_ADD(c->bytes, bytes);
+	KVFS_OP_ADD(c->ns, ns);
+	KVFS_OP_ADD(c->hist[kvfs_op_bucket(ns)], 1);
+	if (ns > c->max_ns)
+		__atomic_store_n(&c->max_ns, ns, __ATOMIC_RELAXED);
+	return result;
+}
+
+// The latency (in microseconds) under which a fraction q of c's calls
+// finished.
+static double kvfs_op_percentile(const struct kvfs_opcount *c, double q)
+{
+	uint64_t want = (uint64_t) (q * c->calls + 0.5), seen = 0, max;
+	int b;
+
+	if (want == 0)
+		want = 1;
+	for (b = 0; b < KVFS_OP_BUCKETS; b++)
+	{
+		seen += c->hist[b];
+		if (seen >= want)
+			break;
+	}
+	max = b < KVFS_OP_BUCKETS ? kvfs_op_bucket_max(b) : c->max_ns;
+	return (max < c->max_ns ? max : c->max_ns) / 1000.0;
+}
+
+// The counts of every operation called so far, as text.
+static int kvfs_op_format(char *buf, size_t size)
+{
+	struct kvfs_opstats *sum, *t;
+	struct kvfs_opcount *c;
+	int i, n, len = 0;
+
+	if (!kvfs_op_on)
+		return 0;
+	sum = calloc(1, sizeof(*sum));
+	if (sum == NULL)
+		return 0;
+	pthread_mutex_lock(&kvfs_op_lock);
+	kvfs_op_add(sum, &kvfs_op_exited);
+	for (t = kvfs_op_threads; t != NULL; t = t->next)
+		kvfs_op_add(sum, t);
+	pthread_mutex_unlock(&kvfs_op_lock);
+
+	for (i = 0; i < KVFS_OPS && (size_t) len < size; i++)
+	{
+		c = &sum->ops[i];
+		if (c->calls == 0)
+			continue;
+		n = snprintf(buf + len, size - len,
+			"op.%s.calls %llu\nop.%s.errors %llu\nop.%s.bytes %llu\nop.%s.total_ms %.3f\n"
+			"op.%s.mean_us %.2f\nop.%s.p50_us %.2f\nop.%s.p99_us %.2f\nop.%s.p999_us %.2f\n"
+			"op.%s.max_us %.2f\n",
+			kvfs_op_names[i], (unsigned long long) c->calls, kvfs_op_names[i],
+			(unsigned long long) c->errors, kvfs_op_names[i], (unsigned long long) c->bytes,
+			kvfs_op_names[i], c->ns / 1e6, kvfs_op_names[i], c->ns / 1e3 / c->calls,
+			kvfs_op_names[i], kvfs_op_percentile(c, 0.5), kvfs_op_names[i], kvfs_op_percentile(c, 0.99),
+			kvfs_op_names[i], kvfs_op_percentile(c, 0.999), kvfs_op_names[i], c->max_ns / 1e3);
+		if (n < 0)
+			break;
+		len += n;
+	}
+	free(sum);
+	return len;
+}
+
+// Everything there is to report, in a buffer of its own for the
+// caller to free.
+static char *kvfs_op_report(size_t *len)
+{
+	size_t size = 16384 + KVFS_OPS * 512;
+	char *buf = malloc(size);
+	int n = 0;
+
+	if (buf == NULL)
+		return NULL;
+#ifdef HAVE_SYS_XATTR_H
+	n = kvfs_stats_format(buf, size);
+	if (n < 0 || (size_t) n >= size)
+		n = 0;
+#endif
+	n += kvfs_op_format(buf + n, size - n);
+	*len = (size_t) n < size ? (size_t) n : size - 1;
+	return buf;
+}
+
+// All a signal handler may do is poke the dump thread.  (If the pipe
+// is full, a dump is pending anyway.)
+static void kvfs_op_signal(int sig)
+{
+	int saved = errno;
+	ssize_t n;
+
+	n = write(kvfs_op_pipe[1], "", 1);
+	(void) n;
+	errno = saved;
+}
+
+// Write the report to the log for each SIGUSR1, whatever the log level.
+static void *kvfs_op_dump_thread(void *arg)
+{
+	char c, *report;
+	size_t len;
+
+	while (read(kvfs_op_pipe[0], &c, 1) >= 0 || errno == EINTR)
+	{
+		report = kvfs_op_report(&len);
+		if (report == NULL || kvfs_log_file == NULL)
+		{
+			free(report);
+			continue;
+		}
+		fprintf(kvfs_log_file, "kvfs: statistics on SIGUSR1\n%.*s", (int) len, report);
+		fflush(kvfs_log_file);
+		free(report);
+	}
+	return NULL;
+}
+
+static void kvfs_op_init(void)
+{
+	struct sigaction sa;
+	pthread_t thread;
+
+	kvfs_op_on = kvfs_getenv_num("KVFS_OP_STATS", 1) != 0;
+	if (pthread_key_create(&kvfs_op_key, kvfs_op_thread_exit) != 0)
+		kvfs_op_on = 0;
+
+	if (pipe(kvfs_op_pipe) < 0)
+		return;
+	fcntl(kvfs_op_pipe[1], F_SETFL, O_NONBLOCK);
+	if (pthread_create(&thread, NULL, kvfs_op_dump_thread, NULL) != 0)
+		return;
+	pthread_detach(thread);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = kvfs_op_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+static int kvfs_is_stats(const char *key)
+{
+	return strcmp(key, KVFS_STATS_KEY) == 0;
+}
+
+// The stats file or the batch file, which can't be renamed, linked,
+// removed or have their attributes changed.
+static int kvfs_is_made_up(const char *key)
+{
+	return kvfs_is_stats(key) || kvfs_is_batch(key);
+}
+
+// The stats file is read-only and has no size: it is opened for direct
+// I/O, so the kernel reads it to the end of a snapshot taken at open.
+// The batch file is the same, but only its owner may use it.
+static int kvfs_made_up_getattr(const char *key, struct stat *statbuf)
+{
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_mode = S_IFREG | (kvfs_is_stats(key) ? 0444 : 0600);
+	statbuf->st_nlink = 1;
+	statbuf->st_uid = getuid();
+	statbuf->st_gid = getgid();
+	statbuf->st_blksize = 4096;
+	clock_gettime(CLOCK_REALTIME, &statbuf->st_mtim);
+	statbuf->st_atim = statbuf->st_ctim = statbuf->st_mtim;
+	return 0;
+}
+
+static int kvfs_stats_open(struct fuse_file_info *fi)
+{
+	char *report;
+	size_t len;
+	int fd;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+		return -EACCES;
+	report = kvfs_op_report(&len);
+	if (report == NULL)
+		return -ENOMEM;
+	fd = memfd_create("kvfs_stats", MFD_CLOEXEC);
+	if (fd < 0)
+	{
+		free(report);
+		return -errno;
+	}
+	if (pwrite(fd, report, len, 0) != (ssize_t) len)
+	{
+		free(report);
+		close(fd);
+		return -EIO;
+	}
+	free(report);
+	// Reads go through the usual path, which must not serve an
+	// earlier snapshot from the page cache.
+	kvfs_pcache_invalidate(KVFS_STATS_KEY, 0, 0);
+	fi->fh = fd;
+	fi->direct_io = 1;
+	return 0;
+}
+
+int kvfs_getattr_impl(const char *path, struct stat *statbuf)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_GETATTR, start,
+			    kvfs_is_made_up(path) ? kvfs_made_up_getattr(path, statbuf) : kvfs_getattr_op(path, statbuf), 0);
+}
+
+int kvfs_readlink_impl(const char *path, char *link, size_t size)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_READLINK, start,
+			    kvfs_is_made_up(path) ? -EINVAL : kvfs_readlink_op(path, link, size), 0);
+}
+
+int kvfs_mknod_impl(const char *path, mode_t mode, dev_t dev)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_MKNOD, start, kvfs_is_made_up(path) ? -EEXIST : kvfs_mknod_op(path, kvfs_key_path(path), mode, dev), 0);
+}
+
+int kvfs_mkdir_impl(const char *path, mode_t mode)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_MKDIR, start, kvfs_is_made_up(path) ? -EEXIST : kvfs_mkdir_op(path, kvfs_key_path(path), mode), 0);
+}
+
+int kvfs_unlink_impl(const char *path)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_UNLINK, start, kvfs_is_made_up(path) ? -EPERM : kvfs_unlink_op(path), 0);
+}
+
+int kvfs_rmdir_impl(const char *path)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_RMDIR, start, kvfs_is_made_up(path) ? -ENOTDIR : kvfs_rmdir_op(path), 0);
+}
+
+int kvfs_symlink_impl(const char *path, const char *link)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_SYMLINK, start, kvfs_is_made_up(link) ? -EEXIST : kvfs_symlink_op(path, link, kvfs_key_path(link)), 0);
+}
+
+int kvfs_rename_impl(const char *path, const char *newpath)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_RENAME, start,
+			    kvfs_is_made_up(path) || kvfs_is_made_up(newpath) ? -EPERM :
+			    kvfs_rename_op(path, newpath, kvfs_key_path(newpath)), 0);
+}
+
+int kvfs_link_impl(const char *path, const char *newpath)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_LINK, start,
+			    kvfs_is_made_up(path) ? -EPERM : kvfs_is_made_up(newpath) ? -EEXIST :
+			    kvfs_link_op(path, newpath, kvfs_key_path(newpath)), 0);
+}
+
+int kvfs_chmod_impl(const char *path, mode_t mode)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_CHMOD, start, kvfs_is_made_up(path) ? -EPERM : kvfs_chmod_op(path, mode), 0);
+}
+
+int kvfs_chown_impl(const char *path, uid_t uid, gid_t gid)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_CHOWN, start, kvfs_is_made_up(path) ? -EPERM : kvfs_chown_op(path, uid, gid), 0);
+}
+
+int kvfs_truncate_impl(const char *path, off_t newsize)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_TRUNCATE, start,
+			    kvfs_is_stats(path) ? -EACCES : kvfs_is_batch(path) ? 0 : kvfs_truncate_op(path, newsize), 0);
+}
+
+int kvfs_utime_impl(const char *path, struct utimbuf *ubuf)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_UTIME, start, kvfs_is_made_up(path) ? -EPERM : kvfs_utime_op(path, ubuf), 0);
+}
+
+int kvfs_open_impl(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_OPEN, start,
+			    kvfs_is_stats(path) ? kvfs_stats_open(fi) : kvfs_is_batch(path) ? kvfs_batch_open(fi) : kvfs_open_op(path, fi), 0);
+}
+
+int kvfs_read_impl(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+	int result = kvfs_is_batch(path) ? kvfs_batch_read(fi, buf, size) : kvfs_read_op(path, buf, size, offset, fi);
+
+	return kvfs_op_done(KVFS_OP_READ, start, result, result > 0 ? result : 0);
+}
+
+int kvfs_write_impl(const char *path, const char *buf, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+	int result = kvfs_is_batch(path) ? kvfs_batch_write(fi, buf, size) : kvfs_write_op(path, buf, size, offset, fi);
+
+	return kvfs_op_done(KVFS_OP_WRITE, start, result, result > 0 ? result : 0);
+}
+
+int kvfs_read_buf_impl(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+	int result = kvfs_is_batch(path) ? kvfs_batch_read_buf(fi, bufp, size) : kvfs_read_buf_op(path, bufp, size, offset, fi);
+
+	return kvfs_op_done(KVFS_OP_READ_BUF, start, result, result == 0 ? fuse_buf_size(*bufp) : 0);
+}
+
+int kvfs_write_buf_impl(const char *path, struct fuse_bufvec *buf, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+	int result = kvfs_is_batch(path) ? kvfs_batch_write_buf(fi, buf) : kvfs_write_buf_op(path, buf, offset, fi);
+
+	return kvfs_op_done(KVFS_OP_WRITE_BUF, start, result, result > 0 ? result : 0);
+}
+
+int kvfs_statfs_impl(const char *path, struct statvfs *statv)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_STATFS, start, kvfs_statfs_op(path, statv), 0);
+}
+
+int kvfs_flush_impl(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_FLUSH, start, kvfs_is_batch(path) ? kvfs_batch_flush(fi) : kvfs_flush_op(path, fi), 0);
+}
+
+int kvfs_release_impl(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_RELEASE, start, kvfs_is_batch(path) ? kvfs_batch_release(fi) : kvfs_release_op(path, fi), 0);
+}
+
+int kvfs_fsync_impl(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_FSYNC, start, kvfs_is_batch(path) ? 0 : kvfs_fsync_op(path, datasync, fi), 0);
+}
+
+#ifdef HAVE_SYS_XATTR_H
+int kvfs_setxattr_impl(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_SETXATTR, start,
+			    kvfs_is_made_up(path) ? -EPERM : kvfs_setxattr_op(path, name, value, size, flags), 0);
+}
+
+int kvfs_getxattr_impl(const char *path, const char *name, char *value, size_t size)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_GETXATTR, start,
+			    kvfs_is_made_up(path) ? -ENODATA : kvfs_getxattr_op(path, name, value, size), 0);
+}
+
+int kvfs_listxattr_impl(const char *path, char *list, size_t size)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_LISTXATTR, start, kvfs_is_made_up(path) ? 0 : kvfs_listxattr_op(path, list, size), 0);
+}
+
+int kvfs_removexattr_impl(const char *path, const char *name)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_REMOVEXATTR, start,
+			    kvfs_is_made_up(path) ? -EPERM : kvfs_removexattr_op(path, name), 0);
+}
+#endif
+
+int kvfs_opendir_impl(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_OPENDIR, start, kvfs_is_made_up(path) ? -ENOTDIR : kvfs_opendir_op(path, fi), 0);
+}
+
+int kvfs_readdir_impl(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+	       struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_READDIR, start, kvfs_readdir_op(path, buf, filler, offset, fi), 0);
+}
+
+int kvfs_releasedir_impl(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
+
+	return kvfs_op_done(KVFS_OP_RELEASEDIR, start, kvfs_releasedir_op(path, fi), 0);
+}
+
+int kvfs_fsyncdir_impl(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	uint64_t start = kvfs_op_clock();
 
-	return result;	
+	return kvfs_op_done(KVFS_OP_FSYNCDIR, start, kvfs_fsyncdir_op(path, datasync, fi), 0);
 }
 
-/** Synchronize file contents
- *
- * If the datasync parameter is non-zero, then only the user data
- * should be flushed, not the meta data.
- *
- * Changed in version 2.2
- */
-int kvfs_fsync_impl(const char *path, int datasync, struct fuse_file_info *fi)
+int kvfs_access_impl(const char *path, int mask)
 {
-	int result = 0;
-	log_msg("\nkvfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n", path, datasync, fi);
-	log_fi(fi);
+	uint64_t start = kvfs_op_clock();
 
-	#ifdef HAVE_FDATASYNC
-   	if (datasync)
-	{
-		result = fdatasync(fi->fh);
-		if(result < 0)
-		{
-			return -errno;
-		}
-	}  
-   	else 
-	{
-		result = fsync(fi->fh);
-		if(result < 0)
-		{
-			return -errno;
-		}
-	}
-	#endif
-        return result;
+	return kvfs_op_done(KVFS_OP_ACCESS, start,
+			    kvfs_is_stats(path) ? ((mask & (W_OK | X_OK)) ? -EACCES : 0) :
+			    kvfs_is_batch(path) ? ((mask & X_OK) ? -EACCES : 0) : kvfs_access_op(path, mask), 0);
 }
 
-#ifdef HAVE_SYS_XATTR_H
-/** Set extended attributes */
-int kvfs_setxattr_impl(const char *path, const char *name, const char *value, size_t size, int flags)
+int kvfs_create_impl(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
+	uint64_t start = kvfs_op_clock();
 
-	log_msg("kvfs_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, flags=0x%08x)\n", path, name, value, size, flags);
-	
-	result = lsetxattr(fullpath, name, value, size, flags);
-	if(result < 0)
-	{
-		return --errno;	
-	}
-	return result;
+	return kvfs_op_done(KVFS_OP_CREATE, start,
+			    kvfs_is_stats(path) ? ((fi->flags & O_EXCL) ? -EEXIST : -EACCES) :
+			    kvfs_is_batch(path) ? ((fi->flags & O_EXCL) ? -EEXIST : kvfs_batch_open(fi)) :
+			    kvfs_create_op(path, kvfs_key_path(path), mode, fi), 0);
 }
 
-/** Get extended attributes */
-int kvfs_getxattr_impl(const char *path, const char *name, char *value, size_t size)
+int kvfs_ftruncate_impl(const char *path, off_t offset, struct fuse_file_info *fi)
 {
-	int result = 0;	
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
-
-	log_msg("kvfs_getxattr(path = \"%s\", name = \"%s\", value = 0x%08x, size = %d)\n", path, name, value, size);
+	uint64_t start = kvfs_op_clock();
 
-	result = lgetxattr(fullpath, name, value, size);	
-	if(result >= 0)
-	{
-        	log_msg("    value = \"%s\"\n", value);
-	}
-	return result;
+	return kvfs_op_done(KVFS_OP_FTRUNCATE, start, kvfs_is_batch(path) ? 0 : kvfs_ftruncate_op(path, offset, fi), 0);
 }
 
-/** List extended attributes */
-int kvfs_listxattr_impl(const char *path, char *list, size_t size)
+int kvfs_fgetattr_impl(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
-	char* ptr;
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   
+	uint64_t start = kvfs_op_clock();
 
-	log_msg("kvfs_listxattr(path=\"%s\", list=0x%08x, size=%d)\n", path, list, size);
+	return kvfs_op_done(KVFS_OP_FGETATTR, start,
+			    kvfs_is_made_up(path) ? kvfs_made_up_getattr(path, statbuf) : kvfs_fgetattr_op(path, statbuf, fi), 0);
+}
 
-	result = llistxattr(fullpath, list, size);
+///////////////////////////////////////////////////////////
+//
+// Batches
+//
+// Removing or chmod'ing thousands of files costs a FUSE round trip,
+// and a path lookup, for each.  mountdir/.kvfs_batch is made up like
+// .kvfs_stats and takes many operations at once.  Each line written
+// to it is one item, the path being the rest of the line:
+//
+//     put <octal mode> <path>      make path an empty file
+//     unlink <path>
+//     stat <path>
+//     chmod <octal mode> <path>
+//
+// Reading the handle runs what was written since the last read, and
+// returns one line per item, in order:
+//
+//     <result> <op> [<octal mode> <size> <nlinks> <mtime>] <path>
+//
+// where result is 0 or a negative errno, and only a stat that worked
+// has the fields in brackets.  The handle is a stream: reads ignore
+// the offset and return 0 when everything run so far was read.  A
+// write-only handle runs its items when it is closed, and close()
+// returns the first error, so
+//
+//     printf 'unlink /a\nunlink /b\n' > mountdir/.kvfs_batch
+//
+// needs nothing else.  A batch is spread over up to KVFS_BATCH_THREADS
+// threads (default 4) by path, so the items on one path run in the
+// order given and items on different paths in any order.  Each item
+// counts as the operations it does in the per-operation statistics.
+//
+#define KVFS_BATCH_RUN		(1 << 20)	// unread input run by write
+#define KVFS_BATCH_PER_THREAD	32		// fewest items worth a thread
 
-	if (result >= 0) 
-	{
-        	log_msg("    returned attributes (length %d):\n", result);
-        	for (ptr = list; ptr < list + result; ptr += strlen(ptr)+1)
-		{  
-			log_msg("    \"%s\"\n", ptr);
-		}
-	}
+enum { KVFS_BATCH_PUT, KVFS_BATCH_UNLINK, KVFS_BATCH_STAT, KVFS_BATCH_CHMOD, KVFS_BATCH_BAD };
 
-	return result;
+static const char *kvfs_batch_ops[] = { "put", "unlink", "stat", "chmod" };
 
+// An open handle of the batch file, in fi->fh.
+struct kvfs_batch {
+	pthread_mutex_t lock;
+	int wronly;
+	int error;		// first failed item, for close() of wronly
+	char *in;		// written, not run yet
+	size_t in_len, in_size;
+	char *out;		// results not read yet
+	size_t out_off, out_len, out_size;
+};
 
-//    return -1;
+struct kvfs_bitem {
+	int op;
+	mode_t mode;
+	const char *word;	// as written, for the result
+	const char *path;
+	size_t len;
+	unsigned int thread;
+	int result;
+	struct stat st;
+};
+
+struct kvfs_bwork {
+	struct kvfs_bitem *items;
+	size_t count;
+	unsigned int thread;	// runs the items with this thread
+	pthread_t tid;
+	int started;
+};
+
+static struct {
+	uint64_t batches;
+	uint64_t items;
+	uint64_t errors;
+	uint64_t threads;
+} kvfs_batch_stats;
+
+static int kvfs_is_batch(const char *key)
+{
+	return strcmp(key, KVFS_BATCH_KEY) == 0;
 }
 
-/** Remove extended attributes */
-int kvfs_removexattr_impl(const char *path, const char *name)
+static struct kvfs_batch *kvfs_batch_handle(struct fuse_file_info *fi)
 {
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   	
+	return (struct kvfs_batch *) (uintptr_t) fi->fh;
+}
 
-	log_msg("\nkvfs_removexattr(path=\"%s\", name=\"%s\")\n", path, name);
+static int kvfs_batch_open(struct fuse_file_info *fi)
+{
+	struct kvfs_batch *b;
+	uid_t uid = fuse_get_context()->uid;
 
-	result = lremovexattr(fullpath, name);
+	// The kernel only checks the mode with -o default_permissions,
+	// and a batch can do anything kvfs can.
+	if (uid != 0 && uid != getuid())
+		return -EACCES;
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		return -ENOMEM;
+	pthread_mutex_init(&b->lock, NULL);
+	b->wronly = (fi->flags & O_ACCMODE) == O_WRONLY;
+	fi->fh = (uintptr_t) b;
+	fi->direct_io = 1;
+	return 0;
+}
 
-	if(result < 0)
+// Split a line into an item; it stays in the caller's buffer.
+static void kvfs_batch_parse(char *line, struct kvfs_bitem *it)
+{
+	char *end;
+	int op;
+
+	memset(it, 0, sizeof(*it));
+	it->op = KVFS_BATCH_BAD;
+	it->result = -EINVAL;
+	it->word = line;
+	it->path = "";
+	end = strchr(line, ' ');
+	if (end == NULL)
+		return;
+	*end++ = '\0';
+	for (op = 0; op < KVFS_BATCH_BAD; op++)
+		if (strcmp(line, kvfs_batch_ops[op]) == 0)
+			break;
+	it->path = end;
+	if (op == KVFS_BATCH_PUT || op == KVFS_BATCH_CHMOD)
 	{
-		return -errno;
+		it->mode = strtoul(end, &end, 8) & 07777;
+		if (*end != ' ')
+			return;
+		it->path = end + 1;
 	}
+	it->len = strlen(it->path);
+	if (op == KVFS_BATCH_BAD || it->path[0] != '/' || it->len >= PATH_MAX)
+		return;
+	it->op = op;
+	it->result = 0;
+}
+
+// The kernel looks up a file's directory before creating it, but a
+// batch comes in one request, so put checks that path's is there.
+static int kvfs_batch_parent(const char *path, size_t len)
+{
+	char key[KVFS_KEY_MAX];
+	struct stat st;
+	uint64_t start;
+	int result;
+
+	while (len > 1 && path[len - 1] != '/')
+		len--;
+	if (len > 1)
+		len--;
+	kvfs_str2key(path, len, key);
+	if (kvfs_is_made_up(key))
+		return -ENOTDIR;
+	start = kvfs_op_clock();
+	result = kvfs_op_done(KVFS_OP_GETATTR, start, kvfs_getattr_op(key, &st), 0);
+	if (result == 0 && !S_ISDIR(st.st_mode))
+		result = -ENOTDIR;
 	return result;
 }
-#endif
 
-/** Open directory
- *
- * This method should check if the open operation is permitted for
- * this  directory
- *
- * Introduced in version 2.3
- */
-int kvfs_opendir_impl(const char *path, struct fuse_file_info *fi)
+// Run one item on this thread, counted as what it did.
+static int kvfs_batch_item(struct kvfs_bitem *it)
 {
-	DIR *dp;
-	int result = 0;
-	char fullpath[PATH_MAX];
-	kvfs_fullpath(fullpath, path);   	
-	
-	log_msg("\nkvfs_opendir(path=\"%s\", fi=0x%08x)\n", path, fi);
+	char key[KVFS_KEY_MAX];
+	struct fuse_file_info fi;
+	uint64_t start;
+	int result;
 
-	dp = opendir(fullpath);
-	log_msg("    opendir returned 0x%p\n", dp);
+	if (it->op == KVFS_BATCH_PUT && (result = kvfs_batch_parent(it->path, it->len)) < 0)
+		return result;
+	kvfs_str2key(it->path, it->len, key);
+	if (kvfs_is_made_up(key))
+		return -EPERM;
 
-	if (dp == NULL)
+	start = kvfs_op_clock();
+	switch (it->op)
 	{
-		result = log_error("kvfs_opendir opendir");
+	case KVFS_BATCH_PUT:
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+		result = kvfs_op_done(KVFS_OP_CREATE, start, kvfs_create_op(key, it->path, S_IFREG | it->mode, &fi), 0);
+		if (result < 0)
+			return result;
+		start = kvfs_op_clock();
+		return kvfs_op_done(KVFS_OP_RELEASE, start, kvfs_release_op(key, &fi), 0);
+	case KVFS_BATCH_UNLINK:
+		return kvfs_op_done(KVFS_OP_UNLINK, start, kvfs_unlink_op(key), 0);
+	case KVFS_BATCH_STAT:
+		return kvfs_op_done(KVFS_OP_GETATTR, start, kvfs_getattr_op(key, &it->st), 0);
+	case KVFS_BATCH_CHMOD:
+		return kvfs_op_done(KVFS_OP_CHMOD, start, kvfs_chmod_op(key, it->mode), 0);
 	}
+	return -EINVAL;
+}
 
-	fi->fh = (intptr_t) dp;
-	log_fi(fi);
+static void *kvfs_batch_worker(void *arg)
+{
+	struct kvfs_bwork *w = arg;
+	size_t i;
 
-	return result;
+	for (i = 0; i < w->count; i++)
+		if (w->items[i].thread == w->thread && w->items[i].op != KVFS_BATCH_BAD)
+			w->items[i].result = kvfs_batch_item(&w->items[i]);
+	return NULL;
 }
 
-/** Read directory
- *
- * This supersedes the old getdir() interface.  New applications
- * should use this.
- *
- * The filesystem may choose between two modes of operation:
- *
- * 1) The readdir implementation ignores the offset parameter, and
- * passes zero to the filler function's offset.  The filler
- * function will not return '1' (unless an error happens), so the
- * whole directory is read in a single readdir operation.  This
- * works just like the old getdir() method.
- *
- * 2) The readdir implementation keeps track of the offsets of the
- * directory entries.  It uses the offset parameter and always
- * passes non-zero offset to the filler function.  When the buffer
- * is full (or an error happens) the filler function will return
- * '1'.
- *
- * Introduced in version 2.3
- */
+// Append the result of it to b's output.
+static int kvfs_batch_result(struct kvfs_batch *b, const struct kvfs_bitem *it)
+{
+	size_t need = it->len + 128;
+	char *out;
+	int len;
 
-int kvfs_readdir_impl(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-	       struct fuse_file_info *fi)
+	for (;;)
+	{
+		if (b->out_size - b->out_len < need)
+		{
+			out = realloc(b->out, b->out_len + need + b->out_size);
+			if (out == NULL)
+				return -ENOMEM;
+			b->out = out;
+			b->out_size += b->out_len + need;
+		}
+		if (it->op == KVFS_BATCH_STAT && it->result == 0)
+			len = snprintf(b->out + b->out_len, b->out_size - b->out_len, "0 stat %o %lld %lu %lld %s\n",
+				(unsigned int) it->st.st_mode, (long long) it->st.st_size,
+				(unsigned long) it->st.st_nlink, (long long) it->st.st_mtime, it->path);
+		else
+			len = snprintf(b->out + b->out_len, b->out_size - b->out_len, "%d %s %s\n",
+				it->result, it->word, it->path);
+		if (len < 0)
+			return -EIO;
+		// Cut short: make room for all of it and write it again.
+		if ((size_t) len >= b->out_size - b->out_len)
+		{
+			need = len + 1;
+			continue;
+		}
+		b->out_len += len;
+		return 0;
+	}
+}
+
+// Run the items in b's input, all of it or only its whole lines.
+// Called with b->lock held.
+static int kvfs_batch_run(struct kvfs_batch *b, int all)
 {
+	struct kvfs_bitem *items;
+	struct kvfs_bwork *work;
+	unsigned int nthreads, t;
+	size_t count = 1, used, i;
+	char *line, *next, *end;
 	int result = 0;
-	DIR *dp;
-	struct dirent *de;
-
-	log_msg("\nkvfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
-            path, buf, filler, offset, fi);
 
-	dp = (DIR *) (uintptr_t) fi->fh;
+	if (all)
+		end = b->in + b->in_len;
+	else if ((end = memrchr(b->in, '\n', b->in_len)) != NULL)
+		end++;
+	if (end == NULL || end == b->in)
+		return 0;
+	used = end - b->in;
+	for (line = b->in; line < end; line++)
+		count += *line == '\n';
+	items = calloc(count, sizeof(*items));
+	if (items == NULL)
+		return -ENOMEM;
 
-	de = readdir(dp);
-	log_msg("    readdir returned 0x%p\n", de);
-	if (de == 0) {
-        	result = log_error("kvfs_readdir readdir");
-        	return result;
-   	}
+	// The last line may lack its newline, so the input has room for
+	// a NUL after it (see kvfs_batch_write()).
+	count = 0;
+	for (line = b->in; line < end; line = next)
+	{
+		next = memchr(line, '\n', end - line);
+		next = next != NULL ? next : end;
+		*next++ = '\0';
+		if (*line != '\0')
+			kvfs_batch_parse(line, &items[count++]);
+	}
 
-	do {
-    	log_msg("calling filler with name %s\n", de->d_name);
-   		if (filler(buf, de->d_name, NULL, 0) != 0) {
-    		log_msg("    ERROR kvfs_readdir filler:  buffer full");
-       		return -ENOMEM;
-	   }
-	} while ((de = readdir(dp)) != NULL);
+	nthreads = (count + KVFS_BATCH_PER_THREAD - 1) / KVFS_BATCH_PER_THREAD;
+	if (nthreads > kvfs_conf.batch_threads)
+		nthreads = kvfs_conf.batch_threads;
+	if (nthreads < 1)
+		nthreads = 1;
+	work = calloc(nthreads, sizeof(*work));
+	if (work == NULL)
+	{
+		free(items);
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; i++)
+		items[i].thread = kvfs_xxh64(items[i].path, items[i].len) % nthreads;
+	for (t = 0; t < nthreads; t++)
+	{
+		work[t].items = items;
+		work[t].count = count;
+		work[t].thread = t;
+	}
+	// This thread does the first share, and any a thread couldn't be
+	// started for.
+	for (t = 1; t < nthreads; t++)
+		work[t].started = pthread_create(&work[t].tid, NULL, kvfs_batch_worker, &work[t]) == 0;
+	kvfs_batch_worker(&work[0]);
+	for (t = 1; t < nthreads; t++)
+	{
+		if (work[t].started)
+			pthread_join(work[t].tid, NULL);
+		else
+			kvfs_batch_worker(&work[t]);
+	}
+	free(work);
 
-   	log_fi(fi);
+	__atomic_add_fetch(&kvfs_batch_stats.batches, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kvfs_batch_stats.items, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kvfs_batch_stats.threads, nthreads, __ATOMIC_RELAXED);
+	for (i = 0; i < count; i++)
+	{
+		if (items[i].result < 0)
+		{
+			__atomic_add_fetch(&kvfs_batch_stats.errors, 1, __ATOMIC_RELAXED);
+			if (b->error == 0)
+				b->error = items[i].result;
+		}
+		// Nobody reads a write-only handle's results.
+		if (!b->wronly && result == 0)
+			result = kvfs_batch_result(b, &items[i]);
+	}
+	free(items);
 
+	memmove(b->in, b->in + used, b->in_len - used);
+	b->in_len -= used;
 	return result;
 }
 
-/** Release directory
- *
- * Introduced in version 2.3
- */
-int kvfs_releasedir_impl(const char *path, struct fuse_file_info *fi)
+static int kvfs_batch_write(struct fuse_file_info *fi, const char *buf, size_t size)
 {
+	struct kvfs_batch *b = kvfs_batch_handle(fi);
+	char *in;
 	int result = 0;
 
-	log_msg("\nkvfs_releasedir(path=\"%s\", fi=0x%08x)\n",
-            path, fi);
-	log_fi(fi);
+	pthread_mutex_lock(&b->lock);
+	if (b->in_size - b->in_len <= size)
+	{
+		in = realloc(b->in, b->in_len + size + 1 + b->in_size);
+		if (in == NULL)
+		{
+			pthread_mutex_unlock(&b->lock);
+			return -ENOMEM;
+		}
+		b->in = in;
+		b->in_size += b->in_len + size + 1;
+	}
+	memcpy(b->in + b->in_len, buf, size);
+	b->in_len += size;
+	// A long stream of items is run as it comes.
+	if (b->in_len >= KVFS_BATCH_RUN)
+		result = kvfs_batch_run(b, 0);
+	pthread_mutex_unlock(&b->lock);
+	return result < 0 ? result : (int) size;
+}
 
-	closedir((DIR *) (uintptr_t) fi->fh);
+static int kvfs_batch_write_buf(struct fuse_file_info *fi, struct fuse_bufvec *buf)
+{
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	ssize_t len;
+	int result;
 
+	dst.buf[0].mem = malloc(size);
+	if (dst.buf[0].mem == NULL)
+		return -ENOMEM;
+	len = fuse_buf_copy(&dst, buf, FUSE_BUF_NO_SPLICE);
+	result = len < 0 ? (int) len : kvfs_batch_write(fi, dst.buf[0].mem, len);
+	free(dst.buf[0].mem);
 	return result;
-
 }
 
-/** Synchronize directory contents
- *
- * If the datasync parameter is non-zero, then only the user data
- * should be flushed, not the meta data
- *
- * Introduced in version 2.3
- */
-// when exactly is this called?  when a user calls fsync and it
-// happens to be a directory? ??? >>> I need to implement this...
-int kvfs_fsyncdir_impl(const char *path, int datasync, struct fuse_file_info *fi)
+static int kvfs_batch_read(struct fuse_file_info *fi, char *buf, size_t size)
 {
+	struct kvfs_batch *b = kvfs_batch_handle(fi);
 	int result = 0;
 
-    	log_msg("\nkvfs_fsyncdir(path=\"%s\", datasync=%d, fi=0x%08x)\n",
-            path, datasync, fi);
-   	log_fi(fi);
-
+	pthread_mutex_lock(&b->lock);
+	if (b->in_len > 0)
+		result = kvfs_batch_run(b, 1);
+	if (result == 0)
+	{
+		if (size > b->out_len - b->out_off)
+			size = b->out_len - b->out_off;
+		if (size > INT_MAX)
+			size = INT_MAX;
+		memcpy(buf, b->out + b->out_off, size);
+		b->out_off += size;
+		if (b->out_off == b->out_len)
+			b->out_off = b->out_len = 0;
+		result = size;
+	}
+	pthread_mutex_unlock(&b->lock);
 	return result;
 }
 
-int kvfs_access_impl(const char *path, int mask)
+static int kvfs_batch_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t size)
 {
-	int result = 0;
-    char fullpath[PATH_MAX];
+	struct fuse_bufvec *src;
+	int len;
 
-	log_msg("\nkvfs_access(path=\"%s\", mask=0%o)\n",
-            path, mask);
-    kvfs_fullpath(fullpath, path);   
-
-	result = access(fullpath, mask);
-
-	if (result < 0)
-		result = log_error("kvfs_access access");
-
-	return result;
+	src = malloc(sizeof(*src));
+	if (src == NULL)
+		return -ENOMEM;
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].mem = malloc(size);
+	if (src->buf[0].mem == NULL)
+	{
+		free(src);
+		return -ENOMEM;
+	}
+	len = kvfs_batch_read(fi, src->buf[0].mem, size);
+	if (len < 0)
+	{
+		free(src->buf[0].mem);
+		free(src);
+		return len;
+	}
+	src->buf[0].size = len;
+	*bufp = src;
+	return 0;
 }
 
-/**
- * Create and open a file
- *
- * If the file does not exist, first create it with the specified
- * mode, and then open it.
- *
- * If this method is not implemented or under Linux kernel
- * versions earlier than 2.6.15, the mknod() and open() methods
- * will be called instead.
- *
- * Introduced in version 2.5
- */
-// Not implemented.  I had a version that used creat() to create and
-// open the file, which it turned out opened the file write-only.
-
-/**
- * Change the size of an open file
- *
- * This method is called instead of the truncate() method if the
- * truncation was invoked from an ftruncate() system call.
- *
- * If this method is not implemented or under Linux kernel
- * versions earlier than 2.6.15, the truncate() method will be
- * called instead.
- *
- * Introduced in version 2.5
- */
-int kvfs_ftruncate_impl(const char *path, off_t offset, struct fuse_file_info *fi)
+// close() of a write-only handle runs what is left and reports the
+// first error since it was opened or last closed.
+static int kvfs_batch_flush(struct fuse_file_info *fi)
 {
+	struct kvfs_batch *b = kvfs_batch_handle(fi);
 	int result = 0;
-	log_msg("\nkvfs_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n",
-        path, offset, fi);
-	log_fi(fi);
-
-	result = ftruncate(fi->fh, offset);
-	if (result < 0)
-    	result = log_error("kvfs_ftruncate ftruncate");
 
+	pthread_mutex_lock(&b->lock);
+	if (b->wronly)
+	{
+		if (b->in_len > 0)
+			result = kvfs_batch_run(b, 1);
+		if (result == 0)
+			result = b->error;
+		b->error = 0;
+	}
+	pthread_mutex_unlock(&b->lock);
 	return result;
 }
 
-/**
- * Get attributes from an open file
- *
- * This method is called instead of the getattr() method if the
- * file information is available.
- *
- * Currently this is only called after the create() method if that
- * is implemented (see above).  Later it may be called for
- * invocations of fstat() too.
- *
- * Introduced in version 2.5
- */
-int kvfs_fgetattr_impl(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+static int kvfs_batch_release(struct fuse_file_info *fi)
 {
-	int result = 0;
+	struct kvfs_batch *b = kvfs_batch_handle(fi);
 
-	log_msg("\nkvfs_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n",
-        path, statbuf, fi);
-	log_fi(fi);
+	// Flush has run everything a write-only handle was given, and a
+	// reader that stops reading gets no more.
+	pthread_mutex_destroy(&b->lock);
+	free(b->in);
+	free(b->out);
+	free(b);
+	return 0;
+}
 
-    // On FreeBSD, trying to do anything with the mountpoint ends up
-    // opening it, and then using the FD for an fgetattr.  So in the
-    // special case of a path of "/", I need to do a getattr on the
-    // underlying root directory instead of doing the fgetattr().
-	if (!strcmp(path, "/"))
-    	return kvfs_getattr_impl(path, statbuf);
+static void kvfs_batch_init(void)
+{
+	double threads = kvfs_getenv_num("KVFS_BATCH_THREADS", 4);
 
-	result = fstat(fi->fh, statbuf);
-	if (result < 0)
-    	result = log_error("kvfs_fgetattr fstat");
+	kvfs_conf.batch_threads = threads < 1 ? 1 : threads > 64 ? 64 : threads;
+}
 
-	log_stat(statbuf);
+#ifdef HAVE_SYS_XATTR_H
+static int kvfs_batch_format(char *buf, size_t size)
+{
+	uint64_t batches = __atomic_load_n(&kvfs_batch_stats.batches, __ATOMIC_RELAXED);
 
-	return result;
+	return snprintf(buf, size, "batch.batches %llu\nbatch.items %llu\nbatch.errors %llu\nbatch.threads_mean %.2f\n",
+		(unsigned long long) batches,
+		(unsigned long long) __atomic_load_n(&kvfs_batch_stats.items, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&kvfs_batch_stats.errors, __ATOMIC_RELAXED),
+		batches ? (double) __atomic_load_n(&kvfs_batch_stats.threads, __ATOMIC_RELAXED) / batches : 0.0);
 }
-
+#endif
@@ -0,0 +1,214 @@
+/*
+  kvfs_migrate: offline re-layout of a KVFS backing root
+
+  Moves every key of an unmounted root between the flat layout
+  (rootdir/<key>) and the sharded layout (rootdir/<k0k1>/<k2k3>/<key>)
+  used with KVFS_LAYOUT=shard.  Keys are moved with rename(2), so the
+  migration never copies data and can be re-run after an interruption.
+  The layout recorded in the root's .kvfs_super is updated to match
+  once every key has moved.
+
+  Build:  gcc -O2 -Wall -o kvfs_migrate kvfs_migrate.c
+  Usage:  ./kvfs_migrate <rootdir> flat|shard
+
+  Do not run it against a mounted root.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static const char hexdigits[] = "0123456789abcdef";
+
+// A key is all lowercase hex and long enough to be sharded.
+static int is_key(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && strspn(name, hexdigits) == len;
+}
+
+static int is_shard(const char *name)
+{
+	return strspn(name, hexdigits) == 2 && name[2] == '\0';
+}
+
+static int mkdir_exist_ok(int dirfd, const char *name)
+{
+	if (mkdirat(dirfd, name, 0755) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "mkdir %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int to_shard(int rootfd, DIR *dp)
+{
+	// One bit per shard already known to exist, to skip the mkdirs.
+	static unsigned char made[65536 / 8];
+	struct dirent *de;
+	char dir[8], to[PATH_MAX];
+	unsigned long moved = 0;
+	unsigned int idx;
+
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (!is_key(de->d_name))
+			continue;
+
+		idx = 0;
+		for (int i = 0; i < 4; i++)
+			idx = idx * 16 + (strchr(hexdigits, de->d_name[i]) - hexdigits);
+		if (!(made[idx / 8] & (1 << (idx % 8))))
+		{
+			snprintf(dir, sizeof(dir), "%.2s", de->d_name);
+			if (mkdir_exist_ok(rootfd, dir) < 0)
+				return -1;
+			snprintf(dir, sizeof(dir), "%.2s/%.2s", de->d_name, de->d_name + 2);
+			if (mkdir_exist_ok(rootfd, dir) < 0)
+				return -1;
+			made[idx / 8] |= 1 << (idx % 8);
+		}
+
+		snprintf(to, sizeof(to), "%.2s/%.2s/%s", de->d_name, de->d_name + 2, de->d_name);
+		if (renameat(rootfd, de->d_name, rootfd, to) < 0)
+		{
+			// readdir may hand back a name it already returned
+			if (errno == ENOENT)
+				continue;
+			fprintf(stderr, "rename %s: %s\n", de->d_name, strerror(errno));
+			return -1;
+		}
+		moved++;
+	}
+
+	printf("moved %lu keys into shards\n", moved);
+	return 0;
+}
+
+static int to_flat(int rootfd, DIR *dp)
+{
+	struct dirent *de, *de1, *de2;
+	DIR *dp1, *dp2;
+	char from[PATH_MAX];
+	unsigned long moved = 0;
+	int fd;
+
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (!is_shard(de->d_name))
+			continue;
+		fd = openat(rootfd, de->d_name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || (dp1 = fdopendir(fd)) == NULL)
+		{
+			fprintf(stderr, "open %s: %s\n", de->d_name, strerror(errno));
+			return -1;
+		}
+		while ((de1 = readdir(dp1)) != NULL)
+		{
+			if (!is_shard(de1->d_name))
+				continue;
+			fd = openat(dirfd(dp1), de1->d_name, O_RDONLY | O_DIRECTORY);
+			if (fd < 0 || (dp2 = fdopendir(fd)) == NULL)
+			{
+				fprintf(stderr, "open %s/%s: %s\n", de->d_name, de1->d_name, strerror(errno));
+				return -1;
+			}
+			while ((de2 = readdir(dp2)) != NULL)
+			{
+				if (!is_key(de2->d_name))
+					continue;
+				snprintf(from, sizeof(from), "%s/%s/%s", de->d_name, de1->d_name, de2->d_name);
+				if (renameat(rootfd, from, rootfd, de2->d_name) < 0)
+				{
+					fprintf(stderr, "rename %s: %s\n", from, strerror(errno));
+					return -1;
+				}
+				moved++;
+			}
+			closedir(dp2);
+			unlinkat(dirfd(dp1), de1->d_name, AT_REMOVEDIR);
+		}
+		closedir(dp1);
+		unlinkat(rootfd, de->d_name, AT_REMOVEDIR);
+	}
+
+	printf("moved %lu keys out of shards\n", moved);
+	return 0;
+}
+
+// Rewrite .kvfs_super with the new layout, keeping its hash and
+// index lines.  Roots from before the superblock existed always used
+// MD5 and have no index.
+static int write_super(int rootfd, const char *layout)
+{
+	char line[128], hash[64] = "md5", index[128] = "", value[64];
+	FILE *fp;
+	int fd;
+
+	fd = openat(rootfd, ".kvfs_super", O_RDONLY);
+	if (fd >= 0 && (fp = fdopen(fd, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), fp) != NULL)
+			if (sscanf(line, "hash %63s", value) == 1)
+				strcpy(hash, value);
+			else if (strncmp(line, "index ", 6) == 0)
+				snprintf(index, sizeof(index), "%s", line);
+		fclose(fp);
+	}
+
+	fd = openat(rootfd, ".kvfs_super.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL)
+	{
+		fprintf(stderr, ".kvfs_super: %s\n", strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "kvfs 1\nhash %s\nlayout %s\n%s", hash, layout, index);
+	if (fflush(fp) != 0 || fsync(fd) < 0 || fclose(fp) != 0 ||
+	    renameat(rootfd, ".kvfs_super.tmp", rootfd, ".kvfs_super") < 0)
+	{
+		fprintf(stderr, ".kvfs_super: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	DIR *dp;
+	int rootfd, result;
+
+	if (argc != 3 || (strcmp(argv[2], "flat") != 0 && strcmp(argv[2], "shard") != 0))
+	{
+		fprintf(stderr, "usage: %s <rootdir> flat|shard\n", argv[0]);
+		return 2;
+	}
+
+	rootfd = open(argv[1], O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0 || (dp = fdopendir(dup(rootfd))) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (strcmp(argv[2], "shard") == 0)
+		result = to_shard(rootfd, dp);
+	else
+		result = to_flat(rootfd, dp);
+	if (result == 0)
+		result = write_super(rootfd, argv[2]);
+
+	closedir(dp);
+	close(rootfd);
+	return result < 0 ? 1 : 0;
+}